@@ -0,0 +1,927 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* A compiler from classic BPF to native code.
+ *
+ * Programs are checked first, so that neither the native code nor the
+ * interpreter have to worry about bad jumps, scratch memory indexes or
+ * division by a constant zero. Packet accesses are still bounds checked
+ * on every load, and any load past the end of the packet rejects it, just
+ * like bpf_filter().
+ *
+ * On x86-64 each BPF instruction is translated directly into a short
+ * sequence of machine instructions, with A in eax, X in r9d and the
+ * scratch memory in the red zone below the stack pointer. The generated
+ * function doesn't call anything, so it needs no stack frame. Every other
+ * platform uses the interpreter in this file.
+ */
+
+#include "config.h"
+#include "bpf-jit/bpf-jit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+
+/* Classic BPF opcodes. These are defined here rather than taken from
+ * pcap-bpf.h because we may be built against the eBPF headers instead */
+#define BPFJ_CLASS(code)	((code) & 0x07)
+#define BPFJ_LD		0x00
+#define BPFJ_LDX	0x01
+#define BPFJ_ST		0x02
+#define BPFJ_STX	0x03
+#define BPFJ_ALU	0x04
+#define BPFJ_JMP	0x05
+#define BPFJ_RET	0x06
+#define BPFJ_MISC	0x07
+
+#define BPFJ_SIZE(code)	((code) & 0x18)
+#define BPFJ_W		0x00
+#define BPFJ_H		0x08
+#define BPFJ_B		0x10
+
+#define BPFJ_MODE(code)	((code) & 0xe0)
+#define BPFJ_IMM	0x00
+#define BPFJ_ABS	0x20
+#define BPFJ_IND	0x40
+#define BPFJ_MEM	0x60
+#define BPFJ_LEN	0x80
+#define BPFJ_MSH	0xa0
+
+#define BPFJ_OP(code)	((code) & 0xf0)
+#define BPFJ_ADD	0x00
+#define BPFJ_SUB	0x10
+#define BPFJ_MUL	0x20
+#define BPFJ_DIV	0x30
+#define BPFJ_OR		0x40
+#define BPFJ_AND	0x50
+#define BPFJ_LSH	0x60
+#define BPFJ_RSH	0x70
+#define BPFJ_NEG	0x80
+#define BPFJ_MOD	0x90
+#define BPFJ_XOR	0xa0
+
+#define BPFJ_JA		0x00
+#define BPFJ_JEQ	0x10
+#define BPFJ_JGT	0x20
+#define BPFJ_JGE	0x30
+#define BPFJ_JSET	0x40
+
+#define BPFJ_SRC(code)	((code) & 0x08)
+#define BPFJ_K		0x00
+#define BPFJ_X		0x08
+
+#define BPFJ_RVAL(code)	((code) & 0x18)
+#define BPFJ_A		0x10
+
+#define BPFJ_MISCOP(code) ((code) & 0xf8)
+#define BPFJ_TAX	0x00
+#define BPFJ_TXA	0x80
+
+#define BPFJ_MEMWORDS	16
+#define BPFJ_MAXINSNS	4096
+
+/* Returns 1 if code is a classic BPF opcode that we know how to run */
+static int valid_opcode(uint16_t code) {
+	switch (code) {
+	case BPFJ_RET|BPFJ_K:
+	case BPFJ_RET|BPFJ_A:
+	case BPFJ_LD|BPFJ_W|BPFJ_ABS:
+	case BPFJ_LD|BPFJ_H|BPFJ_ABS:
+	case BPFJ_LD|BPFJ_B|BPFJ_ABS:
+	case BPFJ_LD|BPFJ_W|BPFJ_IND:
+	case BPFJ_LD|BPFJ_H|BPFJ_IND:
+	case BPFJ_LD|BPFJ_B|BPFJ_IND:
+	case BPFJ_LD|BPFJ_W|BPFJ_LEN:
+	case BPFJ_LDX|BPFJ_W|BPFJ_LEN:
+	case BPFJ_LDX|BPFJ_B|BPFJ_MSH:
+	case BPFJ_LD|BPFJ_IMM:
+	case BPFJ_LDX|BPFJ_IMM:
+	case BPFJ_LD|BPFJ_MEM:
+	case BPFJ_LDX|BPFJ_MEM:
+	case BPFJ_ST:
+	case BPFJ_STX:
+	case BPFJ_JMP|BPFJ_JA:
+	case BPFJ_JMP|BPFJ_JGT|BPFJ_K:
+	case BPFJ_JMP|BPFJ_JGE|BPFJ_K:
+	case BPFJ_JMP|BPFJ_JEQ|BPFJ_K:
+	case BPFJ_JMP|BPFJ_JSET|BPFJ_K:
+	case BPFJ_JMP|BPFJ_JGT|BPFJ_X:
+	case BPFJ_JMP|BPFJ_JGE|BPFJ_X:
+	case BPFJ_JMP|BPFJ_JEQ|BPFJ_X:
+	case BPFJ_JMP|BPFJ_JSET|BPFJ_X:
+	case BPFJ_ALU|BPFJ_ADD|BPFJ_X:
+	case BPFJ_ALU|BPFJ_SUB|BPFJ_X:
+	case BPFJ_ALU|BPFJ_MUL|BPFJ_X:
+	case BPFJ_ALU|BPFJ_DIV|BPFJ_X:
+	case BPFJ_ALU|BPFJ_MOD|BPFJ_X:
+	case BPFJ_ALU|BPFJ_AND|BPFJ_X:
+	case BPFJ_ALU|BPFJ_OR|BPFJ_X:
+	case BPFJ_ALU|BPFJ_XOR|BPFJ_X:
+	case BPFJ_ALU|BPFJ_LSH|BPFJ_X:
+	case BPFJ_ALU|BPFJ_RSH|BPFJ_X:
+	case BPFJ_ALU|BPFJ_ADD|BPFJ_K:
+	case BPFJ_ALU|BPFJ_SUB|BPFJ_K:
+	case BPFJ_ALU|BPFJ_MUL|BPFJ_K:
+	case BPFJ_ALU|BPFJ_DIV|BPFJ_K:
+	case BPFJ_ALU|BPFJ_MOD|BPFJ_K:
+	case BPFJ_ALU|BPFJ_AND|BPFJ_K:
+	case BPFJ_ALU|BPFJ_OR|BPFJ_K:
+	case BPFJ_ALU|BPFJ_XOR|BPFJ_K:
+	case BPFJ_ALU|BPFJ_LSH|BPFJ_K:
+	case BPFJ_ALU|BPFJ_RSH|BPFJ_K:
+	case BPFJ_ALU|BPFJ_NEG:
+	case BPFJ_MISC|BPFJ_TAX:
+	case BPFJ_MISC|BPFJ_TXA:
+		return 1;
+	}
+	return 0;
+}
+
+/* Checks that a program is safe to run without any further checks other
+ * than packet bounds. Returns 1 if the program is valid */
+static int validate_program(const bpf_jit_insn_t *insns, unsigned int plen) {
+	unsigned int i;
+
+	if (plen == 0 || plen > BPFJ_MAXINSNS)
+		return 0;
+
+	for (i = 0; i < plen; i++) {
+		const bpf_jit_insn_t *p = &insns[i];
+		unsigned int remaining = plen - i - 1;
+
+		if (!valid_opcode(p->code))
+			return 0;
+
+		switch (BPFJ_CLASS(p->code)) {
+		case BPFJ_LD:
+		case BPFJ_LDX:
+			if (BPFJ_MODE(p->code) == BPFJ_MEM &&
+					p->k >= BPFJ_MEMWORDS)
+				return 0;
+			break;
+		case BPFJ_ST:
+		case BPFJ_STX:
+			if (p->k >= BPFJ_MEMWORDS)
+				return 0;
+			break;
+		case BPFJ_ALU:
+			if ((BPFJ_OP(p->code) == BPFJ_DIV ||
+					BPFJ_OP(p->code) == BPFJ_MOD) &&
+					BPFJ_SRC(p->code) == BPFJ_K &&
+					p->k == 0)
+				return 0;
+			break;
+		case BPFJ_JMP:
+			if (BPFJ_OP(p->code) == BPFJ_JA) {
+				if (p->k >= remaining)
+					return 0;
+			} else if (p->jt >= remaining || p->jf >= remaining) {
+				return 0;
+			}
+			break;
+		}
+	}
+
+	/* Jumps are all forward and in range, so this guarantees that every
+	 * path through the program ends in a return */
+	return BPFJ_CLASS(insns[plen - 1].code) == BPFJ_RET;
+}
+
+/* Reads a big endian value from an unaligned packet pointer */
+static inline uint32_t load_word(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint32_t load_half(const unsigned char *p) {
+	return ((uint32_t)p[0] << 8) | (uint32_t)p[1];
+}
+
+/* Returns non-zero if size bytes at offset are within the packet */
+static inline int in_bounds(uint64_t offset, uint32_t size,
+		unsigned int length) {
+	return offset + size <= length;
+}
+
+unsigned int bpf_jit_interpret(const bpf_jit_t *bpf_jit,
+		const unsigned char *packet, unsigned int length) {
+	const bpf_jit_insn_t *p = bpf_jit->insns;
+	uint32_t A = 0, X = 0;
+	uint32_t mem[BPFJ_MEMWORDS];
+	uint64_t k;
+
+	memset(mem, 0, sizeof(mem));
+
+	for (;; p++) {
+		switch (p->code) {
+		case BPFJ_RET|BPFJ_K:
+			return p->k;
+		case BPFJ_RET|BPFJ_A:
+			return A;
+
+		case BPFJ_LD|BPFJ_W|BPFJ_ABS:
+			if (!in_bounds(p->k, 4, length))
+				return 0;
+			A = load_word(packet + p->k);
+			continue;
+		case BPFJ_LD|BPFJ_H|BPFJ_ABS:
+			if (!in_bounds(p->k, 2, length))
+				return 0;
+			A = load_half(packet + p->k);
+			continue;
+		case BPFJ_LD|BPFJ_B|BPFJ_ABS:
+			if (!in_bounds(p->k, 1, length))
+				return 0;
+			A = packet[p->k];
+			continue;
+		case BPFJ_LD|BPFJ_W|BPFJ_IND:
+			k = (uint64_t)X + p->k;
+			if (!in_bounds(k, 4, length))
+				return 0;
+			A = load_word(packet + k);
+			continue;
+		case BPFJ_LD|BPFJ_H|BPFJ_IND:
+			k = (uint64_t)X + p->k;
+			if (!in_bounds(k, 2, length))
+				return 0;
+			A = load_half(packet + k);
+			continue;
+		case BPFJ_LD|BPFJ_B|BPFJ_IND:
+			k = (uint64_t)X + p->k;
+			if (!in_bounds(k, 1, length))
+				return 0;
+			A = packet[k];
+			continue;
+		case BPFJ_LD|BPFJ_W|BPFJ_LEN:
+			A = length;
+			continue;
+		case BPFJ_LDX|BPFJ_W|BPFJ_LEN:
+			X = length;
+			continue;
+		case BPFJ_LDX|BPFJ_B|BPFJ_MSH:
+			if (!in_bounds(p->k, 1, length))
+				return 0;
+			X = (packet[p->k] & 0xf) << 2;
+			continue;
+		case BPFJ_LD|BPFJ_IMM:
+			A = p->k;
+			continue;
+		case BPFJ_LDX|BPFJ_IMM:
+			X = p->k;
+			continue;
+		case BPFJ_LD|BPFJ_MEM:
+			A = mem[p->k];
+			continue;
+		case BPFJ_LDX|BPFJ_MEM:
+			X = mem[p->k];
+			continue;
+		case BPFJ_ST:
+			mem[p->k] = A;
+			continue;
+		case BPFJ_STX:
+			mem[p->k] = X;
+			continue;
+
+		case BPFJ_JMP|BPFJ_JA:
+			p += p->k;
+			continue;
+		case BPFJ_JMP|BPFJ_JGT|BPFJ_K:
+			p += (A > p->k) ? p->jt : p->jf;
+			continue;
+		case BPFJ_JMP|BPFJ_JGE|BPFJ_K:
+			p += (A >= p->k) ? p->jt : p->jf;
+			continue;
+		case BPFJ_JMP|BPFJ_JEQ|BPFJ_K:
+			p += (A == p->k) ? p->jt : p->jf;
+			continue;
+		case BPFJ_JMP|BPFJ_JSET|BPFJ_K:
+			p += (A & p->k) ? p->jt : p->jf;
+			continue;
+		case BPFJ_JMP|BPFJ_JGT|BPFJ_X:
+			p += (A > X) ? p->jt : p->jf;
+			continue;
+		case BPFJ_JMP|BPFJ_JGE|BPFJ_X:
+			p += (A >= X) ? p->jt : p->jf;
+			continue;
+		case BPFJ_JMP|BPFJ_JEQ|BPFJ_X:
+			p += (A == X) ? p->jt : p->jf;
+			continue;
+		case BPFJ_JMP|BPFJ_JSET|BPFJ_X:
+			p += (A & X) ? p->jt : p->jf;
+			continue;
+
+		case BPFJ_ALU|BPFJ_ADD|BPFJ_X:
+			A += X;
+			continue;
+		case BPFJ_ALU|BPFJ_SUB|BPFJ_X:
+			A -= X;
+			continue;
+		case BPFJ_ALU|BPFJ_MUL|BPFJ_X:
+			A *= X;
+			continue;
+		case BPFJ_ALU|BPFJ_DIV|BPFJ_X:
+			if (X == 0)
+				return 0;
+			A /= X;
+			continue;
+		case BPFJ_ALU|BPFJ_MOD|BPFJ_X:
+			if (X == 0)
+				return 0;
+			A %= X;
+			continue;
+		case BPFJ_ALU|BPFJ_AND|BPFJ_X:
+			A &= X;
+			continue;
+		case BPFJ_ALU|BPFJ_OR|BPFJ_X:
+			A |= X;
+			continue;
+		case BPFJ_ALU|BPFJ_XOR|BPFJ_X:
+			A ^= X;
+			continue;
+		case BPFJ_ALU|BPFJ_LSH|BPFJ_X:
+			A = X < 32 ? A << X : 0;
+			continue;
+		case BPFJ_ALU|BPFJ_RSH|BPFJ_X:
+			A = X < 32 ? A >> X : 0;
+			continue;
+		case BPFJ_ALU|BPFJ_ADD|BPFJ_K:
+			A += p->k;
+			continue;
+		case BPFJ_ALU|BPFJ_SUB|BPFJ_K:
+			A -= p->k;
+			continue;
+		case BPFJ_ALU|BPFJ_MUL|BPFJ_K:
+			A *= p->k;
+			continue;
+		case BPFJ_ALU|BPFJ_DIV|BPFJ_K:
+			A /= p->k;
+			continue;
+		case BPFJ_ALU|BPFJ_MOD|BPFJ_K:
+			A %= p->k;
+			continue;
+		case BPFJ_ALU|BPFJ_AND|BPFJ_K:
+			A &= p->k;
+			continue;
+		case BPFJ_ALU|BPFJ_OR|BPFJ_K:
+			A |= p->k;
+			continue;
+		case BPFJ_ALU|BPFJ_XOR|BPFJ_K:
+			A ^= p->k;
+			continue;
+		case BPFJ_ALU|BPFJ_LSH|BPFJ_K:
+			A = p->k < 32 ? A << p->k : 0;
+			continue;
+		case BPFJ_ALU|BPFJ_RSH|BPFJ_K:
+			A = p->k < 32 ? A >> p->k : 0;
+			continue;
+		case BPFJ_ALU|BPFJ_NEG:
+			A = -A;
+			continue;
+
+		case BPFJ_MISC|BPFJ_TAX:
+			X = A;
+			continue;
+		case BPFJ_MISC|BPFJ_TXA:
+			A = X;
+			continue;
+
+		default:
+			/* Not reachable, the program has been checked */
+			return 0;
+		}
+	}
+}
+
+#if defined(__x86_64__)
+
+/* x86-64 register numbers */
+#define REG_EAX 0
+#define REG_ECX 1
+#define REG_EDX 2
+#define REG_ESI 6
+#define REG_EDI 7
+#define REG_R8 8
+#define REG_R9 9
+#define REG_R10 10
+
+/* Condition codes for jcc */
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+
+/* Scratch memory lives in the red zone */
+#define MEM_DISP(k) ((int8_t)(-64 + 4 * (int)(k)))
+
+struct jit_state {
+	/* Output buffer, NULL while we are only measuring the code */
+	uint8_t *buf;
+	size_t len;
+	/* Offset of the start of the code for each instruction */
+	size_t *addrs;
+	/* Offset of the code that rejects the packet */
+	size_t reject;
+};
+
+static inline void emit1(struct jit_state *s, uint8_t b) {
+	if (s->buf)
+		s->buf[s->len] = b;
+	s->len++;
+}
+
+static inline void emit2(struct jit_state *s, uint8_t a, uint8_t b) {
+	emit1(s, a);
+	emit1(s, b);
+}
+
+static inline void emit3(struct jit_state *s, uint8_t a, uint8_t b,
+		uint8_t c) {
+	emit1(s, a);
+	emit1(s, b);
+	emit1(s, c);
+}
+
+static inline void emit4(struct jit_state *s, uint32_t v) {
+	emit1(s, v & 0xff);
+	emit1(s, (v >> 8) & 0xff);
+	emit1(s, (v >> 16) & 0xff);
+	emit1(s, (v >> 24) & 0xff);
+}
+
+/* Emits an optional REX prefix for a register to register instruction */
+static inline void emit_rex(struct jit_state *s, int w, int reg, int rm) {
+	uint8_t rex = 0x40 | (w ? 0x08 : 0) | (reg >= 8 ? 0x04 : 0) |
+			(rm >= 8 ? 0x01 : 0);
+	if (rex != 0x40)
+		emit1(s, rex);
+}
+
+/* <op> rm, reg for the 32 bit ALU opcodes (mov, add, cmp, ...) */
+static void emit_alu_rr(struct jit_state *s, uint8_t op, int rm, int reg) {
+	emit_rex(s, 0, reg, rm);
+	emit2(s, op, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* mov reg, imm32 */
+static void emit_mov_imm(struct jit_state *s, int reg, uint32_t imm) {
+	if (imm == 0) {
+		/* xor reg, reg */
+		emit_alu_rr(s, 0x31, reg, reg);
+		return;
+	}
+	emit_rex(s, 0, 0, reg);
+	emit1(s, 0xb8 | (reg & 7));
+	emit4(s, imm);
+}
+
+/* Jumps to the start of the given BPF instruction, or to the reject code
+ * if target is (size_t)-1 */
+static void emit_jcc(struct jit_state *s, uint8_t cc, size_t target) {
+	size_t dest = target == (size_t)-1 ? s->reject : s->addrs[target];
+	emit2(s, 0x0f, 0x80 | cc);
+	emit4(s, (uint32_t)(dest - (s->len + 4)));
+}
+
+static void emit_jmp(struct jit_state *s, size_t target) {
+	size_t dest = target == (size_t)-1 ? s->reject : s->addrs[target];
+	emit1(s, 0xe9);
+	emit4(s, (uint32_t)(dest - (s->len + 4)));
+}
+
+#define REJECT ((size_t)-1)
+
+/* Emits the bounds check for a load of size bytes at an absolute offset.
+ * Returns 0 if the load can never succeed, in which case a jump to the
+ * reject code has been emitted instead */
+static int emit_abs_check(struct jit_state *s, uint32_t k, uint32_t size) {
+	/* Offsets that don't fit in a signed displacement are beyond any
+	 * packet we could be given */
+	if (k > 0x7fffffffu - size) {
+		emit_jmp(s, REJECT);
+		return 0;
+	}
+	/* cmp esi, k + size; jb reject */
+	emit2(s, 0x81, 0xfe);
+	emit4(s, k + size);
+	emit_jcc(s, CC_B, REJECT);
+	return 1;
+}
+
+/* Emits the bounds check for a load of size bytes at X + k, leaving the
+ * offset in r8 */
+static void emit_ind_check(struct jit_state *s, uint32_t k, uint32_t size) {
+	/* mov r8d, r9d */
+	emit_alu_rr(s, 0x89, REG_R8, REG_R9);
+	/* mov r10d, k; add r8, r10 */
+	emit_mov_imm(s, REG_R10, k);
+	emit3(s, 0x4d, 0x01, 0xd0);
+	/* lea r10, [r8 + size]; cmp r10, rsi; ja reject */
+	emit3(s, 0x4d, 0x8d, 0x50);
+	emit1(s, size);
+	emit3(s, 0x49, 0x39, 0xf2);
+	emit_jcc(s, CC_A, REJECT);
+}
+
+/* Emits a conditional jump for a BPF comparison, using the condition code
+ * for true and its inverse for false */
+static void emit_cond(struct jit_state *s, size_t i,
+		const bpf_jit_insn_t *p, uint8_t cc, uint8_t ncc) {
+	if (p->jt && p->jf) {
+		emit_jcc(s, cc, i + 1 + p->jt);
+		emit_jmp(s, i + 1 + p->jf);
+	} else if (p->jt) {
+		emit_jcc(s, cc, i + 1 + p->jt);
+	} else if (p->jf) {
+		emit_jcc(s, ncc, i + 1 + p->jf);
+	}
+}
+
+static int uses_scratch_memory(const bpf_jit_insn_t *insns, unsigned int plen) {
+	unsigned int i;
+
+	for (i = 0; i < plen; i++) {
+		if (insns[i].code == (BPFJ_LD|BPFJ_MEM) ||
+				insns[i].code == (BPFJ_LDX|BPFJ_MEM))
+			return 1;
+	}
+	return 0;
+}
+
+/* Generates the code for the whole program. This is run twice, first with
+ * no buffer to work out where each instruction starts, then again to emit
+ * the code. The length of each instruction never depends on where jumps
+ * go, so the addresses from the first pass are exact. */
+static void emit_program(struct jit_state *s, const bpf_jit_insn_t *insns,
+		unsigned int plen) {
+	unsigned int i;
+
+	s->len = 0;
+
+	/* mov esi, esi to clear the top of rsi; A = 0; X = 0 */
+	emit_alu_rr(s, 0x89, REG_ESI, REG_ESI);
+	emit_mov_imm(s, REG_EAX, 0);
+	emit_mov_imm(s, REG_R9, 0);
+
+	if (uses_scratch_memory(insns, plen)) {
+		/* xor edx, edx; mov [rsp - 64 + 8i], rdx */
+		emit_mov_imm(s, REG_EDX, 0);
+		for (i = 0; i < BPFJ_MEMWORDS / 2; i++) {
+			emit3(s, 0x48, 0x89, 0x54);
+			emit2(s, 0x24, (uint8_t)(-64 + 8 * (int)i));
+		}
+	}
+
+	for (i = 0; i < plen; i++) {
+		const bpf_jit_insn_t *p = &insns[i];
+
+		s->addrs[i] = s->len;
+
+		switch (p->code) {
+		case BPFJ_RET|BPFJ_K:
+			emit_mov_imm(s, REG_EAX, p->k);
+			emit1(s, 0xc3);
+			break;
+		case BPFJ_RET|BPFJ_A:
+			emit1(s, 0xc3);
+			break;
+
+		case BPFJ_LD|BPFJ_W|BPFJ_ABS:
+			if (!emit_abs_check(s, p->k, 4))
+				break;
+			/* mov eax, [rdi + k]; bswap eax */
+			emit2(s, 0x8b, 0x87);
+			emit4(s, p->k);
+			emit2(s, 0x0f, 0xc8);
+			break;
+		case BPFJ_LD|BPFJ_H|BPFJ_ABS:
+			if (!emit_abs_check(s, p->k, 2))
+				break;
+			/* movzx eax, word [rdi + k]; rol ax, 8 */
+			emit3(s, 0x0f, 0xb7, 0x87);
+			emit4(s, p->k);
+			emit2(s, 0x66, 0xc1);
+			emit2(s, 0xc0, 0x08);
+			break;
+		case BPFJ_LD|BPFJ_B|BPFJ_ABS:
+			if (!emit_abs_check(s, p->k, 1))
+				break;
+			/* movzx eax, byte [rdi + k] */
+			emit3(s, 0x0f, 0xb6, 0x87);
+			emit4(s, p->k);
+			break;
+		case BPFJ_LD|BPFJ_W|BPFJ_IND:
+			emit_ind_check(s, p->k, 4);
+			/* mov eax, [rdi + r8]; bswap eax */
+			emit2(s, 0x42, 0x8b);
+			emit2(s, 0x04, 0x07);
+			emit2(s, 0x0f, 0xc8);
+			break;
+		case BPFJ_LD|BPFJ_H|BPFJ_IND:
+			emit_ind_check(s, p->k, 2);
+			/* movzx eax, word [rdi + r8]; rol ax, 8 */
+			emit3(s, 0x42, 0x0f, 0xb7);
+			emit2(s, 0x04, 0x07);
+			emit2(s, 0x66, 0xc1);
+			emit2(s, 0xc0, 0x08);
+			break;
+		case BPFJ_LD|BPFJ_B|BPFJ_IND:
+			emit_ind_check(s, p->k, 1);
+			/* movzx eax, byte [rdi + r8] */
+			emit3(s, 0x42, 0x0f, 0xb6);
+			emit2(s, 0x04, 0x07);
+			break;
+		case BPFJ_LD|BPFJ_W|BPFJ_LEN:
+			emit_alu_rr(s, 0x89, REG_EAX, REG_ESI);
+			break;
+		case BPFJ_LDX|BPFJ_W|BPFJ_LEN:
+			emit_alu_rr(s, 0x89, REG_R9, REG_ESI);
+			break;
+		case BPFJ_LDX|BPFJ_B|BPFJ_MSH:
+			if (!emit_abs_check(s, p->k, 1))
+				break;
+			/* movzx r9d, byte [rdi + k]; and r9d, 0xf; shl r9d, 2 */
+			emit2(s, 0x44, 0x0f);
+			emit2(s, 0xb6, 0x8f);
+			emit4(s, p->k);
+			emit2(s, 0x41, 0x83);
+			emit2(s, 0xe1, 0x0f);
+			emit2(s, 0x41, 0xc1);
+			emit2(s, 0xe1, 0x02);
+			break;
+		case BPFJ_LD|BPFJ_IMM:
+			emit_mov_imm(s, REG_EAX, p->k);
+			break;
+		case BPFJ_LDX|BPFJ_IMM:
+			emit_mov_imm(s, REG_R9, p->k);
+			break;
+		case BPFJ_LD|BPFJ_MEM:
+			/* mov eax, [rsp + disp] */
+			emit2(s, 0x8b, 0x44);
+			emit2(s, 0x24, MEM_DISP(p->k));
+			break;
+		case BPFJ_LDX|BPFJ_MEM:
+			/* mov r9d, [rsp + disp] */
+			emit3(s, 0x44, 0x8b, 0x4c);
+			emit2(s, 0x24, MEM_DISP(p->k));
+			break;
+		case BPFJ_ST:
+			/* mov [rsp + disp], eax */
+			emit2(s, 0x89, 0x44);
+			emit2(s, 0x24, MEM_DISP(p->k));
+			break;
+		case BPFJ_STX:
+			/* mov [rsp + disp], r9d */
+			emit3(s, 0x44, 0x89, 0x4c);
+			emit2(s, 0x24, MEM_DISP(p->k));
+			break;
+
+		case BPFJ_JMP|BPFJ_JA:
+			if (p->k)
+				emit_jmp(s, i + 1 + p->k);
+			break;
+		case BPFJ_JMP|BPFJ_JGT|BPFJ_K:
+		case BPFJ_JMP|BPFJ_JGE|BPFJ_K:
+		case BPFJ_JMP|BPFJ_JEQ|BPFJ_K:
+			/* cmp eax, k */
+			emit1(s, 0x3d);
+			emit4(s, p->k);
+			goto cond;
+		case BPFJ_JMP|BPFJ_JSET|BPFJ_K:
+			/* test eax, k */
+			emit1(s, 0xa9);
+			emit4(s, p->k);
+			goto cond;
+		case BPFJ_JMP|BPFJ_JGT|BPFJ_X:
+		case BPFJ_JMP|BPFJ_JGE|BPFJ_X:
+		case BPFJ_JMP|BPFJ_JEQ|BPFJ_X:
+			/* cmp eax, r9d */
+			emit_alu_rr(s, 0x39, REG_EAX, REG_R9);
+			goto cond;
+		case BPFJ_JMP|BPFJ_JSET|BPFJ_X:
+			/* test eax, r9d */
+			emit_alu_rr(s, 0x85, REG_EAX, REG_R9);
+		cond:
+			switch (BPFJ_OP(p->code)) {
+			case BPFJ_JGT:
+				emit_cond(s, i, p, CC_A, CC_BE);
+				break;
+			case BPFJ_JGE:
+				emit_cond(s, i, p, CC_AE, CC_B);
+				break;
+			case BPFJ_JEQ:
+				emit_cond(s, i, p, CC_E, CC_NE);
+				break;
+			case BPFJ_JSET:
+				emit_cond(s, i, p, CC_NE, CC_E);
+				break;
+			}
+			break;
+
+		case BPFJ_ALU|BPFJ_ADD|BPFJ_X:
+			emit_alu_rr(s, 0x01, REG_EAX, REG_R9);
+			break;
+		case BPFJ_ALU|BPFJ_SUB|BPFJ_X:
+			emit_alu_rr(s, 0x29, REG_EAX, REG_R9);
+			break;
+		case BPFJ_ALU|BPFJ_AND|BPFJ_X:
+			emit_alu_rr(s, 0x21, REG_EAX, REG_R9);
+			break;
+		case BPFJ_ALU|BPFJ_OR|BPFJ_X:
+			emit_alu_rr(s, 0x09, REG_EAX, REG_R9);
+			break;
+		case BPFJ_ALU|BPFJ_XOR|BPFJ_X:
+			emit_alu_rr(s, 0x31, REG_EAX, REG_R9);
+			break;
+		case BPFJ_ALU|BPFJ_MUL|BPFJ_X:
+			/* imul eax, r9d */
+			emit2(s, 0x41, 0x0f);
+			emit2(s, 0xaf, 0xc1);
+			break;
+		case BPFJ_ALU|BPFJ_DIV|BPFJ_X:
+		case BPFJ_ALU|BPFJ_MOD|BPFJ_X:
+			/* test r9d, r9d; je reject; xor edx, edx; div r9d */
+			emit_alu_rr(s, 0x85, REG_R9, REG_R9);
+			emit_jcc(s, CC_E, REJECT);
+			emit_mov_imm(s, REG_EDX, 0);
+			emit3(s, 0x41, 0xf7, 0xf1);
+			if (BPFJ_OP(p->code) == BPFJ_MOD)
+				emit_alu_rr(s, 0x89, REG_EAX, REG_EDX);
+			break;
+		case BPFJ_ALU|BPFJ_LSH|BPFJ_X:
+		case BPFJ_ALU|BPFJ_RSH|BPFJ_X:
+			/* mov ecx, r9d; shl/shr eax, cl; xor edx, edx;
+			 * cmp r9d, 31; cmova eax, edx */
+			emit_alu_rr(s, 0x89, REG_ECX, REG_R9);
+			emit2(s, 0xd3, BPFJ_OP(p->code) == BPFJ_LSH ?
+					0xe0 : 0xe8);
+			emit_mov_imm(s, REG_EDX, 0);
+			emit2(s, 0x41, 0x83);
+			emit2(s, 0xf9, 0x1f);
+			emit3(s, 0x0f, 0x47, 0xc2);
+			break;
+		case BPFJ_ALU|BPFJ_ADD|BPFJ_K:
+			emit1(s, 0x05);
+			emit4(s, p->k);
+			break;
+		case BPFJ_ALU|BPFJ_SUB|BPFJ_K:
+			emit1(s, 0x2d);
+			emit4(s, p->k);
+			break;
+		case BPFJ_ALU|BPFJ_AND|BPFJ_K:
+			emit1(s, 0x25);
+			emit4(s, p->k);
+			break;
+		case BPFJ_ALU|BPFJ_OR|BPFJ_K:
+			emit1(s, 0x0d);
+			emit4(s, p->k);
+			break;
+		case BPFJ_ALU|BPFJ_XOR|BPFJ_K:
+			emit1(s, 0x35);
+			emit4(s, p->k);
+			break;
+		case BPFJ_ALU|BPFJ_MUL|BPFJ_K:
+			/* imul eax, eax, k */
+			emit2(s, 0x69, 0xc0);
+			emit4(s, p->k);
+			break;
+		case BPFJ_ALU|BPFJ_DIV|BPFJ_K:
+		case BPFJ_ALU|BPFJ_MOD|BPFJ_K:
+			/* mov ecx, k; xor edx, edx; div ecx */
+			emit_mov_imm(s, REG_ECX, p->k);
+			emit_mov_imm(s, REG_EDX, 0);
+			emit2(s, 0xf7, 0xf1);
+			if (BPFJ_OP(p->code) == BPFJ_MOD)
+				emit_alu_rr(s, 0x89, REG_EAX, REG_EDX);
+			break;
+		case BPFJ_ALU|BPFJ_LSH|BPFJ_K:
+		case BPFJ_ALU|BPFJ_RSH|BPFJ_K:
+			if (p->k >= 32) {
+				emit_mov_imm(s, REG_EAX, 0);
+				break;
+			}
+			emit2(s, 0xc1, BPFJ_OP(p->code) == BPFJ_LSH ?
+					0xe0 : 0xe8);
+			emit1(s, p->k);
+			break;
+		case BPFJ_ALU|BPFJ_NEG:
+			emit2(s, 0xf7, 0xd8);
+			break;
+
+		case BPFJ_MISC|BPFJ_TAX:
+			emit_alu_rr(s, 0x89, REG_R9, REG_EAX);
+			break;
+		case BPFJ_MISC|BPFJ_TXA:
+			emit_alu_rr(s, 0x89, REG_EAX, REG_R9);
+			break;
+		}
+	}
+
+	/* The last instruction is always a return, so this is only reached
+	 * by jumping to it. xor eax, eax; ret */
+	s->reject = s->len;
+	emit_mov_imm(s, REG_EAX, 0);
+	emit1(s, 0xc3);
+}
+
+/* Compiles a checked program to native code */
+static int compile_native(bpf_jit_t *jit) {
+	struct jit_state s;
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	void *code;
+
+	s.buf = NULL;
+	s.reject = 0;
+	s.addrs = (size_t *)calloc(jit->plen, sizeof(size_t));
+	if (!s.addrs)
+		return -1;
+
+	/* Work out where everything goes before generating any code */
+	emit_program(&s, jit->insns, jit->plen);
+
+	jit->codelen = (s.len + pagesize - 1) & ~(pagesize - 1);
+	code = mmap(NULL, jit->codelen, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		free(s.addrs);
+		return -1;
+	}
+
+	s.buf = (uint8_t *)code;
+	emit_program(&s, jit->insns, jit->plen);
+	free(s.addrs);
+
+	if (mprotect(code, jit->codelen, PROT_READ | PROT_EXEC) != 0) {
+		munmap(code, jit->codelen);
+		return -1;
+	}
+
+	jit->bpf_run = (bpf_run_t)code;
+	return 0;
+}
+#endif
+
+bpf_jit_t *compile_program(const void *insns, int plen) {
+	bpf_jit_t *jit;
+
+	if (plen <= 0 || !validate_program((const bpf_jit_insn_t *)insns,
+			(unsigned int)plen))
+		return NULL;
+
+	jit = (bpf_jit_t *)calloc(1, sizeof(bpf_jit_t));
+	if (!jit)
+		return NULL;
+	jit->plen = plen;
+	jit->insns = (bpf_jit_insn_t *)malloc(plen * sizeof(bpf_jit_insn_t));
+	if (!jit->insns) {
+		free(jit);
+		return NULL;
+	}
+	memcpy(jit->insns, insns, plen * sizeof(bpf_jit_insn_t));
+
+#if defined(__x86_64__)
+	/* If we can't get executable memory, interpret the program */
+	if (compile_native(jit) < 0)
+		jit->bpf_run = NULL;
+#endif
+	return jit;
+}
+
+void destroy_program(struct bpf_jit_t *bpf_jit) {
+	if (!bpf_jit)
+		return;
+#if defined(__x86_64__)
+	if (bpf_jit->bpf_run)
+		munmap((void *)bpf_jit->bpf_run, bpf_jit->codelen);
+#endif
+	free(bpf_jit->insns);
+	free(bpf_jit);
+}
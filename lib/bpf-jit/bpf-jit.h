@@ -24,22 +24,78 @@
  *
  */
 
+#ifndef BPF_JIT_H
+#define BPF_JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
 
-#include <pcap.h>
-#include <pcap-bpf.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
-typedef unsigned int (*bpf_run_t)(unsigned char *packet, unsigned int length);
 
+/** A classic BPF instruction, laid out the way pcap_compile() produces it.
+ * This is declared here because some of the headers libtrace can be built
+ * against define struct bpf_insn as an eBPF instruction instead.
+ */
+typedef struct bpf_jit_insn {
+	uint16_t code;
+	uint8_t jt;
+	uint8_t jf;
+	uint32_t k;
+} bpf_jit_insn_t;
+
+typedef unsigned int (*bpf_run_t)(const unsigned char *packet,
+		unsigned int length);
+
+/** A BPF program that has been prepared for fast execution */
 typedef struct bpf_jit_t {
+	/** The program compiled to native code, or NULL if it has to be
+	 * interpreted on this platform */
 	bpf_run_t bpf_run;
+	/** A checked copy of the program, used by the interpreter */
+	bpf_jit_insn_t *insns;
+	unsigned int plen;
+	/** Size of the mapping holding the native code */
+	size_t codelen;
 } bpf_jit_t;
 
-bpf_jit_t *compile_program(struct bpf_insn insns[], int plen);
+/** Prepares a classic BPF program for execution by bpf_jit_run(). On x86-64
+ * the program is compiled to native code, elsewhere a validated copy is
+ * interpreted.
+ *
+ * This is thread safe and does not hold on to insns.
+ *
+ * @param insns		The BPF program, as produced by pcap_compile()
+ * @param plen		The number of instructions in the program
+ * @return The prepared program, or NULL if the program is invalid
+ */
+bpf_jit_t *compile_program(const void *insns, int plen);
+
+/** Frees a program returned by compile_program() */
 void destroy_program(struct bpf_jit_t *bpf_jit);
 
+/** Interprets a program prepared by compile_program(). Callers should use
+ * bpf_jit_run() rather than calling this directly. */
+unsigned int bpf_jit_interpret(const bpf_jit_t *bpf_jit,
+		const unsigned char *packet, unsigned int length);
+
+/** Runs a prepared BPF program against a packet
+ *
+ * @param bpf_jit	The program returned by compile_program()
+ * @param packet	The start of the link layer header
+ * @param length	The number of bytes captured
+ * @return The value returned by the program, 0 if the packet is rejected
+ */
+static inline unsigned int bpf_jit_run(const bpf_jit_t *bpf_jit,
+		const unsigned char *packet, unsigned int length) {
+	if (bpf_jit->bpf_run)
+		return bpf_jit->bpf_run(packet, length);
+	return bpf_jit_interpret(bpf_jit, packet, length);
+}
+
 #ifdef __cplusplus
 }
 #endif
 
+#endif
@@ -26,25 +26,79 @@
 
 
 #include "checksum.h"
-
+#include <string.h>
+
+/* Sums the buffer as 16-bit words in host byte order. Rather than adding
+ * one word at a time, the buffer is read eight bytes at a time and the two
+ * 32-bit halves of each read are added into 64-bit accumulators. Ones'
+ * complement addition does not care how the words are grouped, so the
+ * halves can be folded back down to 16 bits at the end. Even a 64KB buffer
+ * cannot come close to overflowing the accumulators, so there is no need to
+ * handle carries inside the loop.
+ *
+ * The result is congruent to the word-at-a-time sum and never exceeds
+ * 0xffff, so callers can safely add several of them together before
+ * calling finish_checksum().
+ */
 uint32_t add_checksum(void *buffer, uint16_t length) {
-        uint32_t sum = 0;
-        uint16_t * buff = (uint16_t *) buffer;
-        uint16_t count = length;
-	uint16_t val;
-
-        while(count > 1 ) {
-                val = *buff;
-		sum += val;
-		buff ++;
-                count = count -2;
-        }
-
-        if(count > 0) {
-		sum += *(uint8_t *)buff;
-        }
-
-	return sum;
+	const uint8_t *buff = (const uint8_t *)buffer;
+	uint32_t count = length;
+	uint64_t sum = 0, sum2 = 0;
+	uint64_t w1, w2;
+	uint32_t w32;
+	uint16_t w16;
+
+	/* Two independent accumulators so consecutive additions do not
+	 * have to wait for each other. memcpy keeps the loads legal for
+	 * unaligned buffers and compiles down to plain loads. */
+	while (count >= 16) {
+		memcpy(&w1, buff, sizeof(w1));
+		memcpy(&w2, buff + 8, sizeof(w2));
+		sum += (w1 & 0xffffffff) + (w1 >> 32);
+		sum2 += (w2 & 0xffffffff) + (w2 >> 32);
+		buff += 16;
+		count -= 16;
+	}
+	sum += sum2;
+
+	if (count >= 8) {
+		memcpy(&w1, buff, sizeof(w1));
+		sum += (w1 & 0xffffffff) + (w1 >> 32);
+		buff += 8;
+		count -= 8;
+	}
+	if (count >= 4) {
+		memcpy(&w32, buff, sizeof(w32));
+		sum += w32;
+		buff += 4;
+		count -= 4;
+	}
+	if (count >= 2) {
+		memcpy(&w16, buff, sizeof(w16));
+		sum += w16;
+		buff += 2;
+		count -= 2;
+	}
+	if (count > 0) {
+		/* A trailing odd byte is padded with a zero byte */
+		w16 = 0;
+		memcpy(&w16, buff, 1);
+		sum += w16;
+	}
+
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return (uint32_t)sum;
+}
+
+uint32_t add_checksum_skip(void *buffer, uint16_t length, uint16_t skip) {
+	uint8_t *buff = (uint8_t *)buffer;
+
+	return add_checksum(buff, skip) +
+		add_checksum(buff + skip + 2, length - skip - 2);
 }
 
 uint16_t finish_checksum(uint32_t sum) {
@@ -99,4 +153,18 @@ uint32_t ipv6_pseudo_checksum(libtrace_ip6_t *ip) {
 
 }
 
+DLLEXPORT uint16_t trace_checksum_adjust(uint16_t csum, const void *oldval,
+		const void *newval, uint16_t length) {
 
+	uint32_t sum;
+
+	/* RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m'). Ones' complement sums
+	 * come out byte-swapped if every word is byte-swapped, so this works
+	 * directly on network byte order values. finish_checksum() gives us
+	 * the complement of the (folded) sum of the old contents. */
+	sum = (uint16_t)~csum;
+	sum += finish_checksum(add_checksum((void *)oldval, length));
+	sum += add_checksum((void *)newval, length);
+
+	return finish_checksum(sum);
+}
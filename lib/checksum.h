@@ -30,6 +30,9 @@
 #include "libtrace.h"
 
 uint32_t add_checksum(void *buffer, uint16_t length);
+/* Sums a header as though the 16-bit field at the (even) offset skip,
+ * usually the header's own checksum, was zero */
+uint32_t add_checksum_skip(void *buffer, uint16_t length, uint16_t skip);
 uint16_t finish_checksum(uint32_t total_sum);
 uint16_t checksum_buffer(void *buffer, uint16_t length);
 uint32_t ipv4_pseudo_checksum(libtrace_ip_t *ip);
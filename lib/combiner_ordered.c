@@ -27,199 +27,231 @@
 
 #include "libtrace.h"
 #include "libtrace_int.h"
-#include "data-struct/deque.h"
+#include "data-struct/spsc_queue.h"
 #include <assert.h>
 #include <stdlib.h>
 
 /* TODO hook up configuration option for sequentual packets again */
 
+/* Every perpkt thread publishes into its own lock-free queue, which only the
+ * reporter thread reads from. The reporter merges the queues by keeping a
+ * binary min-heap of the key at the front of each queue.
+ */
+
+typedef struct heap_entry {
+	uint64_t key;
+	int queue;
+} heap_entry_t;
+
+typedef struct ordered_state {
+	int nqueues;
+	libtrace_spsc_queue_t *queues;
+	heap_entry_t *heap;
+} ordered_state_t;
+
+static void publish_bulk(libtrace_t *trace, int t_id, libtrace_combine_t *c,
+		libtrace_result_t *results, size_t count);
+
 static int init_combiner(libtrace_t *t, libtrace_combine_t *c) {
 	int i = 0;
+	ordered_state_t *state;
+
 	if (trace_get_perpkt_threads(t) <= 0) {
 		trace_set_err(t, TRACE_ERR_INIT_FAILED, "You must have atleast 1 processing thread");
 		return -1;
 	}
-	libtrace_queue_t *queues;
-	c->queues = calloc(sizeof(libtrace_queue_t), trace_get_perpkt_threads(t));
-	queues = c->queues;
-	for (i = 0; i < trace_get_perpkt_threads(t); ++i) {
-		libtrace_deque_init(&queues[i], sizeof(libtrace_result_t));
+	state = calloc(1, sizeof(ordered_state_t));
+	if (!state) {
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the ordered combiner");
+		return -1;
 	}
+	state->nqueues = trace_get_perpkt_threads(t);
+	state->queues = calloc(state->nqueues, sizeof(libtrace_spsc_queue_t));
+	state->heap = calloc(state->nqueues, sizeof(heap_entry_t));
+	if (!state->queues || !state->heap) {
+		free(state->queues);
+		free(state->heap);
+		free(state);
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the ordered combiner");
+		return -1;
+	}
+	for (i = 0; i < state->nqueues; ++i) {
+		if (libtrace_spsc_queue_init(&state->queues[i],
+				sizeof(libtrace_result_t)) == -1)
+			break;
+	}
+	if (i < state->nqueues) {
+		while (i-- > 0)
+			libtrace_spsc_queue_destroy(&state->queues[i]);
+		free(state->queues);
+		free(state->heap);
+		free(state);
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the ordered combiner");
+		return -1;
+	}
+	c->queues = state;
+	trace_set_combiner_publish_bulk(t, publish_bulk);
 	return 0;
 }
 
 static void publish(libtrace_t *trace, int t_id, libtrace_combine_t *c, libtrace_result_t *res) {
-	libtrace_queue_t *queue = &((libtrace_queue_t*)c->queues)[t_id];
-	//while (libtrace_deque_get_size(&t->deque) >= 1000)
-	//	sched_yield();
-	libtrace_deque_push_back(queue, res); // Automatically locking for us :)
+	ordered_state_t *state = c->queues;
+	libtrace_spsc_queue_t *queue = &state->queues[t_id];
+
+	if (libtrace_spsc_queue_push(queue, res) == -1) {
+		if (res->type == RESULT_PACKET)
+			trace_free_packet(trace, res->value.pkt);
+		trace_set_err(trace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to queue a result for the ordered combiner");
+		return;
+	}
 
-	if (libtrace_deque_get_size(queue) >= trace->config.reporter_thold) {
+	if (libtrace_spsc_queue_get_size(queue) >= trace->config.reporter_thold) {
 		trace_post_reporter(trace);
 	}
 }
 
-inline static int peek_queue(libtrace_t *trace, libtrace_combine_t *c,
-                libtrace_queue_t *v, uint64_t *key, libtrace_result_t *peeked) {
+static void publish_bulk(libtrace_t *trace, int t_id, libtrace_combine_t *c,
+		libtrace_result_t *results, size_t count) {
+	ordered_state_t *state = c->queues;
+	libtrace_spsc_queue_t *queue = &state->queues[t_id];
 
-        libtrace_result_t r;
-        if (!peeked) {
-                libtrace_deque_peek_front(v, (void *) &r);
-                peeked = &r;
-        }
+	if (libtrace_spsc_queue_push_bulk(queue, results, count) == -1) {
+		size_t i;
+
+		for (i = 0; i < count; i++) {
+			if (results[i].type == RESULT_PACKET)
+				trace_free_packet(trace, results[i].value.pkt);
+		}
+		trace_set_err(trace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to queue results for the ordered combiner");
+		return;
+	}
+
+	if (libtrace_spsc_queue_get_size(queue) >= trace->config.reporter_thold) {
+		trace_post_reporter(trace);
+	}
+}
+
+/* Passes a tick straight to the reporter after removing it from the queue */
+static void forward_tick(libtrace_t *trace, libtrace_spsc_queue_t *v) {
+	libtrace_result_t r;
+	libtrace_generic_t gt = {.res = &r};
 
-        /* Ticks are a bit tricky, because we can get TS
-         * ticks in amongst packets indexed by their cardinal
-         * order and vice versa. Also, every thread will
-         * produce an equivalent tick and we should really
-         * combine those into a single tick for the reporter
-         * thread.
-         */
-
-        if (peeked->type == RESULT_TICK_INTERVAL) {
-                if (peeked->key > c->last_ts_tick) {
-                        c->last_ts_tick = peeked->key;
-
-                        /* Pass straight to reporter */
-                        libtrace_generic_t gt = {.res = peeked};
-                        ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
-                        send_message(trace, &trace->reporter_thread,
-                                        MESSAGE_RESULT, gt,
-                                        &trace->reporter_thread);
-                        return 0;
-
-                } else {
-                        /* Duplicate -- pop it */
-                        ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
-                        return 0;
+	ASSERT_RET (libtrace_spsc_queue_pop_front(v, &r), == 1);
+	send_message(trace, &trace->reporter_thread, MESSAGE_RESULT, gt,
+			&trace->reporter_thread);
+}
+
+/* Finds the key of the next result in a queue that should be merged,
+ * returns false if the queue is empty.
+ */
+static bool next_message(libtrace_t *trace, libtrace_combine_t *c,
+                libtrace_spsc_queue_t *v, uint64_t *key) {
+
+        libtrace_result_t *peeked;
+
+        while ((peeked = libtrace_spsc_queue_peek_front(v)) != NULL) {
+                /* Ticks are a bit tricky, because we can get TS
+                 * ticks in amongst packets indexed by their cardinal
+                 * order and vice versa. Also, every thread will
+                 * produce an equivalent tick and we should really
+                 * combine those into a single tick for the reporter
+                 * thread.
+                 */
+                if (peeked->type == RESULT_TICK_INTERVAL) {
+                        if (peeked->key > c->last_ts_tick) {
+                                c->last_ts_tick = peeked->key;
+                                forward_tick(trace, v);
+                        } else {
+                                /* Duplicate -- pop it */
+                                ASSERT_RET (libtrace_spsc_queue_pop_front(v, NULL), == 1);
+                        }
+                        continue;
                 }
-        }
 
-        if (peeked->type == RESULT_TICK_COUNT) {
-                if (peeked->key > c->last_count_tick) {
+                if (peeked->type == RESULT_TICK_COUNT) {
+                        if (peeked->key <= c->last_count_tick) {
+                                /* Duplicate -- pop it */
+                                ASSERT_RET (libtrace_spsc_queue_pop_front(v, NULL), == 1);
+                                continue;
+                        }
                         c->last_count_tick = peeked->key;
 
                         /* Tick doesn't match packet order */
                         if (trace_is_parallel(trace)) {
-                                /* Pass straight to reporter */
-                                libtrace_generic_t gt = {.res = peeked};
-                                ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
-                                send_message(trace, &trace->reporter_thread,
-                                                MESSAGE_RESULT, gt,
-                                                &trace->reporter_thread);
-                                return 0;
+                                forward_tick(trace, v);
+                                continue;
                         }
                         /* Tick matches packet order */
-                        *key = peeked->key;
-                        return 1;
-
-                        /* Tick doesn't match packet order */
-                } else {
-                        /* Duplicate -- pop it */
-                        ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
-                        return 0;
                 }
-        }
 
-        *key = peeked->key;
-        return 1;
+                *key = peeked->key;
+                return true;
+        }
+        return false;
 }
 
-inline static uint64_t next_message(libtrace_t *trace, libtrace_combine_t *c,
-                libtrace_queue_t *v) {
+static inline bool heap_less(const heap_entry_t *a, const heap_entry_t *b) {
+        if (a->key != b->key)
+                return a->key < b->key;
+        return a->queue < b->queue;
+}
 
-        libtrace_result_t r;
-        uint64_t nextkey = 0;
+static void heap_sift_down(heap_entry_t *heap, int size, int i) {
+        heap_entry_t e = heap[i];
 
-        do {
-                if (libtrace_deque_peek_front(v, (void *) &r) == 0) {
-                        return 0;
-                }
-        } while (peek_queue(trace, c, v, &nextkey, &r) == 0);
+        for (;;) {
+                int child = i * 2 + 1;
 
-        return nextkey;
+                if (child >= size)
+                        break;
+                if (child + 1 < size && heap_less(&heap[child + 1], &heap[child]))
+                        child++;
+                if (!heap_less(&heap[child], &e))
+                        break;
+                heap[i] = heap[child];
+                i = child;
+        }
+        heap[i] = e;
 }
 
+static void read_internal(libtrace_t *trace, libtrace_combine_t *c, const bool final){
+        ordered_state_t *state = c->queues;
+        heap_entry_t *heap = state->heap;
+        int i, size = 0;
 
-inline static void read_internal(libtrace_t *trace, libtrace_combine_t *c, const bool final){
-	int i;
-	int live_count = 0;
-        libtrace_queue_t *queues = c->queues;
-	bool allactive = true;
-        bool live[trace_get_perpkt_threads(trace)]; // Set if a trace is alive
-	uint64_t key[trace_get_perpkt_threads(trace)]; // Cached keys
-	uint64_t min_key = UINT64_MAX;
-        uint64_t peeked = 0;
-	int min_queue = -1;
-
-	/* Loop through check all are alive (have data) and find the smallest */
-        for (i = 0; i < trace_get_perpkt_threads(trace); ++i) {
-		libtrace_queue_t *v = &queues[i];
-                if (libtrace_deque_get_size(v) != 0 &&
-                                peek_queue(trace, c, v, &peeked, NULL)) {
-                        live_count ++;
-                        live[i] = true;
-                        key[i] = peeked;
-                        if (i == 0 || min_key > peeked) {
-                                min_key = peeked;
-                                min_queue = i;
-                        }
-                } else {
-                        allactive = false;
-                        live[i] = false;
-                        key[i] = 0;
+        /* Find the head of every queue that has data */
+        for (i = 0; i < state->nqueues; ++i) {
+                if (next_message(trace, c, &state->queues[i], &heap[size].key)) {
+                        heap[size].queue = i;
+                        size++;
                 }
-	}
-
-	/* Now remove the smallest and loop - special case if all threads have
-	 * joined we always flush what's left. Or the next smallest is the same
-	 * value or less than the previous */
-        while (allactive || (live_count && final)) {
-		/* Get the minimum queue and then do stuff */
+        }
+        for (i = size / 2 - 1; i >= 0; --i)
+                heap_sift_down(heap, size, i);
+
+	/* Now remove the smallest and loop - we can only be sure of the order
+	 * while every thread has something queued, unless all threads have
+	 * joined in which case we always flush what's left */
+        while (size == state->nqueues || (size && final)) {
+                libtrace_spsc_queue_t *v = &state->queues[heap[0].queue];
 		libtrace_result_t r;
 		libtrace_generic_t gt = {.res = &r};
 
-		ASSERT_RET (libtrace_deque_pop_front(&queues[min_queue], (void *) &r), == 1);
-
-                //printf("%lu %lu %lu %lu %d\n", key[0], key[1], key[2], key[3], min_queue);
-
+		ASSERT_RET (libtrace_spsc_queue_pop_front(v, &r), == 1);
                 send_message(trace, &trace->reporter_thread,
                                 MESSAGE_RESULT, gt,
                                 NULL);
 
 		// Now update the one we just removed
-                peeked = next_message(trace, c, &queues[min_queue]);
-                if (peeked != 0) {
-
-                        key[min_queue] = peeked;
-                        // We are still the smallest, might be out of order :(
-                        if (key[min_queue] <= min_key) {
-                                min_key = key[min_queue];
-                        } else {
-                                min_key = key[min_queue]; // Update our minimum
-                                // Check all find the smallest again - all are alive
-                                for (i = 0; i < trace_get_perpkt_threads(trace); ++i) {
-                                        if (live[i] && min_key >= key[i]) {
-                                                min_key = key[i];
-                                                min_queue = i;
-                                        }
-                                }
-                        }
-		} else {
-			allactive = false;
-                        live[min_queue] = false;
-                        key[min_queue] = 0;
-			live_count--;
-			min_key = UINT64_MAX; // Update our minimum
-                        min_queue = -1;
-			// Check all find the smallest again - all are alive
-			for (i = 0; i < trace_get_perpkt_threads(trace); ++i) {
-				if (live[i] && min_key >= key[i]) {
-					min_key = key[i];
-					min_queue = i;
-				}
-			}
-		}
+                if (!next_message(trace, c, v, &heap[0].key)) {
+                        heap[0] = heap[--size];
+                }
+                heap_sift_down(heap, size, 0);
 	}
 }
 
@@ -228,41 +260,46 @@ static void read(libtrace_t *trace, libtrace_combine_t *c) {
 }
 
 static void read_final(libtrace_t *trace, libtrace_combine_t *c) {
+        ordered_state_t *state = c->queues;
         int empty = 0, i;
-        libtrace_queue_t *q = c->queues;
 
         do {
                 read_internal(trace, c, true);
                 empty = 0;
-		for (i = 0; i < trace_get_perpkt_threads(trace); ++i) {
-                        if (libtrace_deque_get_size(&q[i]) == 0)
+		for (i = 0; i < state->nqueues; ++i) {
+                        if (libtrace_spsc_queue_get_size(&state->queues[i]) == 0)
                                 empty ++;
                 }
         }
-        while (empty < trace_get_perpkt_threads(trace));
+        while (empty < state->nqueues);
 }
 
 static void destroy(libtrace_t *trace, libtrace_combine_t *c) {
+	ordered_state_t *state = c->queues;
 	int i;
-	libtrace_queue_t *queues = c->queues;
 
-	for (i = 0; i < trace_get_perpkt_threads(trace); i++) {
-		if (libtrace_deque_get_size(&queues[i]) != 0) {
+	for (i = 0; i < state->nqueues; i++) {
+		if (libtrace_spsc_queue_get_size(&state->queues[i]) != 0) {
 			trace_set_err(trace, TRACE_ERR_COMBINER,
 				"Failed to destroy queues, A thread still has data in destroy()");
 			return;
 		}
 	}
-	free(queues);
-	queues = NULL;
+	for (i = 0; i < state->nqueues; i++)
+		libtrace_spsc_queue_destroy(&state->queues[i]);
+	free(state->queues);
+	free(state->heap);
+	free(state);
+	c->queues = NULL;
 }
 
 
-static void pause(libtrace_t *trace, libtrace_combine_t *c) {
-	libtrace_queue_t *queues = c->queues;
+static void pause(libtrace_t *trace UNUSED, libtrace_combine_t *c) {
+	ordered_state_t *state = c->queues;
 	int i;
-	for (i = 0; i < trace_get_perpkt_threads(trace); i++) {
-		libtrace_deque_apply_function(&queues[i], (deque_data_fn) libtrace_make_result_safe);
+	for (i = 0; i < state->nqueues; i++) {
+		libtrace_spsc_queue_apply_function(&state->queues[i],
+				(spsc_data_fn) libtrace_make_result_safe);
 	}
 }
 
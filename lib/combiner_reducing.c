@@ -0,0 +1,366 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "data-struct/spsc_queue.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Results with the same key are merged by the reporter thread as they are
+ * read from the perpkt threads' queues. Partial results are kept in a hash
+ * table, along with which threads have contributed to them, and the merged
+ * result is passed on as soon as every thread has contributed. Anything
+ * still incomplete when the trace finishes is passed on in key order.
+ */
+
+#define INITIAL_BUCKETS 64
+
+typedef struct reduce_entry reduce_entry_t;
+struct reduce_entry {
+	reduce_entry_t *next;
+	libtrace_result_t merged;
+	int contributors;
+	uint64_t seen[]; // One bit per perpkt thread
+};
+
+typedef struct reduce_state {
+	int nqueues;
+	libtrace_spsc_queue_t *queues;
+	fn_result_merge merge;
+	void *data;
+
+	reduce_entry_t **buckets;
+	size_t nbuckets;
+	size_t count;
+	size_t seen_words;
+} reduce_state_t;
+
+static inline size_t bucket_of(reduce_state_t *state, uint64_t key) {
+	return (key * 0x9E3779B97F4A7C15ULL) >> 32 & (state->nbuckets - 1);
+}
+
+static void publish_bulk(libtrace_t *trace, int t_id, libtrace_combine_t *c,
+		libtrace_result_t *results, size_t count);
+
+static int init_combiner(libtrace_t *t, libtrace_combine_t *c) {
+	libtrace_reducer_config_t *config = c->configuration.ptr;
+	reduce_state_t *state;
+	int i = 0;
+
+	if (trace_get_perpkt_threads(t) <= 0) {
+		trace_set_err(t, TRACE_ERR_INIT_FAILED, "You must have atleast 1 processing thread");
+		return -1;
+	}
+	if (!config || !config->merge) {
+		trace_set_err(t, TRACE_ERR_INIT_FAILED,
+			"combiner_reducing requires a merge function");
+		return -1;
+	}
+	state = calloc(1, sizeof(reduce_state_t));
+	if (!state) {
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the reducing combiner");
+		return -1;
+	}
+	state->nqueues = trace_get_perpkt_threads(t);
+	state->merge = config->merge;
+	state->data = config->data;
+	state->nbuckets = INITIAL_BUCKETS;
+	state->seen_words = (state->nqueues + 63) / 64;
+	state->queues = calloc(state->nqueues, sizeof(libtrace_spsc_queue_t));
+	state->buckets = calloc(state->nbuckets, sizeof(reduce_entry_t *));
+	if (!state->queues || !state->buckets) {
+		free(state->queues);
+		free(state->buckets);
+		free(state);
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the reducing combiner");
+		return -1;
+	}
+	for (i = 0; i < state->nqueues; ++i) {
+		if (libtrace_spsc_queue_init(&state->queues[i],
+				sizeof(libtrace_result_t)) == -1)
+			break;
+	}
+	if (i < state->nqueues) {
+		while (i-- > 0)
+			libtrace_spsc_queue_destroy(&state->queues[i]);
+		free(state->queues);
+		free(state->buckets);
+		free(state);
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the reducing combiner");
+		return -1;
+	}
+	c->queues = state;
+	trace_set_combiner_publish_bulk(t, publish_bulk);
+	return 0;
+}
+
+static void publish(libtrace_t *trace, int t_id, libtrace_combine_t *c, libtrace_result_t *res) {
+	reduce_state_t *state = c->queues;
+	libtrace_spsc_queue_t *queue = &state->queues[t_id];
+
+	if (libtrace_spsc_queue_push(queue, res) == -1) {
+		if (res->type == RESULT_PACKET)
+			trace_free_packet(trace, res->value.pkt);
+		trace_set_err(trace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to queue a result for the reducing combiner");
+		return;
+	}
+
+	if (libtrace_spsc_queue_get_size(queue) >= trace->config.reporter_thold) {
+		trace_post_reporter(trace);
+	}
+}
+
+static void publish_bulk(libtrace_t *trace, int t_id, libtrace_combine_t *c,
+		libtrace_result_t *results, size_t count) {
+	reduce_state_t *state = c->queues;
+	libtrace_spsc_queue_t *queue = &state->queues[t_id];
+
+	if (libtrace_spsc_queue_push_bulk(queue, results, count) == -1) {
+		size_t i;
+
+		for (i = 0; i < count; i++) {
+			if (results[i].type == RESULT_PACKET)
+				trace_free_packet(trace, results[i].value.pkt);
+		}
+		trace_set_err(trace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to queue results for the reducing combiner");
+		return;
+	}
+
+	if (libtrace_spsc_queue_get_size(queue) >= trace->config.reporter_thold) {
+		trace_post_reporter(trace);
+	}
+}
+
+static void grow_table(reduce_state_t *state) {
+	reduce_entry_t **old = state->buckets;
+	size_t i, oldsize = state->nbuckets;
+
+	state->buckets = calloc(oldsize * 2, sizeof(reduce_entry_t *));
+	if (!state->buckets) {
+		/* Carry on with longer chains */
+		state->buckets = old;
+		return;
+	}
+	state->nbuckets = oldsize * 2;
+	for (i = 0; i < oldsize; i++) {
+		reduce_entry_t *e = old[i];
+
+		while (e) {
+			reduce_entry_t *next = e->next;
+			size_t b = bucket_of(state, e->merged.key);
+
+			e->next = state->buckets[b];
+			state->buckets[b] = e;
+			e = next;
+		}
+	}
+	free(old);
+}
+
+/* Merges a result into the table, passing the merged result on if this
+ * was the last thread to contribute */
+static void reduce_result(libtrace_t *trace, reduce_state_t *state,
+		int t_id, libtrace_result_t *res) {
+	reduce_entry_t **prev = &state->buckets[bucket_of(state, res->key)];
+	reduce_entry_t *e = *prev;
+	uint64_t bit = 1ULL << (t_id % 64);
+	int word = t_id / 64;
+
+	while (e && e->merged.key != res->key) {
+		prev = &e->next;
+		e = e->next;
+	}
+
+	if (!e) {
+		e = calloc(1, sizeof(reduce_entry_t) +
+				state->seen_words * sizeof(uint64_t));
+		if (!e) {
+			/* Pass it on unmerged rather than lose it */
+			libtrace_generic_t gt = {.res = res};
+			send_message(trace, &trace->reporter_thread,
+					MESSAGE_RESULT, gt, NULL);
+			return;
+		}
+		e->merged = *res;
+		e->next = state->buckets[bucket_of(state, res->key)];
+		state->buckets[bucket_of(state, res->key)] = e;
+		prev = &state->buckets[bucket_of(state, res->key)];
+		state->count++;
+	} else {
+		state->merge(&e->merged, res, state->data);
+	}
+
+	if (!(e->seen[word] & bit)) {
+		e->seen[word] |= bit;
+		e->contributors++;
+	}
+
+	if (e->contributors == state->nqueues) {
+		libtrace_generic_t gt = {.res = &e->merged};
+
+		*prev = e->next;
+		state->count--;
+		send_message(trace, &trace->reporter_thread,
+				MESSAGE_RESULT, gt, NULL);
+		free(e);
+	} else if (state->count > state->nbuckets) {
+		grow_table(state);
+	}
+}
+
+static void read(libtrace_t *trace, libtrace_combine_t *c){
+	reduce_state_t *state = c->queues;
+	int i;
+
+	/* Loop through and read all that are here */
+	for (i = 0; i < state->nqueues; ++i) {
+		libtrace_spsc_queue_t *v = &state->queues[i];
+		libtrace_result_t r;
+
+		while (libtrace_spsc_queue_pop_front(v, &r)) {
+                        libtrace_generic_t gt = {.res = &r};
+
+                        /* Ignore any ticks that we've already seen */
+                        if (r.type == RESULT_TICK_INTERVAL) {
+                                if (r.key <= c->last_ts_tick)
+                                        continue;
+                                c->last_ts_tick = r.key;
+                        }
+
+                        if (r.type == RESULT_TICK_COUNT) {
+                                if (r.key <= c->last_count_tick)
+                                        continue;
+                                c->last_count_tick = r.key;
+                        }
+
+                        /* Only user results are merged */
+                        if (r.type < RESULT_USER) {
+                                send_message(trace, &trace->reporter_thread,
+                                        MESSAGE_RESULT, gt, NULL);
+                                continue;
+                        }
+                        reduce_result(trace, state, i, &r);
+		}
+	}
+}
+
+static int compare_entry(const void *p1, const void *p2) {
+	const reduce_entry_t *e1 = *(reduce_entry_t * const *) p1;
+	const reduce_entry_t *e2 = *(reduce_entry_t * const *) p2;
+
+	if (e1->merged.key < e2->merged.key)
+		return -1;
+	if (e1->merged.key == e2->merged.key)
+		return 0;
+	return 1;
+}
+
+static void read_final(libtrace_t *trace, libtrace_combine_t *c) {
+	reduce_state_t *state = c->queues;
+	reduce_entry_t **pending;
+	size_t i, n = 0;
+
+	read(trace, c);
+	if (state->count == 0)
+		return;
+
+	/* Not every thread contributed to these, pass on what we have */
+	pending = malloc(state->count * sizeof(reduce_entry_t *));
+	for (i = 0; i < state->nbuckets; i++) {
+		reduce_entry_t *e = state->buckets[i];
+
+		for (; e; e = e->next) {
+			if (pending)
+				pending[n++] = e;
+			else
+				send_message(trace, &trace->reporter_thread,
+						MESSAGE_RESULT,
+						(libtrace_generic_t){.res = &e->merged},
+						NULL);
+		}
+	}
+	if (pending) {
+		qsort(pending, n, sizeof(reduce_entry_t *), compare_entry);
+		for (i = 0; i < n; i++) {
+			libtrace_generic_t gt = {.res = &pending[i]->merged};
+			send_message(trace, &trace->reporter_thread,
+					MESSAGE_RESULT, gt, NULL);
+		}
+		free(pending);
+	}
+
+	for (i = 0; i < state->nbuckets; i++) {
+		reduce_entry_t *e = state->buckets[i];
+
+		while (e) {
+			reduce_entry_t *next = e->next;
+			free(e);
+			e = next;
+		}
+		state->buckets[i] = NULL;
+	}
+	state->count = 0;
+}
+
+static void destroy(libtrace_t *trace, libtrace_combine_t *c) {
+	reduce_state_t *state = c->queues;
+	int i;
+
+	for (i = 0; i < state->nqueues; i++) {
+		if (libtrace_spsc_queue_get_size(&state->queues[i]) != 0) {
+			trace_set_err(trace, TRACE_ERR_COMBINER,
+				"Failed to destroy queues, A thread still has data in destroy()");
+			return;
+		}
+	}
+	for (i = 0; i < state->nqueues; i++)
+		libtrace_spsc_queue_destroy(&state->queues[i]);
+	free(state->queues);
+	free(state->buckets);
+	free(state);
+	c->queues = NULL;
+}
+
+DLLEXPORT const libtrace_combine_t combiner_reducing = {
+    init_combiner,	/* initialise */
+	destroy,		/* destroy */
+	publish,		/* publish */
+    read,			/* read */
+    read_final,			/* read_final */
+    read,			/* pause */
+    NULL,			/* queues */
+    0,                          /* last_count_tick */
+    0,                          /* last_ts_tick */
+    {0}				/* opts */
+};
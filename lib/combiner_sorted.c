@@ -29,32 +29,100 @@
 #include "libtrace_int.h"
 #include "data-struct/vector.h"
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* Each perpkt thread collects its results in its own vector, which is kept
+ * as a single run sorted by key. Results are usually published in nearly
+ * key order so the run is only sorted when it is needed. When the trace is
+ * paused or finishes the runs from every thread are merged with a min-heap
+ * and passed to the reporter.
+ *
+ * If a memory budget is configured, a thread whose run grows past its share
+ * of the budget sorts the run and appends it to a temporary file. Spilled
+ * runs are read back a block at a time while merging.
+ */
+
+/* Number of results read from a spilled run at a time */
+#define SPILL_BLOCK 256
+
+typedef struct spilled_run {
+	off_t offset;
+	size_t count;
+} spilled_run_t;
+
+typedef struct sorted_queue {
+	libtrace_vector_t results;
+	/* False once a result arrives out of key order */
+	bool sorted;
+	uint64_t last_key;
+	/* Runs written out to disk, NULL until the first spill */
+	FILE *spill;
+	off_t spill_size;
+	libtrace_vector_t spilled_runs;
+	bool spill_failed;
+} sorted_queue_t;
+
+typedef struct sorted_state {
+	int nqueues;
+	/* Most results a thread may hold in memory, 0 for no limit */
+	size_t max_results;
+	sorted_queue_t *queues;
+} sorted_state_t;
+
+/* A run being merged, either in memory or being read back from disk */
+typedef struct merge_source {
+	libtrace_result_t *next;
+	size_t available;
+	/* Spilled runs only */
+	FILE *file;
+	off_t offset;
+	size_t remaining;
+	libtrace_result_t *block;
+} merge_source_t;
 
 static int init_combiner(libtrace_t *t, libtrace_combine_t *c) {
 	int i = 0;
+	sorted_state_t *state;
+
 	if (trace_get_perpkt_threads(t) <= 0) {
 		trace_set_err(t, TRACE_ERR_INIT_FAILED, "You must have atleast 1 processing thread");
 		return -1;
 	}
-	libtrace_vector_t *queues;
-	c->queues = calloc(sizeof(libtrace_vector_t), trace_get_perpkt_threads(t));
-	queues = c->queues;
-	for (i = 0; i < trace_get_perpkt_threads(t); ++i) {
-		libtrace_vector_init(&queues[i], sizeof(libtrace_result_t));
+	state = calloc(1, sizeof(sorted_state_t));
+	if (!state) {
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the sorted combiner");
+		return -1;
 	}
+	state->nqueues = trace_get_perpkt_threads(t);
+	state->queues = calloc(state->nqueues, sizeof(sorted_queue_t));
+	if (!state->queues) {
+		free(state);
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the sorted combiner");
+		return -1;
+	}
+	if (c->configuration.uint64) {
+		/* Split the budget evenly, a thread must be able to hold
+		 * at least one result */
+		state->max_results = c->configuration.uint64 /
+				sizeof(libtrace_result_t) / state->nqueues;
+		if (state->max_results == 0)
+			state->max_results = 1;
+	}
+	for (i = 0; i < state->nqueues; ++i) {
+		libtrace_vector_init(&state->queues[i].results,
+				sizeof(libtrace_result_t));
+		libtrace_vector_init(&state->queues[i].spilled_runs,
+				sizeof(spilled_run_t));
+		state->queues[i].sorted = true;
+	}
+	c->queues = state;
 	return 0;
 }
 
-static void publish(libtrace_t *trace UNUSED, int t_id, libtrace_combine_t *c, libtrace_result_t *res) {
-	libtrace_vector_t *vec = &((libtrace_vector_t*)c->queues)[t_id];
-	libtrace_vector_push_back(vec, res);
-}
-
-static void read(libtrace_t *trace UNUSED, libtrace_combine_t *c UNUSED){
-	return;
-}
-
 static int compare_result(const void* p1, const void* p2)
 {
 	const libtrace_result_t * r1 = p1;
@@ -67,55 +135,238 @@ static int compare_result(const void* p1, const void* p2)
 		return 1;
 }
 
-static void pause(libtrace_t *trace, libtrace_combine_t *c) {
-	libtrace_vector_t *queues = c->queues;
-	int i;
-	for (i = 0; i < trace_get_perpkt_threads(trace); ++i) {
-		libtrace_vector_apply_function(&queues[i], (vector_data_fn) libtrace_make_result_safe);
+static void sort_run(sorted_queue_t *q) {
+	if (!q->sorted) {
+		libtrace_vector_qsort(&q->results, compare_result);
+		q->sorted = true;
 	}
 }
 
-static void read_final(libtrace_t *trace, libtrace_combine_t *c) {
-	libtrace_vector_t *queues = c->queues;
-	int i;
+/* Moves the results a thread is holding into its spill file. This is called
+ * by the perpkt thread that owns the queue. */
+static void spill_run(sorted_queue_t *q) {
+	spilled_run_t run;
+	size_t count = libtrace_vector_get_size(&q->results);
+
+	if (!q->spill) {
+		q->spill = tmpfile();
+		if (!q->spill) {
+			perror("Unable to create a spill file for the sorted combiner");
+			q->spill_failed = true;
+			return;
+		}
+	}
+
+	sort_run(q);
+	run.offset = q->spill_size;
+	run.count = count;
+	if (fseeko(q->spill, run.offset, SEEK_SET) != 0 ||
+			fwrite(q->results.elements, sizeof(libtrace_result_t),
+			count, q->spill) != count) {
+		/* Keep everything in memory from now on */
+		perror("Unable to spill results for the sorted combiner");
+		q->spill_failed = true;
+		return;
+	}
+	q->spill_size += count * sizeof(libtrace_result_t);
+	libtrace_vector_push_back(&q->spilled_runs, &run);
+	libtrace_vector_empty(&q->results);
+}
+
+static void publish(libtrace_t *trace UNUSED, int t_id, libtrace_combine_t *c, libtrace_result_t *res) {
+	sorted_state_t *state = c->queues;
+	sorted_queue_t *q = &state->queues[t_id];
+
+	if (res->type == RESULT_TICK_INTERVAL ||
+			res->type == RESULT_TICK_COUNT) {
+		/* Ticks are essentially useless for this combiner? */
+		return;
+	}
+
+	if (q->sorted && libtrace_vector_get_size(&q->results) != 0 &&
+			res->key < q->last_key)
+		q->sorted = false;
+	q->last_key = res->key;
+	libtrace_vector_push_back(&q->results, res);
+
+	if (state->max_results && !q->spill_failed &&
+			libtrace_vector_get_size(&q->results) >= state->max_results)
+		spill_run(q);
+}
+
+static void read(libtrace_t *trace UNUSED, libtrace_combine_t *c UNUSED){
+	return;
+}
+
+/* Makes sure the next result of a spilled run is in memory, returns false
+ * once the run is finished */
+static bool refill_source(libtrace_t *trace, merge_source_t *src) {
+	size_t n;
+
+	if (src->available)
+		return true;
+	if (!src->file || src->remaining == 0)
+		return false;
+
+	n = src->remaining < SPILL_BLOCK ? src->remaining : SPILL_BLOCK;
+	if (fseeko(src->file, src->offset, SEEK_SET) != 0 ||
+			fread(src->block, sizeof(libtrace_result_t), n,
+			src->file) != n) {
+		trace_set_err(trace, TRACE_ERR_COMBINER,
+			"Failed to read back results spilled by the sorted combiner");
+		src->remaining = 0;
+		return false;
+	}
+	src->offset += n * sizeof(libtrace_result_t);
+	src->remaining -= n;
+	src->next = src->block;
+	src->available = n;
+	return true;
+}
+
+static inline bool source_less(merge_source_t *srcs, int a, int b) {
+	if (srcs[a].next->key != srcs[b].next->key)
+		return srcs[a].next->key < srcs[b].next->key;
+	return a < b;
+}
+
+static void heap_sift_down(merge_source_t *srcs, int *heap, int size, int i) {
+	int e = heap[i];
+
+	for (;;) {
+		int child = i * 2 + 1;
+
+		if (child >= size)
+			break;
+		if (child + 1 < size &&
+				source_less(srcs, heap[child + 1], heap[child]))
+			child++;
+		if (!source_less(srcs, heap[child], e))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = e;
+}
+
+/* Merges the runs from every thread and passes the results to the reporter
+ * in key order */
+static void merge_runs(libtrace_t *trace, libtrace_combine_t *c) {
+	sorted_state_t *state = c->queues;
+	merge_source_t *srcs;
+	int *heap;
+	int i, nsrcs = 0, size = 0;
 	size_t a;
-	// Combine all results into queue 1
-	for (i = 1; i < trace_get_perpkt_threads(trace); ++i)
-	{
-		libtrace_vector_append(&queues[0],&queues[i]);
+
+	for (i = 0; i < state->nqueues; ++i) {
+		nsrcs += libtrace_vector_get_size(&state->queues[i].spilled_runs) + 1;
+	}
+	srcs = calloc(nsrcs, sizeof(merge_source_t));
+	heap = calloc(nsrcs, sizeof(int));
+	if (!srcs || !heap) {
+		trace_set_err(trace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory to merge results");
+		free(srcs);
+		free(heap);
+		return;
+	}
+
+	nsrcs = 0;
+	for (i = 0; i < state->nqueues; ++i) {
+		sorted_queue_t *q = &state->queues[i];
+
+		for (a = 0; a < libtrace_vector_get_size(&q->spilled_runs); ++a) {
+			spilled_run_t run;
+			merge_source_t *src = &srcs[nsrcs++];
+
+			ASSERT_RET (libtrace_vector_get(&q->spilled_runs, a, &run), == 1);
+			src->file = q->spill;
+			src->offset = run.offset;
+			src->remaining = run.count;
+			src->block = malloc(SPILL_BLOCK * sizeof(libtrace_result_t));
+			if (!src->block) {
+				trace_set_err(trace, TRACE_ERR_OUT_OF_MEMORY,
+					"Unable to allocate memory to merge results");
+				src->remaining = 0;
+			}
+		}
+
+		sort_run(q);
+		srcs[nsrcs].next = (libtrace_result_t *) q->results.elements;
+		srcs[nsrcs].available = libtrace_vector_get_size(&q->results);
+		nsrcs++;
+	}
+
+	for (i = 0; i < nsrcs; ++i) {
+		if (refill_source(trace, &srcs[i]))
+			heap[size++] = i;
 	}
-	// Sort them
-	libtrace_vector_qsort(&queues[0], compare_result);
+	for (i = size / 2 - 1; i >= 0; --i)
+		heap_sift_down(srcs, heap, size, i);
 
-	for (a = 0; a < libtrace_vector_get_size(&queues[0]); ++a) {
-		libtrace_result_t r;
+	while (size) {
+		merge_source_t *src = &srcs[heap[0]];
+		libtrace_result_t r = *src->next;
 		libtrace_generic_t gt = {.res = &r};
-		ASSERT_RET (libtrace_vector_get(&queues[0], a, (void *) &r), == 1);
-		if (r.type == RESULT_TICK_INTERVAL ||
-                                r.type == RESULT_TICK_COUNT) {
-                        /* Ticks are essentially useless for this combiner? */
-                        continue;
-                }
-                send_message(trace, &trace->reporter_thread, MESSAGE_RESULT,
-                                gt, NULL);
-	}
-	libtrace_vector_empty(&queues[0]);
+
+		src->next++;
+		src->available--;
+		send_message(trace, &trace->reporter_thread, MESSAGE_RESULT,
+				gt, NULL);
+
+		if (!refill_source(trace, src))
+			heap[0] = heap[--size];
+		heap_sift_down(srcs, heap, size, 0);
+	}
+
+	for (i = 0; i < nsrcs; ++i)
+		free(srcs[i].block);
+	free(srcs);
+	free(heap);
+
+	for (i = 0; i < state->nqueues; ++i) {
+		sorted_queue_t *q = &state->queues[i];
+
+		libtrace_vector_empty(&q->results);
+		libtrace_vector_empty(&q->spilled_runs);
+		q->spill_size = 0;
+		q->spill_failed = false;
+		if (q->spill) {
+			fclose(q->spill);
+			q->spill = NULL;
+		}
+	}
+}
+
+/* Everything published before the pause is passed on now, so the results
+ * never have to be made safe */
+static void pause(libtrace_t *trace, libtrace_combine_t *c) {
+	merge_runs(trace, c);
+}
+
+static void read_final(libtrace_t *trace, libtrace_combine_t *c) {
+	merge_runs(trace, c);
 }
 
 static void destroy(libtrace_t *trace, libtrace_combine_t *c) {
+	sorted_state_t *state = c->queues;
 	int i;
-	libtrace_vector_t *queues = c->queues;
 
-	for (i = 0; i < trace_get_perpkt_threads(trace); i++) {
-		if (libtrace_vector_get_size(&queues[i]) != 0) {
+	for (i = 0; i < state->nqueues; i++) {
+		if (libtrace_vector_get_size(&state->queues[i].results) != 0 ||
+				libtrace_vector_get_size(&state->queues[i].spilled_runs) != 0) {
 			trace_set_err(trace, TRACE_ERR_COMBINER,
 				"Failed to destroy queues, A thread still has data in destroy()");
 			return;
 		}
-		libtrace_vector_destroy(&queues[i]);
 	}
-	free(queues);
-	queues = NULL;
+	for (i = 0; i < state->nqueues; i++) {
+		libtrace_vector_destroy(&state->queues[i].results);
+		libtrace_vector_destroy(&state->queues[i].spilled_runs);
+	}
+	free(state->queues);
+	free(state);
+	c->queues = NULL;
 }
 
 DLLEXPORT const libtrace_combine_t combiner_sorted = {
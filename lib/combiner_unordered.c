@@ -31,6 +31,9 @@
 #include <assert.h>
 #include <stdlib.h>
 
+static void publish_bulk(libtrace_t *trace, int t_id, libtrace_combine_t *c,
+		libtrace_result_t *results, size_t count);
+
 static int init_combiner(libtrace_t *t, libtrace_combine_t *c) {
 	int i = 0;
 	if (trace_get_perpkt_threads(t) <= 0) {
@@ -43,6 +46,7 @@ static int init_combiner(libtrace_t *t, libtrace_combine_t *c) {
 	for (i = 0; i < trace_get_perpkt_threads(t); ++i) {
 		libtrace_deque_init(&queues[i], sizeof(libtrace_result_t));
 	}
+	trace_set_combiner_publish_bulk(t, publish_bulk);
 	return 0;
 }
 
@@ -55,6 +59,19 @@ static void publish(libtrace_t *trace, int t_id, libtrace_combine_t *c, libtrace
 	}
 }
 
+static void publish_bulk(libtrace_t *trace, int t_id, libtrace_combine_t *c,
+		libtrace_result_t *results, size_t count) {
+	libtrace_queue_t *queue = &((libtrace_queue_t*)c->queues)[t_id];
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		libtrace_deque_push_back(queue, &results[i]);
+
+	if (libtrace_deque_get_size(queue) >= trace->config.reporter_thold) {
+		trace_post_reporter(trace);
+	}
+}
+
 static void read(libtrace_t *trace, libtrace_combine_t *c){
 	libtrace_queue_t *queues = c->queues;
 	int i;
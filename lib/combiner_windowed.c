@@ -0,0 +1,376 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "data-struct/spsc_queue.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Results are ordered by their event time, the key for most results or the
+ * timestamp of the packet for RESULT_PACKET. Each perpkt thread has a
+ * watermark, the latest event time it has published a result or interval
+ * tick for, and it is assumed that the thread won't publish anything
+ * earlier than that. The reporter thread buffers results in a min-heap
+ * until every watermark has passed the end of their window.
+ *
+ * With a lateness bound, a window is also passed on once the furthest
+ * ahead thread is that far past its end, so one slow or stalled thread
+ * can't hold everything up. Anything that turns up for a window that has
+ * already been passed on is sent straight to the reporter, flagged as
+ * late.
+ */
+
+/* One second, for when no window is configured */
+#define DEFAULT_WINDOW ((uint64_t) 1 << 32)
+
+typedef struct pending {
+	uint64_t ts;
+	/* Keeps results with the same event time in the order they were
+	 * read */
+	uint64_t seq;
+	libtrace_result_t res;
+} pending_t;
+
+typedef struct window_state {
+	int nqueues;
+	libtrace_spsc_queue_t *queues;
+	uint64_t window;
+	uint64_t lateness;
+
+	uint64_t *watermarks;
+	uint64_t max_watermark;
+	/* Everything before this has been passed on */
+	uint64_t closed;
+
+	pending_t *heap;
+	size_t size;
+	size_t capacity;
+	uint64_t seq;
+} window_state_t;
+
+static void publish_bulk(libtrace_t *trace, int t_id, libtrace_combine_t *c,
+		libtrace_result_t *results, size_t count);
+
+static int init_combiner(libtrace_t *t, libtrace_combine_t *c) {
+	libtrace_window_config_t *config = c->configuration.ptr;
+	window_state_t *state;
+	int i = 0;
+
+	if (trace_get_perpkt_threads(t) <= 0) {
+		trace_set_err(t, TRACE_ERR_INIT_FAILED, "You must have atleast 1 processing thread");
+		return -1;
+	}
+	state = calloc(1, sizeof(window_state_t));
+	if (!state) {
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the windowed combiner");
+		return -1;
+	}
+	state->nqueues = trace_get_perpkt_threads(t);
+	state->window = DEFAULT_WINDOW;
+	if (config) {
+		if (config->window)
+			state->window = config->window;
+		state->lateness = config->lateness;
+	}
+	state->queues = calloc(state->nqueues, sizeof(libtrace_spsc_queue_t));
+	state->watermarks = calloc(state->nqueues, sizeof(uint64_t));
+	if (!state->queues || !state->watermarks) {
+		free(state->queues);
+		free(state->watermarks);
+		free(state);
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the windowed combiner");
+		return -1;
+	}
+	for (i = 0; i < state->nqueues; ++i) {
+		if (libtrace_spsc_queue_init(&state->queues[i],
+				sizeof(libtrace_result_t)) == -1)
+			break;
+	}
+	if (i < state->nqueues) {
+		while (i-- > 0)
+			libtrace_spsc_queue_destroy(&state->queues[i]);
+		free(state->queues);
+		free(state->watermarks);
+		free(state);
+		trace_set_err(t, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the windowed combiner");
+		return -1;
+	}
+	c->queues = state;
+	trace_set_combiner_publish_bulk(t, publish_bulk);
+	return 0;
+}
+
+static void publish(libtrace_t *trace, int t_id, libtrace_combine_t *c, libtrace_result_t *res) {
+	window_state_t *state = c->queues;
+	libtrace_spsc_queue_t *queue = &state->queues[t_id];
+
+	if (libtrace_spsc_queue_push(queue, res) == -1) {
+		if (res->type == RESULT_PACKET)
+			trace_free_packet(trace, res->value.pkt);
+		trace_set_err(trace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to queue a result for the windowed combiner");
+		return;
+	}
+
+	if (libtrace_spsc_queue_get_size(queue) >= trace->config.reporter_thold) {
+		trace_post_reporter(trace);
+	}
+}
+
+static void publish_bulk(libtrace_t *trace, int t_id, libtrace_combine_t *c,
+		libtrace_result_t *results, size_t count) {
+	window_state_t *state = c->queues;
+	libtrace_spsc_queue_t *queue = &state->queues[t_id];
+
+	if (libtrace_spsc_queue_push_bulk(queue, results, count) == -1) {
+		size_t i;
+
+		for (i = 0; i < count; i++) {
+			if (results[i].type == RESULT_PACKET)
+				trace_free_packet(trace, results[i].value.pkt);
+		}
+		trace_set_err(trace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to queue results for the windowed combiner");
+		return;
+	}
+
+	if (libtrace_spsc_queue_get_size(queue) >= trace->config.reporter_thold) {
+		trace_post_reporter(trace);
+	}
+}
+
+static inline bool pending_less(const pending_t *a, const pending_t *b) {
+	if (a->ts != b->ts)
+		return a->ts < b->ts;
+	return a->seq < b->seq;
+}
+
+static bool heap_push(window_state_t *state, uint64_t ts,
+		libtrace_result_t *res) {
+	size_t i;
+
+	if (state->size == state->capacity) {
+		size_t capacity = state->capacity ? state->capacity * 2 : 1024;
+		pending_t *heap = realloc(state->heap,
+				capacity * sizeof(pending_t));
+
+		if (!heap)
+			return false;
+		state->heap = heap;
+		state->capacity = capacity;
+	}
+
+	i = state->size++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+
+		/* Anything already queued was read first */
+		if (state->heap[parent].ts <= ts)
+			break;
+		state->heap[i] = state->heap[parent];
+		i = parent;
+	}
+	state->heap[i].ts = ts;
+	state->heap[i].seq = state->seq++;
+	state->heap[i].res = *res;
+	return true;
+}
+
+static void heap_pop(window_state_t *state) {
+	pending_t e = state->heap[--state->size];
+	size_t i = 0;
+
+	for (;;) {
+		size_t child = i * 2 + 1;
+
+		if (child >= state->size)
+			break;
+		if (child + 1 < state->size &&
+				pending_less(&state->heap[child + 1],
+				&state->heap[child]))
+			child++;
+		if (!pending_less(&state->heap[child], &e))
+			break;
+		state->heap[i] = state->heap[child];
+		i = child;
+	}
+	if (state->size)
+		state->heap[i] = e;
+}
+
+/* Passes on every window that all of the watermarks have passed, or that
+ * is further behind the leading thread than the lateness bound */
+static void close_windows(libtrace_t *trace, libtrace_combine_t *c,
+		const bool final) {
+	window_state_t *state = c->queues;
+	uint64_t low = UINT64_MAX, boundary;
+	int i;
+
+	if (final) {
+		boundary = UINT64_MAX;
+	} else {
+		for (i = 0; i < state->nqueues; ++i) {
+			if (state->watermarks[i] < low)
+				low = state->watermarks[i];
+		}
+		if (state->lateness && state->max_watermark > state->lateness &&
+				state->max_watermark - state->lateness > low)
+			low = state->max_watermark - state->lateness;
+		boundary = low - low % state->window;
+	}
+	if (boundary <= state->closed)
+		return;
+
+	while (state->size && state->heap[0].ts < boundary) {
+		libtrace_result_t r = state->heap[0].res;
+		libtrace_generic_t gt = {.res = &r};
+
+		heap_pop(state);
+		send_message(trace, &trace->reporter_thread, MESSAGE_RESULT,
+				gt, NULL);
+	}
+	state->closed = boundary;
+
+	/* Let the reporter know that everything before this time has
+	 * been passed on */
+	if (!final && boundary > c->last_ts_tick) {
+		libtrace_result_t r;
+		libtrace_generic_t gt = {.res = &r};
+
+		memset(&r, 0, sizeof(r));
+		r.type = RESULT_TICK_INTERVAL;
+		r.key = boundary;
+		c->last_ts_tick = boundary;
+		send_message(trace, &trace->reporter_thread, MESSAGE_RESULT,
+				gt, NULL);
+	}
+}
+
+static void read(libtrace_t *trace, libtrace_combine_t *c){
+	window_state_t *state = c->queues;
+	int i;
+
+	for (i = 0; i < state->nqueues; ++i) {
+		libtrace_spsc_queue_t *v = &state->queues[i];
+		libtrace_result_t r;
+
+		while (libtrace_spsc_queue_pop_front(v, &r)) {
+			libtrace_generic_t gt = {.res = &r};
+			uint64_t ts;
+
+			/* Count ticks say nothing about time, pass on the
+			 * first of each */
+			if (r.type == RESULT_TICK_COUNT) {
+				if (r.key <= c->last_count_tick)
+					continue;
+				c->last_count_tick = r.key;
+				send_message(trace, &trace->reporter_thread,
+						MESSAGE_RESULT, gt, NULL);
+				continue;
+			}
+
+			if (r.type == RESULT_PACKET)
+				ts = trace_get_erf_timestamp(r.value.pkt);
+			else
+				ts = r.key;
+			if (ts > state->watermarks[i])
+				state->watermarks[i] = ts;
+			if (ts > state->max_watermark)
+				state->max_watermark = ts;
+
+			/* Interval ticks only move the watermark, we send
+			 * our own once windows are passed on */
+			if (r.type == RESULT_TICK_INTERVAL)
+				continue;
+
+			if (ts < state->closed || !heap_push(state, ts, &r)) {
+				if (ts < state->closed)
+					r.flags |= RESULT_FLAG_LATE;
+				send_message(trace, &trace->reporter_thread,
+						MESSAGE_RESULT, gt, NULL);
+			}
+		}
+	}
+	close_windows(trace, c, false);
+}
+
+static void read_final(libtrace_t *trace, libtrace_combine_t *c) {
+	read(trace, c);
+	close_windows(trace, c, true);
+}
+
+static void pause(libtrace_t *trace, libtrace_combine_t *c) {
+	window_state_t *state = c->queues;
+	size_t i;
+
+	read(trace, c);
+	for (i = 0; i < state->size; i++)
+		libtrace_make_result_safe(&state->heap[i].res);
+}
+
+static void destroy(libtrace_t *trace, libtrace_combine_t *c) {
+	window_state_t *state = c->queues;
+	int i;
+
+	for (i = 0; i < state->nqueues; i++) {
+		if (libtrace_spsc_queue_get_size(&state->queues[i]) != 0) {
+			trace_set_err(trace, TRACE_ERR_COMBINER,
+				"Failed to destroy queues, A thread still has data in destroy()");
+			return;
+		}
+	}
+	if (state->size != 0) {
+		trace_set_err(trace, TRACE_ERR_COMBINER,
+			"Failed to destroy queues, results are still waiting in destroy()");
+		return;
+	}
+	for (i = 0; i < state->nqueues; i++)
+		libtrace_spsc_queue_destroy(&state->queues[i]);
+	free(state->queues);
+	free(state->watermarks);
+	free(state->heap);
+	free(state);
+	c->queues = NULL;
+}
+
+DLLEXPORT const libtrace_combine_t combiner_windowed = {
+    init_combiner,	/* initialise */
+	destroy,		/* destroy */
+	publish,		/* publish */
+    read,			/* read */
+    read_final,			/* read_final */
+    pause,			/* pause */
+    NULL,			/* queues */
+    0,                          /* last_count_tick */
+    0,                          /* last_ts_tick */
+    {0}				/* opts */
+};
@@ -31,15 +31,61 @@
 
 #define MAX_OUTSTANDING (200000)
 
-static void clear_bucket_node(void *node) {
+static void clear_bucket_node(libtrace_bucket_t *b, void *node) {
 
         libtrace_bucket_node_t *bnode = (libtrace_bucket_node_t *)node;
-        if (bnode->buffer)
-                free(bnode->buffer);
+        if (bnode->buffer) {
+                if (b->freecb)
+                        b->freecb(bnode->buffer, b->freedata);
+                else
+                        free(bnode->buffer);
+        }
         if (bnode->released)
                 free(bnode->released);
 }
 
+/* Frees every node at the front of the list that no longer has any packets
+ * referring to it. Must be called with the bucket lock held. */
+static void free_released_nodes(libtrace_bucket_t *b) {
+
+        uint16_t i;
+        libtrace_bucket_node_t *front;
+        libtrace_list_node_t *lnode;
+        libtrace_bucket_node_t tmp;
+
+        while (libtrace_list_get_size(b->nodelist) > 1) {
+                lnode = libtrace_list_get_index(b->nodelist, 0);
+
+                front = *(libtrace_bucket_node_t **)lnode->data;
+
+                if (front->activemembers > 0) {
+                        break;
+                }
+                if (front == b->node)
+                        break;
+
+		if (!lnode->next) {
+			fprintf(stderr, "Error in libtrace_release_bucket_id()\n");
+			return;
+		}
+                for (i = 0; i < front->slots; i++) {
+                        if (front->released[i] == 2) {
+                                int index = i + front->startindex;
+                                if (index >= MAX_OUTSTANDING) {
+                                        index -= (MAX_OUTSTANDING - 1);
+                                }
+                                b->packets[index] = NULL;
+                        }
+                }
+
+                clear_bucket_node(b, front);
+                libtrace_list_pop_front(b->nodelist, &tmp);
+                free(front);
+                pthread_cond_signal(&b->cond);
+
+        }
+}
+
 DLLEXPORT libtrace_bucket_t *libtrace_bucket_init() {
 
         libtrace_bucket_t *b = (libtrace_bucket_t *) malloc(sizeof(libtrace_bucket_t));
@@ -49,7 +95,11 @@ DLLEXPORT libtrace_bucket_t *libtrace_bucket_init() {
 
         b->nextid = 199999;
         b->node = NULL;
-        b->nodelist = libtrace_list_init(sizeof(libtrace_bucket_node_t));
+        b->nodelist = libtrace_list_init(sizeof(libtrace_bucket_node_t *));
+
+        b->freecb = NULL;
+        b->freedata = NULL;
+        b->low_space = 0;
 
         pthread_mutex_init(&b->lock, NULL);
         pthread_cond_init(&b->cond, NULL);
@@ -62,7 +112,7 @@ DLLEXPORT void libtrace_bucket_destroy(libtrace_bucket_t *b) {
 
         pthread_mutex_lock(&b->lock);
         if (b->node) {
-                clear_bucket_node(b->node);
+                clear_bucket_node(b, b->node);
                 free(b->node);
         }
 
@@ -86,7 +136,7 @@ DLLEXPORT void libtrace_create_new_bucket(libtrace_bucket_t *b, void *buffer) {
          */
         pthread_mutex_lock(&b->lock);
         if (b->node && b->node->startindex == 0) {
-                clear_bucket_node(b->node);
+                clear_bucket_node(b, b->node);
                 libtrace_list_pop_back(b->nodelist, &tmp);
                 free(b->node);
         }
@@ -105,6 +155,10 @@ DLLEXPORT void libtrace_create_new_bucket(libtrace_bucket_t *b, void *buffer) {
         b->node = bnode;
 
         libtrace_list_push_back(b->nodelist, &bnode);
+
+        /* The previous node may have had all of its packets released
+         * while it was still the current node */
+        free_released_nodes(b);
         pthread_mutex_unlock(&b->lock);
 
 }
@@ -177,10 +231,8 @@ DLLEXPORT uint64_t libtrace_push_into_bucket(libtrace_bucket_t *b) {
 
 DLLEXPORT void libtrace_release_bucket_id(libtrace_bucket_t *b, uint64_t id) {
 
-        uint16_t s, i;
-        libtrace_bucket_node_t *bnode, *front;
-        libtrace_list_node_t *lnode;
-        libtrace_bucket_node_t tmp;
+        uint16_t s;
+        libtrace_bucket_node_t *bnode;
 
 	if (id == 0) {
 		fprintf(stderr, "bucket ID cannot be 0 in libtrace_release_bucket_id()\n");
@@ -228,37 +280,24 @@ DLLEXPORT void libtrace_release_bucket_id(libtrace_bucket_t *b, uint64_t id) {
                 bnode->activemembers -= 1;
         }
 
-        while (libtrace_list_get_size(b->nodelist) > 1) {
-                lnode = libtrace_list_get_index(b->nodelist, 0);
-
-                front = *(libtrace_bucket_node_t **)lnode->data;
-
-                if (front->activemembers > 0) {
-                        break;
-                }
-                if (front == b->node)
-                        break;
+        free_released_nodes(b);
+        pthread_mutex_unlock(&b->lock);
 
-		if (!lnode->next) {
-			fprintf(stderr, "Error in libtrace_release_bucket_id()\n");
-			return;
-		}
-                for (i = 0; i < front->slots; i++) {
-                        if (front->released[i] == 2) {
-                                int index = i + front->startindex;
-                                if (index >= MAX_OUTSTANDING) {
-                                        index -= (MAX_OUTSTANDING - 1);
-                                }
-                                b->packets[index] = NULL;
-                        }
-                }
+}
 
-                clear_bucket_node(front);
-                libtrace_list_pop_front(b->nodelist, &tmp);
-                free(front);
-                pthread_cond_signal(&b->cond);
+DLLEXPORT void libtrace_bucket_set_free_callback(libtrace_bucket_t *b,
+                libtrace_bucket_free_cb_t cb, void *data) {
 
-        }
+        pthread_mutex_lock(&b->lock);
+        b->freecb = cb;
+        b->freedata = data;
         pthread_mutex_unlock(&b->lock);
+}
+
+DLLEXPORT void libtrace_bucket_set_low_space(libtrace_bucket_t *b, int low) {
+        __atomic_store_n(&b->low_space, low, __ATOMIC_RELAXED);
+}
 
+DLLEXPORT int libtrace_bucket_low_space(libtrace_bucket_t *b) {
+        return __atomic_load_n(&b->low_space, __ATOMIC_RELAXED);
 }
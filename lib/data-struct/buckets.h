@@ -29,6 +29,8 @@
 #include <pthread.h>
 #include "linked_list.h"
 
+typedef void (*libtrace_bucket_free_cb_t)(void *buffer, void *data);
+
 typedef struct bucket_node {
         uint64_t startindex;
         uint8_t *released;
@@ -44,6 +46,13 @@ typedef struct buckets {
         libtrace_list_t *nodelist;
         pthread_mutex_t lock;
         pthread_cond_t cond;
+        /* Called instead of free() when a node's buffer is released, for
+         * formats that manage their own buffer memory */
+        libtrace_bucket_free_cb_t freecb;
+        void *freedata;
+        /* Set by the owner while its buffer space is running low, so that
+         * packets being held are copied rather than keeping their space */
+        int low_space;
 } libtrace_bucket_t;
 
 libtrace_bucket_t *libtrace_bucket_init(void);
@@ -51,5 +60,9 @@ void libtrace_bucket_destroy(libtrace_bucket_t *b);
 void libtrace_create_new_bucket(libtrace_bucket_t *b, void *buffer);
 uint64_t libtrace_push_into_bucket(libtrace_bucket_t *b);
 void libtrace_release_bucket_id(libtrace_bucket_t *b, uint64_t id);
+void libtrace_bucket_set_free_callback(libtrace_bucket_t *b,
+                libtrace_bucket_free_cb_t cb, void *data);
+void libtrace_bucket_set_low_space(libtrace_bucket_t *b, int low);
+int libtrace_bucket_low_space(libtrace_bucket_t *b);
 
 #endif
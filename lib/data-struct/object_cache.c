@@ -30,6 +30,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if ENABLE_DTRACE
+#include <sys/sdt.h>
+#endif
+
 
 // pthread tls is most likely slower than __thread, but they have destructors so
 // we use a combination of the two here!!
@@ -41,6 +45,9 @@ struct local_cache {
 	size_t used;
 	void **cache;
 	bool invalid;
+	// Objects this thread reused, and objects it had to allocate
+	uint64_t hits;
+	uint64_t misses;
 };
 
 struct mem_stats {
@@ -91,6 +98,9 @@ static inline void unregister_thread(struct local_cache *lc) {
 		return;
 	}
 	lc->invalid = true;
+	/* Threads without a local cache update these without the lock */
+	__atomic_fetch_add(&lc->oc->hits, lc->hits, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&lc->oc->misses, lc->misses, __ATOMIC_RELAXED);
 
 	if (lc->oc->max_allocations) {
 		libtrace_ringbuffer_swrite_bulk(&lc->oc->rb, lc->cache, lc->used, lc->used);
@@ -109,6 +119,8 @@ static inline void unregister_thread(struct local_cache *lc) {
  */
 static inline void register_thread(libtrace_ocache_t *oc, struct local_cache *lc) {
 	lc->invalid = false;
+	lc->hits = 0;
+	lc->misses = 0;
 	pthread_spin_lock(&oc->spin);
 	if (oc->nb_thread_list == oc->max_nb_thread_list) {
 		oc->max_nb_thread_list += 0x10;
@@ -278,6 +290,8 @@ DLLEXPORT int libtrace_ocache_init(libtrace_ocache_t *oc, void *(*alloc)(void),
 	oc->free = free;
 	oc->current_allocations = 0;
 	oc->thread_cache_size = thread_cache_size;
+	oc->hits = 0;
+	oc->misses = 0;
 	oc->nb_thread_list = 0;
 	oc->max_nb_thread_list = 0x10;
 	oc->thread_list = calloc(0x10, sizeof(void*));
@@ -363,11 +377,17 @@ static inline size_t libtrace_ocache_alloc_cache(libtrace_ocache_t *oc, void *va
 		mem_hits.read.cache_hit += i;
 #endif
 
+#if ENABLE_DTRACE
+		DTRACE_PROBE1(libtrace, ocache_refill_start, oc);
+#endif
 		// Make sure we still meet the minimum requirement
 		if (i < min_nb_buffers)
 			lc->used = libtrace_ringbuffer_sread_bulk(rb, lc->cache, lc->total, min_nb_buffers - i);
 		else
 			lc->used = libtrace_ringbuffer_sread_bulk(rb, lc->cache, lc->total, 0);
+#if ENABLE_DTRACE
+		DTRACE_PROBE2(libtrace, ocache_refill_done, oc, lc->used);
+#endif
 #ifdef ENABLE_MEM_STATS
 		if (lc->used == lc->total)
 			mem_hits.readbulk.ring_hit += 1;
@@ -399,6 +419,8 @@ DLLEXPORT size_t libtrace_ocache_alloc(libtrace_ocache_t *oc, void *values[], si
 	struct local_cache *lc = find_cache(oc);
 	size_t i;
 	size_t min;
+	size_t reused;
+	size_t allocated = 0;
 	bool try_alloc = !(oc->max_allocations && oc->max_allocations <= oc->current_allocations);
 
 	if (oc->max_allocations) {
@@ -413,6 +435,7 @@ DLLEXPORT size_t libtrace_ocache_alloc(libtrace_ocache_t *oc, void *values[], si
 		i = libtrace_ocache_alloc_cache(oc, values, nb_buffers, min,  lc);
 	else
 		i = libtrace_ringbuffer_sread_bulk(&oc->rb, values, nb_buffers, min);
+	reused = i;
 
 	if (try_alloc) {
 		size_t nb;
@@ -435,6 +458,11 @@ DLLEXPORT size_t libtrace_ocache_alloc(libtrace_ocache_t *oc, void *values[], si
 				return ~0U;
 			}
 		}
+		allocated = nb - reused;
+#if ENABLE_DTRACE
+		if (allocated)
+			DTRACE_PROBE2(libtrace, ocache_miss, oc, allocated);
+#endif
 
 		if (i != nb) {
 			fprintf(stderr, "Expected i == nb in libtrace_ocache_alloc()\n");
@@ -453,6 +481,13 @@ DLLEXPORT size_t libtrace_ocache_alloc(libtrace_ocache_t *oc, void *values[], si
 			"object cache in libtrace_ocache_alloc()\n");
 		return ~0U;
 	}
+	if (lc) {
+		lc->hits += i - allocated;
+		lc->misses += allocated;
+	} else {
+		__atomic_fetch_add(&oc->hits, i - allocated, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&oc->misses, allocated, __ATOMIC_RELAXED);
+	}
 	return i;
 }
 
@@ -558,11 +593,33 @@ DLLEXPORT void libtrace_zero_ocache(libtrace_ocache_t *oc) {
 	oc->free = NULL;
 	oc->current_allocations = 0;
 	oc->max_allocations = 0;
+	oc->hits = 0;
+	oc->misses = 0;
 	oc->nb_thread_list = 0;
 	oc->max_nb_thread_list = 0;
 	oc->thread_list = NULL;
 }
 
+/**
+ * Counts how many objects have been reused from the cache, and how many had
+ * to be newly allocated because the cache was empty. Counts for threads
+ * that are still registered are read without synchronising with them, so
+ * may be slightly behind.
+ */
+DLLEXPORT void libtrace_ocache_get_stats(libtrace_ocache_t *oc,
+                                         uint64_t *hits, uint64_t *misses) {
+	size_t i;
+
+	pthread_spin_lock(&oc->spin);
+	*hits = oc->hits;
+	*misses = oc->misses;
+	for (i = 0; i < oc->nb_thread_list; ++i) {
+		*hits += oc->thread_list[i]->hits;
+		*misses += oc->thread_list[i]->misses;
+	}
+	pthread_spin_unlock(&oc->spin);
+}
+
 /**
  * @brief ocache_unregister_thread removes a thread from an ocache.
  * @param The ocache to remove this thread, this will free any packets in the TLS cache
@@ -38,6 +38,10 @@ typedef struct libtrace_ocache {
 	size_t thread_cache_size;
 	size_t max_allocations;
 	size_t current_allocations;
+	/* Counts from threads that have unregistered, see
+	 * libtrace_ocache_get_stats() */
+	uint64_t hits;
+	uint64_t misses;
 	pthread_spinlock_t spin;
 	size_t nb_thread_list;
 	size_t max_nb_thread_list;
@@ -51,4 +55,6 @@ DLLEXPORT size_t libtrace_ocache_alloc(libtrace_ocache_t *oc, void *values[], si
 DLLEXPORT size_t libtrace_ocache_free(libtrace_ocache_t *oc, void *values[], size_t nb_buffers, size_t min_nb_buffers);
 DLLEXPORT void libtrace_zero_ocache(libtrace_ocache_t *oc);
 DLLEXPORT void libtrace_ocache_unregister_thread(libtrace_ocache_t *oc);
+DLLEXPORT void libtrace_ocache_get_stats(libtrace_ocache_t *oc,
+                                         uint64_t *hits, uint64_t *misses);
 #endif // LIBTRACE_OBJECT_CACHE_H
@@ -27,6 +27,7 @@
  * A ring or circular buffer, very useful
  */
 
+#include "config.h"
 #include "ring_buffer.h"
 
 #include <stdlib.h>
@@ -34,6 +35,10 @@
 #include <string.h>
 #include <stdio.h>
 
+#if ENABLE_DTRACE
+#include <sys/sdt.h>
+#endif
+
 #define LOCK_TYPE_MUTEX 0 // Default if not defined
 #define LOCK_TYPE_SPIN 1
 #define LOCK_TYPE_NONE 2
@@ -162,24 +167,48 @@ static inline size_t libtrace_ringbuffer_nb_empty(const libtrace_ringbuffer_t *r
 	// return (rb->start + rb->size - rb->end - 1) % rb->size;
 }
 
+/**
+ * Returns the number of items in the ringbuffer. When using multiple threads
+ * this is only a snapshot, the reader or writer may have moved on by the
+ * time it is returned.
+ */
+DLLEXPORT size_t libtrace_ringbuffer_count(const libtrace_ringbuffer_t * rb) {
+	return libtrace_ringbuffer_nb_full(rb);
+}
+
 /**
  * Waits for a empty slot, that we can write to.
  * @param rb The ringbuffer
  */
 static inline void wait_for_empty(libtrace_ringbuffer_t *rb) {
-	/* Need an empty to start with */
+	/* Need an empty to start with. The probes only fire once we have
+	 * to wait, so the usual case costs no more than the check itself */
 	if (rb->mode == LIBTRACE_RINGBUFFER_BLOCKING) {
 		pthread_mutex_lock(&rb->empty_lock);
-		while (libtrace_ringbuffer_is_full(rb))
-			pthread_cond_wait(&rb->empty_cond, &rb->empty_lock);
+		if (libtrace_ringbuffer_is_full(rb)) {
+#if ENABLE_DTRACE
+			DTRACE_PROBE1(libtrace, ring_full_wait, rb);
+#endif
+			while (libtrace_ringbuffer_is_full(rb))
+				pthread_cond_wait(&rb->empty_cond, &rb->empty_lock);
+#if ENABLE_DTRACE
+			DTRACE_PROBE1(libtrace, ring_full_done, rb);
+#endif
+		}
 		pthread_mutex_unlock(&rb->empty_lock);
-	} else {
+	} else if (libtrace_ringbuffer_is_full(rb)) {
+#if ENABLE_DTRACE
+		DTRACE_PROBE1(libtrace, ring_full_wait, rb);
+#endif
 		while (libtrace_ringbuffer_is_full(rb))
 			/* Yield our time, why?, we tried and failed to write an item
 			 * to the buffer - so we should give up our time in the hope
 			 * that the reader thread can empty the buffer giving us a good
 			 * burst to write without blocking */
 			sched_yield();//_mm_pause();
+#if ENABLE_DTRACE
+		DTRACE_PROBE1(libtrace, ring_full_done, rb);
+#endif
 	}
 }
 
@@ -188,19 +217,33 @@ static inline void wait_for_empty(libtrace_ringbuffer_t *rb) {
  * @param rb The ringbuffer
  */
 static inline void wait_for_full(libtrace_ringbuffer_t *rb) {
-	/* Need an empty to start with */
+	/* Need a full to start with, the probes are as in wait_for_empty() */
 	if (rb->mode == LIBTRACE_RINGBUFFER_BLOCKING) {
 		pthread_mutex_lock(&rb->full_lock);
-		while (libtrace_ringbuffer_is_empty(rb))
-			pthread_cond_wait(&rb->full_cond, &rb->full_lock);
+		if (libtrace_ringbuffer_is_empty(rb)) {
+#if ENABLE_DTRACE
+			DTRACE_PROBE1(libtrace, ring_empty_wait, rb);
+#endif
+			while (libtrace_ringbuffer_is_empty(rb))
+				pthread_cond_wait(&rb->full_cond, &rb->full_lock);
+#if ENABLE_DTRACE
+			DTRACE_PROBE1(libtrace, ring_empty_done, rb);
+#endif
+		}
 		pthread_mutex_unlock(&rb->full_lock);
-	} else {
+	} else if (libtrace_ringbuffer_is_empty(rb)) {
+#if ENABLE_DTRACE
+		DTRACE_PROBE1(libtrace, ring_empty_wait, rb);
+#endif
 		while (libtrace_ringbuffer_is_empty(rb))
 			/* Yield our time, why?, we tried and failed to write an item
 			 * to the buffer - so we should give up our time in the hope
 			 * that the reader thread can empty the buffer giving us a good
 			 * burst to write without blocking */
 			sched_yield();//_mm_pause();
+#if ENABLE_DTRACE
+		DTRACE_PROBE1(libtrace, ring_empty_done, rb);
+#endif
 	}
 }
 
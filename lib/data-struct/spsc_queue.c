@@ -0,0 +1,198 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include "spsc_queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct spsc_segment {
+	spsc_segment_t *next;
+	char data[]; // LIBTRACE_SPSC_SEGMENT_SIZE items go here
+};
+
+#define ITEM(q, seg, i) ((seg)->data + (i) * (q)->element_size)
+
+static spsc_segment_t *new_segment(libtrace_spsc_queue_t *q) {
+	spsc_segment_t *seg;
+
+	seg = __atomic_exchange_n(&q->spare, NULL, __ATOMIC_ACQ_REL);
+	if (!seg) {
+		seg = malloc(sizeof(spsc_segment_t) +
+				LIBTRACE_SPSC_SEGMENT_SIZE * q->element_size);
+		if (!seg)
+			return NULL;
+	}
+	seg->next = NULL;
+	return seg;
+}
+
+DLLEXPORT int libtrace_spsc_queue_init(libtrace_spsc_queue_t *q,
+		size_t element_size) {
+	memset(q, 0, sizeof(libtrace_spsc_queue_t));
+	q->element_size = element_size;
+	q->head = q->tail = new_segment(q);
+	if (!q->head)
+		return -1;
+	return 0;
+}
+
+DLLEXPORT void libtrace_spsc_queue_destroy(libtrace_spsc_queue_t *q) {
+	spsc_segment_t *seg = q->head;
+
+	while (seg) {
+		spsc_segment_t *next = seg->next;
+		free(seg);
+		seg = next;
+	}
+	free(q->spare);
+	q->head = q->tail = q->spare = NULL;
+}
+
+DLLEXPORT int libtrace_spsc_queue_push(libtrace_spsc_queue_t *q, void *d) {
+	if (q->tail_index == LIBTRACE_SPSC_SEGMENT_SIZE) {
+		spsc_segment_t *seg = new_segment(q);
+
+		if (!seg)
+			return -1;
+		/* The consumer won't follow next until it sees the item
+		 * published below, so this needs no barrier of its own */
+		q->tail->next = seg;
+		q->tail = seg;
+		q->tail_index = 0;
+	}
+	memcpy(ITEM(q, q->tail, q->tail_index), d, q->element_size);
+	q->tail_index++;
+	__atomic_store_n(&q->pushed, q->pushed + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+DLLEXPORT int libtrace_spsc_queue_push_bulk(libtrace_spsc_queue_t *q,
+		void *d, size_t count) {
+	spsc_segment_t *first = NULL, *last = NULL;
+	size_t room = LIBTRACE_SPSC_SEGMENT_SIZE - q->tail_index;
+	char *src = d;
+	size_t left = count;
+
+	/* Allocate every segment needed up front, so that either all of
+	 * the items are pushed or none are */
+	if (count > room) {
+		size_t nsegs = (count - room + LIBTRACE_SPSC_SEGMENT_SIZE - 1) /
+				LIBTRACE_SPSC_SEGMENT_SIZE;
+
+		while (nsegs--) {
+			spsc_segment_t *seg = new_segment(q);
+
+			if (!seg) {
+				while (first) {
+					seg = first->next;
+					free(first);
+					first = seg;
+				}
+				return -1;
+			}
+			if (last)
+				last->next = seg;
+			else
+				first = seg;
+			last = seg;
+		}
+	}
+
+	while (left) {
+		size_t n;
+
+		if (q->tail_index == LIBTRACE_SPSC_SEGMENT_SIZE) {
+			spsc_segment_t *seg = first;
+
+			first = seg->next;
+			seg->next = NULL;
+			q->tail->next = seg;
+			q->tail = seg;
+			q->tail_index = 0;
+		}
+		n = LIBTRACE_SPSC_SEGMENT_SIZE - q->tail_index;
+		if (n > left)
+			n = left;
+		memcpy(ITEM(q, q->tail, q->tail_index), src,
+				n * q->element_size);
+		q->tail_index += n;
+		src += n * q->element_size;
+		left -= n;
+	}
+	/* Publish everything at once */
+	__atomic_store_n(&q->pushed, q->pushed + count, __ATOMIC_RELEASE);
+	return 0;
+}
+
+DLLEXPORT size_t libtrace_spsc_queue_get_size(libtrace_spsc_queue_t *q) {
+	return __atomic_load_n(&q->pushed, __ATOMIC_ACQUIRE) -
+			__atomic_load_n(&q->popped, __ATOMIC_ACQUIRE);
+}
+
+DLLEXPORT void *libtrace_spsc_queue_peek_front(libtrace_spsc_queue_t *q) {
+	if (q->popped == q->visible) {
+		q->visible = __atomic_load_n(&q->pushed, __ATOMIC_ACQUIRE);
+		if (q->popped == q->visible)
+			return NULL;
+	}
+	if (q->head_index == LIBTRACE_SPSC_SEGMENT_SIZE) {
+		/* The producer has moved on to the next segment and won't
+		 * touch this one again, hand it back for reuse */
+		spsc_segment_t *old = q->head;
+
+		q->head = old->next;
+		q->head_index = 0;
+		free(__atomic_exchange_n(&q->spare, old, __ATOMIC_ACQ_REL));
+	}
+	return ITEM(q, q->head, q->head_index);
+}
+
+DLLEXPORT int libtrace_spsc_queue_pop_front(libtrace_spsc_queue_t *q, void *d) {
+	void *item = libtrace_spsc_queue_peek_front(q);
+
+	if (!item)
+		return 0;
+	if (d)
+		memcpy(d, item, q->element_size);
+	q->head_index++;
+	__atomic_store_n(&q->popped, q->popped + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+DLLEXPORT void libtrace_spsc_queue_apply_function(libtrace_spsc_queue_t *q,
+		spsc_data_fn fn) {
+	spsc_segment_t *seg = q->head;
+	size_t index = q->head_index;
+	size_t i, count = libtrace_spsc_queue_get_size(q);
+
+	for (i = 0; i < count; i++, index++) {
+		if (index == LIBTRACE_SPSC_SEGMENT_SIZE) {
+			seg = seg->next;
+			index = 0;
+		}
+		fn(ITEM(q, seg, index));
+	}
+}
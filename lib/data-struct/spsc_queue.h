@@ -0,0 +1,87 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include "../libtrace.h"
+
+#ifndef LIBTRACE_SPSC_QUEUE_H
+#define LIBTRACE_SPSC_QUEUE_H
+
+/* An unbounded FIFO queue for exactly one producer thread and one consumer
+ * thread, which needs no locks. Items are copied into fixed size segments
+ * that are chained together as the queue grows, so the producer never has
+ * to wait for the consumer and nothing is ever dropped, short of running
+ * out of memory.
+ *
+ * Only the producer may call push, only the consumer may call peek_front,
+ * pop_front and apply_function. get_size can be called from either side.
+ */
+
+/* Number of items held by each segment */
+#define LIBTRACE_SPSC_SEGMENT_SIZE 256
+
+typedef struct spsc_segment spsc_segment_t;
+typedef void (*spsc_data_fn)(void *data);
+typedef struct libtrace_spsc_queue {
+	size_t element_size;
+	/* A drained segment kept for the producer to reuse */
+	spsc_segment_t *spare;
+
+	/* Consumer side */
+	spsc_segment_t *head;
+	size_t head_index;
+	size_t popped;
+	/* The last value of pushed seen by the consumer */
+	size_t visible;
+
+	// Keep the producer and consumer on separate cache lines
+	char padding[CACHE_LINE_SIZE];
+
+	/* Producer side */
+	spsc_segment_t *tail;
+	size_t tail_index;
+	size_t pushed;
+} libtrace_spsc_queue_t;
+
+DLLEXPORT int libtrace_spsc_queue_init(libtrace_spsc_queue_t *q,
+		size_t element_size);
+DLLEXPORT void libtrace_spsc_queue_destroy(libtrace_spsc_queue_t *q);
+// Returns 0 if successful, or -1 if no memory could be allocated
+DLLEXPORT int libtrace_spsc_queue_push(libtrace_spsc_queue_t *q, void *d);
+// Pushes count items stored one after another in d, either all of them or
+// none if memory runs out
+DLLEXPORT int libtrace_spsc_queue_push_bulk(libtrace_spsc_queue_t *q,
+		void *d, size_t count);
+DLLEXPORT size_t libtrace_spsc_queue_get_size(libtrace_spsc_queue_t *q);
+
+// Returns a pointer to the first item without removing it, or NULL if empty
+DLLEXPORT void *libtrace_spsc_queue_peek_front(libtrace_spsc_queue_t *q);
+DLLEXPORT int libtrace_spsc_queue_pop_front(libtrace_spsc_queue_t *q, void *d);
+
+// Apply a given function to every queued item, the producer must not be
+// pushing at the same time
+DLLEXPORT void libtrace_spsc_queue_apply_function(libtrace_spsc_queue_t *q,
+		spsc_data_fn fn);
+
+#endif
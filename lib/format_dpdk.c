@@ -975,6 +975,7 @@ int dpdk_config_input (libtrace_t *libtrace,
 			FORMAT(libtrace)->rss_key = NULL;
 			return 0;
 		case HASHER_CUSTOM:
+		case HASHER_SYMMETRIC:
 			// Let libtrace do this
 			return -1;
 		}
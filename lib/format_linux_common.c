@@ -158,6 +158,7 @@ int linuxcommon_config_input(libtrace_t *libtrace,
 					FORMAT_DATA->fanout_flags = PACKET_FANOUT_HASH;
 					return 0;
 				case HASHER_CUSTOM:
+				case HASHER_SYMMETRIC:
 					return -1;
 			}
 			break;
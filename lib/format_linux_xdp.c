@@ -43,6 +43,14 @@
 #define MIN_FREE_FRAMES    64
 #define FRAME_SIZE         XSK_UMEM__DEFAULT_FRAME_SIZE
 #define XDP_BUSY_RETRY     5
+/* number of TX descriptors reserved, filled and submitted per burst */
+#define XDP_TX_BATCH       64
+/* most descriptors a single multi-buffer packet can span (MAX_SKB_FRAGS + 1) */
+#define XDP_MAX_FRAGS      18
+/* how long flushing the output waits for the kernel to send each poll, and
+ * how many polls it waits before giving up */
+#define XDP_FLUSH_POLL_MS  10
+#define XDP_FLUSH_RETRIES  100
 
 int hw_rings = 2048;
 int xdp_rings = 2048;
@@ -101,6 +109,11 @@ struct xsk_socket_info {
     struct xsk_umem_info *umem;
     struct xsk_socket *xsk;
     int if_queue;
+    /* socket was bound with XDP_USE_NEED_WAKEUP */
+    bool need_wakeup;
+    /* socket was bound with XDP_USE_SG and may receive multi-buffer
+     * packets */
+    bool multi_buffer;
 };
 
 struct xsk_per_stream {
@@ -110,6 +123,19 @@ struct xsk_per_stream {
     // ring buffer to hold addrs to be released back to the fill queue
     libtrace_ringbuffer_t addr_free_ring;
     pthread_t thread_id;
+
+    /* TX state, only used by output streams */
+    // stack of umem frame addrs not currently owned by the kernel
+    uint64_t *tx_frames;
+    uint32_t tx_frames_free;
+    // next reserved TX descriptor to be filled
+    uint32_t tx_idx;
+    // descriptors reserved but not yet filled
+    uint32_t tx_reserved;
+    // descriptors filled but not yet submitted to the kernel
+    uint32_t tx_pending;
+    // descriptors submitted that have not yet completed
+    uint32_t tx_outstanding;
 };
 
 typedef struct xdp_format_data {
@@ -283,6 +309,7 @@ static int linux_xdp_set_rss_key(char *ifname, enum hasher_types hasher) {
             toeplitz_ncreate_bikey((uint8_t *)rss->rss_config + indir_bytes, rss_head.key_size);
             break;
         case HASHER_CUSTOM:
+        case HASHER_SYMMETRIC:
             // should never hit this, just here to silence warnings
             free(rss);
             return 0;
@@ -426,6 +453,17 @@ static struct xsk_socket_info *xsk_configure_socket(struct xsk_config *cfg,
     xsk_cfg.xdp_flags = cfg->xdp_flags;
     xsk_cfg.bind_flags = cfg->xsk_bind_flags;
 
+    /* Only kick the kernel with a syscall when it tells us it has run
+     * out of work, rather than after every fill or TX submission */
+    xsk_cfg.bind_flags |= XDP_USE_NEED_WAKEUP;
+#ifdef XDP_USE_SG
+    /* Allow packets larger than a single umem frame (jumbo frames) to be
+     * received as a chain of descriptors */
+    if (dir == 0) {
+        xsk_cfg.bind_flags |= XDP_USE_SG;
+    }
+#endif
+
     for (i = 0; i < XDP_BUSY_RETRY; i++) {
         /* inbound */
         if (dir == 0) {
@@ -450,6 +488,13 @@ static struct xsk_socket_info *xsk_configure_socket(struct xsk_config *cfg,
         /* If busy wait and try again */
         if (ret == -EBUSY) {
             usleep(1000);
+#ifdef XDP_USE_SG
+        /* kernel or driver does not support multi-buffer sockets, fall
+         * back to single buffer mode */
+        } else if ((ret == -EOPNOTSUPP || ret == -EINVAL) &&
+                   (xsk_cfg.bind_flags & XDP_USE_SG)) {
+            xsk_cfg.bind_flags &= ~XDP_USE_SG;
+#endif
         } else {
             break;
         }
@@ -460,6 +505,11 @@ static struct xsk_socket_info *xsk_configure_socket(struct xsk_config *cfg,
         return NULL;
     }
 
+    xsk_info->need_wakeup = (xsk_cfg.bind_flags & XDP_USE_NEED_WAKEUP) != 0;
+#ifdef XDP_USE_SG
+    xsk_info->multi_buffer = (xsk_cfg.bind_flags & XDP_USE_SG) != 0;
+#endif
+
     return xsk_info;
 }
 
@@ -485,21 +535,78 @@ static int xsk_populate_fill_ring(struct xsk_umem_info *umem) {
     return 0;
 }
 
-static void linux_xdp_complete_tx(struct xsk_socket_info *xsk) {
+/* kick the kernel into transmitting any submitted TX descriptors */
+static inline void linux_xdp_kick_tx(struct xsk_socket_info *xsk) {
 
-    unsigned int rcvd;
+    /* without XDP_USE_NEED_WAKEUP the kernel always requires a sendto()
+     * to start transmitting, otherwise only when it has flagged the ring */
+    if (!xsk->need_wakeup || xsk_ring_prod__needs_wakeup(&xsk->tx)) {
+        sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+}
+
+/* submit all filled TX descriptors to the kernel with a single kick */
+static void linux_xdp_flush_tx(struct xsk_per_stream *stream) {
+
+    if (stream->tx_pending == 0) {
+        return;
+    }
+
+    xsk_ring_prod__submit(&stream->xsk->tx, stream->tx_pending);
+    stream->tx_outstanding += stream->tx_pending;
+    stream->tx_pending = 0;
+
+    linux_xdp_kick_tx(stream->xsk);
+}
+
+static void linux_xdp_complete_tx(struct xsk_per_stream *stream) {
+
+    struct xsk_socket_info *xsk = stream->xsk;
+    unsigned int rcvd, i;
     uint32_t idx;
 
-    /* does the socket need a wakeup? */
-    if (xsk_ring_prod__needs_wakeup(&xsk->tx)) {
-        sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    if (stream->tx_outstanding == 0) {
+        return;
     }
 
-    /* free completed TX buffers */
-    rcvd = xsk_ring_cons__peek(&xsk->umem->cq, xdp_rings, &idx);
+    /* the kernel may still be waiting on a kick for earlier submissions */
+    linux_xdp_kick_tx(xsk);
+
+    /* reclaim the frames of completed TX descriptors */
+    rcvd = xsk_ring_cons__peek(&xsk->umem->cq, stream->tx_outstanding, &idx);
     if (rcvd > 0) {
+        for (i = 0; i < rcvd; i++) {
+            stream->tx_frames[stream->tx_frames_free++] =
+                *xsk_ring_cons__comp_addr(&xsk->umem->cq, idx++);
+        }
         /* release the number of sent frames */
         xsk_ring_cons__release(&xsk->umem->cq, rcvd);
+        stream->tx_outstanding -= rcvd;
+    }
+}
+
+/* reserve a burst of TX descriptors, reclaiming completed frames as
+ * required. Returns the number of descriptors reserved. */
+static uint32_t linux_xdp_reserve_tx(struct xsk_per_stream *stream) {
+
+    uint32_t want, got, idx;
+
+    while (1) {
+        linux_xdp_complete_tx(stream);
+
+        want = LIBTRACE_MIN(XDP_TX_BATCH, stream->tx_frames_free);
+        if (want > 0) {
+            got = xsk_ring_prod__reserve(&stream->xsk->tx, want, &idx);
+            if (got > 0) {
+                stream->tx_idx = idx;
+                stream->tx_reserved = got;
+                return got;
+            }
+        }
+
+        /* no frames or ring space, push out what we have so the kernel
+         * can complete it */
+        linux_xdp_flush_tx(stream);
     }
 }
 
@@ -961,7 +1068,7 @@ static int linux_xdp_start_output(libtrace_out_t *libtrace) {
 
     struct xsk_per_stream empty_stream = {NULL,0,{0},0};
     struct xsk_per_stream *stream;
-    int ret;
+    int ret, i;
 
     /* insert empty stream into the list */
     libtrace_list_push_back(XDP_FORMAT_DATA->per_stream, &empty_stream);
@@ -976,6 +1083,18 @@ static int linux_xdp_start_output(libtrace_out_t *libtrace) {
         return -1;
     }
 
+    /* every umem frame starts out free for transmitting */
+    stream->tx_frames = malloc(sizeof(uint64_t) * NUM_FRAMES);
+    if (stream->tx_frames == NULL) {
+        trace_set_err_out(libtrace, TRACE_ERR_OUT_OF_MEMORY, "Unable to "
+            "allocate TX frame list in linux_xdp_start_output()");
+        return -1;
+    }
+    for (i = 0; i < NUM_FRAMES; i++) {
+        stream->tx_frames[i] = (uint64_t)i * FRAME_SIZE;
+    }
+    stream->tx_frames_free = NUM_FRAMES;
+
     return 0;
 }
 
@@ -1081,19 +1200,196 @@ static void linux_xdp_fin_packet(libtrace_packet_t *packet) {
     }
 }
 
+/* hand back rx descriptors that were peeked but not consumed */
+static inline void linux_xdp_rx_cancel(struct xsk_socket_info *xsk, uint32_t nb) {
+    xsk->rx.cached_cons -= nb;
+}
+
+/* Work out how many of the avail peeked rx descriptors starting at idx make
+ * up complete packets, stopping after nb_packets packets. A multi-buffer
+ * packet whose remaining descriptors have not arrived yet is left for the
+ * next read. Sets npkts to the number of complete packets. */
+static uint32_t linux_xdp_rx_complete(struct xsk_socket_info *xsk,
+                                      uint32_t idx,
+                                      uint32_t avail,
+                                      size_t nb_packets,
+                                      size_t *npkts) {
+
+    uint32_t used = 0, i;
+
+    *npkts = 0;
+
+    if (!xsk->multi_buffer) {
+        used = LIBTRACE_MIN(avail, nb_packets);
+        *npkts = used;
+        return used;
+    }
+
+#ifdef XDP_USE_SG
+    for (i = 0; i < avail && *npkts < nb_packets; i++) {
+        if (!(xsk_ring_cons__rx_desc(&xsk->rx, idx + i)->options & XDP_PKT_CONTD)) {
+            /* last descriptor of a packet */
+            used = i + 1;
+            (*npkts)++;
+        }
+    }
+#else
+    (void)idx;
+    (void)i;
+#endif
+
+    return used;
+}
+
+/* Attach the packet starting at rx descriptor idx to packet. Single frame
+ * packets are delivered in place from the umem, multi-buffer packets are
+ * gathered into a packet owned buffer and their frames returned straight to
+ * the fill queue. Returns the number of descriptors consumed or -1. */
+static int linux_xdp_rx_packet(libtrace_t *libtrace,
+                               struct xsk_per_stream *stream,
+                               libtrace_packet_t *packet,
+                               uint32_t idx,
+                               uint64_t timestamp) {
+
+    const struct xdp_desc *desc;
+    libtrace_xdp_meta_t *meta;
+    uint8_t *pkt_buffer;
+    uint32_t pkt_len, cap_len = 0;
+    uint32_t ndesc = 1;
+#ifdef XDP_USE_SG
+    uint32_t copy_len;
+#endif
+
+    desc = xsk_ring_cons__rx_desc(&stream->xsk->rx, idx);
+
+#ifdef XDP_USE_SG
+    if (desc->options & XDP_PKT_CONTD) {
+
+        /* gather each fragment into a libtrace owned buffer */
+        if (packet->buf_control == TRACE_CTRL_EXTERNAL || !packet->buffer) {
+            packet->buffer = malloc(LIBTRACE_PACKET_BUFSIZE);
+            if (packet->buffer == NULL) {
+                trace_set_err(libtrace, TRACE_ERR_OUT_OF_MEMORY, "Unable to "
+                    "allocate buffer for multi-buffer XDP packet");
+                return -1;
+            }
+        }
+        packet->buf_control = TRACE_CTRL_PACKET;
+        packet->srcbucket = NULL;
+
+        pkt_len = 0;
+        while (1) {
+            pkt_buffer = xsk_umem__get_data(stream->xsk->umem->buffer, desc->addr);
+            copy_len = LIBTRACE_MIN(desc->len, LIBTRACE_PACKET_BUFSIZE -
+                FRAME_HEADROOM - cap_len);
+            memcpy((uint8_t *)packet->buffer + FRAME_HEADROOM + cap_len,
+                   pkt_buffer, copy_len);
+            cap_len += copy_len;
+            pkt_len += desc->len;
+
+            if (linux_xdp_release_addr(libtrace, stream->xsk,
+                    xsk_umem__extract_addr(desc->addr)) < 0) {
+                return -1;
+            }
+
+            if (!(desc->options & XDP_PKT_CONTD)) {
+                break;
+            }
+            desc = xsk_ring_cons__rx_desc(&stream->xsk->rx, idx + ndesc);
+            ndesc++;
+        }
+
+        packet->header = packet->buffer;
+        packet->payload = (uint8_t *)packet->buffer + FRAME_HEADROOM;
+    } else
+#endif
+    {
+        /* got a packet. Get the address and length from the rx descriptor */
+        pkt_len = desc->len;
+        cap_len = pkt_len;
+
+        /* get pointer to its contents, this gives us pointer to packet payload
+         * and not the start of the headroom allocated */
+        pkt_buffer = xsk_umem__get_data(stream->xsk->umem->buffer, desc->addr);
+
+        /* a previous multi-buffer packet may have left us a buffer */
+        if (packet->buf_control == TRACE_CTRL_PACKET && packet->buffer) {
+            free(packet->buffer);
+        }
+
+        packet->buf_control = TRACE_CTRL_EXTERNAL;
+        packet->buffer = (uint8_t *)pkt_buffer - FRAME_HEADROOM;
+        packet->header = (uint8_t *)pkt_buffer - FRAME_HEADROOM;
+        packet->payload = pkt_buffer;
+        packet->srcbucket = stream;
+    }
+
+    /* prepare the packet */
+    packet->type = TRACE_RT_DATA_XDP;
+    packet->trace = libtrace;
+    packet->error = 1;
+    packet->order = timestamp;
+
+    meta = (libtrace_xdp_meta_t *)packet->buffer;
+    meta->timestamp = timestamp;
+    /* we dont really snap packets but we can pretend to */
+    meta->packet_len = pkt_len;
+    meta->cap_len = LIBTRACE_MIN((unsigned int)XDP_FORMAT_DATA->snaplen,
+                                 cap_len);
+
+    return ndesc;
+}
+
+/* Undo a read that failed while attaching the packet at nb_attached.
+ * Frames already attached to packets and the frames of the descriptors not
+ * yet used go back to the fill queue, and every peeked rx descriptor is
+ * released. */
+static void linux_xdp_rx_abort(libtrace_t *libtrace,
+                               struct xsk_per_stream *stream,
+                               libtrace_packet_t *packet[],
+                               size_t nb_attached,
+                               uint32_t idx,
+                               uint32_t used,
+                               uint32_t rcvd) {
+
+    struct xsk_socket_info *xsk = stream->xsk;
+    uint64_t addr;
+    size_t i;
+
+    for (i = 0; i < nb_attached; i++) {
+        if (packet[i]->buf_control != TRACE_CTRL_EXTERNAL ||
+            packet[i]->srcbucket != stream) {
+            continue;
+        }
+        addr = xsk_umem__extract_addr((uint64_t)packet[i]->buffer -
+            (uint64_t)xsk->umem->buffer + FRAME_HEADROOM);
+        linux_xdp_release_addr(libtrace, xsk, addr);
+        packet[i]->srcbucket = NULL;
+        packet[i]->buffer = NULL;
+        packet[i]->header = NULL;
+        packet[i]->payload = NULL;
+    }
+
+    for (; used < rcvd; used++) {
+        addr = xsk_ring_cons__rx_desc(&xsk->rx, idx + used)->addr;
+        linux_xdp_release_addr(libtrace, xsk, xsk_umem__extract_addr(addr));
+    }
+
+    xsk_ring_cons__release(&xsk->rx, rcvd);
+}
+
 static int linux_xdp_read_stream(libtrace_t *libtrace,
                                  libtrace_packet_t *packet[],
                                  libtrace_message_queue_t *msg,
                                  struct xsk_per_stream *stream,
                                  size_t nb_packets) {
 
+    unsigned int avail = 0;
     unsigned int rcvd = 0;
     uint32_t idx_rx = 0;
-    uint32_t pkt_len;
-    uint64_t pkt_addr;
-    uint8_t *pkt_buffer;
+    uint32_t used;
+    size_t npkts = 0;
     unsigned int i;
-    libtrace_xdp_meta_t *meta;
     struct pollfd fds;
     int ret;
     uint64_t sys_time;
@@ -1109,7 +1405,7 @@ static int linux_xdp_read_stream(libtrace_t *libtrace,
     fds.events = POLLIN;
 
     /* try get nb_packets */
-    while (rcvd < 1) {
+    while (npkts < 1) {
 
         // check for any addrs to be released back to the fill queue
         while (libtrace_ringbuffer_try_read(&stream->addr_free_ring, (void **)&release_addr) == 1) {
@@ -1117,14 +1413,28 @@ static int linux_xdp_read_stream(libtrace_t *libtrace,
                 return -1;
         }
 
-        rcvd = xsk_ring_cons__peek(&stream->xsk->rx, nb_packets, &idx_rx);
+        /* the kernel has run out of fill buffers and is waiting for us */
+        if (stream->xsk->need_wakeup &&
+            xsk_ring_prod__needs_wakeup(&stream->xsk->umem->fq)) {
+            recvfrom(fds.fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+        }
+
+        /* leave room for the fragments of a trailing multi-buffer packet */
+        avail = xsk_ring_cons__peek(&stream->xsk->rx,
+            stream->xsk->multi_buffer ? nb_packets + XDP_MAX_FRAGS : nb_packets,
+            &idx_rx);
+        rcvd = linux_xdp_rx_complete(stream->xsk, idx_rx, avail, nb_packets, &npkts);
+        if (rcvd < avail) {
+            linux_xdp_rx_cancel(stream->xsk, avail - rcvd);
+        }
 
         /* check if libtrace has halted */
         if ((ret = is_halted(libtrace)) != -1) {
+            linux_xdp_rx_cancel(stream->xsk, rcvd);
             return ret;
         }
 
-        if (rcvd < 1) {
+        if (npkts < 1) {
 
             /* poll will return 0 on timeout or a positive on a event */
             ret = poll(&fds, 1, 500);
@@ -1148,43 +1458,21 @@ static int linux_xdp_read_stream(libtrace_t *libtrace,
     }
 
 #if ENABLE_DTRACE
-    DTRACE_PROBE1(libtrace, xdp_received_packets, rcvd);
+    DTRACE_PROBE1(libtrace, xdp_received_packets, npkts);
 #endif
 
     sys_time = linux_xdp_get_time();
     if (stream->prev_sys_time >= sys_time)
         sys_time = stream->prev_sys_time + 1;
 
-    for (i = 0; i < rcvd; i++) {
-
-        /* got a packet. Get the address and length from the rx descriptor */
-        pkt_addr = xsk_ring_cons__rx_desc(&stream->xsk->rx, idx_rx)->addr;
-        pkt_len = xsk_ring_cons__rx_desc(&stream->xsk->rx, idx_rx)->len;
-
-        /* get pointer to its contents, this gives us pointer to packet payload
-         * and not the start of the headroom allocated */
-        pkt_buffer = xsk_umem__get_data(stream->xsk->umem->buffer, pkt_addr);
-
-        /* prepare the packet */
-        packet[i]->buf_control = TRACE_CTRL_EXTERNAL;
-        packet[i]->type = TRACE_RT_DATA_XDP;
-        packet[i]->buffer = (uint8_t *)pkt_buffer - FRAME_HEADROOM;
-        packet[i]->header = (uint8_t *)pkt_buffer - FRAME_HEADROOM;
-        packet[i]->payload = pkt_buffer;
-        packet[i]->trace = libtrace;
-        packet[i]->srcbucket = stream;
-        packet[i]->error = 1;
-        packet[i]->order = sys_time + i;
-
-        meta = (libtrace_xdp_meta_t *)packet[i]->buffer;
-        meta->timestamp = sys_time + i;
-        /* we dont really snap packets but we can pretend to */
-        meta->packet_len = pkt_len;
-        meta->cap_len = LIBTRACE_MIN((unsigned int)XDP_FORMAT_DATA->snaplen,
-                                     (unsigned int)pkt_len);
-
-        /* next packet */
-        idx_rx++;
+    for (i = 0, used = 0; i < npkts; i++) {
+        if ((ret = linux_xdp_rx_packet(libtrace, stream, packet[i],
+                                       idx_rx + used, sys_time + i)) < 0) {
+            linux_xdp_rx_abort(libtrace, stream, packet, i, idx_rx, used,
+                               rcvd);
+            return -1;
+        }
+        used += ret;
     }
 
     stream->prev_sys_time = sys_time + i;
@@ -1193,7 +1481,7 @@ static int linux_xdp_read_stream(libtrace_t *libtrace,
      * back to the fill queue. */
     xsk_ring_cons__release(&stream->xsk->rx, rcvd);
 
-    return rcvd;
+    return npkts;
 }
 
 static int linux_xdp_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
@@ -1237,7 +1525,6 @@ static int linux_xdp_write_packet(libtrace_out_t *libtrace,
 
     struct xsk_per_stream *stream;
     libtrace_list_node_t *node;
-    uint32_t idx;
     struct xdp_desc *tx_desc;
     void *offset;
     uint32_t cap_len;
@@ -1263,16 +1550,22 @@ static int linux_xdp_write_packet(libtrace_out_t *libtrace,
     stream = (struct xsk_per_stream *)node->data;
 
 
-    /* is there a free frame for the packet */
-    while (xsk_ring_prod__reserve(&stream->xsk->tx, 1, &idx) != 1) {
-        /* try free up some frames */
-        linux_xdp_complete_tx(stream->xsk);
+    cap_len = trace_get_capture_length(packet);
+    if (cap_len > FRAME_SIZE) {
+        trace_set_err_out(libtrace, TRACE_ERR_UNSUPPORTED, "Packet of %u "
+            "bytes is larger than the XDP frame size %u", cap_len, FRAME_SIZE);
+        return -1;
     }
 
-    /* get the tx descriptor */
-    tx_desc = xsk_ring_prod__tx_desc(&stream->xsk->tx, idx);
+    /* reserve a burst of descriptors if the previous one is used up */
+    if (stream->tx_reserved == 0) {
+        linux_xdp_reserve_tx(stream);
+    }
 
-    cap_len = trace_get_capture_length(packet);
+    /* get the next reserved tx descriptor and give it a free frame */
+    tx_desc = xsk_ring_prod__tx_desc(&stream->xsk->tx, stream->tx_idx++);
+    tx_desc->addr = stream->tx_frames[--stream->tx_frames_free];
+    tx_desc->options = 0;
 
     /* get the offset to write packet to within the umem */
     offset = xsk_umem__get_data(stream->xsk->umem->buffer, tx_desc->addr);
@@ -1282,15 +1575,55 @@ static int linux_xdp_write_packet(libtrace_out_t *libtrace,
     /* set packet length */
     tx_desc->len = cap_len;
 
-    /* submit the frame */
-    xsk_ring_prod__submit(&stream->xsk->tx, 1);
+    stream->tx_reserved--;
+    stream->tx_pending++;
 
-    /* complete the transaction */
-    linux_xdp_complete_tx(stream->xsk);
+    /* submit the burst once it is full */
+    if (stream->tx_pending >= XDP_TX_BATCH) {
+        linux_xdp_flush_tx(stream);
+    }
 
     return cap_len;
 }
 
+static int linux_xdp_flush_output(libtrace_out_t *libtrace) {
+
+    struct xsk_per_stream *stream;
+    libtrace_list_node_t *node;
+    int tries;
+
+    if (libtrace->format_data == NULL || XDP_FORMAT_DATA->per_stream == NULL) {
+        return 0;
+    }
+
+    node = libtrace_list_get_index(XDP_FORMAT_DATA->per_stream, 0);
+    if (node == NULL) {
+        return 0;
+    }
+    stream = (struct xsk_per_stream *)node->data;
+    if (stream->xsk == NULL) {
+        return 0;
+    }
+
+    /* submit any partial burst and wait for the kernel to send it. If the
+     * link is down the kernel may never complete it, so don't wait forever */
+    linux_xdp_flush_tx(stream);
+    for (tries = 0; ; tries++) {
+        linux_xdp_complete_tx(stream);
+        if (stream->tx_outstanding == 0) {
+            break;
+        }
+        if (tries == XDP_FLUSH_RETRIES) {
+            trace_set_err_out(libtrace, TRACE_ERR_BAD_IO, "Timed out waiting "
+                "for %u XDP frames to be sent", stream->tx_outstanding);
+            return -1;
+        }
+        poll(NULL, 0, XDP_FLUSH_POLL_MS);
+    }
+
+    return 0;
+}
+
 static int linux_xdp_prepare_packet(libtrace_t *libtrace UNUSED, libtrace_packet_t *packet,
     void *buffer, libtrace_rt_types_t rt_type, uint32_t flags) {
 
@@ -1317,12 +1650,10 @@ static libtrace_eventobj_t linux_xdp_event(libtrace_t *libtrace,
                                            libtrace_packet_t *packet) {
 
     libtrace_eventobj_t event = {0,0,0.0,0};
+    unsigned int avail = 0;
     unsigned int rcvd = 0;
-    uint32_t pkt_len;
-    uint64_t pkt_addr;
-    uint8_t *pkt_buffer;
+    size_t npkts = 0;
     uint32_t idx_rx = 0;
-    libtrace_xdp_meta_t *meta;
     struct xsk_per_stream *stream;
     libtrace_list_node_t *node;
     uint64_t sys_time;
@@ -1344,47 +1675,33 @@ static libtrace_eventobj_t linux_xdp_event(libtrace_t *libtrace,
     stream = (struct xsk_per_stream *)node->data;
 
     /* is there a packet available? */
-    rcvd = xsk_ring_cons__peek(&stream->xsk->rx, 1, &idx_rx);
-    if (rcvd > 0) {
-
-        /* got a packet. Get the address and length from the rx descriptor */
-        pkt_addr = xsk_ring_cons__rx_desc(&stream->xsk->rx, idx_rx)->addr;
-        pkt_len = xsk_ring_cons__rx_desc(&stream->xsk->rx, idx_rx)->len;
-
-        /* get pointer to its contents, this gives us pointer to packet payload
-         * and not the start of the headroom allocated?? */
-        pkt_buffer = xsk_umem__get_data(stream->xsk->umem->buffer, pkt_addr);
+    avail = xsk_ring_cons__peek(&stream->xsk->rx,
+        stream->xsk->multi_buffer ? 1 + XDP_MAX_FRAGS : 1, &idx_rx);
+    rcvd = linux_xdp_rx_complete(stream->xsk, idx_rx, avail, 1, &npkts);
+    if (rcvd < avail) {
+        linux_xdp_rx_cancel(stream->xsk, avail - rcvd);
+    }
 
-        /* prepare the packet */
-        packet->buf_control = TRACE_CTRL_EXTERNAL;
-        packet->type = TRACE_RT_DATA_XDP;
-        packet->buffer = (uint8_t *)pkt_buffer - FRAME_HEADROOM;
-        packet->header = (uint8_t *)pkt_buffer - FRAME_HEADROOM;
-        packet->payload = pkt_buffer;
-        packet->trace = libtrace;
-        packet->error = 1;
-        packet->srcbucket = stream;
+    if (npkts > 0) {
 
-        meta = (libtrace_xdp_meta_t *)packet->buffer;
         sys_time = linux_xdp_get_time();
         if (stream->prev_sys_time >= sys_time) {
             sys_time = stream->prev_sys_time + 1;
         }
         stream->prev_sys_time = sys_time;
-        meta->timestamp = sys_time;
 
-        /* we dont really snap packets but we can pretend to */
-        meta->packet_len = pkt_len;
-        meta->cap_len = LIBTRACE_MIN((unsigned int)XDP_FORMAT_DATA->snaplen,
-                                     (unsigned int)pkt_len);
+        if (linux_xdp_rx_packet(libtrace, stream, packet, idx_rx, sys_time) < 0) {
+            event.type = TRACE_EVENT_TERMINATE;
+            return event;
+        }
 
         event.type = TRACE_EVENT_PACKET;
-        event.size = pkt_len;
+        event.size = PACKET_META->packet_len;
 
         /* We have read the packet descriptors from the rx queue, free the slots.
          * Note: We still have the packet buffer reference until it is released
          * back to the fill queue. */
-        xsk_ring_cons__release(&stream->xsk->rx, 1);
+        xsk_ring_cons__release(&stream->xsk->rx, rcvd);
 
     } else {
         /* We only want to sleep for a very short time - we are non-blocking */
@@ -1413,6 +1730,9 @@ static int linux_xdp_destroy_streams(libtrace_list_t *streams) {
                 free(stream->xsk);
             }
             libtrace_ringbuffer_destroy(&stream->addr_free_ring);
+            if (stream->tx_frames != NULL) {
+                free(stream->tx_frames);
+            }
         }
     }
 
@@ -1451,6 +1771,9 @@ static int linux_xdp_fin_input(libtrace_t *libtrace) {
 static int linux_xdp_fin_output(libtrace_out_t *libtrace) {
 
     if (FORMAT_DATA != NULL) {
+        /* make sure any buffered packets are sent */
+        linux_xdp_flush_output(libtrace);
+
         linux_xdp_destroy_streams(XDP_FORMAT_DATA->per_stream);
         libtrace_list_deinit(XDP_FORMAT_DATA->per_stream);
 
@@ -1709,6 +2032,7 @@ static int linux_xdp_config_input(libtrace_t *libtrace,
                     }
                     return 0;
                 case HASHER_CUSTOM:
+                case HASHER_SYMMETRIC:
                     /* libtrace can handle custom hashers */
                     return -1;
             }
@@ -1778,7 +2102,7 @@ static struct libtrace_format_t xdp = {
     linux_xdp_fin_packet,           /* fin_packet */
     linux_xdp_can_hold_packet,      /* can_hold_packet */
     linux_xdp_write_packet,         /* write_packet */
-    NULL,                           /* flush_output */
+    linux_xdp_flush_output,         /* flush_output */
     linux_xdp_get_link_type,        /* get_link_type */
     NULL,                           /* get_direction */
     NULL,                           /* set_direction */
@@ -1917,7 +2241,17 @@ static struct bpf_object *load_bpf_and_xdp_attach(struct xsk_config *cfg) {
      * these gets attached to XDP hook, the others will get freed once this
      * process exit.
      */
-    cfg->bpf_prg = bpf_object__find_program_by_title(cfg->bpf_obj, cfg->bpf_progname);
+    cfg->bpf_prg = NULL;
+    /* prefer the multi-buffer aware libtrace program if this kernel object
+     * was built with it */
+    if (strcmp(cfg->bpf_progname, libtrace_xdp_prog) == 0) {
+        cfg->bpf_prg = bpf_object__find_program_by_title(cfg->bpf_obj,
+            libtrace_xdp_prog_frags);
+    }
+    if (!cfg->bpf_prg) {
+        cfg->bpf_prg = bpf_object__find_program_by_title(cfg->bpf_obj,
+            cfg->bpf_progname);
+    }
     if (!cfg->bpf_prg) {
         fprintf(stderr, "ERR: couldn't find a program in ELF section '%s'\n", cfg->bpf_filename);
         return NULL;
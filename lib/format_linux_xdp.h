@@ -15,6 +15,8 @@ static char *libtrace_xdp_kern[] = {
     "/usr/share/libtrace/format_linux_xdp_kern.bpf",
 };
 static char libtrace_xdp_prog[] = "socket/libtrace_xdp";
+/* multi-buffer capable version of libtrace_xdp_prog, preferred when present */
+static char libtrace_xdp_prog_frags[] = "xdp.frags";
 
 typedef struct libtrace_xdp {
     /* BPF filter */
@@ -40,6 +40,7 @@ struct bpf_map_def SEC("maps") libtrace_ctrl_map = {
 };
 
 int libtrace_xdp_sock(struct xdp_md *ctx);
+int libtrace_xdp_sock_frags(struct xdp_md *ctx);
 
 static __always_inline void increment_stats(__u32 ifindex) {
 
@@ -63,8 +64,7 @@ static __always_inline int redirect_map(__u32 ifindex) {
 }
 
 
-SEC("socket/libtrace_xdp")
-int libtrace_xdp_sock(struct xdp_md *ctx) {
+static __always_inline int libtrace_xdp_redirect(struct xdp_md *ctx) {
 
     libtrace_ctrl_map_t *queue_ctrl;
     __u32 ifindex = ctx->rx_queue_index;
@@ -86,4 +86,17 @@ int libtrace_xdp_sock(struct xdp_md *ctx) {
     return redirect_map(ifindex);
 }
 
+SEC("socket/libtrace_xdp")
+int libtrace_xdp_sock(struct xdp_md *ctx) {
+    return libtrace_xdp_redirect(ctx);
+}
+
+/* Identical to libtrace_xdp_sock but flagged as multi-buffer aware, so
+ * packets larger than a page (jumbo frames) are passed to AF_XDP sockets
+ * bound with XDP_USE_SG as a chain of descriptors */
+SEC("xdp.frags")
+int libtrace_xdp_sock_frags(struct xdp_md *ctx) {
+    return libtrace_xdp_redirect(ctx);
+}
+
 char _license[] SEC("license") = "GPL";
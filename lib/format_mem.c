@@ -0,0 +1,597 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "format_helper.h"
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* In-memory replay format
+ *
+ * "mem:[options:]uri" reads the whole of another trace into memory when the
+ * trace is started and then replays it from there, so that the cost of
+ * processing packets can be measured without any I/O getting in the way.
+ *
+ * Options are given as a comma separated list:
+ *   loops=N	 replay the trace N times, 0 means forever (default 1)
+ *   hugepages	 back the preloaded packets with huge pages
+ *
+ * Every loop is shifted forward in time so that timestamps keep increasing,
+ * and packets are numbered across all of the loops so the order is unique.
+ * Only the record header is copied for each packet, the packet contents are
+ * shared by every loop and must not be modified.
+ */
+
+/* Size of the buffer the trace is first read into, doubled as needed */
+#define MEM_INITIAL_SIZE (1024 * 1024)
+
+/* Huge pages are assumed to be 2MB when rounding the mapping */
+#define MEM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+#define MEM_RECORD_ALIGN 8
+
+#define DATA(x) ((struct mem_format_data_t *)((x)->format_data))
+
+/* The header stored in front of every preloaded packet */
+typedef struct mem_record {
+	/* Total length of the record including this header and padding */
+	uint32_t length;
+	uint32_t caplen;
+	uint32_t wirelen;
+	/* libtrace_linktype_t */
+	uint16_t linktype;
+	/* libtrace_direction_t */
+	int16_t direction;
+	uint64_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t padding;
+} mem_record_t;
+
+struct mem_format_data_t {
+	/* The trace that the packets are loaded from */
+	libtrace_t *source;
+
+	/* Number of times to replay the trace, 0 is forever */
+	uint64_t loops;
+	bool hugepages;
+
+	/* The preloaded records */
+	uint8_t *arena;
+	size_t arena_len;
+	/* Length of the mapping if the arena was mmapped, 0 if malloced */
+	size_t mapped_len;
+	/* Offset of each record in the arena */
+	uint64_t *offsets;
+	uint64_t count;
+
+	/* Amount to move the timestamps forward by for each loop */
+	uint64_t period_ns;
+
+	/* Index of the next packet to be delivered across all loops */
+	uint64_t next;
+	/* Total number of packets to deliver, UINT64_MAX if looping forever */
+	uint64_t total;
+};
+
+static inline uint64_t mem_ts_ns(const mem_record_t *rec) {
+	return rec->ts_sec * 1000000000ull + rec->ts_nsec;
+}
+
+/* Splits any options off the front of the URI, returning the URI of the
+ * trace to load or NULL if an option is invalid */
+static const char *mem_parse_options(libtrace_t *libtrace, const char *uri) {
+	const char *end = strchr(uri, ':');
+	const char *opt;
+	char *endptr;
+	bool isopts = true;
+
+	if (!end)
+		return uri;
+
+	/* Format names never contain '=' or ',', so the first part of the
+	 * URI is only an option list if every entry is a known option */
+	for (opt = uri; opt < end; opt += strcspn(opt, ",:") + 1) {
+		if (strncmp(opt, "loops=", 6) != 0 &&
+				(strncmp(opt, "hugepages", 9) != 0 ||
+				 (opt[9] != ',' && opt[9] != ':'))) {
+			isopts = false;
+			break;
+		}
+	}
+	if (!isopts)
+		return uri;
+
+	for (opt = uri; opt < end; opt += strcspn(opt, ",:") + 1) {
+		if (strncmp(opt, "loops=", 6) == 0) {
+			DATA(libtrace)->loops = strtoull(opt + 6, &endptr, 10);
+			if (endptr == opt + 6 || (*endptr != ',' &&
+					*endptr != ':')) {
+				trace_set_err(libtrace, TRACE_ERR_BAD_FORMAT,
+					"Invalid loop count in mem: URI");
+				return NULL;
+			}
+		} else {
+			DATA(libtrace)->hugepages = true;
+		}
+	}
+	return end + 1;
+}
+
+static void mem_copy_source_err(libtrace_t *libtrace) {
+	libtrace_err_t err = trace_get_err(DATA(libtrace)->source);
+
+	trace_set_err(libtrace, err.err_num, "%s", err.problem);
+}
+
+static int mem_init_input(libtrace_t *libtrace) {
+	const char *uri;
+
+	libtrace->format_data = calloc(1, sizeof(struct mem_format_data_t));
+	if (!libtrace->format_data) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "Unable to "
+			"allocate memory for format data inside "
+			"mem_init_input()");
+		return -1;
+	}
+	DATA(libtrace)->loops = 1;
+
+	uri = mem_parse_options(libtrace, libtrace->uridata);
+	if (!uri)
+		goto fail;
+
+	DATA(libtrace)->source = trace_create(uri);
+	if (trace_is_err(DATA(libtrace)->source)) {
+		mem_copy_source_err(libtrace);
+		trace_destroy(DATA(libtrace)->source);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	free(libtrace->format_data);
+	libtrace->format_data = NULL;
+	return -1;
+}
+
+static bool mem_can_load(libtrace_packet_t *packet) {
+	libtrace_linktype_t ltype = trace_get_link_type(packet);
+
+	if (ltype == TRACE_TYPE_PCAPNG_META
+		|| ltype == TRACE_TYPE_CONTENT_INVALID
+		|| ltype == TRACE_TYPE_UNKNOWN
+		|| ltype == TRACE_TYPE_ERF_META
+		|| ltype == TRACE_TYPE_NONDATA) {
+
+		return false;
+	}
+
+	return true;
+}
+
+/* Appends a packet to the arena, growing it if required */
+static int mem_load_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
+		size_t *arena_size, size_t *offsets_size) {
+	struct mem_format_data_t *data = DATA(libtrace);
+	libtrace_linktype_t linktype;
+	mem_record_t *rec;
+	struct timespec ts;
+	uint32_t remaining, reclen;
+	void *ptr;
+
+	ptr = trace_get_packet_buffer(packet, &linktype, &remaining);
+	if (!ptr)
+		return 0;
+
+	reclen = (sizeof(mem_record_t) + remaining + MEM_RECORD_ALIGN - 1) &
+			~(MEM_RECORD_ALIGN - 1);
+
+	while (data->arena_len + reclen > *arena_size) {
+		uint8_t *arena = realloc(data->arena, *arena_size * 2);
+		if (!arena)
+			goto oom;
+		data->arena = arena;
+		*arena_size *= 2;
+	}
+	if (data->count == *offsets_size) {
+		uint64_t *offsets = realloc(data->offsets,
+				*offsets_size * 2 * sizeof(uint64_t));
+		if (!offsets)
+			goto oom;
+		data->offsets = offsets;
+		*offsets_size *= 2;
+	}
+
+	ts = trace_get_timespec(packet);
+	rec = (mem_record_t *)(data->arena + data->arena_len);
+	rec->length = reclen;
+	rec->caplen = remaining;
+	rec->wirelen = trace_get_wire_length(packet);
+	rec->linktype = linktype;
+	rec->direction = trace_get_direction(packet);
+	rec->ts_sec = ts.tv_sec;
+	rec->ts_nsec = ts.tv_nsec;
+	rec->padding = 0;
+	memcpy((uint8_t *)rec + sizeof(mem_record_t), ptr, remaining);
+
+	data->offsets[data->count++] = data->arena_len;
+	data->arena_len += reclen;
+	return 0;
+
+oom:
+	trace_set_err(libtrace, TRACE_ERR_OUT_OF_MEMORY,
+		"Unable to allocate memory for the preloaded trace");
+	return -1;
+}
+
+/* Moves the arena into huge pages, if we can get any. Falls back to asking
+ * for transparent huge pages, and then to leaving the arena where it is */
+static void mem_move_to_hugepages(libtrace_t *libtrace) {
+	struct mem_format_data_t *data = DATA(libtrace);
+	size_t len = (data->arena_len + MEM_HUGEPAGE_SIZE - 1) &
+			~((size_t)MEM_HUGEPAGE_SIZE - 1);
+	void *map = MAP_FAILED;
+
+	if (len == 0)
+		return;
+
+#ifdef MAP_HUGETLB
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (map == MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+		map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map != MAP_FAILED)
+			madvise(map, len, MADV_HUGEPAGE);
+#endif
+	}
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Unable to allocate huge pages for %s, "
+			"using normal memory instead\n", libtrace->uridata);
+		return;
+	}
+
+	memcpy(map, data->arena, data->arena_len);
+	free(data->arena);
+	data->arena = map;
+	data->mapped_len = len;
+}
+
+/* Reads every packet from the source trace into memory */
+static int mem_load(libtrace_t *libtrace) {
+	struct mem_format_data_t *data = DATA(libtrace);
+	libtrace_packet_t *packet;
+	size_t arena_size = MEM_INITIAL_SIZE;
+	size_t offsets_size = 1024;
+	mem_record_t *first, *last;
+	uint64_t span;
+	int ret;
+
+	if (trace_start(data->source) == -1) {
+		mem_copy_source_err(libtrace);
+		return -1;
+	}
+
+	data->arena = malloc(arena_size);
+	data->offsets = malloc(offsets_size * sizeof(uint64_t));
+	packet = trace_create_packet();
+	if (!data->arena || !data->offsets || !packet) {
+		trace_set_err(libtrace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory for the preloaded trace");
+		if (packet)
+			trace_destroy_packet(packet);
+		return -1;
+	}
+
+	while ((ret = trace_read_packet(data->source, packet)) > 0) {
+		if (!mem_can_load(packet))
+			continue;
+		if (mem_load_packet(libtrace, packet, &arena_size,
+				&offsets_size) < 0)
+			break;
+	}
+	trace_destroy_packet(packet);
+
+	if (trace_is_err(libtrace))
+		return -1;
+	if (ret < 0) {
+		mem_copy_source_err(libtrace);
+		return -1;
+	}
+
+	/* Nothing else will be read from the source */
+	trace_destroy(data->source);
+	data->source = NULL;
+
+	if (data->hugepages)
+		mem_move_to_hugepages(libtrace);
+
+	/* Each loop starts one average inter-packet gap after the end of
+	 * the previous one */
+	if (data->count > 0) {
+		first = (mem_record_t *)(data->arena + data->offsets[0]);
+		last = (mem_record_t *)(data->arena +
+				data->offsets[data->count - 1]);
+		span = mem_ts_ns(last) > mem_ts_ns(first) ?
+				mem_ts_ns(last) - mem_ts_ns(first) : 0;
+		data->period_ns = span;
+		if (data->count > 1)
+			data->period_ns += span / (data->count - 1);
+		if (data->period_ns == 0)
+			data->period_ns = 1;
+	}
+
+	if (data->loops == 0 && data->count > 0)
+		data->total = UINT64_MAX;
+	else
+		data->total = data->count * data->loops;
+	return 0;
+}
+
+static int mem_start_input(libtrace_t *libtrace) {
+	/* Restarting after a pause carries on from where we were */
+	if (DATA(libtrace)->arena)
+		return 0;
+	return mem_load(libtrace);
+}
+
+static int mem_pause_input(libtrace_t *libtrace UNUSED) {
+	return 0;
+}
+
+static int mem_fin_input(libtrace_t *libtrace) {
+	if (DATA(libtrace)->source)
+		trace_destroy(DATA(libtrace)->source);
+	if (DATA(libtrace)->mapped_len)
+		munmap(DATA(libtrace)->arena, DATA(libtrace)->mapped_len);
+	else
+		free(DATA(libtrace)->arena);
+	free(DATA(libtrace)->offsets);
+	free(libtrace->format_data);
+	return 0;
+}
+
+/* Fills in a packet with the given packet number. The record header is
+ * copied into the packet's own buffer so the timestamp can be moved forward
+ * for later loops, while the payload points straight into the arena. */
+static int mem_deliver(libtrace_t *libtrace, libtrace_packet_t *packet,
+		uint64_t index) {
+	struct mem_format_data_t *data = DATA(libtrace);
+	uint64_t loop = index / data->count;
+	mem_record_t *rec, *hdr;
+	uint64_t ts;
+
+	if (!packet->buffer || packet->buf_control == TRACE_CTRL_EXTERNAL) {
+		packet->buffer = malloc((size_t)LIBTRACE_PACKET_BUFSIZE);
+		if (!packet->buffer) {
+			trace_set_err(libtrace, TRACE_ERR_OUT_OF_MEMORY,
+				"Cannot allocate memory for packet buffer");
+			return -1;
+		}
+		packet->buf_control = TRACE_CTRL_PACKET;
+	}
+
+	rec = (mem_record_t *)(data->arena + data->offsets[index % data->count]);
+	hdr = (mem_record_t *)packet->buffer;
+	*hdr = *rec;
+	if (loop > 0) {
+		ts = mem_ts_ns(rec) + loop * data->period_ns;
+		hdr->ts_sec = ts / 1000000000ull;
+		hdr->ts_nsec = ts % 1000000000ull;
+	}
+
+	packet->type = TRACE_RT_DATA_MEM;
+	packet->header = hdr;
+	packet->payload = (uint8_t *)rec + sizeof(mem_record_t);
+	packet->trace = libtrace;
+	packet->order = index + 1;
+	packet->error = sizeof(mem_record_t) + rec->caplen;
+	return packet->error;
+}
+
+/* Claims up to nb packet numbers, returning the first in start */
+static uint64_t mem_claim(libtrace_t *libtrace, uint64_t nb,
+		uint64_t *start) {
+	struct mem_format_data_t *data = DATA(libtrace);
+	uint64_t next = __atomic_load_n(&data->next, __ATOMIC_RELAXED);
+	uint64_t n;
+
+	do {
+		if (next >= data->total)
+			return 0;
+		n = data->total - next < nb ? data->total - next : nb;
+	} while (!__atomic_compare_exchange_n(&data->next, &next, next + n,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	*start = next;
+	return n;
+}
+
+static int mem_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	uint64_t index;
+
+	if (mem_claim(libtrace, 1, &index) == 0)
+		return 0;
+	return mem_deliver(libtrace, packet, index);
+}
+
+static int mem_pread_packets(libtrace_t *libtrace,
+		libtrace_thread_t *t UNUSED, libtrace_packet_t **packets,
+		size_t nb_packets) {
+	uint64_t start, n, i;
+
+	n = mem_claim(libtrace, nb_packets, &start);
+	for (i = 0; i < n; i++) {
+		if (mem_deliver(libtrace, packets[i], start + i) < 0)
+			return i > 0 ? (int)i : -1;
+	}
+	return n;
+}
+
+static int mem_prepare_packet(libtrace_t *libtrace UNUSED,
+		libtrace_packet_t *packet, void *buffer,
+		libtrace_rt_types_t rt_type, uint32_t flags) {
+
+	if (packet->buffer != buffer &&
+			packet->buf_control == TRACE_CTRL_PACKET) {
+		free(packet->buffer);
+	}
+
+	if ((flags & TRACE_PREP_OWN_BUFFER) == TRACE_PREP_OWN_BUFFER) {
+		packet->buf_control = TRACE_CTRL_PACKET;
+	} else
+		packet->buf_control = TRACE_CTRL_EXTERNAL;
+
+	packet->type = rt_type;
+	packet->buffer = buffer;
+	packet->header = buffer;
+	packet->payload = (char *)buffer + sizeof(mem_record_t);
+	return 0;
+}
+
+static libtrace_linktype_t mem_get_link_type(const libtrace_packet_t *packet) {
+	return (libtrace_linktype_t)((mem_record_t *)packet->header)->linktype;
+}
+
+static libtrace_direction_t mem_get_direction(const libtrace_packet_t *packet) {
+	return (libtrace_direction_t)((mem_record_t *)packet->header)->direction;
+}
+
+static struct timespec mem_get_timespec(const libtrace_packet_t *packet) {
+	mem_record_t *rec = (mem_record_t *)packet->header;
+	struct timespec ts;
+
+	ts.tv_sec = rec->ts_sec;
+	ts.tv_nsec = rec->ts_nsec;
+	return ts;
+}
+
+static int mem_get_capture_length(const libtrace_packet_t *packet) {
+	return ((mem_record_t *)packet->header)->caplen;
+}
+
+static int mem_get_wire_length(const libtrace_packet_t *packet) {
+	return ((mem_record_t *)packet->header)->wirelen;
+}
+
+static int mem_get_framing_length(const libtrace_packet_t *packet UNUSED) {
+	return sizeof(mem_record_t);
+}
+
+static void mem_get_statistics(libtrace_t *libtrace, libtrace_stat_t *stat) {
+	uint64_t next = __atomic_load_n(&DATA(libtrace)->next,
+			__ATOMIC_RELAXED);
+
+	stat->received_valid = 1;
+	stat->received = next < DATA(libtrace)->total ? next :
+			DATA(libtrace)->total;
+	stat->dropped_valid = 1;
+	stat->dropped = 0;
+}
+
+static void mem_help(void) {
+	printf("mem format module: $Revision$\n");
+	printf("Supported input URIs:\n");
+	printf("\tmem:uri\n");
+	printf("\tmem:options:uri\n");
+	printf("\n");
+	printf("\te.g.: mem:pcapfile:trace.pcap\n");
+	printf("\te.g.: mem:loops=10,hugepages:erf:trace.erf.gz\n");
+	printf("\n");
+	printf("The whole trace is read into memory when it is started.\n");
+	printf("Options:\n");
+	printf("\tloops=N\t\treplay the trace N times, 0 for forever\n");
+	printf("\thugepages\tstore the trace in huge pages\n");
+	printf("\n");
+}
+
+static struct libtrace_format_t mem = {
+	"mem",
+	"$Id$",
+	TRACE_FORMAT_MEM,
+	NULL,				/* probe filename */
+	NULL,				/* probe magic */
+	mem_init_input,			/* init_input */
+	NULL,				/* config_input */
+	mem_start_input,		/* start_input */
+	mem_pause_input,		/* pause */
+	NULL,				/* init_output */
+	NULL,				/* config_output */
+	NULL,				/* start_output */
+	mem_fin_input,			/* fin_input */
+	NULL,				/* fin_output */
+	mem_read_packet,		/* read_packet */
+	mem_prepare_packet,		/* prepare_packet */
+	NULL,				/* fin_packet */
+	NULL,				/* can_hold_packet */
+	NULL,				/* write_packet */
+	NULL,				/* flush_output */
+	mem_get_link_type,		/* get_link_type */
+	mem_get_direction,		/* get_direction */
+	NULL,				/* set_direction */
+	NULL,				/* get_erf_timestamp */
+	NULL,				/* get_timeval */
+	mem_get_timespec,		/* get_timespec */
+	NULL,				/* get_seconds */
+	NULL,				/* get_meta_section */
+	NULL,				/* seek_erf */
+	NULL,				/* seek_timeval */
+	NULL,				/* seek_seconds */
+	mem_get_capture_length,		/* get_capture_length */
+	mem_get_wire_length,		/* get_wire_length */
+	mem_get_framing_length,		/* get_framing_length */
+	NULL,				/* set_capture_length */
+	NULL,				/* get_received_packets */
+	NULL,				/* get_filtered_packets */
+	NULL,				/* get_dropped_packets */
+	mem_get_statistics,		/* get_statistics */
+	NULL,				/* get_fd */
+	trace_event_trace,		/* trace_event */
+	mem_help,			/* help */
+	NULL,				/* next pointer */
+	{false, -1},			/* Not live, no thread limit */
+	mem_start_input,		/* pstart_input */
+	mem_pread_packets,		/* pread_packets */
+	mem_pause_input,		/* ppause */
+	mem_fin_input,			/* p_fin */
+	NULL,				/* register thread */
+	NULL,				/* unregister thread */
+	NULL				/* get thread stats */
+};
+
+void mem_constructor(void) {
+	register_format(&mem);
+}
@@ -39,6 +39,11 @@
 #  include <pcap.h>
 #endif
 
+#ifdef HAVE_PACKET_FANOUT
+#  include <sys/socket.h>
+#  include <linux/if_packet.h>
+#endif
+
 /* This format module deals with traces captured using the PCAP library. This
  * format module handles both captures from a live interface and from PCAP
  * files.
@@ -55,6 +60,12 @@
 /* Formats implemented in this module:
  * 	pcap - deals with PCAP trace files
  * 	pcapint - deals with live PCAP interfaces
+ *
+ * pcapint can also be read in parallel on Linux. Each perpkt thread gets
+ * its own PCAP handle on the interface and the handles are joined into a
+ * PACKET_FANOUT group, so the kernel spreads packets across them. Packets
+ * are read in batches using pcap_dispatch(), which lets libpcap hand over
+ * an entire TPACKET_V3 block at once.
  */
 
 #ifdef HAVE_LIBPCAP
@@ -79,6 +90,35 @@ struct pcap_format_data_t {
 	/* Whether the capture interface should be set to promiscuous mode
 	 * (live only) */
 	int promisc;
+	/* The PCAP handles used by each perpkt thread (parallel live only) */
+	libtrace_list_t *per_stream;
+	/* The PACKET_FANOUT mode used to spread packets across handles */
+	uint16_t fanout_flags;
+	/* The PACKET_FANOUT group that all of our handles join */
+	uint16_t fanout_group;
+};
+
+/* Per thread state for a parallel pcapint input */
+struct pcap_per_stream_t {
+	/* The PCAP handle for this thread */
+	pcap_t *pcap;
+	/* The order of the last packet read from this handle */
+	uint64_t last_timestamp;
+};
+
+/* Where pcap_dispatch() deposits a batch of packets */
+struct pcap_dispatch_state_t {
+	libtrace_t *libtrace;
+	/* The stream the packets are being read from */
+	struct pcap_per_stream_t *stream;
+	/* The packets being filled */
+	libtrace_packet_t **packets;
+	/* The number of packets filled so far */
+	size_t count;
+	/* The RT type of the packets, derived from the DLT */
+	libtrace_rt_types_t type;
+	/* Set if a packet buffer could not be allocated */
+	int error;
 };
 
 struct pcap_format_data_out_t {
@@ -123,6 +163,7 @@ static int pcap_init_input(libtrace_t *libtrace) {
 	DATA(libtrace)->filter = NULL;
 	DATA(libtrace)->snaplen = LIBTRACE_PACKET_BUFSIZE;
 	DATA(libtrace)->promisc = 0;
+	DATA(libtrace)->per_stream = NULL;
 
 	return 0;
 }
@@ -240,9 +281,17 @@ static int pcapint_init_input(libtrace_t *libtrace) {
 		return -1;
 	}
 
+	INPUT.pcap = NULL;
 	DATA(libtrace)->filter = NULL;
 	DATA(libtrace)->snaplen = LIBTRACE_PACKET_BUFSIZE;
 	DATA(libtrace)->promisc = 0;
+	DATA(libtrace)->per_stream = NULL;
+	DATA(libtrace)->fanout_group = (uint16_t)(rand() % 65536);
+#ifdef HAVE_PACKET_FANOUT
+	DATA(libtrace)->fanout_flags = PACKET_FANOUT_LB;
+#else
+	DATA(libtrace)->fanout_flags = 0;
+#endif
 	return 0; /* success */
 }
 
@@ -264,6 +313,24 @@ static int pcapint_config_input(libtrace_t *libtrace,
 		case TRACE_OPTION_PROMISC:
 			DATA(libtrace)->promisc=*(int*)data;
 			return 0;
+#ifdef HAVE_PACKET_FANOUT
+		case TRACE_OPTION_HASHER:
+			/* Only relevant when the handles are joined into a
+			 * fanout group by pcapint_pstart_input() */
+			switch (*((enum hasher_types *)data)) {
+				case HASHER_BALANCE:
+					DATA(libtrace)->fanout_flags = PACKET_FANOUT_LB;
+					return 0;
+				case HASHER_BIDIRECTIONAL:
+				case HASHER_UNIDIRECTIONAL:
+					DATA(libtrace)->fanout_flags = PACKET_FANOUT_HASH;
+					return 0;
+				case HASHER_CUSTOM:
+				case HASHER_SYMMETRIC:
+					return -1;
+			}
+			return -1;
+#endif
 		case TRACE_OPTION_META_FREQ:
 			/* No meta-data for this format */
 		case TRACE_OPTION_EVENT_REALTIME:
@@ -278,50 +345,53 @@ static int pcapint_config_input(libtrace_t *libtrace,
 	return -1;
 }
 
-static int pcapint_start_input(libtrace_t *libtrace) {
+/* Opens and activates a PCAP handle on the interface named by the URI,
+ * applying the configured snap length, promiscuous mode and filter */
+static int pcapint_open_handle(libtrace_t *libtrace, pcap_t **handle) {
 	char errbuf[PCAP_ERRBUF_SIZE];
+	pcap_t *pcap;
 
 #ifdef HAVE_PCAP_CREATE
 	int ret = 0;
 	
-	if ((INPUT.pcap = pcap_create(libtrace->uridata, errbuf)) == NULL) {
+	if ((pcap = pcap_create(libtrace->uridata, errbuf)) == NULL) {
 		trace_set_err(libtrace,TRACE_ERR_INIT_FAILED,"%s",errbuf);
 		return -1; /* failure */
 	}
-	if ((pcap_set_snaplen(INPUT.pcap, DATA(libtrace)->snaplen) == 
+	if ((pcap_set_snaplen(pcap, DATA(libtrace)->snaplen) == 
 				PCAP_ERROR_ACTIVATED)) {
 		trace_set_err(libtrace,TRACE_ERR_INIT_FAILED,"%s",errbuf);
 		return -1; /* failure */
 	}
 
-	if ((pcap_set_promisc(INPUT.pcap, DATA(libtrace)->promisc) == 
+	if ((pcap_set_promisc(pcap, DATA(libtrace)->promisc) == 
 				PCAP_ERROR_ACTIVATED)) {
 		trace_set_err(libtrace,TRACE_ERR_INIT_FAILED,"%s",errbuf);
 		return -1; /* failure */
 	}
 	
-	if ((pcap_set_timeout(INPUT.pcap, 1) == PCAP_ERROR_ACTIVATED)) {
+	if ((pcap_set_timeout(pcap, 1) == PCAP_ERROR_ACTIVATED)) {
 		trace_set_err(libtrace,TRACE_ERR_INIT_FAILED,"%s",errbuf);
 		return -1; /* failure */
 	}
 
 #ifdef HAVE_PCAP_IMMEDIATE
-        if ((pcap_set_immediate_mode(INPUT.pcap, 1) == PCAP_ERROR_ACTIVATED)) {
+        if ((pcap_set_immediate_mode(pcap, 1) == PCAP_ERROR_ACTIVATED)) {
 		trace_set_err(libtrace,TRACE_ERR_INIT_FAILED,"%s",errbuf);
 		return -1; /* failure */
 	}
 #endif
 
-	if ((ret = pcap_activate(INPUT.pcap)) != 0) {
+	if ((ret = pcap_activate(pcap)) != 0) {
 		if (ret == PCAP_WARNING_PROMISC_NOTSUP) {
 			trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,"Promiscuous mode unsupported");
 			return -1;
 		}
 		if (ret == PCAP_WARNING) {
-			pcap_perror(INPUT.pcap, "Pcap Warning:");
+			pcap_perror(pcap, "Pcap Warning:");
 		} else {
 			trace_set_err(libtrace,TRACE_ERR_INIT_FAILED,"%s",
-					pcap_geterr(INPUT.pcap));
+					pcap_geterr(pcap));
 			return -1;
 		}
 	}
@@ -329,7 +399,7 @@ static int pcapint_start_input(libtrace_t *libtrace) {
 #else	
 
 	/* Open the live device */
-	if ((INPUT.pcap = 
+	if ((pcap = 
 			pcap_open_live(libtrace->uridata,
 			DATA(libtrace)->snaplen,
 			DATA(libtrace)->promisc,
@@ -340,7 +410,7 @@ static int pcapint_start_input(libtrace_t *libtrace) {
 	}
 #endif
 #ifdef HAVE_PCAP_SETNONBLOCK
-	pcap_setnonblock(INPUT.pcap,0,errbuf);
+	pcap_setnonblock(pcap,0,errbuf);
 #endif
 	/* Set a filter if one is defined */
 #ifdef HAVE_BPF
@@ -350,16 +420,16 @@ static int pcapint_start_input(libtrace_t *libtrace) {
                 int pcapret;
 		
                 if (DATA(libtrace)->filter->flag == 0) {
-			pcap_compile(INPUT.pcap, 
+			pcap_compile(pcap, 
 					&DATA(libtrace)->filter->filter,
 					DATA(libtrace)->filter->filterstring, 
 					1, 0);
 			DATA(libtrace)->filter->flag = 1;
 		}
-                if (pcap_setfilter(INPUT.pcap,&DATA(libtrace)->filter->filter)
+                if (pcap_setfilter(pcap,&DATA(libtrace)->filter->filter)
 			== -1) {
 			trace_set_err(libtrace,TRACE_ERR_INIT_FAILED,"%s",
-					pcap_geterr(INPUT.pcap));
+					pcap_geterr(pcap));
 			return -1; /* failure */
 		}
 
@@ -381,7 +451,7 @@ static int pcapint_start_input(libtrace_t *libtrace) {
                  * this to work, so let's hope that holds in the future.
                  */
                 do {
-        		pcapret = pcap_next_ex(INPUT.pcap, &pcap_hdr, 
+        		pcapret = pcap_next_ex(pcap, &pcap_hdr, 
 				(const u_char **)&pcap_payload);
 		} while (0);
 
@@ -389,21 +459,266 @@ static int pcapint_start_input(libtrace_t *libtrace) {
                         return -1;
 	}
 #endif
+	*handle = pcap;
 	return 0; /* success */
 }
 
+static int pcapint_start_input(libtrace_t *libtrace) {
+	/* Check if the device is already open */
+	if (INPUT.pcap)
+		return 0; /* success */
+
+	return pcapint_open_handle(libtrace, &INPUT.pcap);
+}
+
 static int pcap_pause_input(libtrace_t *libtrace UNUSED)
 {
 	return 0; /* success */
 }
 
 
+#ifdef HAVE_PACKET_FANOUT
+/* Closes the PCAP handles belonging to each perpkt thread */
+static void pcapint_close_streams(libtrace_t *libtrace) {
+	struct pcap_per_stream_t *stream;
+	size_t i;
+
+	if (DATA(libtrace)->per_stream == NULL)
+		return;
+
+	for (i = 0; i < libtrace_list_get_size(DATA(libtrace)->per_stream); i++) {
+		stream = libtrace_list_get_index(DATA(libtrace)->per_stream,
+				i)->data;
+		if (stream->pcap) {
+			pcap_close(stream->pcap);
+			stream->pcap = NULL;
+		}
+	}
+}
+
+/* Adds the socket underlying a PCAP handle to our PACKET_FANOUT group */
+static int pcapint_join_fanout(libtrace_t *libtrace, pcap_t *pcap,
+		bool first) {
+	int fanout_opt;
+	int attempts = 0;
+
+	while (attempts < 5) {
+		fanout_opt = ((int)DATA(libtrace)->fanout_flags << 16) |
+				(int)DATA(libtrace)->fanout_group;
+
+		if (setsockopt(pcap_fileno(pcap), SOL_PACKET, PACKET_FANOUT,
+				&fanout_opt, sizeof(fanout_opt)) == 0) {
+			return 0;
+		}
+		/* Only the first handle may move to another group, the rest
+		 * must join the group it ended up in */
+		if (!first)
+			break;
+		DATA(libtrace)->fanout_group ++;
+		attempts ++;
+	}
+	trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+			"Converting the pcap handle to a socket fanout failed %s",
+			libtrace->uridata);
+	return -1;
+}
+
+static int pcapint_pstart_input(libtrace_t *libtrace) {
+	struct pcap_per_stream_t empty_stream = {NULL, 0};
+	struct pcap_per_stream_t *stream;
+	int i;
+
+	if (DATA(libtrace)->per_stream == NULL) {
+		DATA(libtrace)->per_stream = libtrace_list_init(
+				sizeof(struct pcap_per_stream_t));
+		if (DATA(libtrace)->per_stream == NULL) {
+			trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "Unable "
+				"to create list for stream data in "
+				"pcapint_pstart_input()");
+			return -1;
+		}
+	}
+
+	for (i = 0; i < libtrace->perpkt_thread_count; i++) {
+		if (libtrace_list_get_size(DATA(libtrace)->per_stream) <=
+				(size_t) i) {
+			libtrace_list_push_back(DATA(libtrace)->per_stream,
+					&empty_stream);
+		}
+		stream = libtrace_list_get_index(DATA(libtrace)->per_stream,
+				i)->data;
+
+		if (pcapint_open_handle(libtrace, &stream->pcap) != 0)
+			goto error;
+
+		/* A single handle sees everything anyway */
+		if (libtrace->perpkt_thread_count > 1 &&
+				pcapint_join_fanout(libtrace, stream->pcap,
+				i == 0) != 0) {
+			goto error;
+		}
+	}
+	return 0;
+
+error:
+	pcapint_close_streams(libtrace);
+	return -1;
+}
+
+static int pcapint_ppause_input(libtrace_t *libtrace) {
+	/* The handles are recreated (and rejoin the fanout group) when the
+	 * trace is restarted */
+	pcapint_close_streams(libtrace);
+	return 0;
+}
+
+static int pcapint_pregister_thread(libtrace_t *libtrace,
+		libtrace_thread_t *t, bool reading) {
+	libtrace_list_node_t *item;
+
+	if (reading) {
+		item = libtrace_list_get_index(DATA(libtrace)->per_stream,
+				t->perpkt_num);
+		t->format_data = item ? item->data : NULL;
+		if (!t->format_data) {
+			trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+				"Failed to attached thread %d to a stream",
+				t->perpkt_num);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Called by pcap_dispatch() for each packet in the current batch. The
+ * header and payload only remain valid until the callback returns (with
+ * TPACKET_V3 the block is handed back to the kernel once it has been
+ * drained), so each packet is copied into a libtrace owned buffer with the
+ * payload directly after the pcap header. */
+static void pcapint_dispatch_packet(u_char *user,
+		const struct pcap_pkthdr *pcap_hdr, const u_char *pcap_payload) {
+	struct pcap_dispatch_state_t *state =
+			(struct pcap_dispatch_state_t *)user;
+	libtrace_packet_t *packet = state->packets[state->count];
+	struct pcap_pkthdr *hdr;
+	uint32_t caplen;
+
+	if (state->error)
+		return;
+
+	if (packet->buf_control == TRACE_CTRL_EXTERNAL || !packet->buffer) {
+		packet->buffer = malloc((size_t)LIBTRACE_PACKET_BUFSIZE);
+		if (!packet->buffer) {
+			state->error = 1;
+			return;
+		}
+	}
+	packet->buf_control = TRACE_CTRL_PACKET;
+
+	caplen = pcap_hdr->caplen;
+	if (caplen > LIBTRACE_PACKET_BUFSIZE - sizeof(struct pcap_pkthdr))
+		caplen = LIBTRACE_PACKET_BUFSIZE - sizeof(struct pcap_pkthdr);
+
+	hdr = (struct pcap_pkthdr *)packet->buffer;
+	memcpy(hdr, pcap_hdr, sizeof(struct pcap_pkthdr));
+	hdr->caplen = caplen;
+	memcpy((char *)packet->buffer + sizeof(struct pcap_pkthdr),
+			pcap_payload, caplen);
+
+	packet->header = packet->buffer;
+	packet->payload = (char *)packet->buffer + sizeof(struct pcap_pkthdr);
+	packet->type = state->type;
+	packet->trace = state->libtrace;
+	packet->error = hdr->len + sizeof(struct pcap_pkthdr);
+
+	/* Order by timestamp, as the combiners expect each thread's packets
+	 * to be in increasing order */
+	packet->order = (((uint64_t)hdr->ts.tv_sec) << 32)
+			+ ((((uint64_t)hdr->ts.tv_usec) << 32) / 1000000);
+	if (packet->order <= state->stream->last_timestamp)
+		packet->order = state->stream->last_timestamp + 1;
+	state->stream->last_timestamp = packet->order;
+
+	state->count ++;
+}
+
+static int pcapint_pread_packets(libtrace_t *libtrace, libtrace_thread_t *t,
+		libtrace_packet_t **packets, size_t nb_packets) {
+	struct pcap_per_stream_t *stream =
+			(struct pcap_per_stream_t *)t->format_data;
+	struct pcap_dispatch_state_t state;
+	int ret;
+
+	state.libtrace = libtrace;
+	state.stream = stream;
+	state.packets = packets;
+	state.count = 0;
+	state.type = pcap_linktype_to_rt(pcap_datalink(stream->pcap));
+	state.error = 0;
+
+	for (;;) {
+		/* Drains at most one buffer (TPACKET_V3 block) */
+		ret = pcap_dispatch(stream->pcap, (int)nb_packets,
+				pcapint_dispatch_packet, (u_char *)&state);
+
+		if (state.error) {
+			trace_set_err(libtrace, TRACE_ERR_OUT_OF_MEMORY,
+				"Unable to allocate memory for packet buffer "
+				"in pcapint_pread_packets()");
+			return -1;
+		}
+		if (state.count > 0)
+			return state.count;
+
+		switch (ret) {
+			case 0:
+				/* timeout */
+				if ((ret = is_halted(libtrace)) != -1)
+					return ret;
+				if (libtrace_message_queue_count(
+						&t->messages) > 0)
+					return READ_MESSAGE;
+				break;
+			case -2:
+				/* pcap_breakloop() */
+				return READ_MESSAGE;
+			default:
+				trace_set_err(libtrace, TRACE_ERR_BAD_PACKET,
+						"%s", pcap_geterr(stream->pcap));
+				return -1;
+		}
+	}
+}
+
+static void pcapint_get_thread_statistics(libtrace_t *libtrace UNUSED,
+		libtrace_thread_t *t, libtrace_stat_t *stat) {
+	struct pcap_per_stream_t *stream =
+			(struct pcap_per_stream_t *)t->format_data;
+	struct pcap_stat pcapstats;
+
+	if (!stream || !stream->pcap ||
+			pcap_stats(stream->pcap, &pcapstats) == -1)
+		return;
+
+	stat->received_valid = 1;
+	stat->received = pcapstats.ps_recv;
+	stat->dropped_valid = 1;
+	stat->dropped = pcapstats.ps_drop;
+}
+#endif /* HAVE_PACKET_FANOUT */
+
 static int pcap_fin_input(libtrace_t *libtrace) 
 {
 	if (INPUT.pcap != NULL) {
 		pcap_close(INPUT.pcap);
 	}
 	INPUT.pcap=NULL;
+#ifdef HAVE_PACKET_FANOUT
+	if (DATA(libtrace)->per_stream) {
+		pcapint_close_streams(libtrace);
+		libtrace_list_deinit(DATA(libtrace)->per_stream);
+	}
+#endif
 	free(libtrace->format_data);
 	return 0; /* success */
 }
@@ -795,6 +1110,31 @@ static int pcap_get_fd(const libtrace_t *trace) {
 static void pcap_get_statistics(libtrace_t *trace, libtrace_stat_t *stat) {
 
 	struct pcap_stat pcapstats;
+
+#ifdef HAVE_PACKET_FANOUT
+	/* Parallel capture, add up the counters from every handle */
+	if (DATA(trace)->per_stream && !DATA(trace)->input.pcap) {
+		struct pcap_per_stream_t *stream;
+		size_t i;
+
+		stat->received = 0;
+		stat->dropped = 0;
+		for (i = 0; i < libtrace_list_get_size(DATA(trace)->per_stream);
+				i++) {
+			stream = libtrace_list_get_index(DATA(trace)->per_stream,
+					i)->data;
+			if (!stream->pcap ||
+					pcap_stats(stream->pcap, &pcapstats) == -1)
+				continue;
+			stat->received += pcapstats.ps_recv;
+			stat->dropped += pcapstats.ps_drop;
+		}
+		stat->received_valid = 1;
+		stat->dropped_valid = 1;
+		return;
+	}
+#endif
+
 	if (pcap_stats(DATA(trace)->input.pcap,&pcapstats)==-1) {
 		char *errmsg = pcap_geterr(DATA(trace)->input.pcap);
 		trace_set_err(trace,TRACE_ERR_UNSUPPORTED,
@@ -925,7 +1265,18 @@ static struct libtrace_format_t pcapint = {
 	trace_event_device,		/* trace_event */
 	pcapint_help,			/* help */
 	NULL,			/* next pointer */
+#ifdef HAVE_PACKET_FANOUT
+	{true, -1},			/* Live, no thread limit */
+	pcapint_pstart_input,		/* pstart_input */
+	pcapint_pread_packets,		/* pread_packets */
+	pcapint_ppause_input,		/* ppause */
+	pcap_fin_input,			/* p_fin */
+	pcapint_pregister_thread,	/* register thread */
+	NULL,				/* unregister thread */
+	pcapint_get_thread_statistics	/* get thread stats */
+#else
 	NON_PARALLEL(true)
+#endif
 };
 
 void pcap_constructor(void) {
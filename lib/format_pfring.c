@@ -496,6 +496,7 @@ UNUSED static int pfringzc_config_input(libtrace_t *libtrace, trace_option_t opt
 				case HASHER_BALANCE:
 					return 0;		
 				case HASHER_CUSTOM:
+				case HASHER_SYMMETRIC:
 					return -1;
 			}
 			break;
@@ -537,6 +538,7 @@ static int pfring_config_input(libtrace_t *libtrace, trace_option_t option,
 				case HASHER_BALANCE:
 				case HASHER_CUSTOM:
 				case HASHER_BIDIRECTIONAL:
+				case HASHER_SYMMETRIC:
 					return -1;
 			}
 			break;
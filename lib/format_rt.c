@@ -36,6 +36,7 @@
 #include "rt_protocol.h"
 
 #include "data-struct/buckets.h"
+#include "data-struct/simple_circular_buffer.h"
 
 #include <sys/stat.h>
 #include <errno.h>
@@ -44,11 +45,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
 
 #ifndef WIN32
 # include <netdb.h>
 #endif
 
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
 #define RT_INFO ((struct rt_format_data_t*)libtrace->format_data)
 
 /* Convert the RT denial code into a nice printable and coherent string */
@@ -74,15 +83,36 @@ static const char *rt_deny_reason(enum rt_conn_denied_t reason)
 }
 
 
+/* A run of consecutive RT records in the receive buffer that were read
+ * using the same bucket node. The space can be reused once every packet in
+ * the run (and every run before it) has been released.
+ */
+struct rt_segment_t {
+	/* Number of bytes of the receive buffer covered by this run */
+	uint32_t length;
+	/* Set once all of the packets in this run have been released */
+	int released;
+	struct rt_segment_t *next;
+};
+
 struct rt_format_data_t {
 	/* Name of the host to connect to */
 	char *hostname;
-	/* Buffer to store received packets into */
-	char *pkt_buffer;
-	/* Pointer to the next packet to be read from the buffer */
-	char *buf_read;
-	/* Pointer to the next unused byte in the buffer */
-	char *buf_write;
+	/* Circular buffer that records are received into. The buffer is
+	 * mapped twice back-to-back so records never wrap and can be
+	 * handed to the user in place */
+	libtrace_scb_t recvbuf;
+	/* Number of bytes at the front of the receive buffer that have
+	 * already been handed out as packets */
+	uint32_t delivered;
+	/* Runs of records that are still in the receive buffer, oldest
+	 * first. The last run is the one currently being read into */
+	struct rt_segment_t *seg_head;
+	struct rt_segment_t *seg_tail;
+	/* Protects the released flags, which are set by whichever thread
+	 * releases the last packet in a run */
+	pthread_mutex_t seg_lock;
+	pthread_cond_t seg_cond;
 	/* The port to connect to */
 	int port;
 	/* The file descriptor for the RT connection */
@@ -207,6 +237,19 @@ static int rt_connect(libtrace_t *libtrace) {
         return -1;
 }
 
+/* Called by the bucket once every packet in a run has been released. This
+ * may happen on any thread, so the space is only marked as reusable here and
+ * reclaimed later by the reading thread */
+static void rt_release_segment(void *buffer, void *data) {
+	struct rt_format_data_t *rt = (struct rt_format_data_t *)data;
+	struct rt_segment_t *seg = (struct rt_segment_t *)buffer;
+
+	pthread_mutex_lock(&rt->seg_lock);
+	seg->released = 1;
+	pthread_cond_signal(&rt->seg_cond);
+	pthread_mutex_unlock(&rt->seg_lock);
+}
+
 static void rt_init_format_data(libtrace_t *libtrace) {
         libtrace->format_data = malloc(sizeof(struct rt_format_data_t));
 
@@ -216,14 +259,23 @@ static void rt_init_format_data(libtrace_t *libtrace) {
 	RT_INFO->dummy_linux = NULL;
 	RT_INFO->dummy_ring = NULL;
 	RT_INFO->dummy_bpf = NULL;
-	RT_INFO->pkt_buffer = NULL;
-	RT_INFO->buf_read = NULL;
-	RT_INFO->buf_write = NULL;
+	RT_INFO->recvbuf.address = NULL;
+	RT_INFO->recvbuf.shm_file = NULL;
+	RT_INFO->recvbuf.fd = -1;
+	RT_INFO->delivered = 0;
+	RT_INFO->seg_head = NULL;
+	RT_INFO->seg_tail = NULL;
 	RT_INFO->hostname = NULL;
 	RT_INFO->port = 0;
+	RT_INFO->input_fd = -1;
 	RT_INFO->unacked = 0;
 
+	pthread_mutex_init(&RT_INFO->seg_lock, NULL);
+	pthread_cond_init(&RT_INFO->seg_cond, NULL);
+
         RT_INFO->bucket = libtrace_bucket_init();
+        libtrace_bucket_set_free_callback(RT_INFO->bucket, rt_release_segment,
+                        libtrace->format_data);
 }
 
 static int rt_init_input(libtrace_t *libtrace) {
@@ -296,6 +348,14 @@ static int rt_pause_input(libtrace_t *libtrace) {
 	}
 
 	close(RT_INFO->input_fd);
+	RT_INFO->input_fd = -1;
+
+	/* Throw away any partial record, the server will start again from a
+	 * record boundary when we reconnect */
+	if (RT_INFO->recvbuf.address) {
+		RT_INFO->recvbuf.write_offset = RT_INFO->recvbuf.read_offset +
+				RT_INFO->delivered;
+	}
 	return 0;
 }
 
@@ -322,6 +382,19 @@ static int rt_fin_input(libtrace_t *libtrace) {
 
         if (RT_INFO->bucket)
                 libtrace_bucket_destroy(RT_INFO->bucket);
+
+	while (RT_INFO->seg_head) {
+		struct rt_segment_t *seg = RT_INFO->seg_head;
+		RT_INFO->seg_head = seg->next;
+		free(seg);
+	}
+	if (RT_INFO->recvbuf.address)
+		libtrace_scb_destroy(&RT_INFO->recvbuf);
+	if (RT_INFO->hostname)
+		free(RT_INFO->hostname);
+
+	pthread_mutex_destroy(&RT_INFO->seg_lock);
+	pthread_cond_destroy(&RT_INFO->seg_cond);
 	free(libtrace->format_data);
         return 0;
 }
@@ -466,17 +539,18 @@ static int rt_set_format(libtrace_t *libtrace, libtrace_packet_t *packet)
 }		
 
 
-/* I've upped this to 10K to deal with jumbo-grams that have not been snapped
- * in any way. This means we have a much larger memory overhead per packet
- * (which won't be used in the vast majority of cases), so we may want to think
- * about doing something smarter, e.g. allocate a smaller block of memory and
- * only increase it as required.
- *
- * XXX Capturing off int: can still lead to packets that are larger than 10K,
- * in instances where the fragmentation is done magically by the NIC. This
- * is pretty nasty, but also very rare.
+/* Size of the receive buffer. This must be comfortably larger than the
+ * largest possible RT record (a 16 bit length plus the RT header), and limits
+ * how much data can be received but not yet released by the user before the
+ * client stops reading from the socket.
  */
-#define RT_BUF_SIZE (LIBTRACE_PACKET_BUFSIZE * 2)
+#define RT_BUF_SIZE (16 * 1024 * 1024)
+/* Held packets are copied out of the receive buffer once less than this
+ * much of it is free */
+#define RT_LOW_SPACE (RT_BUF_SIZE / 4)
+/* How long to wait for a run of records to be released before checking
+ * whether the trace is pausing or stopping */
+#define RT_WAIT_NSEC (100 * 1000 * 1000)
 
 static int rt_process_data_packet(libtrace_t *libtrace,
                 libtrace_packet_t *packet) {
@@ -510,46 +584,157 @@ static int rt_process_data_packet(libtrace_t *libtrace,
 
 }
 
-/* Receives data from an RT server */
-static int rt_read(libtrace_t *libtrace, int block) {
-        int numbytes;
+/* Starts a new run of records in the receive buffer. Packets delivered from
+ * now on are tracked by a new bucket node, so the previous run can be reused
+ * as soon as all of its packets have been released */
+static int rt_new_segment(libtrace_t *libtrace) {
+	struct rt_segment_t *seg;
 
-	if (!RT_INFO->pkt_buffer) {
-		RT_INFO->pkt_buffer = (char*)malloc((size_t)RT_BUF_SIZE);
-		RT_INFO->buf_write = RT_INFO->pkt_buffer;
-                RT_INFO->buf_read = RT_INFO->pkt_buffer;
-                libtrace_create_new_bucket(RT_INFO->bucket, RT_INFO->pkt_buffer);
+	seg = (struct rt_segment_t *)malloc(sizeof(struct rt_segment_t));
+	if (!seg) {
+		trace_set_err(libtrace, TRACE_ERR_OUT_OF_MEMORY,
+				"Unable to allocate memory in rt_new_segment()");
+		return -1;
 	}
+	seg->length = 0;
+	seg->released = 0;
+	seg->next = NULL;
 
-#ifndef MSG_DONTWAIT
-#define MSG_DONTWAIT 0
-#endif
-#ifndef MSG_NOSIGNAL
-#  define MSG_NOSIGNAL 0
-#endif
+	pthread_mutex_lock(&RT_INFO->seg_lock);
+	if (RT_INFO->seg_tail)
+		RT_INFO->seg_tail->next = seg;
+	else
+		RT_INFO->seg_head = seg;
+	RT_INFO->seg_tail = seg;
+	pthread_mutex_unlock(&RT_INFO->seg_lock);
+
+	/* Must not hold seg_lock here, this may release the previous run */
+	libtrace_create_new_bucket(RT_INFO->bucket, seg);
+	return 0;
+}
+
+/* Gives the space used by released runs of records back to the receive
+ * buffer. Returns the number of bytes that were reclaimed. */
+static uint32_t rt_reclaim_segments(libtrace_t *libtrace) {
+	struct rt_segment_t *seg;
+	uint32_t reclaimed = 0;
+
+	pthread_mutex_lock(&RT_INFO->seg_lock);
+	while ((seg = RT_INFO->seg_head) != NULL && seg->released) {
+		RT_INFO->seg_head = seg->next;
+		if (RT_INFO->seg_tail == seg)
+			RT_INFO->seg_tail = NULL;
+		libtrace_scb_advance_read(&RT_INFO->recvbuf, seg->length);
+		RT_INFO->delivered -= seg->length;
+		reclaimed += seg->length;
+		free(seg);
+	}
+	pthread_mutex_unlock(&RT_INFO->seg_lock);
+	return reclaimed;
+}
+
+/* Waits for the oldest run of records to be released when the receive
+ * buffer is full. The wait gives up if the trace is halted or pausing, or
+ * if a message arrives on queue (which may be NULL), as the packets may not
+ * be released until that is dealt with.
+ *
+ * Returns 1 once there is space, otherwise the value the read should
+ * return */
+static int rt_wait_for_space(libtrace_t *libtrace,
+		libtrace_message_queue_t *queue) {
+	struct timespec deadline;
+	int ret;
+
+	while (rt_reclaim_segments(libtrace) == 0) {
+		/* Outside of a parallel trace nobody else can release
+		 * these packets */
+		if (libtrace->state == STATE_NEW) {
+			trace_set_err(libtrace, TRACE_ERR_RT_FAILURE,
+				"RT receive buffer is full of packets that "
+				"have not been released");
+			return -1;
+		}
+		if ((ret = is_halted(libtrace)) != -1)
+			return ret;
+		if (queue && libtrace_message_queue_count(queue) > 0)
+			return READ_MESSAGE;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += RT_WAIT_NSEC;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&RT_INFO->seg_lock);
+		if (!RT_INFO->seg_head->released)
+			pthread_cond_timedwait(&RT_INFO->seg_cond,
+					&RT_INFO->seg_lock, &deadline);
+		pthread_mutex_unlock(&RT_INFO->seg_lock);
+	}
+	return 1;
+}
+
+/* Makes room to receive into, waiting for records to be released if the
+ * receive buffer is full.
+ *
+ * Returns 1 once there is space, otherwise the value the read should
+ * return */
+static int rt_make_space(libtrace_t *libtrace,
+		libtrace_message_queue_t *queue) {
+        libtrace_scb_t *buf = &RT_INFO->recvbuf;
+        uint32_t space;
+        int ret = 1;
+
+	if (buf->address == NULL) {
+		if (libtrace_scb_init(buf, RT_BUF_SIZE,
+				(uint16_t)RT_INFO->input_fd) < 0) {
+			trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+				"Unable to create receive buffer for RT client");
+			return -1;
+		}
+		RT_INFO->delivered = 0;
+		if (rt_new_segment(libtrace) < 0)
+			return -1;
+	}
+
+        /* Anything delivered since the last read gets a run of its own, so
+         * it can be reclaimed without waiting on the data we read now */
+        if (RT_INFO->seg_tail->length > 0) {
+                if (rt_new_segment(libtrace) < 0)
+                        return -1;
+        }
+        rt_reclaim_segments(libtrace);
+
+        space = buf->count_bytes - (buf->write_offset - buf->read_offset);
+        if (space == 0)
+                ret = rt_wait_for_space(libtrace, queue);
+
+        /* Have packets that are being held copied out of the buffer while
+         * it is short of space, so one slow consumer cannot fill it */
+        space = buf->count_bytes - (buf->write_offset - buf->read_offset);
+        libtrace_bucket_set_low_space(RT_INFO->bucket, space < RT_LOW_SPACE);
+        return ret;
+}
+
+/* Receives data from an RT server, rt_make_space() must have been called
+ * first */
+static int rt_read(libtrace_t *libtrace, int block) {
+        libtrace_scb_t *buf = &RT_INFO->recvbuf;
+        int numbytes;
+        uint32_t space;
 
 	if (block)
 		block=0;
 	else
 		block=MSG_DONTWAIT;
 
-        /* If the current buffer has plenty of space left, we can continue to 
-         * read into it, otherwise create a new buffer and move anything in
-         * the old buffer over to it */
-        if (RT_INFO->buf_write - RT_INFO->pkt_buffer > RT_BUF_SIZE / 2) {
-                char *newbuf = (char*)malloc((size_t)RT_BUF_SIZE);
-
-                memcpy(newbuf, RT_INFO->buf_read, RT_INFO->buf_write - RT_INFO->buf_read);
-                RT_INFO->buf_write = newbuf + (RT_INFO->buf_write - RT_INFO->buf_read);
-                RT_INFO->buf_read = newbuf;
-                RT_INFO->pkt_buffer = newbuf;
-                libtrace_create_new_bucket(RT_INFO->bucket, newbuf);
+        space = buf->count_bytes - (buf->write_offset - buf->read_offset);
 
-        }
-
-        /* Attempt to fill the buffer as much as we can */
-        if ((numbytes = recv(RT_INFO->input_fd, RT_INFO->buf_write,
-                        RT_BUF_SIZE - (RT_INFO->buf_write-RT_INFO->pkt_buffer),
+        /* Receive as much as we have room for, the mirrored mapping means
+         * the free space is always contiguous */
+        if ((numbytes = recv(RT_INFO->input_fd,
+                        buf->address + buf->write_offset, space,
                         MSG_NOSIGNAL | block)) <= 0) {
 
                 if (numbytes == 0) {
@@ -575,41 +760,66 @@ static int rt_read(libtrace_t *libtrace, int block) {
                 return -1;
         }
 
-        RT_INFO->buf_write += numbytes;
-        return (RT_INFO->buf_write - RT_INFO->buf_read);
+        buf->write_offset += numbytes;
+        return (buf->write_offset - buf->read_offset - RT_INFO->delivered);
 
 }
 
+/* Returns the next complete record in the receive buffer, or NULL if the
+ * whole record has not been received yet */
+static rt_header_t *rt_next_record(libtrace_t *libtrace) {
+        uint32_t available;
+        uint8_t *ptr;
+        rt_header_t *rthdr;
+
+        ptr = libtrace_scb_get_read(&RT_INFO->recvbuf, &available);
+        if (ptr == NULL)
+                return NULL;
+
+        ptr += RT_INFO->delivered;
+        available -= RT_INFO->delivered;
+
+        if (available < sizeof(rt_header_t))
+                return NULL;
+
+        rthdr = (rt_header_t *)ptr;
+        if (available - sizeof(rt_header_t) < ntohs(rthdr->length))
+                return NULL;
+        return rthdr;
+}
 
 static int rt_get_next_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
                 int block) {
 
         rt_header_t *rthdr;
+        uint32_t reclen;
+        int ret;
 
         if (packet->buffer && packet->buf_control == TRACE_CTRL_PACKET)
                 free(packet->buffer);
 
-        while (RT_INFO->buf_write - RT_INFO->buf_read <
-                                (uint32_t)sizeof(rt_header_t)) {
-                if (rt_read(libtrace, block) == -1)
-                        return -1;
+        /* trace_read_packet() only finalises packets that belong to this
+         * trace, and ours have been moved to one of the dummy traces, so
+         * release the record this packet previously referred to */
+        if (packet->srcbucket == RT_INFO->bucket && packet->internalid != 0) {
+                libtrace_release_bucket_id(RT_INFO->bucket,
+                                packet->internalid);
+                packet->internalid = 0;
+                packet->srcbucket = NULL;
         }
 
-        rthdr = (rt_header_t *)RT_INFO->buf_read;
-
-        /* Check if we have enough payload */
-        while (RT_INFO->buf_write - (RT_INFO->buf_read + sizeof(rt_header_t))
-                        < ntohs(rthdr->length)) {
+        while ((rthdr = rt_next_record(libtrace)) == NULL) {
+                if ((ret = rt_make_space(libtrace, NULL)) != 1)
+                        return ret;
                 if (rt_read(libtrace, block) == -1)
                         return -1;
-                rthdr = (rt_header_t *)RT_INFO->buf_read;
         }
 
-
-        packet->buffer = RT_INFO->buf_read;
-        packet->header = RT_INFO->buf_read;
-        packet->type = ntohl(((rt_header_t *)packet->header)->type);
-        packet->payload = RT_INFO->buf_read + sizeof(rt_header_t);
+        /* Deliver the record in place */
+        packet->buffer = rthdr;
+        packet->header = rthdr;
+        packet->type = ntohl(rthdr->type);
+        packet->payload = (char *)rthdr + sizeof(rt_header_t);
         packet->internalid = libtrace_push_into_bucket(RT_INFO->bucket);
 	if (!packet->internalid) {
 		trace_set_err(libtrace, TRACE_ERR_RT_FAILURE, "packet->internalid is 0 in rt_get_next_packet()");
@@ -618,7 +828,9 @@ static int rt_get_next_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
         packet->srcbucket = RT_INFO->bucket;
         packet->buf_control = TRACE_CTRL_EXTERNAL;
 
-        RT_INFO->buf_read += ntohs(rthdr->length) + sizeof(rt_header_t);
+        reclen = ntohs(rthdr->length) + sizeof(rt_header_t);
+        RT_INFO->delivered += reclen;
+        RT_INFO->seg_tail->length += reclen;
 
         if (packet->type >= TRACE_RT_DATA_SIMPLE) {
                 rt_process_data_packet(libtrace, packet);
@@ -685,6 +897,74 @@ static int rt_read_packet(libtrace_t *libtrace,
 }
 
 
+static int rt_pstart_input(libtrace_t *libtrace) {
+	/* An RT feed is a single TCP stream, so only one thread can read it
+	 * directly. Otherwise fall back to start_input() and let the
+	 * parallel core distribute the packets */
+	if (libtrace->perpkt_thread_count > 1)
+		return 1;
+	return rt_start_input(libtrace);
+}
+
+/* Reads a batch of records. This only blocks until the first record is
+ * available and then hands out whatever else has already been received,
+ * so a single recv() can satisfy many packets */
+static int rt_pread_packets(libtrace_t *libtrace, libtrace_thread_t *t,
+		libtrace_packet_t **packets, size_t nb_packets) {
+	struct pollfd pfd;
+	rt_header_t *rthdr;
+	size_t i;
+	int ret;
+
+	while (rt_next_record(libtrace) == NULL) {
+		if ((ret = is_halted(libtrace)) != -1)
+			return ret;
+		if (libtrace_message_queue_count(&t->messages) > 0)
+			return READ_MESSAGE;
+
+		/* Poll so we can notice messages while the feed is idle */
+		pfd.fd = RT_INFO->input_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		ret = poll(&pfd, 1, 100);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			trace_set_err(libtrace, TRACE_ERR_RT_FAILURE,
+					"Error polling RT socket: %s",
+					strerror(errno));
+			return -1;
+		}
+		if (ret == 0)
+			continue;
+		if ((ret = rt_make_space(libtrace, &t->messages)) != 1)
+			return ret;
+		if (rt_read(libtrace, 1) == -1)
+			return -1;
+	}
+
+	for (i = 0; i < nb_packets; i++) {
+		rthdr = rt_next_record(libtrace);
+		if (rthdr == NULL)
+			break;
+		/* Zero length records such as TRACE_RT_END_DATA are reported
+		 * as EOF, so make sure they are delivered on their own */
+		if (i > 0 && ntohs(rthdr->length) == 0)
+			break;
+
+		packets[i]->trace = libtrace;
+		ret = rt_get_next_packet(libtrace, packets[i], 0);
+		if (ret < 0)
+			return i > 0 ? (int)i : -1;
+		if (ret == 0)
+			return 0;
+
+		packets[i]->error = ret;
+		trace_packet_set_order(packets[i], libtrace->sequence_number++);
+	}
+	return i;
+}
+
 /* This should only get called for RT messages - RT-encapsulated data records
  * should be converted to the appropriate capture format */
 static int rt_get_capture_length(const libtrace_packet_t *packet) {
@@ -881,7 +1161,14 @@ static struct libtrace_format_t rt = {
         trace_event_rt,                 /* trace_event */
         rt_help,			/* help */
 	NULL,			        /* next pointer */
-	NON_PARALLEL(true)              /* This is normally live */
+	{true, 1},			/* Live, one stream */
+	rt_pstart_input,		/* pstart_input */
+	rt_pread_packets,		/* pread_packets */
+	rt_pause_input,			/* ppause */
+	rt_fin_input,			/* p_fin */
+	NULL,				/* register thread */
+	NULL,				/* unregister thread */
+	NULL				/* get thread stats */
 };
 
 void rt_constructor(void) {
@@ -0,0 +1,1081 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "format_helper.h"
+
+#include "data-struct/buckets.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Shared memory fan-out format
+ *
+ * An output trace ("shm:name") publishes packets into a ring in POSIX
+ * shared memory, and any number of input traces on the same host
+ * ("shm:name") read them directly from the ring without copying.
+ *
+ * Every consumer has a slot in the ring header holding its own read cursor,
+ * release cursor and drop counter. The read cursor is the next record the
+ * consumer will read, while the release cursor is the oldest record that is
+ * still referenced by one of its packets. The producer never overwrites
+ * anything past a release cursor; when a consumer falls behind, its unread
+ * records are skipped and counted as drops for that consumer alone. Only if
+ * a consumer is still holding on to the space that is needed is the new
+ * packet dropped for everyone.
+ *
+ * The data area is mapped twice back-to-back so a record never wraps.
+ */
+
+#define SHM_MAGIC 0x6c74736d
+#define SHM_VERSION 1
+
+/* Maximum number of consumers that can attach to a ring at once */
+#define SHM_MAX_CONSUMERS 32
+
+/* Default size of the data area, can be changed with shm:name:<MB> */
+#define SHM_DEFAULT_SIZE (64 * 1024 * 1024)
+
+/* Number of records claimed at a time by the single threaded read path */
+#define SHM_READ_BATCH 32
+
+/* How long a consumer sleeps for while waiting for the producer before
+ * checking for messages again */
+#define SHM_WAIT_NSEC (10 * 1000 * 1000)
+
+#define SHM_RECORD_ALIGN 8
+
+#define DATA(x) ((struct shm_format_data_t *)((x)->format_data))
+#define DATAOUT(x) ((struct shm_format_data_out_t *)((x)->format_data))
+
+/* The header written in front of every packet in the ring */
+typedef struct shm_record {
+	/* Total length of the record including this header and padding */
+	uint32_t length;
+	uint32_t caplen;
+	uint32_t wirelen;
+	/* libtrace_linktype_t */
+	uint16_t linktype;
+	/* libtrace_direction_t */
+	int16_t direction;
+	/* Position of this record in the stream, used as the packet order */
+	uint64_t seq;
+	uint64_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t padding;
+} shm_record_t;
+
+struct shm_consumer_t {
+	/* Serialises claims by this consumer against the producer skipping
+	 * it forward */
+	pthread_mutex_t lock;
+	/* Offset of the next record to be read */
+	uint64_t read_offset;
+	/* Offset of the oldest record that is still in use */
+	uint64_t release_offset;
+	/* Records skipped because this consumer fell behind */
+	uint64_t dropped;
+	/* Records read by this consumer */
+	uint64_t received;
+	/* Value of the ring's dropped counter when this consumer attached */
+	uint64_t dropped_base;
+	pid_t pid;
+	uint32_t active;
+};
+
+struct shm_ring_t {
+	uint32_t magic;
+	uint32_t version;
+	/* Size of the data area, a power of two */
+	uint64_t size;
+	/* Offset of the data area from the start of the mapping */
+	uint64_t hdrlen;
+	/* Protects the consumer slots and is used to wait for the producer */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t waiters;
+	/* Set once the producer has stopped */
+	uint32_t finished;
+	/* Offset just past the last record published by the producer */
+	uint64_t write_offset;
+	/* Sequence number for the next record */
+	uint64_t next_seq;
+	/* Records that could not be written because a consumer was still
+	 * using the space */
+	uint64_t dropped;
+	struct shm_consumer_t consumers[SHM_MAX_CONSUMERS];
+};
+
+/* A batch of records claimed by a consumer in a single call. The space can
+ * be given back to the producer once every packet in the batch (and every
+ * batch before it) has been released */
+struct shm_segment_t {
+	/* Offset of the first record in the batch */
+	uint64_t start;
+	/* Set once all of the packets in this batch have been released */
+	int released;
+	struct shm_segment_t *next;
+};
+
+struct shm_format_data_t {
+	/* Name of the shared memory object */
+	char *name;
+	int fd;
+	struct shm_ring_t *ring;
+	/* Our slot in the ring, NULL if we are not attached */
+	struct shm_consumer_t *consumer;
+
+	/* Tracks when the packets we hand out are released */
+	libtrace_bucket_t *bucket;
+	/* Claimed batches that are still in use, oldest first */
+	struct shm_segment_t *seg_head;
+	struct shm_segment_t *seg_tail;
+	pthread_mutex_t seg_lock;
+	/* Keeps each claimed batch and the packets delivered from it
+	 * together in the bucket when more than one thread is reading */
+	pthread_mutex_t claim_lock;
+
+	/* Records claimed by the single threaded read path that have not
+	 * been delivered yet */
+	uint64_t next;
+	uint64_t end;
+};
+
+struct shm_format_data_out_t {
+	/* Name of the shared memory object */
+	char *name;
+	int fd;
+	struct shm_ring_t *ring;
+	/* Size of the data area */
+	uint64_t size;
+};
+
+#define SHM_DATA_AREA(ring) ((uint8_t *)(ring) + (ring)->hdrlen)
+
+static inline shm_record_t *shm_record_at(struct shm_ring_t *ring,
+		uint64_t offset) {
+	return (shm_record_t *)(SHM_DATA_AREA(ring) +
+			(offset & (ring->size - 1)));
+}
+
+static inline size_t shm_map_length(uint64_t hdrlen, uint64_t size) {
+	return hdrlen + 2 * size;
+}
+
+/* Locks a mutex in shared memory, recovering it if the process that held
+ * it died */
+static void shm_lock(pthread_mutex_t *lock) {
+	if (pthread_mutex_lock(lock) == EOWNERDEAD)
+		pthread_mutex_consistent(lock);
+}
+
+static void shm_init_lock(pthread_mutex_t *lock) {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* Converts the name given in the URI into a shared memory object name. Any
+ * size suffix is ignored */
+static char *shm_object_name(const char *uridata) {
+	char name[NAME_MAX];
+	size_t len = strcspn(uridata, ":");
+
+	if (len == 0 || memchr(uridata, '/', len) != NULL)
+		return NULL;
+	if (snprintf(name, sizeof(name), "/libtrace-%.*s", (int)len,
+			uridata) >= (int)sizeof(name))
+		return NULL;
+	return strdup(name);
+}
+
+/* Maps the ring header followed by two copies of the data area, so that a
+ * record starting anywhere in the ring can be accessed contiguously */
+static struct shm_ring_t *shm_map_ring(int fd, uint64_t hdrlen,
+		uint64_t size) {
+	uint8_t *base;
+
+	base = mmap(NULL, shm_map_length(hdrlen, size), PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	if (mmap(base, hdrlen + size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+			mmap(base + hdrlen + size, size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			fd, hdrlen) == MAP_FAILED) {
+		munmap(base, shm_map_length(hdrlen, size));
+		return NULL;
+	}
+	return (struct shm_ring_t *)base;
+}
+
+static bool shm_can_write(libtrace_packet_t *packet) {
+	libtrace_linktype_t ltype = trace_get_link_type(packet);
+
+	if (ltype == TRACE_TYPE_PCAPNG_META
+		|| ltype == TRACE_TYPE_CONTENT_INVALID
+		|| ltype == TRACE_TYPE_UNKNOWN
+		|| ltype == TRACE_TYPE_ERF_META
+		|| ltype == TRACE_TYPE_NONDATA) {
+
+		return false;
+	}
+
+	return true;
+}
+
+/* Called by the bucket once every packet in a batch has been released. This
+ * can happen on any thread, so only batches at the front of the list are
+ * handed back to the producer */
+static void shm_release_segment(void *buffer, void *data) {
+	struct shm_format_data_t *shm = (struct shm_format_data_t *)data;
+	struct shm_segment_t *seg = (struct shm_segment_t *)buffer;
+	uint64_t release;
+
+	pthread_mutex_lock(&shm->seg_lock);
+	seg->released = 1;
+	while ((seg = shm->seg_head) != NULL && seg->released) {
+		shm->seg_head = seg->next;
+		if (shm->seg_tail == seg)
+			shm->seg_tail = NULL;
+		free(seg);
+	}
+
+	if (shm->consumer) {
+		if (shm->seg_head)
+			release = shm->seg_head->start;
+		else
+			release = __atomic_load_n(&shm->consumer->read_offset,
+					__ATOMIC_ACQUIRE);
+		__atomic_store_n(&shm->consumer->release_offset, release,
+				__ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&shm->seg_lock);
+}
+
+static int shm_init_input(libtrace_t *libtrace) {
+
+	libtrace->format_data = malloc(sizeof(struct shm_format_data_t));
+	if (!libtrace->format_data) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "Unable to "
+			"allocate memory for format data inside "
+			"shm_init_input()");
+		return -1;
+	}
+
+	DATA(libtrace)->name = shm_object_name(libtrace->uridata);
+	if (!DATA(libtrace)->name) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+			"Invalid shared memory name '%s'", libtrace->uridata);
+		free(libtrace->format_data);
+		libtrace->format_data = NULL;
+		return -1;
+	}
+	DATA(libtrace)->fd = -1;
+	DATA(libtrace)->ring = NULL;
+	DATA(libtrace)->consumer = NULL;
+	DATA(libtrace)->seg_head = NULL;
+	DATA(libtrace)->seg_tail = NULL;
+	DATA(libtrace)->next = 0;
+	DATA(libtrace)->end = 0;
+	pthread_mutex_init(&DATA(libtrace)->seg_lock, NULL);
+	pthread_mutex_init(&DATA(libtrace)->claim_lock, NULL);
+
+	DATA(libtrace)->bucket = libtrace_bucket_init();
+	libtrace_bucket_set_free_callback(DATA(libtrace)->bucket,
+			shm_release_segment, libtrace->format_data);
+	return 0;
+}
+
+/* Opens and maps the ring created by the producer */
+static int shm_open_ring(libtrace_t *libtrace) {
+	struct shm_ring_t *hdr;
+	uint64_t hdrlen, size;
+
+	DATA(libtrace)->fd = shm_open(DATA(libtrace)->name, O_RDWR, 0);
+	if (DATA(libtrace)->fd < 0) {
+		trace_set_err(libtrace, errno, "Unable to open shared memory "
+			"%s, is the producer running?", DATA(libtrace)->name);
+		return -1;
+	}
+
+	/* Check the header before mapping the whole ring */
+	hdr = mmap(NULL, sizeof(struct shm_ring_t), PROT_READ, MAP_SHARED,
+			DATA(libtrace)->fd, 0);
+	if (hdr == MAP_FAILED) {
+		trace_set_err(libtrace, errno, "Unable to map shared memory %s",
+				DATA(libtrace)->name);
+		return -1;
+	}
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+			hdr->version != SHM_VERSION) {
+		munmap(hdr, sizeof(struct shm_ring_t));
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+			"Shared memory %s is not a libtrace ring",
+			DATA(libtrace)->name);
+		return -1;
+	}
+	hdrlen = hdr->hdrlen;
+	size = hdr->size;
+	munmap(hdr, sizeof(struct shm_ring_t));
+
+	DATA(libtrace)->ring = shm_map_ring(DATA(libtrace)->fd, hdrlen, size);
+	if (!DATA(libtrace)->ring) {
+		trace_set_err(libtrace, errno, "Unable to map shared memory %s",
+				DATA(libtrace)->name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Takes a consumer slot, starting from the producer's current position */
+static int shm_attach(libtrace_t *libtrace) {
+	struct shm_ring_t *ring = DATA(libtrace)->ring;
+	struct shm_consumer_t *c = NULL;
+	int i;
+
+	shm_lock(&ring->lock);
+	for (i = 0; i < SHM_MAX_CONSUMERS; i++) {
+		c = &ring->consumers[i];
+		if (!c->active)
+			break;
+		/* Reclaim slots left behind by consumers that have died */
+		if (kill(c->pid, 0) == -1 && errno == ESRCH)
+			break;
+	}
+	if (i == SHM_MAX_CONSUMERS) {
+		pthread_mutex_unlock(&ring->lock);
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+			"Too many consumers attached to %s",
+			DATA(libtrace)->name);
+		return -1;
+	}
+
+	shm_lock(&c->lock);
+	c->read_offset = __atomic_load_n(&ring->write_offset,
+			__ATOMIC_ACQUIRE);
+	c->release_offset = c->read_offset;
+	c->dropped = 0;
+	c->received = 0;
+	c->dropped_base = ring->dropped;
+	c->pid = getpid();
+	__atomic_store_n(&c->active, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&c->lock);
+	pthread_mutex_unlock(&ring->lock);
+
+	pthread_mutex_lock(&DATA(libtrace)->seg_lock);
+	DATA(libtrace)->consumer = c;
+	pthread_mutex_unlock(&DATA(libtrace)->seg_lock);
+	DATA(libtrace)->next = 0;
+	DATA(libtrace)->end = 0;
+	return 0;
+}
+
+static void shm_detach(libtrace_t *libtrace) {
+	struct shm_consumer_t *c = DATA(libtrace)->consumer;
+
+	if (!c)
+		return;
+
+	pthread_mutex_lock(&DATA(libtrace)->seg_lock);
+	DATA(libtrace)->consumer = NULL;
+	pthread_mutex_unlock(&DATA(libtrace)->seg_lock);
+
+	shm_lock(&c->lock);
+	__atomic_store_n(&c->active, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static int shm_start_input(libtrace_t *libtrace) {
+
+	if (!DATA(libtrace)->ring && shm_open_ring(libtrace) < 0)
+		return -1;
+	if (DATA(libtrace)->consumer)
+		return 0;
+	return shm_attach(libtrace);
+}
+
+static int shm_pause_input(libtrace_t *libtrace) {
+	shm_detach(libtrace);
+	return 0;
+}
+
+static int shm_fin_input(libtrace_t *libtrace) {
+	struct shm_segment_t *seg;
+
+	shm_detach(libtrace);
+
+	/* This must happen before the ring is unmapped */
+	libtrace_bucket_destroy(DATA(libtrace)->bucket);
+	while ((seg = DATA(libtrace)->seg_head) != NULL) {
+		DATA(libtrace)->seg_head = seg->next;
+		free(seg);
+	}
+
+	if (DATA(libtrace)->ring)
+		munmap(DATA(libtrace)->ring, shm_map_length(
+				DATA(libtrace)->ring->hdrlen,
+				DATA(libtrace)->ring->size));
+	if (DATA(libtrace)->fd != -1)
+		close(DATA(libtrace)->fd);
+
+	pthread_mutex_destroy(&DATA(libtrace)->seg_lock);
+	pthread_mutex_destroy(&DATA(libtrace)->claim_lock);
+	free(DATA(libtrace)->name);
+	free(libtrace->format_data);
+	return 0;
+}
+
+/* Points a packet at a record in the ring */
+static void shm_deliver_record(libtrace_t *libtrace, libtrace_packet_t *packet,
+		shm_record_t *rec) {
+
+	if (packet->buf_control == TRACE_CTRL_PACKET && packet->buffer)
+		free(packet->buffer);
+
+	packet->buf_control = TRACE_CTRL_EXTERNAL;
+	packet->type = TRACE_RT_DATA_SHM;
+	packet->buffer = rec;
+	packet->header = rec;
+	packet->payload = (char *)rec + sizeof(shm_record_t);
+	packet->trace = libtrace;
+	packet->order = rec->seq;
+	packet->error = sizeof(shm_record_t) + rec->caplen;
+	packet->srcbucket = DATA(libtrace)->bucket;
+	packet->internalid = libtrace_push_into_bucket(DATA(libtrace)->bucket);
+}
+
+/* Claims up to nb records for this consumer as a single batch, returning the
+ * number of records claimed and the range they cover. If packets is not NULL
+ * the records are also delivered into the packets, which must be done while
+ * the batch is still the newest one when more than one thread is reading.
+ *
+ * Delivering can block until earlier packets are released, so it happens
+ * after the consumer lock, which the producer also takes, is dropped.
+ */
+static size_t shm_claim_records(libtrace_t *libtrace, size_t nb,
+		uint64_t *start, uint64_t *end, libtrace_packet_t **packets) {
+	struct shm_ring_t *ring = DATA(libtrace)->ring;
+	struct shm_consumer_t *c = DATA(libtrace)->consumer;
+	struct shm_segment_t *seg;
+	uint64_t first, offset, limit;
+	size_t n = 0;
+
+	pthread_mutex_lock(&DATA(libtrace)->claim_lock);
+	shm_lock(&c->lock);
+	first = c->read_offset;
+	limit = __atomic_load_n(&ring->write_offset, __ATOMIC_ACQUIRE);
+
+	for (offset = first; offset < limit && n < nb; n++) {
+		offset += shm_record_at(ring, offset)->length;
+	}
+
+	if (n == 0) {
+		pthread_mutex_unlock(&c->lock);
+		pthread_mutex_unlock(&DATA(libtrace)->claim_lock);
+		return 0;
+	}
+
+	seg = (struct shm_segment_t *)malloc(sizeof(struct shm_segment_t));
+	if (!seg) {
+		pthread_mutex_unlock(&c->lock);
+		pthread_mutex_unlock(&DATA(libtrace)->claim_lock);
+		trace_set_err(libtrace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate memory in shm_claim_records()");
+		return 0;
+	}
+	seg->start = first;
+	seg->released = 0;
+	seg->next = NULL;
+
+	pthread_mutex_lock(&DATA(libtrace)->seg_lock);
+	if (DATA(libtrace)->seg_tail)
+		DATA(libtrace)->seg_tail->next = seg;
+	else
+		DATA(libtrace)->seg_head = seg;
+	DATA(libtrace)->seg_tail = seg;
+	__atomic_store_n(&c->read_offset, offset, __ATOMIC_RELEASE);
+	c->received += n;
+	pthread_mutex_unlock(&DATA(libtrace)->seg_lock);
+	pthread_mutex_unlock(&c->lock);
+
+	/* Must not hold seg_lock here, this may release the previous batch */
+	libtrace_create_new_bucket(DATA(libtrace)->bucket, seg);
+
+	if (packets) {
+		size_t i;
+		offset = first;
+		for (i = 0; i < n; i++) {
+			shm_record_t *rec = shm_record_at(ring, offset);
+			shm_deliver_record(libtrace, packets[i], rec);
+			offset += rec->length;
+		}
+	}
+	pthread_mutex_unlock(&DATA(libtrace)->claim_lock);
+
+	*start = first;
+	*end = offset;
+	return n;
+}
+
+/* Waits for the producer to publish more records. Returns 1 once there is
+ * something to read, 0 if the producer has finished, or the code to pass on
+ * if the trace is halted or there is a message waiting. */
+static int shm_wait(libtrace_t *libtrace, libtrace_message_queue_t *queue) {
+	struct shm_ring_t *ring = DATA(libtrace)->ring;
+	struct shm_consumer_t *c = DATA(libtrace)->consumer;
+	struct timespec deadline;
+	int ret;
+
+	for (;;) {
+		if (__atomic_load_n(&ring->write_offset, __ATOMIC_SEQ_CST) >
+				__atomic_load_n(&c->read_offset,
+				__ATOMIC_ACQUIRE))
+			return 1;
+		if (__atomic_load_n(&ring->finished, __ATOMIC_ACQUIRE)) {
+			/* Catch anything published just before finishing */
+			if (__atomic_load_n(&ring->write_offset,
+					__ATOMIC_ACQUIRE) >
+					__atomic_load_n(&c->read_offset,
+					__ATOMIC_ACQUIRE))
+				return 1;
+			return 0;
+		}
+		if ((ret = is_halted(libtrace)) != -1)
+			return ret;
+		if (queue && libtrace_message_queue_count(queue) > 0)
+			return READ_MESSAGE;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += SHM_WAIT_NSEC;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		/* The producer only signals if it sees a waiter, so register
+		 * before checking for data one last time */
+		shm_lock(&ring->lock);
+		__atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->write_offset, __ATOMIC_SEQ_CST) ==
+				__atomic_load_n(&c->read_offset,
+				__ATOMIC_ACQUIRE) &&
+				!__atomic_load_n(&ring->finished,
+				__ATOMIC_ACQUIRE)) {
+			if (pthread_cond_timedwait(&ring->cond, &ring->lock,
+					&deadline) == EOWNERDEAD)
+				pthread_mutex_consistent(&ring->lock);
+		}
+		__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&ring->lock);
+	}
+}
+
+/* Delivers the next record from the batch claimed by the single threaded
+ * read path, claiming a new batch if required. Returns 0 if nothing is
+ * available right now. */
+static int shm_next_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	shm_record_t *rec;
+
+	if (DATA(libtrace)->next == DATA(libtrace)->end) {
+		if (shm_claim_records(libtrace, SHM_READ_BATCH,
+				&DATA(libtrace)->next, &DATA(libtrace)->end,
+				NULL) == 0) {
+			return trace_is_err(libtrace) ? -1 : 0;
+		}
+	}
+
+	rec = shm_record_at(DATA(libtrace)->ring, DATA(libtrace)->next);
+	DATA(libtrace)->next += rec->length;
+	shm_deliver_record(libtrace, packet, rec);
+	return packet->error;
+}
+
+static int shm_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	int ret;
+
+	for (;;) {
+		ret = shm_next_packet(libtrace, packet);
+		if (ret != 0)
+			return ret;
+		ret = shm_wait(libtrace, NULL);
+		if (ret <= 0)
+			return ret;
+	}
+}
+
+static int shm_pread_packets(libtrace_t *libtrace, libtrace_thread_t *t,
+		libtrace_packet_t **packets, size_t nb_packets) {
+	uint64_t start, end;
+	size_t n;
+	int ret;
+
+	/* Each thread claims its own batch, the release tracking copes with
+	 * batches being finished out of order */
+	for (;;) {
+		n = shm_claim_records(libtrace, nb_packets, &start, &end,
+				packets);
+		if (n > 0)
+			return n;
+		if (trace_is_err(libtrace))
+			return -1;
+		ret = shm_wait(libtrace, &t->messages);
+		if (ret <= 0)
+			return ret;
+	}
+}
+
+static libtrace_eventobj_t shm_event(libtrace_t *libtrace,
+		libtrace_packet_t *packet) {
+	libtrace_eventobj_t event = {0,0,0.0,0};
+	int ret;
+
+	do {
+		ret = shm_next_packet(libtrace, packet);
+		if (ret < 0) {
+			event.type = TRACE_EVENT_TERMINATE;
+			break;
+		}
+		if (ret == 0) {
+			if (__atomic_load_n(&DATA(libtrace)->ring->finished,
+					__ATOMIC_ACQUIRE) &&
+					shm_wait(libtrace, NULL) == 0) {
+				event.type = TRACE_EVENT_TERMINATE;
+			} else {
+				event.type = TRACE_EVENT_SLEEP;
+				event.seconds = 0.0001;
+			}
+			break;
+		}
+
+		event.type = TRACE_EVENT_PACKET;
+		event.size = ret;
+		libtrace->accepted_packets ++;
+
+		if (libtrace->filter) {
+			if (!trace_apply_filter(libtrace->filter, packet)) {
+				trace_clear_cache(packet);
+				libtrace->filtered_packets ++;
+				continue;
+			}
+		}
+		break;
+	} while (1);
+
+	return event;
+}
+
+static int shm_prepare_packet(libtrace_t *libtrace UNUSED,
+		libtrace_packet_t *packet, void *buffer,
+		libtrace_rt_types_t rt_type, uint32_t flags) {
+
+	if (packet->buffer != buffer &&
+			packet->buf_control == TRACE_CTRL_PACKET) {
+		free(packet->buffer);
+	}
+
+	if ((flags & TRACE_PREP_OWN_BUFFER) == TRACE_PREP_OWN_BUFFER) {
+		packet->buf_control = TRACE_CTRL_PACKET;
+	} else
+		packet->buf_control = TRACE_CTRL_EXTERNAL;
+
+	packet->type = rt_type;
+	packet->buffer = buffer;
+	packet->header = buffer;
+	packet->payload = (char *)buffer + sizeof(shm_record_t);
+	return 0;
+}
+
+static libtrace_linktype_t shm_get_link_type(const libtrace_packet_t *packet) {
+	return (libtrace_linktype_t)((shm_record_t *)packet->header)->linktype;
+}
+
+static libtrace_direction_t shm_get_direction(const libtrace_packet_t *packet) {
+	return (libtrace_direction_t)((shm_record_t *)packet->header)->direction;
+}
+
+static struct timespec shm_get_timespec(const libtrace_packet_t *packet) {
+	shm_record_t *rec = (shm_record_t *)packet->header;
+	struct timespec ts;
+
+	ts.tv_sec = rec->ts_sec;
+	ts.tv_nsec = rec->ts_nsec;
+	return ts;
+}
+
+static int shm_get_capture_length(const libtrace_packet_t *packet) {
+	return ((shm_record_t *)packet->header)->caplen;
+}
+
+static int shm_get_wire_length(const libtrace_packet_t *packet) {
+	return ((shm_record_t *)packet->header)->wirelen;
+}
+
+static int shm_get_framing_length(const libtrace_packet_t *packet UNUSED) {
+	return sizeof(shm_record_t);
+}
+
+static void shm_get_statistics(libtrace_t *libtrace, libtrace_stat_t *stat) {
+	struct shm_consumer_t *c = DATA(libtrace)->consumer;
+
+	if (!c)
+		return;
+
+	stat->received_valid = 1;
+	stat->received = c->received;
+	stat->dropped_valid = 1;
+	stat->dropped = __atomic_load_n(&c->dropped, __ATOMIC_RELAXED) +
+		__atomic_load_n(&DATA(libtrace)->ring->dropped,
+				__ATOMIC_RELAXED) - c->dropped_base;
+}
+
+static int shm_init_output(libtrace_out_t *libtrace) {
+	const char *sizestr;
+	uint64_t size = SHM_DEFAULT_SIZE;
+	uint64_t ringsize;
+
+	if ((sizestr = strchr(libtrace->uridata, ':')) != NULL) {
+		size = strtoull(sizestr + 1, NULL, 10) * 1024 * 1024;
+		if (size == 0) {
+			trace_set_err_out(libtrace, TRACE_ERR_INIT_FAILED,
+				"Invalid shared memory size '%s'",
+				sizestr + 1);
+			return -1;
+		}
+	}
+
+	/* The data area must be a power of two, and at least a page */
+	ringsize = getpagesize();
+	while (ringsize < size)
+		ringsize <<= 1;
+
+	libtrace->format_data = malloc(sizeof(struct shm_format_data_out_t));
+	if (!libtrace->format_data) {
+		trace_set_err_out(libtrace, TRACE_ERR_INIT_FAILED, "Unable to "
+			"allocate memory for format data inside "
+			"shm_init_output()");
+		return -1;
+	}
+
+	DATAOUT(libtrace)->name = shm_object_name(libtrace->uridata);
+	if (!DATAOUT(libtrace)->name) {
+		trace_set_err_out(libtrace, TRACE_ERR_INIT_FAILED,
+			"Invalid shared memory name '%s'", libtrace->uridata);
+		free(libtrace->format_data);
+		libtrace->format_data = NULL;
+		return -1;
+	}
+	DATAOUT(libtrace)->fd = -1;
+	DATAOUT(libtrace)->ring = NULL;
+	DATAOUT(libtrace)->size = ringsize;
+	return 0;
+}
+
+static int shm_start_output(libtrace_out_t *libtrace) {
+	struct shm_ring_t *ring;
+	uint64_t hdrlen;
+	int i;
+
+	/* Throw away any ring left behind by a previous producer, anyone
+	 * still attached to it keeps their mapping */
+	shm_unlink(DATAOUT(libtrace)->name);
+	DATAOUT(libtrace)->fd = shm_open(DATAOUT(libtrace)->name,
+			O_RDWR | O_CREAT | O_EXCL, 0660);
+	if (DATAOUT(libtrace)->fd < 0) {
+		trace_set_err_out(libtrace, errno,
+			"Unable to create shared memory %s",
+			DATAOUT(libtrace)->name);
+		return -1;
+	}
+
+	hdrlen = getpagesize();
+	while (hdrlen < sizeof(struct shm_ring_t))
+		hdrlen += getpagesize();
+
+	if (ftruncate(DATAOUT(libtrace)->fd,
+			hdrlen + DATAOUT(libtrace)->size) < 0) {
+		trace_set_err_out(libtrace, errno,
+			"Unable to size shared memory %s",
+			DATAOUT(libtrace)->name);
+		return -1;
+	}
+
+	ring = shm_map_ring(DATAOUT(libtrace)->fd, hdrlen,
+			DATAOUT(libtrace)->size);
+	if (!ring) {
+		trace_set_err_out(libtrace, errno,
+			"Unable to map shared memory %s",
+			DATAOUT(libtrace)->name);
+		return -1;
+	}
+
+	/* ftruncate() has zeroed everything else */
+	ring->version = SHM_VERSION;
+	ring->size = DATAOUT(libtrace)->size;
+	ring->hdrlen = hdrlen;
+	ring->next_seq = 1;
+	shm_init_lock(&ring->lock);
+	{
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_cond_init(&ring->cond, &attr);
+		pthread_condattr_destroy(&attr);
+	}
+	for (i = 0; i < SHM_MAX_CONSUMERS; i++)
+		shm_init_lock(&ring->consumers[i].lock);
+
+	/* Consumers check the magic before attaching */
+	__atomic_store_n(&ring->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	DATAOUT(libtrace)->ring = ring;
+	return 0;
+}
+
+/* Returns true if consumer c has released the space that a record of
+ * reclen bytes written at write would overwrite */
+static bool shm_has_room(struct shm_ring_t *ring, struct shm_consumer_t *c,
+		uint64_t write, uint32_t reclen) {
+	return write + reclen - __atomic_load_n(&c->release_offset,
+			__ATOMIC_ACQUIRE) <= ring->size;
+}
+
+/* Makes sure no consumer still needs the part of the ring that the next
+ * record will be written into. Consumers that have fallen behind skip
+ * forward to the current write position, with the records they missed
+ * counted as drops. Returns 0 if a consumer is still holding the space. */
+static int shm_make_room(struct shm_ring_t *ring, uint64_t write,
+		uint32_t reclen) {
+	struct shm_consumer_t *c;
+	uint64_t read;
+	int i;
+
+	for (i = 0; i < SHM_MAX_CONSUMERS; i++) {
+		c = &ring->consumers[i];
+		if (!__atomic_load_n(&c->active, __ATOMIC_ACQUIRE))
+			continue;
+		if (shm_has_room(ring, c, write, reclen))
+			continue;
+
+		shm_lock(&c->lock);
+		read = c->read_offset;
+		if (c->active && read < write) {
+			c->dropped += ring->next_seq -
+					shm_record_at(ring, read)->seq;
+			__atomic_store_n(&c->read_offset, write,
+					__ATOMIC_RELEASE);
+			/* Nothing was in use, so all of it can be reused */
+			if (__atomic_load_n(&c->release_offset,
+					__ATOMIC_ACQUIRE) == read)
+				__atomic_store_n(&c->release_offset, write,
+						__ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&c->lock);
+
+		if (shm_has_room(ring, c, write, reclen))
+			continue;
+
+		if (kill(c->pid, 0) == -1 && errno == ESRCH) {
+			__atomic_store_n(&c->active, 0, __ATOMIC_RELEASE);
+			continue;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+static int shm_write_packet(libtrace_out_t *libtrace,
+		libtrace_packet_t *packet) {
+	struct shm_ring_t *ring = DATAOUT(libtrace)->ring;
+	libtrace_linktype_t linktype;
+	shm_record_t *rec;
+	struct timespec ts;
+	uint32_t remaining, reclen;
+	uint64_t write;
+	void *ptr;
+
+	if (!shm_can_write(packet))
+		return 0;
+
+	ptr = trace_get_packet_buffer(packet, &linktype, &remaining);
+	if (!ptr)
+		return 0;
+
+	reclen = (sizeof(shm_record_t) + remaining + SHM_RECORD_ALIGN - 1) &
+			~(SHM_RECORD_ALIGN - 1);
+	if (reclen > ring->size) {
+		trace_set_err_out(libtrace, TRACE_ERR_BAD_PACKET,
+			"Packet is larger than the shared memory ring");
+		return -1;
+	}
+
+	write = ring->write_offset;
+	if (!shm_make_room(ring, write, reclen)) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	ts = trace_get_timespec(packet);
+	rec = shm_record_at(ring, write);
+	rec->length = reclen;
+	rec->caplen = remaining;
+	rec->wirelen = trace_get_wire_length(packet);
+	rec->linktype = linktype;
+	rec->direction = trace_get_direction(packet);
+	rec->seq = ring->next_seq++;
+	rec->ts_sec = ts.tv_sec;
+	rec->ts_nsec = ts.tv_nsec;
+	rec->padding = 0;
+	memcpy((char *)rec + sizeof(shm_record_t), ptr, remaining);
+
+	__atomic_store_n(&ring->write_offset, write + reclen, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST) > 0) {
+		shm_lock(&ring->lock);
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	return reclen;
+}
+
+static int shm_fin_output(libtrace_out_t *libtrace) {
+	struct shm_ring_t *ring = DATAOUT(libtrace)->ring;
+
+	if (ring) {
+		/* Let the consumers drain what is left and then stop */
+		shm_lock(&ring->lock);
+		__atomic_store_n(&ring->finished, 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+
+		munmap(ring, shm_map_length(ring->hdrlen, ring->size));
+	}
+	if (DATAOUT(libtrace)->fd != -1) {
+		close(DATAOUT(libtrace)->fd);
+		shm_unlink(DATAOUT(libtrace)->name);
+	}
+
+	free(DATAOUT(libtrace)->name);
+	free(libtrace->format_data);
+	return 0;
+}
+
+static void shm_help(void) {
+	printf("shm format module: $Revision$\n");
+	printf("Supported input URIs:\n");
+	printf("\tshm:name\n");
+	printf("\n");
+	printf("\te.g.: shm:monitor\n");
+	printf("\n");
+	printf("Supported output URIs:\n");
+	printf("\tshm:name\n");
+	printf("\tshm:name:size (ring size in MB, default %d)\n",
+			SHM_DEFAULT_SIZE / (1024 * 1024));
+	printf("\n");
+	printf("\te.g.: shm:monitor:256\n");
+	printf("\n");
+	printf("Packets written to shm:name can be read by any number of "
+			"local consumers\n");
+	printf("\n");
+}
+
+static struct libtrace_format_t shm = {
+	"shm",
+	"$Id$",
+	TRACE_FORMAT_SHM,
+	NULL,				/* probe filename */
+	NULL,				/* probe magic */
+	shm_init_input,			/* init_input */
+	NULL,				/* config_input */
+	shm_start_input,		/* start_input */
+	shm_pause_input,		/* pause */
+	shm_init_output,		/* init_output */
+	NULL,				/* config_output */
+	shm_start_output,		/* start_output */
+	shm_fin_input,			/* fin_input */
+	shm_fin_output,			/* fin_output */
+	shm_read_packet,		/* read_packet */
+	shm_prepare_packet,		/* prepare_packet */
+	NULL,				/* fin_packet */
+	NULL,				/* can_hold_packet */
+	shm_write_packet,		/* write_packet */
+	NULL,				/* flush_output */
+	shm_get_link_type,		/* get_link_type */
+	shm_get_direction,		/* get_direction */
+	NULL,				/* set_direction */
+	NULL,				/* get_erf_timestamp */
+	NULL,				/* get_timeval */
+	shm_get_timespec,		/* get_timespec */
+	NULL,				/* get_seconds */
+	NULL,				/* get_meta_section */
+	NULL,				/* seek_erf */
+	NULL,				/* seek_timeval */
+	NULL,				/* seek_seconds */
+	shm_get_capture_length,		/* get_capture_length */
+	shm_get_wire_length,		/* get_wire_length */
+	shm_get_framing_length,		/* get_framing_length */
+	NULL,				/* set_capture_length */
+	NULL,				/* get_received_packets */
+	NULL,				/* get_filtered_packets */
+	NULL,				/* get_dropped_packets */
+	shm_get_statistics,		/* get_statistics */
+	NULL,				/* get_fd */
+	shm_event,			/* trace_event */
+	shm_help,			/* help */
+	NULL,				/* next pointer */
+	{true, -1},			/* Live, no thread limit */
+	shm_start_input,		/* pstart_input */
+	shm_pread_packets,		/* pread_packets */
+	shm_pause_input,		/* ppause */
+	shm_fin_input,			/* p_fin */
+	NULL,				/* register thread */
+	NULL,				/* unregister thread */
+	NULL				/* get thread stats */
+};
+
+void shm_constructor(void) {
+	register_format(&shm);
+}
@@ -0,0 +1,473 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+/**
+ * A symmetric hash of a packet's flow. The two endpoints of the flow are
+ * put into a fixed order before hashing, so both directions of a flow get
+ * the same hash without the collisions that XORing the endpoints together
+ * would cause. The hash is CRC32C, using the SSE4.2 crc32 instruction when
+ * the CPU has it.
+ */
+#include "hash_symmetric.h"
+#include "libtrace_int.h"
+#include "protocols.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+/* CRC32C (Castagnoli), bit reversed */
+#define CRC32C_POLY 0x82F63B78
+
+/* The most VLAN tags included in the hash */
+#define MAX_HASH_VLANS 2
+
+/* The most tunnels removed to find the inner header */
+#define MAX_TUNNEL_DEPTH 4
+
+/* GRE protocol type for an encapsulated Ethernet frame */
+#define ETHERTYPE_TEB 0x6558
+
+/* The UDP port GTP-U is sent to, 3GPP TS 29.281 */
+#define GTPU_PORT 2152
+#define GTPU_FLAG_EXT 0x04
+#define GTPU_FLAGS_OPTIONAL 0x07
+#define GTPU_MSG_GPDU 0xff
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CRC32_INSN 1
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(const uint8_t *data, size_t n, uint32_t crc) {
+	uint64_t crc64 = crc;
+
+	while (n >= 8) {
+		uint64_t v;
+		memcpy(&v, data, sizeof(v));
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		data += 8;
+		n -= 8;
+	}
+	crc = (uint32_t) crc64;
+	while (n > 0) {
+		crc = __builtin_ia32_crc32qi(crc, *data);
+		++data;
+		--n;
+	}
+	return crc;
+}
+#endif
+
+void symmetric_init_config(symmetric_conf_t *conf, enum hasher_fields fields)
+{
+	unsigned int seed = time(NULL);
+	uint32_t i, j, crc;
+
+	conf->fields = fields;
+	conf->seed = (uint32_t) rand_r(&seed);
+	for (i = 0; i < 256; ++i) {
+		crc = i;
+		for (j = 0; j < 8; ++j)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		conf->crc_table[i] = crc;
+	}
+#ifdef HAVE_CRC32_INSN
+	__builtin_cpu_init();
+	conf->hw_crc = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#else
+	conf->hw_crc = 0;
+#endif
+}
+
+/**
+ * Continues a CRC32C over n bytes of data. No inversion is applied at
+ * either end.
+ */
+uint32_t symmetric_crc32c(const symmetric_conf_t *conf, const uint8_t *data, size_t n, uint32_t crc)
+{
+#ifdef HAVE_CRC32_INSN
+	if (conf->hw_crc)
+		return crc32c_hw(data, n, crc);
+#endif
+	while (n > 0) {
+		crc = conf->crc_table[(crc ^ *data) & 0xff] ^ (crc >> 8);
+		++data;
+		--n;
+	}
+	return crc;
+}
+
+/* Appends the IDs of the outer VLAN tags of an Ethernet packet to key */
+static size_t add_vlans(const libtrace_packet_t *pkt, uint8_t *key) {
+	libtrace_linktype_t linktype;
+	uint32_t remaining;
+	uint16_t type, vid;
+	size_t len = 0;
+	void *l2 = trace_get_layer2(pkt, &linktype, &remaining);
+
+	if (!l2 || linktype != TRACE_TYPE_ETH ||
+			remaining < sizeof(libtrace_ether_t))
+		return 0;
+
+	type = ntohs(((libtrace_ether_t *)l2)->ether_type);
+	l2 = (char *)l2 + sizeof(libtrace_ether_t);
+	remaining -= sizeof(libtrace_ether_t);
+
+	while ((type == TRACE_ETHERTYPE_8021Q || type == TRACE_ETHERTYPE_8021QS)
+			&& len < MAX_HASH_VLANS * sizeof(vid)
+			&& remaining >= sizeof(libtrace_8021q_t)) {
+		libtrace_8021q_t *vlan = (libtrace_8021q_t *)l2;
+
+		vid = LT_VLAN_VID(vlan);
+		memcpy(key + len, &vid, sizeof(vid));
+		len += sizeof(vid);
+		l2 = trace_get_payload_from_vlan(l2, &type, &remaining);
+	}
+	return len;
+}
+
+/* Returns the payload of an IPv4 or IPv6 header */
+static void *get_payload_from_l3(void *l3, uint16_t ethertype, uint8_t *proto,
+		uint32_t *remaining) {
+	switch (ethertype) {
+		case TRACE_ETHERTYPE_IP:
+			return trace_get_payload_from_ip((libtrace_ip_t *)l3,
+					proto, remaining);
+		case TRACE_ETHERTYPE_IPV6:
+			return trace_get_payload_from_ip6((libtrace_ip6_t *)l3,
+					proto, remaining);
+	}
+	return NULL;
+}
+
+/* Skips the VLAN tags and MPLS labels in front of a layer 3 header, the same
+ * way trace_get_layer3() does */
+static void *skip_l2_shims(void *ptr, uint16_t *type, uint32_t *remaining) {
+	while (ptr && *remaining > 0) {
+		switch (*type) {
+			case TRACE_ETHERTYPE_8021Q:
+			case TRACE_ETHERTYPE_8021QS:
+				ptr = trace_get_payload_from_vlan(ptr, type,
+						remaining);
+				break;
+			case TRACE_ETHERTYPE_MPLS:
+				ptr = trace_get_payload_from_mpls(ptr, type,
+						remaining);
+				/* A pseudowire carrying Ethernet */
+				if (ptr && *type == 0)
+					ptr = trace_get_payload_from_ethernet(
+							ptr, type, remaining);
+				break;
+			default:
+				return ptr;
+		}
+	}
+	return NULL;
+}
+
+/* Returns the packet carried by a GTPv1-U G-PDU, which has no ethertype so
+ * one is guessed from the IP version */
+static void *get_payload_from_gtpu(uint8_t *gtp, uint16_t *type,
+		uint32_t *remaining) {
+	uint32_t size = 8;
+	uint8_t flags;
+
+	if (*remaining < size)
+		return NULL;
+	flags = gtp[0];
+	/* Version 1 GTP (not GTP'), carrying a user packet */
+	if ((flags & 0xf0) != 0x30 || gtp[1] != GTPU_MSG_GPDU)
+		return NULL;
+
+	/* The sequence number, N-PDU number and next extension header type
+	 * are all present if any of them are */
+	if (flags & GTPU_FLAGS_OPTIONAL) {
+		uint8_t next;
+
+		size = 12;
+		if (*remaining < size)
+			return NULL;
+		next = gtp[size - 1];
+		while ((flags & GTPU_FLAG_EXT) && next != 0) {
+			/* Extension lengths are in units of 4 bytes, and the
+			 * last byte is the type of the next extension */
+			uint32_t extlen;
+
+			if (*remaining <= size)
+				return NULL;
+			extlen = gtp[size] * 4;
+			if (extlen == 0 || *remaining < size + extlen)
+				return NULL;
+			next = gtp[size + extlen - 1];
+			size += extlen;
+		}
+	}
+
+	if (*remaining <= size)
+		return NULL;
+	switch (gtp[size] >> 4) {
+		case 4:
+			*type = TRACE_ETHERTYPE_IP;
+			break;
+		case 6:
+			*type = TRACE_ETHERTYPE_IPV6;
+			break;
+		default:
+			return NULL;
+	}
+	*remaining -= size;
+	return gtp + size;
+}
+
+/* Returns the IP header carried by a tunnel, or NULL if l3 is not the outer
+ * header of a tunnel we know how to remove */
+static void *get_tunnel_payload(void *l3, uint16_t *ethertype,
+		uint32_t *remaining) {
+	uint32_t rem = *remaining;
+	uint16_t type = 0;
+	uint8_t proto = 0;
+	void *inner = NULL;
+	void *payload = get_payload_from_l3(l3, *ethertype, &proto, &rem);
+
+	if (!payload || rem == 0)
+		return NULL;
+
+	switch (proto) {
+		case TRACE_IPPROTO_IPIP:
+			type = TRACE_ETHERTYPE_IP;
+			inner = payload;
+			break;
+		case TRACE_IPPROTO_IPV6:
+			type = TRACE_ETHERTYPE_IPV6;
+			inner = payload;
+			break;
+		case TRACE_IPPROTO_GRE:
+			if (rem < 4)
+				return NULL;
+			type = ntohs(((libtrace_gre_t *)payload)->ethertype);
+			inner = trace_get_payload_from_gre(
+					(libtrace_gre_t *)payload, &rem);
+			if (inner && type == ETHERTYPE_TEB)
+				inner = trace_get_payload_from_ethernet(inner,
+						&type, &rem);
+			inner = skip_l2_shims(inner, &type, &rem);
+			break;
+		case TRACE_IPPROTO_UDP: {
+			libtrace_udp_t *udp = (libtrace_udp_t *)payload;
+			libtrace_vxlan_t *vxlan;
+
+			if (rem < sizeof(libtrace_udp_t))
+				return NULL;
+			vxlan = trace_get_vxlan_from_udp(udp, &rem);
+			if (vxlan) {
+				inner = trace_get_payload_from_vxlan(vxlan,
+						&rem);
+				if (inner)
+					inner = trace_get_payload_from_ethernet(
+							inner, &type, &rem);
+				inner = skip_l2_shims(inner, &type, &rem);
+			} else if (udp->dest == htons(GTPU_PORT)) {
+				inner = trace_get_payload_from_udp(udp, &rem);
+				if (inner)
+					inner = get_payload_from_gtpu(
+							(uint8_t *)inner,
+							&type, &rem);
+			}
+			break;
+		}
+	}
+
+	if (!inner || rem == 0)
+		return NULL;
+	if (!(type == TRACE_ETHERTYPE_IP && rem >= sizeof(libtrace_ip_t)) &&
+			!(type == TRACE_ETHERTYPE_IPV6 &&
+			rem >= sizeof(libtrace_ip6_t)))
+		return NULL;
+
+	*ethertype = type;
+	*remaining = rem;
+	return inner;
+}
+
+/* Finds the innermost IP header, starting from the outer layer 3 header */
+static void *decapsulate(void *l3, uint16_t *ethertype, uint32_t *remaining) {
+	int depth;
+
+	for (depth = 0; depth < MAX_TUNNEL_DEPTH; depth++) {
+		void *inner = get_tunnel_payload(l3, ethertype, remaining);
+
+		if (!inner)
+			break;
+		l3 = inner;
+	}
+	return l3;
+}
+
+void *hash_get_inner_layer3(const libtrace_packet_t *packet,
+		uint16_t *ethertype, uint32_t *remaining) {
+	void *layer3 = trace_get_layer3(packet, ethertype, remaining);
+
+	if (!layer3)
+		return NULL;
+	return decapsulate(layer3, ethertype, remaining);
+}
+
+/* The parts of a packet that identify its flow, with the ports in host
+ * byte order */
+struct flow_endpoints {
+	const uint8_t *src;
+	const uint8_t *dst;
+	size_t addrlen;
+	uint16_t ports[2];
+	uint8_t proto;
+};
+
+static inline bool has_ports(uint8_t proto) {
+	return proto == TRACE_IPPROTO_TCP || proto == TRACE_IPPROTO_UDP ||
+			proto == TRACE_IPPROTO_SCTP;
+}
+
+/* Reads the endpoints from the packet's cached header summary */
+static bool get_endpoints(const libtrace_packet_t *pkt,
+		enum hasher_fields fields, struct flow_endpoints *ep) {
+	const libtrace_flow_tuple_t *tuple = trace_get_flow_tuple(pkt);
+
+	if (!tuple || tuple->ip_version == 0)
+		return false;
+
+	ep->src = (const uint8_t *)&tuple->src_ip;
+	ep->dst = (const uint8_t *)&tuple->dst_ip;
+	ep->addrlen = tuple->ip_version == 4 ? 4 : 16;
+	/* Only the first fragment of a datagram has ports, so fragments are
+	 * hashed on their addresses alone to keep them together */
+	if (fields != HASHER_FIELDS_IP &&
+			(tuple->flags & LIBTRACE_TUPLE_PORTS) &&
+			!(tuple->flags & LIBTRACE_TUPLE_MORE_FRAGMENTS) &&
+			tuple->frag_offset == 0 && has_ports(tuple->proto)) {
+		ep->proto = tuple->proto;
+		ep->ports[0] = tuple->src_port;
+		ep->ports[1] = tuple->dst_port;
+	}
+	return true;
+}
+
+/* Reads the endpoints from the innermost IP header */
+static bool get_inner_endpoints(const libtrace_packet_t *pkt,
+		struct flow_endpoints *ep) {
+	uint16_t ethertype;
+	uint32_t remaining;
+	uint8_t proto = 0;
+	struct ports_t *ports;
+	void *layer3 = hash_get_inner_layer3(pkt, &ethertype, &remaining);
+
+	if (!layer3)
+		return false;
+
+	switch (ethertype) {
+		case TRACE_ETHERTYPE_IP:
+			if (remaining < sizeof(libtrace_ip_t))
+				return false;
+			ep->src = (uint8_t *)&((libtrace_ip_t *)layer3)->ip_src;
+			ep->dst = (uint8_t *)&((libtrace_ip_t *)layer3)->ip_dst;
+			ep->addrlen = 4;
+			if (((libtrace_ip_t *)layer3)->ip_off & htons(0x3fff))
+				return true;
+			break;
+		case TRACE_ETHERTYPE_IPV6:
+			if (remaining < sizeof(libtrace_ip6_t))
+				return false;
+			ep->src = (uint8_t *)&((libtrace_ip6_t *)layer3)->ip_src;
+			ep->dst = (uint8_t *)&((libtrace_ip6_t *)layer3)->ip_dst;
+			ep->addrlen = 16;
+			break;
+		default:
+			return false;
+	}
+
+	ports = (struct ports_t *)get_payload_from_l3(layer3, ethertype,
+			&proto, &remaining);
+	if (ports && remaining >= sizeof(*ports) && has_ports(proto)) {
+		ep->proto = proto;
+		ep->ports[0] = ntohs(ports->src);
+		ep->ports[1] = ntohs(ports->dst);
+	}
+	return true;
+}
+
+uint64_t symmetric_hash_packet(const libtrace_packet_t *pkt, const symmetric_conf_t *conf) {
+	/* Both addresses, both ports, the protocol and the VLAN IDs */
+	uint8_t key[16 * 2 + 2 * 2 + 1 + MAX_HASH_VLANS * 2];
+	struct flow_endpoints ep = { NULL, NULL, 0, {0, 0}, 0 };
+	const uint8_t *src, *dst;
+	size_t addrlen, len;
+	uint32_t hash;
+
+	if (conf->fields == HASHER_FIELDS_INNER) {
+		if (!get_inner_endpoints(pkt, &ep))
+			return 0;
+	} else if (!get_endpoints(pkt, conf->fields, &ep)) {
+		return 0;
+	}
+	src = ep.src;
+	dst = ep.dst;
+	addrlen = ep.addrlen;
+
+	/* Put the endpoint with the lower address (or port) first */
+	{
+		int cmp = memcmp(src, dst, addrlen);
+		if (cmp > 0 || (cmp == 0 && ep.ports[0] > ep.ports[1])) {
+			const uint8_t *tmp = src;
+			uint16_t port = ep.ports[0];
+			src = dst;
+			dst = tmp;
+			ep.ports[0] = ep.ports[1];
+			ep.ports[1] = port;
+		}
+	}
+
+	memcpy(key, src, addrlen);
+	memcpy(key + addrlen, dst, addrlen);
+	len = addrlen * 2;
+	if (conf->fields != HASHER_FIELDS_IP) {
+		memcpy(key + len, ep.ports, sizeof(ep.ports));
+		len += sizeof(ep.ports);
+		key[len++] = ep.proto;
+	}
+	if (conf->fields == HASHER_FIELDS_VLAN)
+		len += add_vlans(pkt, key + len);
+
+	hash = symmetric_crc32c(conf, key, len, conf->seed);
+
+	/* CRC32C mixes the low bits poorly, which are the ones used to pick
+	 * a thread, so finish with the murmur3 finaliser */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
@@ -0,0 +1,54 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/**
+ * A fast symmetric flow hash, for spreading packets across threads in
+ * software when matching the NIC's RSS hash doesn't matter
+ */
+#include "config.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <libtrace.h>
+#include <libtrace_parallel.h>
+
+#ifndef HASH_SYMMETRIC_H
+#define HASH_SYMMETRIC_H
+
+typedef struct symmetric_conf {
+	/* The packet fields that are hashed */
+	enum hasher_fields fields;
+	/* Set if the CPU has the SSE4.2 crc32 instruction */
+	unsigned int hw_crc : 1;
+	uint32_t seed;
+	/* Used to compute CRC32C a byte at a time without SSE4.2 */
+	uint32_t crc_table[256];
+} symmetric_conf_t;
+
+DLLEXPORT void symmetric_init_config(symmetric_conf_t *conf, enum hasher_fields fields);
+DLLEXPORT uint32_t symmetric_crc32c(const symmetric_conf_t *conf, const uint8_t *data, size_t n, uint32_t crc);
+DLLEXPORT uint64_t symmetric_hash_packet(const libtrace_packet_t *pkt, const symmetric_conf_t *conf);
+
+#endif
@@ -33,10 +33,12 @@
  * 
  */
 #include "hash_toeplitz.h"
+#include "libtrace_int.h"
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 #include <stdio.h>
+#include <arpa/inet.h>
  
 static inline uint8_t get_bit(uint8_t byte, size_t num) {
 	return byte & (0x80>>num);
@@ -65,6 +67,41 @@ void toeplitz_hash_expand_key(toeplitz_conf_t *conf) {
 	} while (i < 320);
 }
 
+struct toeplitz_table {
+	toeplitz_conf_t conf;
+	uint32_t byte_table[40][256];
+};
+
+/**
+ * Builds the byte table for an expanded key, each entry being the XOR of
+ * the key_cache entries for the bits set in that byte value. The table can
+ * be freed with toeplitz_destroy_table() or free().
+ */
+toeplitz_table_t *toeplitz_create_table(const toeplitz_conf_t *conf) {
+	toeplitz_table_t *tt = malloc(sizeof(toeplitz_table_t));
+	size_t i, j;
+	unsigned int value;
+
+	if (!tt)
+		return NULL;
+	memcpy(&tt->conf, conf, sizeof(toeplitz_conf_t));
+	for (i = 0; i < 40; ++i) {
+		for (value = 0; value < 256; ++value) {
+			uint32_t res = 0;
+			for (j = 0; j < 8; ++j) {
+				if (get_bit(value, j))
+					res ^= conf->key_cache[i * 8 + j];
+			}
+			tt->byte_table[i][value] = res;
+		}
+	}
+	return tt;
+}
+
+void toeplitz_destroy_table(toeplitz_table_t *tt) {
+	free(tt);
+}
+
 
 /**
  * Creates a random unidirectional RSS key - a ip or ip+port combination in
@@ -136,7 +173,8 @@ void toeplitz_init_config(toeplitz_conf_t *conf, bool bidirectional)
 }
 
 /**
- * n is bits
+ * Hashes n bytes of data, which start offset bytes into the hash input.
+ * offset + n must not be more than 40.
  */
 uint32_t toeplitz_hash(const toeplitz_conf_t *tc, const uint8_t *data, size_t offset, size_t n, uint32_t result)
 {
@@ -152,18 +190,39 @@ uint32_t toeplitz_hash(const toeplitz_conf_t *tc, const uint8_t *data, size_t of
 	return result;
 }
 
+/**
+ * The same as toeplitz_hash(), but one table lookup per byte
+ */
+uint32_t toeplitz_table_hash(const toeplitz_table_t *tt, const uint8_t *data, size_t offset, size_t n, uint32_t result)
+{
+	size_t byte;
+	const uint32_t (*table)[256] = tt->byte_table + offset;
+	for (byte = 0; byte < n; ++byte) {
+		result ^= table[byte][data[byte]];
+	}
+	return result;
+}
+
+/* Hashes with the table if there is one */
+static inline uint32_t hash_bytes(const toeplitz_conf_t *cnf,
+		const toeplitz_table_t *tt, const uint8_t *data, size_t offset,
+		size_t n, uint32_t result) {
+	if (tt)
+		return toeplitz_table_hash(tt, data, offset, n, result);
+	return toeplitz_hash(cnf, data, offset, n, result);
+}
+
 uint32_t toeplitz_first_hash(const toeplitz_conf_t *tc, const uint8_t *data, size_t n)
 {
 	return toeplitz_hash(tc, data, 0, n, 0);
 }
 
-uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf_t *cnf) {
-	uint8_t proto;
-	uint16_t eth_type;
-	uint32_t remaining;
+/* Hashes the addresses in an IP header and, if transport is set, the ports
+ * that follow it */
+static uint32_t toeplitz_hash_headers(const toeplitz_conf_t *cnf,
+		const toeplitz_table_t *tt, void *layer3, uint16_t eth_type,
+		uint32_t remaining, void *transport, uint8_t proto, uint32_t trans_remaining) {
 	uint32_t res = 0; // shutup warning, logic was to complex for gcc to follow
-	void *layer3 = trace_get_layer3(pkt, &eth_type, &remaining);
-	void *transport = NULL;
 	size_t offset = 0;
 	bool accept_tcp = false, accept_udp = false;
 
@@ -181,8 +240,13 @@ uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf
 						&& remaining >= sizeof(libtrace_ip_t)) {	
 					libtrace_ip_t * ip = (libtrace_ip_t *)layer3;
 					// Order here is src dst as required by RSS
-					res = toeplitz_first_hash(cnf, (uint8_t *)&ip->ip_src, 8);
+					res = hash_bytes(cnf, tt, (uint8_t *)&ip->ip_src, 0, 8, 0);
 					offset = 8;
+					// Only the first fragment has ports, so
+					// hash every fragment on the addresses
+					// alone to keep them together
+					if (ip->ip_off & htons(0x3fff))
+						break;
 					accept_tcp = cnf->hash_tcp_ipv4;
 					accept_udp = cnf->x_hash_udp_ipv4;
 				}
@@ -193,7 +257,7 @@ uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf
 						&& remaining >= sizeof(libtrace_ip6_t)) {
 					libtrace_ip6_t * ip6 = (libtrace_ip6_t *)layer3;
 					// Order here is src dst as required by RSS
-					res = toeplitz_first_hash(cnf, (uint8_t *)&ip6->ip_src, 32);
+					res = hash_bytes(cnf, tt, (uint8_t *)&ip6->ip_src, 0, 32, 0);
 					offset = 32;
 					accept_tcp = cnf->hash_tcp_ipv6;
 					accept_udp = cnf->x_hash_udp_ipv6;
@@ -204,19 +268,17 @@ uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf
 		}
 	}
 
-	transport = trace_get_transport(pkt, &proto, &remaining);
-
 	if (transport) {
 		switch(proto) {
 			// Hash src & dst port
 			case TRACE_IPPROTO_UDP:
-				if (accept_udp && remaining >= 4) {
-					res = toeplitz_hash(cnf, (uint8_t *)transport, offset, 4, res);
+				if (accept_udp && trans_remaining >= 4) {
+					res = hash_bytes(cnf, tt, (uint8_t *)transport, offset, 4, res);
 				}
 				break;
 			case TRACE_IPPROTO_TCP:
-				if (accept_tcp && remaining >= 4) {
-					res = toeplitz_hash(cnf, (uint8_t *)transport, offset, 4, res);
+				if (accept_tcp && trans_remaining >= 4) {
+					res = hash_bytes(cnf, tt, (uint8_t *)transport, offset, 4, res);
 				}
 				break;
 		}
@@ -224,3 +286,79 @@ uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf
 
 	return res;
 }
+
+/* Hashes the outermost IP header and the ports that follow it */
+static inline uint64_t hash_outer(const libtrace_packet_t *pkt,
+		const toeplitz_conf_t *cnf, const toeplitz_table_t *tt) {
+	uint8_t proto = 0;
+	uint16_t eth_type = 0;
+	uint32_t remaining = 0, trans_remaining = 0;
+	void *layer3 = trace_get_layer3(pkt, &eth_type, &remaining);
+	void *transport = trace_get_transport(pkt, &proto, &trans_remaining);
+
+	return toeplitz_hash_headers(cnf, tt, layer3, eth_type, remaining,
+			transport, proto, trans_remaining);
+}
+
+/* Hashes the innermost IP header and its ports, so that tunnelled flows
+ * are spread by their own addresses and ports rather than by the tunnel
+ * endpoints. See hash_get_inner_layer3() for the encapsulations that are
+ * removed. */
+static inline uint64_t hash_inner(const libtrace_packet_t *pkt,
+		const toeplitz_conf_t *cnf, const toeplitz_table_t *tt) {
+	uint8_t proto = 0;
+	uint16_t eth_type = 0;
+	uint32_t remaining = 0, trans_remaining = 0;
+	void *layer3 = hash_get_inner_layer3(pkt, &eth_type, &remaining);
+	void *transport = NULL;
+
+	if (!layer3)
+		return 0;
+
+	trans_remaining = remaining;
+	if (eth_type == TRACE_ETHERTYPE_IP)
+		transport = trace_get_payload_from_ip(layer3, &proto,
+				&trans_remaining);
+	else if (eth_type == TRACE_ETHERTYPE_IPV6)
+		transport = trace_get_payload_from_ip6(layer3, &proto,
+				&trans_remaining);
+
+	return toeplitz_hash_headers(cnf, tt, layer3, eth_type, remaining,
+			transport, proto, trans_remaining);
+}
+
+uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf_t *cnf) {
+	return hash_outer(pkt, cnf, NULL);
+}
+
+uint64_t toeplitz_table_hash_packet(const libtrace_packet_t * pkt, const toeplitz_table_t *tt) {
+	return hash_outer(pkt, &tt->conf, tt);
+}
+
+uint64_t toeplitz_table_hash_inner_packet(const libtrace_packet_t * pkt, const toeplitz_table_t *tt) {
+	return hash_inner(pkt, &tt->conf, tt);
+}
+
+/**
+ * Hashes an array of packets with toeplitz_table_hash_packet(), or
+ * toeplitz_table_hash_inner_packet() if inner is set, storing the hash of
+ * pkts[i] in hashes[i]. The next packets are prefetched while each one is
+ * hashed.
+ */
+void toeplitz_hash_packets(libtrace_packet_t **pkts, size_t nb_packets,
+		const toeplitz_table_t *tt, bool inner, uint64_t *hashes) {
+	size_t i;
+
+	for (i = 0; i < nb_packets && i < 2; ++i)
+		__builtin_prefetch(trace_get_packet_buffer(pkts[i], NULL, NULL));
+
+	for (i = 0; i < nb_packets; ++i) {
+		if (i + 2 < nb_packets)
+			__builtin_prefetch(trace_get_packet_buffer(pkts[i + 2],
+					NULL, NULL));
+		if (inner)
+			hashes[i] = hash_inner(pkts[i], &tt->conf, tt);
+		else
+			hashes[i] = hash_outer(pkts[i], &tt->conf, tt);
+	}
+}
@@ -53,11 +53,25 @@ typedef struct toeplitz_conf {
 	uint32_t key_cache[320];
 } toeplitz_conf_t;
 
+/**
+ * A copy of a toeplitz_conf_t along with the hash of each possible value of
+ * each byte of the input, so that the hash can be found one byte at a time
+ * rather than one bit at a time. The table is 40KB, so it is kept out of
+ * toeplitz_conf_t. Created with toeplitz_create_table().
+ */
+typedef struct toeplitz_table toeplitz_table_t;
+
 DLLEXPORT void toeplitz_hash_expand_key(toeplitz_conf_t *conf);
 DLLEXPORT uint32_t toeplitz_hash(const toeplitz_conf_t *tc, const uint8_t *data, size_t offset, size_t n, uint32_t result);
 DLLEXPORT uint32_t toeplitz_first_hash(const toeplitz_conf_t *tc, const uint8_t *data, size_t n);
 DLLEXPORT void toeplitz_init_config(toeplitz_conf_t *conf, bool bidirectional);
 DLLEXPORT uint64_t toeplitz_hash_packet(const libtrace_packet_t * pkt, const toeplitz_conf_t *cnf);
+DLLEXPORT toeplitz_table_t *toeplitz_create_table(const toeplitz_conf_t *conf);
+DLLEXPORT void toeplitz_destroy_table(toeplitz_table_t *tt);
+DLLEXPORT uint32_t toeplitz_table_hash(const toeplitz_table_t *tt, const uint8_t *data, size_t offset, size_t n, uint32_t result);
+DLLEXPORT uint64_t toeplitz_table_hash_packet(const libtrace_packet_t * pkt, const toeplitz_table_t *tt);
+DLLEXPORT uint64_t toeplitz_table_hash_inner_packet(const libtrace_packet_t * pkt, const toeplitz_table_t *tt);
+DLLEXPORT void toeplitz_hash_packets(libtrace_packet_t **pkts, size_t nb_packets, const toeplitz_table_t *tt, bool inner, uint64_t *hashes);
 DLLEXPORT void toeplitz_ncreate_bikey(uint8_t *key, size_t num);
 DLLEXPORT void toeplitz_create_bikey(uint8_t *key);
 DLLEXPORT void toeplitz_ncreate_unikey(uint8_t *key, size_t num);
@@ -170,7 +170,7 @@ static inline int posix_memalign(void **memptr, size_t alignment, size_t size)
 #  include "dagformat.h"
 #endif
 
-#ifdef HAVE_LLVM
+#ifdef HAVE_BPF
 #include "bpf-jit/bpf-jit.h"
 #endif
 
@@ -190,6 +190,9 @@ static inline int posix_memalign(void **memptr, size_t alignment, size_t size)
 
 #define MAX_THREADS 128
 
+/* The most results the reporter hands to a result batch callback at once */
+#define REPORTER_BATCH_SIZE 64
+
 /** Data about the most recent event from a trace file */
 struct libtrace_event_status_t {
 	/** A libtrace packet to store the packet when a PACKET event occurs */
@@ -229,6 +232,33 @@ enum hash_owner {
         HASH_OWNED_EXTERNAL,
 };
 
+/** How many bursts, packets or reads pass between each one that is timed
+ * for trace_get_pipeline_stats() */
+#define PIPELINE_SAMPLE_INTERVAL 16
+
+struct pipeline_stage_counters {
+	uint64_t samples;
+	uint64_t cycles;
+	uint64_t max_cycles;
+};
+
+/** The counters behind trace_get_pipeline_stats(), each thread only updates
+ * its own. Times are in cycles until they are reported. */
+struct pipeline_counters {
+	uint64_t bursts;
+	uint64_t packets;
+	// Counts down to the next burst, packet or read to time
+	uint32_t next_sample;
+	// Set while the current burst is being timed, so that nested stages
+	// such as the filter and the combiner are timed as well
+	bool sampling;
+	// Cycles timed reads have spent waiting for the hasher to queue
+	// packets, left out of the read stage
+	uint64_t wait_cycles;
+	struct pipeline_stage_counters stages[PIPELINE_STAGE_COUNT];
+	uint64_t ring_occupancy[LIBTRACE_RING_OCCUPANCY_BUCKETS];
+};
+
 /**
  * Information of this thread
  */
@@ -236,14 +266,24 @@ struct libtrace_thread_t {
 	uint64_t accepted_packets; // The number of packets accepted only used if pread
 	uint64_t filtered_packets;
 	// is retreving packets
+	// Packets the hasher dropped because our rbuffer was full
+	uint64_t overflow_packets;
 	// Set to true once the first packet has been stored
 	bool recorded_first;
 	// For thread safety reason we actually must store this here
 	int64_t tracetime_offset_usec;
+	// When the next interval tick is due in microseconds, 0 if ticks
+	// are not being sent to this thread. Read by the keepalive thread.
+	uint64_t next_tick;
 	void* user_data; // TLS for the user to use
 	void* format_data; // TLS for the format to use
 	libtrace_message_queue_t messages; // Message handling
 	libtrace_ringbuffer_t rbuffer; // Input
+	// Packets waiting for room in rbuffer. A single producer, single
+	// consumer ring: the hasher writes it, and this processing thread
+	// reads it once rbuffer is empty (hasher_try_read) and drains it
+	// when pausing (trace_perpkt_thread_pause)
+	libtrace_ringbuffer_t spill;
 	libtrace_t * trace;
 	void* ret;
 	enum thread_types type;
@@ -252,6 +292,7 @@ struct libtrace_thread_t {
 	int perpkt_num; // A number from 0-X that represents this perpkt threads number
 				// in the table, intended to quickly identify this thread
 				// -1 represents NA (such as the case this is not a perpkt thread)
+	struct pipeline_counters pipeline;
 } ALIGNED(CACHE_LINE_SIZE);
 
 /**
@@ -317,9 +358,16 @@ struct user_configuration {
 	size_t perpkt_threads;
 	size_t hasher_queue_size;
 	bool hasher_polling;
+	/* Set if a hasher was chosen in the configuration string */
+	bool hasher_configured;
+	enum hasher_types hasher_type;
+	enum hasher_fields hasher_fields;
+	enum hasher_overflow hasher_overflow;
+	size_t hasher_spill_size;
 	bool reporter_polling;
 	size_t reporter_thold;
 	bool debug_state;
+	bool pipeline_stats;
 	int coremap[MAX_THREADS];
 };
 #define ZERO_USER_CONFIG(config) {\
@@ -336,7 +384,9 @@ struct callback_set {
         fn_cb_dataless message_pausing;
         fn_cb_packet message_packet;
 	fn_cb_packet message_meta_packet;
+        fn_cb_packet_batch message_packet_batch;
         fn_cb_result message_result;
+        fn_cb_result_batch message_result_batch;
         fn_cb_first_packet message_first_packet;
         fn_cb_tick message_tick_count;
         fn_cb_tick message_tick_interval;
@@ -423,6 +473,9 @@ struct libtrace_t {
 	libtrace_stat_t *stats;
 	struct user_configuration config;
 	libtrace_combine_t combiner;
+	/** The combiner's method for publishing an array of results, may be
+	 * NULL */
+	fn_combiner_publish_bulk combiner_publish_bulk;
 
         /* Set of callbacks to be executed by per packet threads in response
          * to various messages. */
@@ -430,6 +483,14 @@ struct libtrace_t {
         /* Set of callbacks to be executed by the reporter thread in response
          * to various messages. */
         struct callback_set *reporter_cbs;
+        /* Results waiting to be passed to the reporter's result batch
+         * callback, only used by the reporter thread */
+        libtrace_result_t *reporter_batch;
+        size_t reporter_batch_count;
+        /* When pipeline statistics started being collected, as a cycle
+         * count and in nanoseconds, used to convert cycles to time */
+        uint64_t pipeline_start_cycles;
+        uint64_t pipeline_start_ns;
 };
 
 #define LIBTRACE_STAT_MAGIC 0x41
@@ -1262,6 +1323,23 @@ void promote_packet(libtrace_packet_t *packet);
  */
 bool demote_packet(libtrace_packet_t *packet);
 
+/** Finds the header that demote_packet() would leave at the front of a
+ * packet, without copying or modifying the packet.
+ *
+ * @param[in,out] link		The start of the link layer header. This is
+ * 				set to NULL if the packet was too short to
+ * 				demote.
+ * @param[in,out] linktype	The linktype of the header pointed to by link
+ * @param[in,out] remaining	The number of bytes captured after link
+ * @return True if the linktype can be demoted to one that has a pcap DLT,
+ * false otherwise.
+ *
+ * Demoting a linktype only ever strips fixed size headers, so the outcome
+ * for each linktype is worked out once and cached.
+ */
+bool demote_link_header(void **link, libtrace_linktype_t *linktype,
+		uint32_t *remaining);
+
 /** Returns a pointer to the header following a Linux SLL header.
  *
  * @param link		A pointer to the Linux SLL header to be skipped
@@ -1311,6 +1389,23 @@ void *trace_get_payload_from_linux_sll(const void *link,
 DLLEXPORT void *trace_get_payload_from_atm(void *link, uint8_t *type, 
 		uint32_t *remaining);
 
+/** Returns a pointer to the innermost IP header of a packet, for the hashers
+ * that spread tunnelled flows by their inner headers.
+ *
+ * @param packet	The packet to decapsulate
+ * @param[out] ethertype	The ethertype of the returned header
+ * @param[out] remaining	The number of captured bytes from the returned
+ * 				header onwards
+ * @return A pointer to the innermost IP header, or NULL if the packet has no
+ * layer 3 header.
+ *
+ * IP-in-IP, GRE, VXLAN, GTP-U and MPLS encapsulation is removed. If a tunnel
+ * can't be decapsulated, such as in a non-initial fragment of the outer
+ * header, the innermost header that could be read is returned instead.
+ */
+void *hash_get_inner_layer3(const libtrace_packet_t *packet,
+		uint16_t *ethertype, uint32_t *remaining);
+
 #ifdef HAVE_BPF
 /* A type encapsulating a bpf filter
  * This type covers the compiled bpf filter, as well as the original filter
@@ -1318,17 +1413,43 @@ DLLEXPORT void *trace_get_payload_from_atm(void *link, uint8_t *type,
  *
  */
 
+/** Internal representation of a BPF filter */
+/** A BPF filter compiled for a single DLT. Entries are added to the front
+ * of a filter's cache as new DLTs are seen and are never changed once they
+ * have been published, so the cache can be searched without a lock. */
+typedef struct libtrace_filter_prog_t {
+	struct libtrace_filter_prog_t *next;	/**< The next cached program */
+	libtrace_dlt_t dlt;		/**< The DLT the program was built for */
+	int valid;			/**< Zero if the filter failed to compile */
+	struct bpf_program program;	/**< The BPF program itself */
+	struct bpf_jit_t *jit;		/**< The program prepared by compile_program(), NULL if it must be interpreted */
+} libtrace_filter_prog_t;
+
 /** Internal representation of a BPF filter */
 struct libtrace_filter_t {
-	struct bpf_program filter;	/**< The BPF program itself */
+	/** The BPF program given to capture formats that filter in the
+	 * kernel */
+	struct bpf_program filter;
 	char * filterstring;		/**< The filter string */
 	int flag;			/**< Indicates if the filter is valid */
-	struct bpf_jit_t *jitfilter;
+	/** The programs used by trace_apply_filter(), one per DLT. Filters
+	 * created from bytecode have a single program used for every DLT */
+	libtrace_filter_prog_t *progs;
+};
+
+/** Internal representation of a set of BPF filters */
+struct libtrace_filter_set_t {
+	libtrace_filter_t **filters;	/**< The filters */
+	int count;			/**< The number of filters */
+	/** For each filter, the index of the first filter with the same
+	 * filter string, so that each distinct filter only runs once */
+	int *same_as;
 };
 #else
 /** BPF not supported by this system, but we still need to define a structure
  * for the filter */
 struct libtrace_filter_t {};
+struct libtrace_filter_set_t {};
 #endif
 
 /** Local definition of a PCAP header */
@@ -1378,6 +1499,8 @@ void ndag_constructor(void);
 void etsilive_constructor(void);
 /** Constructor for the live TZSP over UDP format module */
 void tzsplive_constructor(void);
+/** Constructor for the in-memory replay format module */
+void mem_constructor(void);
 #ifdef HAVE_BPF
 /** Constructor for the BPF format module */
 void bpf_constructor(void);
@@ -1397,6 +1520,10 @@ void linux_xdp_constructor(void);
 #if HAVE_PFRING
 void pfring_constructor(void);
 #endif
+#if HAVE_SHM_FORMAT
+/** Constructor for the shared memory fan-out format module */
+void shm_constructor(void);
+#endif
 
 /** Extracts the RadioTap flags from a wireless link header
  *
@@ -117,6 +117,7 @@ struct libtrace_result_t {
 	uint64_t key;   /**< The unique key for the result */
 	libtrace_generic_t value;  /**< The result value itself */
 	int type; /**< Describes the type of result, see enum result_types */
+	uint32_t flags; /**< Set by the combiner, see enum result_flags */
 };
 
 /** The libtrace_messages enum
@@ -277,6 +278,12 @@ enum hasher_types {
 	 * @note it is possible that UDP packets may not be spread across
 	 * processing threads, depending upon the format support. In this case
 	 * they would be directed to a single thread.
+	 *
+	 * IPv4 fragments are hashed on their addresses alone, as only the
+	 * first fragment carries the ports. This keeps every fragment of a
+	 * datagram on the same thread, so they can be reassembled there
+	 * (see trace_create_reassembler()), but it does mean fragments are
+	 * not necessarily given to the same thread as the rest of their flow.
 	 */
 	HASHER_BIDIRECTIONAL,
 
@@ -291,9 +298,163 @@ enum hasher_types {
 	 * This value indicates that the hasher is a custom user-defined
          * function. 
 	 */
-	HASHER_CUSTOM
+	HASHER_CUSTOM,
+
+	/** Use a fast software hash which is bi-directional, such that both
+	 * directions of a flow are sent to the same processing thread. The
+	 * fields that make up a flow are chosen with trace_set_hasher_fields().
+	 *
+	 * Unlike HASHER_BIDIRECTIONAL this is never pushed into the capture
+	 * format, so it should be used when the hash does not need to match
+	 * the hash calculated by the NIC.
+	 */
+	HASHER_SYMMETRIC
+};
+
+/** What the hasher thread does with a packet when the queue of the
+ *  processing thread it belongs to is full. These can be selected using
+ *  trace_set_hasher_overflow().
+ */
+enum hasher_overflow {
+	/** Wait for the processing thread to make room. No packets are lost
+	 * inside libtrace, but one slow thread stops packets being read for
+	 * every thread. This is the default. */
+	HASHER_OVERFLOW_BLOCK,
+
+	/** Drop the packet and count it against the processing thread, see
+	 * the overflow field of libtrace_stat_t. Ticks are never dropped,
+	 * the hasher waits for room for them as with HASHER_OVERFLOW_BLOCK.
+	 */
+	HASHER_OVERFLOW_DROP,
+
+	/** Hold the packet in a per-thread spill buffer until the processing
+	 * thread has room, so that bursts aimed at one thread do not stop the
+	 * others. The processing thread reads its spill buffer once its
+	 * queue is empty, so spilled packets are not held up while the input
+	 * is idle. Packets are only dropped, and counted as with
+	 * HASHER_OVERFLOW_DROP, once the spill buffer is full as well. Ticks
+	 * are never dropped. The size of the spill buffer is set with
+	 * trace_set_hasher_spill_size().
+	 */
+	HASHER_OVERFLOW_SPILL
+};
+
+/** The packet fields that make up a flow for the HASHER_SYMMETRIC hasher.
+ *  These can be selected using trace_set_hasher_fields().
+ *
+ *  HASHER_FIELDS_INNER is also honoured by the HASHER_BIDIRECTIONAL and
+ *  HASHER_UNIDIRECTIONAL hashers, which then hash the innermost header's
+ *  addresses and ports. Those hashers ignore the other values.
+ */
+enum hasher_fields {
+	/** The IP addresses, ports and transport protocol. This is the
+	 * default. */
+	HASHER_FIELDS_5TUPLE,
+
+	/** The IP addresses only, so that all traffic between two hosts is
+	 * sent to the same thread */
+	HASHER_FIELDS_IP,
+
+	/** The 5-tuple plus the IDs of up to two outer VLAN tags, for when
+	 * the same addresses are in use on different VLANs */
+	HASHER_FIELDS_VLAN,
+
+	/** The 5-tuple of the innermost IP header. IP-in-IP, GRE, VXLAN,
+	 * GTP-U and MPLS encapsulation is removed first, so tunnelled flows
+	 * are spread across threads rather than following the tunnel
+	 * endpoints. Packets that can't be decapsulated, such as non-initial
+	 * fragments of the outer header, are hashed on the outermost header
+	 * that could be read.
+	 */
+	HASHER_FIELDS_INNER
 };
 
+/** The stages of the parallel pipeline that trace_get_pipeline_stats()
+ *  reports timings for.
+ */
+enum libtrace_pipeline_stage {
+	/** A processing thread reading a burst of packets, either from the
+	 * format or from the ring buffer filled by the hasher thread. This
+	 * does not include applying the filter, or waiting for the hasher
+	 * thread to queue packets. A read from the format includes any time
+	 * the format waits for packets to arrive. Only reads that return
+	 * packets are counted. */
+	PIPELINE_STAGE_READ,
+
+	/** A processing thread applying the trace's filter to a burst of
+	 * packets. Filters applied by the hasher thread are not timed. */
+	PIPELINE_STAGE_FILTER,
+
+	/** The hasher thread hashing a burst of packets. Reading the packets
+	 * is timed separately as PIPELINE_STAGE_HASHER_READ. */
+	PIPELINE_STAGE_HASHER,
+
+	/** The hasher thread reading a burst of packets from the format,
+	 * which is a single packet for live formats. This includes any time
+	 * the format waits for each packet to arrive, up to the last packet
+	 * read, and bursts that read no packets are not counted. */
+	PIPELINE_STAGE_HASHER_READ,
+
+	/** The hasher thread waiting for space in a processing thread's full
+	 * ring buffer. Every wait is timed, not just a sample. */
+	PIPELINE_STAGE_RING_WAIT,
+
+	/** The user's callbacks for a burst of packets, not including the
+	 * time spent publishing results */
+	PIPELINE_STAGE_CALLBACK,
+
+	/** Passing results to the combiner with trace_publish_result() or
+	 * trace_publish_results() */
+	PIPELINE_STAGE_COMBINER,
+
+	/** The reporter thread reading results from the combiner, including
+	 * the user's result callbacks */
+	PIPELINE_STAGE_REPORTER,
+
+	/** The number of stages, not a stage */
+	PIPELINE_STAGE_COUNT
+};
+
+/** The number of buckets in the ring buffer occupancy histogram */
+#define LIBTRACE_RING_OCCUPANCY_BUCKETS 10
+
+/** Timings for one stage of the parallel pipeline. Stages are only timed
+ * for a sample of the work they do, so these describe a typical burst,
+ * packet or read rather than the total time spent in the stage.
+ */
+typedef struct libtrace_stage_stats {
+	/** The number of times the stage was timed */
+	uint64_t samples;
+	/** The total time taken by the timed samples, in nanoseconds */
+	uint64_t total_ns;
+	/** The longest of the timed samples, in nanoseconds */
+	uint64_t max_ns;
+} libtrace_stage_stats_t;
+
+/** Instrumentation of a parallel trace, see trace_get_pipeline_stats() */
+typedef struct libtrace_pipeline_stats {
+	/** The time since the trace was first started, in nanoseconds */
+	uint64_t elapsed_ns;
+	/** The number of bursts read by processing threads */
+	uint64_t bursts;
+	/** The number of packets read by processing threads, including
+	 * ticks */
+	uint64_t packets;
+	/** Timings for each stage, indexed by enum libtrace_pipeline_stage */
+	libtrace_stage_stats_t stages[PIPELINE_STAGE_COUNT];
+	/** How full processing threads' ring buffers were when sampled
+	 * before reading a burst, only used with a dedicated hasher thread.
+	 * The first bucket counts samples where the ring was empty, the last
+	 * where it was full, and the buckets in between split the rest
+	 * evenly. */
+	uint64_t ring_occupancy[LIBTRACE_RING_OCCUPANCY_BUCKETS];
+	/** The number of packets reused from the packet cache */
+	uint64_t ocache_hits;
+	/** The number of packets that had to be allocated because the
+	 * packet cache was empty */
+	uint64_t ocache_misses;
+} libtrace_pipeline_stats_t;
+
 typedef struct libtrace_info_t {
 	/**
 	 * True if a live format (i.e. packets have to be trace-time).
@@ -407,6 +568,19 @@ struct libtrace_combine {
 	libtrace_generic_t configuration;
 };
 
+/**
+ * Receives an array of results from a processing thread, see
+ * trace_publish_results(). This should behave the same as calling the
+ * combiner's publish method for each result in turn, but only needs to
+ * consider waking the reporter once.
+ *
+ * This is registered with trace_set_combiner_publish_bulk() rather than
+ * being part of libtrace_combine_t, so combiners built against older
+ * versions of libtrace keep working.
+ */
+typedef void (*fn_combiner_publish_bulk)(libtrace_t *, int thread_id,
+		libtrace_combine_t *, libtrace_result_t *results, size_t count);
+
 /**
  * The definition for a hasher function, allowing matching packets to be
  * directed to the correct thread for processing.
@@ -522,6 +696,31 @@ typedef libtrace_packet_t* (*fn_cb_packet)(libtrace_t *libtrace,
                                            void *tls,
                                            libtrace_packet_t *packet);
 
+/**
+ * A callback function triggered when a processing thread has read a burst
+ * of packets, see trace_set_packet_batch_cb().
+ *
+ * @param libtrace The parallel trace.
+ * @param t The thread that is running
+ * @param global The global storage.
+ * @param tls The thread local storage.
+ * @param packets The packets to be processed, in the order they were read.
+ * @param count The number of packets, this is always at least 1.
+ *
+ * Each element of packets follows the same contract as the return value of
+ * a packet callback. Leave packets[i] alone (or replace it with another
+ * packet) to hand it back to libtrace once the callback returns, or set
+ * packets[i] to NULL to keep it, in which case it is the user's
+ * responsibility to ensure the packet is freed when the reporter thread is
+ * finished with it.
+ */
+typedef void (*fn_cb_packet_batch)(libtrace_t *libtrace,
+                                   libtrace_thread_t *t,
+                                   void *global,
+                                   void *tls,
+                                   libtrace_packet_t **packets,
+                                   size_t count);
+
 /**
  * A callback function triggered when a processing thread receives a meta packet.
  *
@@ -555,6 +754,23 @@ typedef libtrace_packet_t* (*fn_cb_meta_packet)(libtrace_t *libtrace,
 typedef void (*fn_cb_result)(libtrace_t *libtrace, libtrace_thread_t *sender,
                 void *global, void *tls, libtrace_result_t *result);
 
+/**
+ * Callback for handling a batch of results that have been passed on by the
+ * combiner, in the order the combiner passed them on.
+ *
+ * @param libtrace The parallel input trace.
+ * @param sender The thread that generated this result.
+ * @param global The global storage.
+ * @param tls The thread local storage.
+ * @param results The results to be handled by the reporter thread.
+ * @param count The number of results, this is always at least 1.
+ *
+ * The results are only valid until the callback returns.
+ */
+typedef void (*fn_cb_result_batch)(libtrace_t *libtrace,
+                libtrace_thread_t *sender, void *global, void *tls,
+                libtrace_result_t *results, size_t count);
+
 
 /**
  * Callback for handling any user-defined message types. This will handle
@@ -624,6 +840,23 @@ DLLEXPORT int trace_set_pausing_cb(libtrace_callback_set_t *cbset,
 DLLEXPORT int trace_set_packet_cb(libtrace_callback_set_t *cbset,
                 fn_cb_packet handler);
 
+/**
+ * Registers a packet batch callback against a callback set. Only valid for
+ * processing threads. If set, this is used instead of the packet callback
+ * and is passed each burst of packets the thread reads at once, so the
+ * user can work across several packets at a time. Meta packets are only
+ * included if no meta packet callback is set, and when playing back in
+ * trace time packets are passed on one at a time.
+ *
+ * @param cbset The callback set.
+ * @param handler The packet batch callback function.
+ * @return 0 if successful, -1 otherwise.
+ *
+ * New in libtrace 4.0.17
+ */
+DLLEXPORT int trace_set_packet_batch_cb(libtrace_callback_set_t *cbset,
+                fn_cb_packet_batch handler);
+
 /**
  * Registers a meta packet callback against a callback set.
  *
@@ -654,6 +887,20 @@ DLLEXPORT int trace_set_first_packet_cb(libtrace_callback_set_t *cbset,
 DLLEXPORT int trace_set_result_cb(libtrace_callback_set_t *cbset,
                 fn_cb_result handler);
 
+/**
+ * Registers a result batch callback against a callback set. Only valid
+ * for reporter threads. If set, this is used instead of the result
+ * callback and is passed up to 64 results at a time.
+ *
+ * @param cbset The callback set.
+ * @param handler The result batch callback function.
+ * @return 0 if successful, -1 otherwise.
+ *
+ * New in libtrace 4.0.17
+ */
+DLLEXPORT int trace_set_result_batch_cb(libtrace_callback_set_t *cbset,
+                fn_cb_result_batch handler);
+
 /**
  * Registers a tick counter callback against a callback set.
  *
@@ -787,6 +1034,11 @@ DLLEXPORT int trace_set_perpkt_threads(libtrace_t *trace, int nb);
  * new packets are not being directed to a processing thread, while still
  * maintaining order etc.
  *
+ * Ticks fall on multiples of the interval since the epoch, so every
+ * processing thread sees the same tick timestamps. A thread that is busy
+ * reading packets sends itself any ticks that are due between bursts of
+ * packets, while an idle thread is woken up to receive them.
+ *
  * @see MESSAGE_TICK_INTERVAL, trace_set_tick_count()
  */
 DLLEXPORT int trace_set_tick_interval(libtrace_t *trace, size_t millisec);
@@ -917,6 +1169,59 @@ DLLEXPORT int trace_set_hasher_queue_size(libtrace_t *trace, size_t size);
  */
 DLLEXPORT int trace_set_hasher_polling(libtrace_t *trace, bool polling);
 
+/** Selects the packet fields hashed by the HASHER_SYMMETRIC hasher.
+ *
+ * @param trace A parallel input trace
+ * @param fields The fields that make up a flow, see enum hasher_fields.
+ * Defaults to HASHER_FIELDS_5TUPLE.
+ *
+ * This can be called before or after trace_set_hasher(), but must be called
+ * before the trace is started.
+ *
+ * HASHER_FIELDS_INNER also applies to the HASHER_BIDIRECTIONAL and
+ * HASHER_UNIDIRECTIONAL hashers when libtrace computes the hash in software.
+ * A hash pushed into the capture format is calculated by the NIC on the
+ * outer header.
+ *
+ * @return 0 if successful otherwise -1
+ */
+DLLEXPORT int trace_set_hasher_fields(libtrace_t *trace,
+                                      enum hasher_fields fields);
+
+/** Selects what the hasher thread does when a processing thread's queue is
+ * full. The same policy applies to the queue of every processing thread.
+ *
+ * @param trace A parallel input trace
+ * @param overflow The policy to use, see enum hasher_overflow. Defaults to
+ * HASHER_OVERFLOW_BLOCK.
+ *
+ * This has no effect unless the trace uses a dedicated hasher thread.
+ * Packets dropped by the hasher are reported in the overflow field of
+ * trace_get_statistics() and trace_get_thread_statistics().
+ *
+ * @return 0 if successful otherwise -1
+ *
+ * New in libtrace 4.0.17
+ */
+DLLEXPORT int trace_set_hasher_overflow(libtrace_t *trace,
+                                        enum hasher_overflow overflow);
+
+/** Sets how many packets the hasher thread can hold for each processing
+ * thread when using HASHER_OVERFLOW_SPILL.
+ *
+ * @param trace A parallel input trace
+ * @param size The number of packets in each spill buffer. Defaults to four
+ * times the hasher queue size.
+ *
+ * Spilled packets come from the packet cache, so a fixed size cache should
+ * be large enough to fill every spill buffer as well as every queue.
+ *
+ * @return 0 if successful otherwise -1
+ *
+ * New in libtrace 4.0.17
+ */
+DLLEXPORT int trace_set_hasher_spill_size(libtrace_t *trace, size_t size);
+
 /**
  * Enables or disables polling of the reporter result queue.
  *
@@ -972,6 +1277,56 @@ DLLEXPORT int trace_set_reporter_thold(libtrace_t *trace, size_t thold);
  */
 DLLEXPORT int trace_set_debug_state(libtrace_t *trace, bool debug_state);
 
+/**
+ * Enable or disable the instrumentation reported by
+ * trace_get_pipeline_stats().
+ *
+ * When enabled each thread counts the work it does and times one in every
+ * 16 bursts, packets or reads using the CPU's cycle counter. When disabled
+ * the only cost is a check per burst.
+ *
+ * @param trace A parallel input trace
+ * @param enabled If true, collect pipeline statistics. Defaults false.
+ * @return 0 if successful otherwise -1.
+ *
+ * New in libtrace 4.0.17
+ */
+DLLEXPORT int trace_set_pipeline_stats(libtrace_t *trace, bool enabled);
+
+/**
+ * Gets the pipeline statistics for a parallel trace, which show where time
+ * is going inside the threads started by trace_pstart().
+ *
+ * This can be called while the trace is running, or after trace_join().
+ *
+ * @param trace A parallel input trace with pipeline statistics enabled, see
+ * trace_set_pipeline_stats()
+ * @param t A thread to get the statistics for, or NULL to combine the
+ * statistics of all of the trace's threads. The packet cache counts are
+ * only filled in when t is NULL.
+ * @param stats The statistics structure to fill in
+ * @return 0 if successful otherwise -1, in which case the error can be
+ * retrieved with trace_get_err().
+ *
+ * New in libtrace 4.0.17
+ */
+DLLEXPORT int trace_get_pipeline_stats(libtrace_t *trace, libtrace_thread_t *t,
+                                       libtrace_pipeline_stats_t *stats);
+
+/**
+ * Prints pipeline statistics to a file stream, with the mean and maximum
+ * time of each stage that was timed.
+ *
+ * @param stats The statistics returned by trace_get_pipeline_stats()
+ * @param f The output file stream
+ * @return -1 if an error occurs when writing to the file stream, check errno.
+ *         Otherwise 0.
+ *
+ * New in libtrace 4.0.17
+ */
+DLLEXPORT int trace_print_pipeline_stats(const libtrace_pipeline_stats_t *stats,
+                                         FILE *f);
+
 /**
  * Bind per-packet threads affinities to specified CPU cores
  *
@@ -1072,6 +1427,17 @@ enum result_types {
 
 };
 
+/** Flags that a combiner can set on a result before passing it to the
+ * reporter thread. Results are always published with no flags set.
+ */
+enum result_flags {
+	/**
+	 * The result arrived after the combiner had already passed on the
+	 * time window it belongs to, see combiner_windowed.
+	 */
+	RESULT_FLAG_LATE = 1
+};
+
 /** Publish a result to the reporter thread (via the combiner)
  *
  * @param[in] libtrace The parallel input trace
@@ -1086,6 +1452,26 @@ DLLEXPORT void trace_publish_result(libtrace_t *libtrace,
                                     libtrace_generic_t value,
                                     int type);
 
+/** Publish several results to the reporter thread (via the combiner)
+ *
+ * @param[in] libtrace The parallel input trace
+ * @param[in] t The current per-packet thread
+ * @param[in] results An array of results, each with their key, value
+ * and type set
+ * @param[in] count The number of results in the array
+ *
+ * This is equivalent to calling trace_publish_result() for each result in
+ * turn, but the combiner can queue them all at once and the reporter is
+ * woken at most once. The results are copied, so the array can be reused
+ * as soon as this returns.
+ *
+ * New in libtrace 4.0.17
+ */
+DLLEXPORT void trace_publish_results(libtrace_t *libtrace,
+                                     libtrace_thread_t *t,
+                                     libtrace_result_t *results,
+                                     size_t count);
+
 /** Check if a dedicated hasher thread is being used.
  *
  * @param[in] libtrace The parallel input trace
@@ -1413,9 +1799,17 @@ DLLEXPORT libtrace_info_t *trace_get_information(libtrace_t * libtrace);
  * * \b perpkt_threads,\b pt see trace_set_perpkt_threads() [int]
  * * \b hasher_queue_size,\b hqs see trace_set_hasher_queue_size() [size_t]
  * * \b hasher_polling,\b hp see trace_set_hasher_polling() [bool]
+ * * \b hasher see trace_set_hasher() [balance, bidirectional,
+ *   unidirectional or symmetric]
+ * * \b hasher_fields,\b hf see trace_set_hasher_fields() [5tuple, ip,
+ *   vlan or inner]
+ * * \b hasher_overflow,\b ho see trace_set_hasher_overflow() [block, drop
+ *   or spill]
+ * * \b hasher_spill_size,\b hss see trace_set_hasher_spill_size() [size_t]
  * * \b reporter_polling,\b rp see trace_set_reporter_polling() [bool]
  * * \b reporter_thold,\b rt see trace_set_reporter_thold() [size_t]
  * * \b debug_state,\b ds see trace_set_debug_state() [bool]
+ * * \b pipeline_stats,\b ps see trace_set_pipeline_stats() [bool]
  * * \b coremap see trace_set_coremap() [string of comma-separated integers]
  *   e.g. coremap=[1,3,5,7] (square brackets required)
  *
@@ -1472,6 +1866,21 @@ DLLEXPORT int trace_get_perpkt_thread_id(libtrace_thread_t *thread);
  */
 DLLEXPORT void trace_set_combiner(libtrace_t *trace, const libtrace_combine_t *combiner, libtrace_generic_t config);
 
+/**
+ * Sets the method that passes an array of results to the trace's combiner.
+ *
+ * @param trace The input trace
+ * @param publish_bulk The method to use, or NULL to call the combiner's
+ * publish method for each result instead
+ *
+ * trace_set_combiner() clears this, so a combiner should call it from its
+ * initialise method. The combiners that come with libtrace already do.
+ *
+ * New in libtrace 4.0.17.
+ */
+DLLEXPORT void trace_set_combiner_publish_bulk(libtrace_t *trace,
+		fn_combiner_publish_bulk publish_bulk);
+
 /**
  * Takes unordered (or ordered) input and produces unordered output.
  * This is the fastest combiner but makes no attempt to ensure you get
@@ -1493,15 +1902,113 @@ extern const libtrace_combine_t combiner_ordered;
 
 /**
  * Like classic Google Map/Reduce, the results are sorted
- * in ascending order based on their key. The sorting is only done when the
- * trace finishes and all results are stored internally until then.
+ * in ascending order based on their key. Results are stored internally
+ * until the trace is paused or finishes, at which point everything
+ * published so far is passed to the reporter in key order. Ticks are
+ * discarded.
+ *
+ * By default every result is held in memory. The config passed to
+ * trace_set_combiner() can set a budget in bytes as config.uint64, shared
+ * evenly between the processing threads. A thread that exceeds its share
+ * sorts the results it is holding and writes them to a temporary file,
+ * which is merged back in when the results are passed on. Only the
+ * libtrace_result_t itself is written out, anything its value points to
+ * stays in memory.
  *
- * This only works with a very limited number of results, otherwise
- * libtrace will just run out of memory and crash. You should always
- * use combiner_ordered if you can.
+ * You should always use combiner_ordered if you can.
  */
 extern const libtrace_combine_t combiner_sorted;
 
+/**
+ * The merge function used by combiner_reducing.
+ *
+ * @param merged The result that has been built up so far for this key, which
+ * the new result should be merged into.
+ * @param res A newly published result with the same key. Once it has been
+ * merged, the reporter will never see it, so anything it points to should be
+ * freed.
+ * @param data The data pointer from the libtrace_reducer_config_t.
+ *
+ * This is called from the reporter thread.
+ */
+typedef void (*fn_result_merge)(libtrace_result_t *merged,
+		libtrace_result_t *res, void *data);
+
+/**
+ * The configuration for combiner_reducing, passed as config.ptr to
+ * trace_set_combiner(). This must remain valid until the trace is started.
+ */
+typedef struct libtrace_reducer_config {
+	/** Merges two results with the same key, this is required */
+	fn_result_merge merge;
+	/** Passed to every call to merge */
+	void *data;
+} libtrace_reducer_config_t;
+
+/**
+ * Merges results that have the same key, such as the partial counts
+ * that each processing thread publishes for an interval, using the merge
+ * function given in a libtrace_reducer_config_t. Once every processing
+ * thread has published a result for a key, a single merged result is
+ * passed to the reporter. Results for keys that some threads never
+ * published are passed on in key order when the trace finishes.
+ *
+ * Results are merged in the order they are read, which is not
+ * necessarily the order they were published in. Only results of type
+ * RESULT_USER or greater are merged, packets and ticks are passed
+ * straight through as with combiner_unordered.
+ *
+ * New in libtrace 4.0.17
+ */
+extern const libtrace_combine_t combiner_reducing;
+
+/**
+ * The configuration for combiner_windowed, passed as config.ptr to
+ * trace_set_combiner(). This must remain valid until the trace is started.
+ * Times are in the same units as ERF timestamps, i.e. 1 << 32 is a second.
+ */
+typedef struct libtrace_window_config {
+	/** The length of each window, if 0 windows are one second long */
+	uint64_t window;
+	/** How far the furthest ahead processing thread may get past the
+	 * end of a window before the window is passed on without waiting for
+	 * the other threads. If 0, windows wait for every thread. */
+	uint64_t lateness;
+} libtrace_window_config_t;
+
+/**
+ * Orders results by event time and passes them on a time window at a time.
+ * The event time is the key of the result, which must be an ERF
+ * timestamp, except for RESULT_PACKET results which use the timestamp of
+ * the packet.
+ *
+ * Each processing thread has a watermark, which is the latest event time it
+ * has published a result for. A thread must not publish results earlier
+ * than its watermark, which is naturally the case for results derived
+ * from the packets a thread sees. A thread that may not see packets for a
+ * while can keep its watermark moving by publishing a RESULT_TICK_INTERVAL
+ * from its tick interval callback, with the tick's timestamp as the key.
+ * Tick timestamps come from the system clock, so this is only useful
+ * for live inputs.
+ *
+ * Once every watermark has passed the end of a window, the window's results
+ * are passed to the reporter in event time order. Each time windows are
+ * passed on the reporter is also sent a RESULT_TICK_INTERVAL, keyed by the
+ * end of the last window, to show that everything before that time has been
+ * seen. The ticks published by processing threads are not passed on.
+ *
+ * If a lateness bound is configured in a libtrace_window_config_t,
+ * windows are also passed on once any thread is that far past the end of
+ * them. Results for windows that have already been passed on are sent to
+ * the reporter as soon as they arrive, with RESULT_FLAG_LATE set.
+ *
+ * Count ticks are passed straight through. Everything is passed on when
+ * the trace finishes.
+ *
+ * New in libtrace 4.0.17
+ */
+extern const libtrace_combine_t combiner_windowed;
+
 #ifdef __cplusplus
 }
 #endif
@@ -400,10 +400,79 @@ static void replacement_pcap_header(libtrace_packet_t *packet, char *payload,
         trace_clear_cache(packet);
 }
 
+/* The outcome of demoting each linktype, filled in the first time a linktype
+ * is seen by demote_link_header(). Each entry is a single word so that it
+ * can be read and written without a lock:
+ *
+ *   bit 63		set once the entry has been filled in
+ *   bit 62		set if the linktype can be demoted to one with a DLT
+ *   bits 32-39		the linktype after demotion
+ *   bits 0-31		the number of bytes stripped by demotion
+ */
+#define DEMOTE_CACHE_SIZE 32
+#define DEMOTE_KNOWN (1ULL << 63)
+#define DEMOTE_OK (1ULL << 62)
+static uint64_t demote_cache[DEMOTE_CACHE_SIZE];
+
+/* Works out how many bytes demote_packet() strips from the front of a packet
+ * with the given linktype. This must be kept in step with demote_packet() */
+static uint64_t demote_linktype(libtrace_linktype_t linktype) {
+	uint32_t offset = 0;
+
+	while (libtrace_to_pcap_dlt(linktype) == TRACE_DLT_ERROR) {
+		switch (linktype) {
+			case TRACE_TYPE_ATM:
+				offset += sizeof(libtrace_atm_capture_cell_t);
+				linktype = TRACE_TYPE_LLCSNAP;
+				break;
+			case TRACE_TYPE_CORSAROTAG:
+				offset += sizeof(corsaro_packet_tags_t);
+				linktype = TRACE_TYPE_ETH;
+				break;
+			default:
+				return DEMOTE_KNOWN;
+		}
+	}
+	return DEMOTE_KNOWN | DEMOTE_OK |
+			((uint64_t)(linktype & 0xff) << 32) | offset;
+}
+
+bool demote_link_header(void **link, libtrace_linktype_t *linktype,
+		uint32_t *remaining) {
+	uint64_t entry;
+	uint32_t offset;
+
+	if (libtrace_to_pcap_dlt(*linktype) != TRACE_DLT_ERROR)
+		return true;
+	if ((unsigned int)*linktype >= DEMOTE_CACHE_SIZE)
+		return false;
+
+	entry = __atomic_load_n(&demote_cache[*linktype], __ATOMIC_RELAXED);
+	if (!entry) {
+		entry = demote_linktype(*linktype);
+		__atomic_store_n(&demote_cache[*linktype], entry,
+				__ATOMIC_RELAXED);
+	}
+	if (!(entry & DEMOTE_OK))
+		return false;
+
+	*linktype = (libtrace_linktype_t)((entry >> 32) & 0xff);
+	offset = (uint32_t)entry;
+	if (*link == NULL || *remaining < offset) {
+		*link = NULL;
+		*remaining = 0;
+		return true;
+	}
+	*link = (char *)*link + offset;
+	*remaining -= offset;
+	return true;
+}
+
 /* Try and remove any extraneous encapsulation that may have been added to
  * a packet. Effectively the opposite to promote_packet.
  *
- * Returns true if demotion was possible, false if not.
+ * Returns true if demotion was possible, false if not. Any linktype added
+ * here must also be added to demote_linktype().
  */
 bool demote_packet(libtrace_packet_t *packet)
 {
@@ -706,7 +706,7 @@ DLLEXPORT void *trace_get_layer2(const libtrace_packet_t *packet,
 
 	if (packet->cached.l2_header) {
 		/* Use cached values */
-		*linktype = packet->cached.link_type;
+		*linktype = packet->cached.l2_link_type;
 		*remaining = packet->cached.l2_remaining;
 		return packet->cached.l2_header;
 	}
@@ -739,6 +739,7 @@ DLLEXPORT void *trace_get_layer2(const libtrace_packet_t *packet,
 		case TRACE_TYPE_OPENBSD_LOOP:
 			((libtrace_packet_t*)packet)->cached.l2_header = meta;
 			((libtrace_packet_t*)packet)->cached.l2_remaining = *remaining;
+			((libtrace_packet_t*)packet)->cached.l2_link_type = *linktype;
 			return meta;
 		case TRACE_TYPE_LINUX_SLL:
 		case TRACE_TYPE_80211_RADIO:
@@ -825,6 +826,7 @@ DLLEXPORT void *trace_get_layer2(const libtrace_packet_t *packet,
 
         ((libtrace_packet_t*)packet)->cached.l2_header = meta;
         ((libtrace_packet_t*)packet)->cached.l2_remaining = *remaining;
+        ((libtrace_packet_t*)packet)->cached.l2_link_type = *linktype;
 
         return meta;
 }
@@ -243,7 +243,7 @@ DLLEXPORT void *trace_get_layer3(const libtrace_packet_t *packet,
 
         if (packet->cached.l2_header) {
                 link = packet->cached.l2_header;
-                linktype = packet->cached.link_type;
+                linktype = packet->cached.l2_link_type;
                 *remaining = packet->cached.l2_remaining;
         } else {
         	link = trace_get_layer2(packet,&linktype,remaining);
@@ -697,8 +697,6 @@ DLLEXPORT uint16_t *trace_checksum_layer3(libtrace_packet_t *packet,
 	uint32_t remaining;
 	char *csum_ptr;
 
-	uint8_t safety[65536];
-
 	if (csum == NULL)
 		return NULL;
 	
@@ -711,20 +709,17 @@ DLLEXPORT uint16_t *trace_checksum_layer3(libtrace_packet_t *packet,
 		libtrace_ip_t *ip = (libtrace_ip_t *)l3;
 		if (remaining < sizeof(libtrace_ip_t))
 			return NULL;
+		if (ip->ip_hl < 5 ||
+				remaining < ip->ip_hl * sizeof(uint32_t))
+			return NULL;
 
 		csum_ptr = (char *)(&ip->ip_sum);
 
-		/* I hate memcpys, but this is the only truly safe way to
-		 * do this without modifying the packet. I'm trying to be
-		 * careful about not creating any more thread-safety issues
-		 * than there already are :) */
-		memcpy(safety, ip, ip->ip_hl * sizeof(uint32_t));
-		
-		/* Set the checksum to zero, so we can do the calculation */
-		ip = (libtrace_ip_t *)safety;
-		ip->ip_sum = 0;
-
-		*csum = checksum_buffer(safety, ip->ip_hl * sizeof(uint32_t));
+		/* Sum around the checksum field rather than zeroing it, so
+		 * we don't have to modify (or copy) the packet */
+		*csum = finish_checksum(add_checksum_skip(ip,
+				ip->ip_hl * sizeof(uint32_t),
+				csum_ptr - (char *)ip));
 		
 		/* Remember to byteswap appropriately */
 		*csum = ntohs(*csum);
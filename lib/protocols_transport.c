@@ -402,6 +402,9 @@ DLLEXPORT uint16_t trace_get_source_port(const libtrace_packet_t *packet)
         uint16_t fragoff;
         uint8_t more;
 
+        if (packet->cached.tuple_state == 1)
+                return packet->cached.tuple.src_port;
+
         fragoff = trace_get_fragment_offset(packet, &more);
 
         /* If we're not the first fragment, we're unlikely to be able
@@ -438,6 +441,9 @@ DLLEXPORT uint16_t trace_get_destination_port(const libtrace_packet_t *packet)
         uint16_t fragoff;
         uint8_t more;
 
+        if (packet->cached.tuple_state == 1)
+                return packet->cached.tuple.dst_port;
+
         fragoff = trace_get_fragment_offset(packet, &more);
 
         /* If we're not the first fragment, we're unlikely to be able
@@ -464,6 +470,133 @@ DLLEXPORT uint16_t trace_get_destination_port(const libtrace_packet_t *packet)
 		return 0;
 }
 
+DLLEXPORT const libtrace_flow_tuple_t *trace_get_flow_tuple(
+		const libtrace_packet_t *packet)
+{
+	libtrace_packet_cache_t *cache;
+	libtrace_flow_tuple_t *tuple;
+	libtrace_linktype_t linktype;
+	uint16_t ethertype = 0;
+	uint32_t remaining;
+	uint8_t proto, more;
+	char *l2, *l3, *l4;
+
+	if (!packet) {
+		fprintf(stderr, "NULL packet passed into trace_get_flow_tuple()\n");
+		return NULL;
+	}
+
+	/* Cast away constness, nasty, but this is just a cache */
+	cache = &((libtrace_packet_t *)packet)->cached;
+	tuple = &cache->tuple;
+	if (cache->tuple_state == 1)
+		return tuple;
+	if (cache->tuple_state == -1)
+		return NULL;
+
+	l2 = (char *)trace_get_layer2(packet, &linktype, &remaining);
+	if (!l2) {
+		cache->tuple_state = -1;
+		return NULL;
+	}
+	memset(tuple, 0, sizeof(*tuple));
+
+	/* Find the layer 3 header the same way as trace_get_layer3(), noting
+	 * the VLAN tags and MPLS labels along the way */
+	l3 = (char *)trace_get_payload_from_layer2(l2, linktype, &ethertype,
+			&remaining);
+	while (l3 && remaining > 0) {
+		if (ethertype == TRACE_ETHERTYPE_8021Q) {
+			libtrace_8021q_t *vlan = (libtrace_8021q_t *)l3;
+
+			if (tuple->vlan_count < LIBTRACE_TUPLE_MAX_LABELS &&
+					remaining >= sizeof(*vlan)) {
+				tuple->vlans[tuple->vlan_count++] =
+						LT_VLAN_VID(vlan);
+			}
+			l3 = (char *)trace_get_payload_from_vlan(l3,
+					&ethertype, &remaining);
+		} else if (ethertype == TRACE_ETHERTYPE_MPLS) {
+			uint32_t label;
+
+			if (tuple->mpls_count < LIBTRACE_TUPLE_MAX_LABELS &&
+					remaining >= sizeof(label)) {
+				memcpy(&label, l3, sizeof(label));
+				tuple->mpls[tuple->mpls_count++] =
+						ntohl(label) >> 12;
+			}
+			l3 = (char *)trace_get_payload_from_mpls(l3,
+					&ethertype, &remaining);
+			if (l3 && ethertype == 0x0) {
+				l3 = (char *)trace_get_payload_from_ethernet(
+						l3, &ethertype, &remaining);
+			}
+		} else if (ethertype == TRACE_ETHERTYPE_PPP_SES) {
+			l3 = (char *)trace_get_payload_from_pppoe(l3,
+					&ethertype, &remaining);
+		} else {
+			break;
+		}
+	}
+
+	if (l3 && remaining > 0) {
+		tuple->flags |= LIBTRACE_TUPLE_L3;
+		tuple->ethertype = ethertype;
+		tuple->l3_offset = l3 - l2;
+
+		/* Save trace_get_layer3() the same walk */
+		if (!cache->l3_header) {
+			cache->l3_ethertype = ethertype;
+			cache->l3_header = l3;
+			cache->l3_remaining = remaining;
+		}
+
+		if (ethertype == TRACE_ETHERTYPE_IP &&
+				remaining >= sizeof(libtrace_ip_t)) {
+			libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+
+			tuple->ip_version = 4;
+			tuple->src_ip.ip4 = ip->ip_src;
+			tuple->dst_ip.ip4 = ip->ip_dst;
+		} else if (ethertype == TRACE_ETHERTYPE_IPV6 &&
+				remaining >= sizeof(libtrace_ip6_t)) {
+			libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+
+			tuple->ip_version = 6;
+			tuple->src_ip.ip6 = ip6->ip_src;
+			tuple->dst_ip.ip6 = ip6->ip_dst;
+		}
+
+		tuple->frag_offset = trace_get_fragment_offset(packet, &more);
+		if (more)
+			tuple->flags |= LIBTRACE_TUPLE_MORE_FRAGMENTS;
+	}
+
+	l4 = (char *)trace_get_transport(packet, &proto, &remaining);
+	if (l4) {
+		tuple->flags |= LIBTRACE_TUPLE_L4;
+		tuple->proto = proto;
+		tuple->l4_offset = l4 - l2;
+
+		/* The same rules as trace_get_source_port() and
+		 * trace_get_destination_port() */
+		if (tuple->frag_offset == 0 && proto != TRACE_IPPROTO_ICMP &&
+				proto != TRACE_IPPROTO_ICMPV6) {
+			struct ports_t *port = (struct ports_t *)l4;
+
+			if (remaining >= 2)
+				tuple->src_port = ntohs(port->src);
+			if (remaining >= 4) {
+				tuple->dst_port = ntohs(port->dst);
+				tuple->flags |= LIBTRACE_TUPLE_PORTS;
+			}
+		}
+	}
+
+	cache->tuple_state = 1;
+	return tuple;
+}
+
 DLLEXPORT uint16_t *trace_checksum_transport(libtrace_packet_t *packet, 
 		uint16_t *csum) {
 
@@ -475,9 +608,6 @@ DLLEXPORT uint16_t *trace_checksum_transport(libtrace_packet_t *packet,
 	char *csum_ptr = NULL;
 	int plen = 0;
 
-	uint8_t safety[65536];
-	uint8_t *ptr = safety;
-
 	header = trace_get_layer3(packet, &ethertype, &remaining);
 
 	if (header == NULL)
@@ -502,33 +632,33 @@ DLLEXPORT uint16_t *trace_checksum_transport(libtrace_packet_t *packet,
 	}
 
 	header = trace_get_transport(packet, &proto, &remaining);
+	if (header == NULL)
+		return NULL;
 
+	/* The transport header is summed around its checksum field, so we
+	 * don't need to copy it somewhere to zero the checksum first */
 	if (proto == TRACE_IPPROTO_TCP) {
 		libtrace_tcp_t *tcp = (libtrace_tcp_t *)header;
+		if (remaining < sizeof(libtrace_tcp_t) ||
+				remaining < tcp->doff * 4U || tcp->doff < 5)
+			return NULL;
 		header = trace_get_payload_from_tcp(tcp, &remaining);
 		
 		csum_ptr = (char *)(&tcp->check);
-
-		memcpy(ptr, tcp, tcp->doff * 4);
-
-		tcp = (libtrace_tcp_t *)ptr;
-		tcp->check = 0;
-
-		ptr += (tcp->doff * 4);
+		sum += add_checksum_skip(tcp, tcp->doff * 4,
+				csum_ptr - (char *)tcp);
 	} 
 	
 	else if (proto == TRACE_IPPROTO_UDP) {
 
 		libtrace_udp_t *udp = (libtrace_udp_t *)header;
+		if (remaining < sizeof(libtrace_udp_t))
+			return NULL;
 		header = trace_get_payload_from_udp(udp, &remaining);
 		
 		csum_ptr = (char *)(&udp->check);
-		memcpy(ptr, udp, sizeof(libtrace_udp_t));
-
-		udp = (libtrace_udp_t *)ptr;
-		udp->check = 0;
-
-		ptr += sizeof(libtrace_udp_t);
+		sum += add_checksum_skip(udp, sizeof(libtrace_udp_t),
+				csum_ptr - (char *)udp);
 	} 
 	
 	else if (proto == TRACE_IPPROTO_ICMP) {
@@ -536,23 +666,19 @@ DLLEXPORT uint16_t *trace_checksum_transport(libtrace_packet_t *packet,
 		sum = 0;
 
 		libtrace_icmp_t *icmp = (libtrace_icmp_t *)header;
+		if (remaining < sizeof(libtrace_icmp_t))
+			return NULL;
 		header = trace_get_payload_from_icmp(icmp, &remaining);
 		
 		csum_ptr = (char *)(&icmp->checksum);
-		memcpy(ptr, icmp, sizeof(libtrace_icmp_t));
-
-		icmp = (libtrace_icmp_t *)ptr;
-		icmp->checksum = 0;
-		
-		ptr += sizeof(libtrace_icmp_t);
+		sum += add_checksum_skip(icmp, sizeof(libtrace_icmp_t),
+				csum_ptr - (char *)icmp);
 
 	} 
 	else {
 		return NULL;
 	}
 
-	sum += add_checksum(safety, (uint16_t)(ptr - safety));
-
 	plen = trace_get_payload_length(packet);
 	if (plen < 0)
 		return NULL;
@@ -564,7 +690,13 @@ DLLEXPORT uint16_t *trace_checksum_transport(libtrace_packet_t *packet,
 		return NULL;
 
 	sum += add_checksum(header, (uint16_t)plen);
-	*csum = ntohs(finish_checksum(sum));
+	*csum = finish_checksum(sum);
+
+	/* A UDP checksum of zero means "no checksum", so a sum that comes
+	 * out as zero is sent as all ones instead (RFC 768) */
+	if (proto == TRACE_IPPROTO_UDP && *csum == 0)
+		*csum = 0xffff;
+	*csum = ntohs(*csum);
 
 	return (uint16_t *)csum_ptr;
 }
@@ -0,0 +1,477 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* IPv4 fragment reassembly.
+ *
+ * Datagrams waiting for fragments live in a chained hash table keyed on
+ * (src, dst, id, proto), and on a list ordered by when their first fragment
+ * arrived. As every datagram has the same timeout, the oldest datagram is
+ * always the next one to expire, so both timeouts and evictions (when the
+ * memory limit is reached) only ever need to look at the head of the list.
+ *
+ * Fragment payloads are copied into one buffer per datagram at their
+ * offset, with some headroom in front. The link and IP headers of the first
+ * fragment are copied into the end of the headroom, so the finished
+ * datagram is contiguous and can be handed to trace_construct_packet()
+ * without another copy.
+ */
+
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "checksum.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* The link layer headers, plus an IP header with the maximum options */
+#define REASM_HEADROOM 256
+#define REASM_MAX_PAYLOAD 65535
+#define REASM_BLOCKS ((REASM_MAX_PAYLOAD + 7) / 8)
+
+#define REASM_DEFAULT_MEMORY (4 * 1024 * 1024)
+#define REASM_DEFAULT_TIMEOUT 30
+#define REASM_SPARES 16
+
+#define IP_MF 0x2000
+#define IP_DF 0x4000
+#define IP_OFFMASK 0x1fff
+
+struct reasm_datagram {
+	/* Hash chain */
+	struct reasm_datagram *next;
+	/* Arrival order, oldest first */
+	struct reasm_datagram *older;
+	struct reasm_datagram *newer;
+
+	uint32_t src;
+	uint32_t dst;
+	uint16_t id;
+	uint8_t proto;
+
+	/* ERF timestamp at which the datagram is abandoned */
+	uint64_t expires;
+
+	/* Headroom followed by the payload, indexed by fragment offset */
+	uint8_t *data;
+	uint32_t capacity;
+
+	/* Bytes of link and IP header in front of the payload, 0 until the
+	 * first fragment has arrived */
+	uint16_t hdrlen;
+	uint8_t iphlen;
+	libtrace_linktype_t linktype;
+
+	/* Payload length, 0 until the last fragment has arrived */
+	uint32_t total;
+	/* End of the furthest fragment seen */
+	uint32_t maxend;
+
+	/* Which 8 byte blocks of payload have arrived */
+	uint32_t blocks;
+	uint64_t received[(REASM_BLOCKS + 63) / 64];
+};
+
+struct libtrace_reassembler_t {
+	struct reasm_datagram **table;
+	uint32_t mask;
+
+	struct reasm_datagram *oldest;
+	struct reasm_datagram *newest;
+
+	/* Datagrams kept for reuse */
+	struct reasm_datagram *spare;
+	int spares;
+
+	size_t max_memory;
+	uint64_t timeout;
+
+	/* The most recently reassembled datagram */
+	libtrace_packet_t *result;
+
+	libtrace_reassembly_stats_t stats;
+};
+
+static inline uint32_t reasm_hash(uint32_t src, uint32_t dst, uint16_t id,
+		uint8_t proto) {
+	uint32_t h = src * 0x9e3779b1;
+
+	h ^= dst * 0x85ebca6b;
+	h ^= ((uint32_t)id << 8 | proto) * 0xc2b2ae35;
+	return h ^ (h >> 16);
+}
+
+static void unlink_datagram(libtrace_reassembler_t *r,
+		struct reasm_datagram *d) {
+	struct reasm_datagram **p = &r->table[reasm_hash(d->src, d->dst,
+			d->id, d->proto) & r->mask];
+
+	while (*p != d)
+		p = &(*p)->next;
+	*p = d->next;
+
+	if (d->older)
+		d->older->newer = d->newer;
+	else
+		r->oldest = d->newer;
+	if (d->newer)
+		d->newer->older = d->older;
+	else
+		r->newest = d->older;
+
+	r->stats.pending--;
+	r->stats.memory -= sizeof(*d) + d->capacity;
+
+	/* Hang on to a few datagrams, buffers and all, to save allocating
+	 * them again for the next ones */
+	if (r->spares < REASM_SPARES) {
+		d->next = r->spare;
+		r->spare = d;
+		r->spares++;
+	} else {
+		free(d->data);
+		free(d);
+	}
+}
+
+/* Gets a cleared datagram, reusing a spare one if possible */
+static struct reasm_datagram *new_datagram(libtrace_reassembler_t *r) {
+	struct reasm_datagram *d = r->spare;
+	uint8_t *data;
+	uint32_t capacity;
+
+	if (!d)
+		return calloc(1, sizeof(*d));
+	r->spare = d->next;
+	r->spares--;
+
+	/* Only the part of the bitmap that was used needs clearing */
+	memset(d->received, 0, ((d->maxend + 7) / 8 + 63) / 64 *
+			sizeof(d->received[0]));
+	data = d->data;
+	capacity = d->capacity;
+	memset(d, 0, offsetof(struct reasm_datagram, received));
+
+	if (r->stats.memory + sizeof(*d) + capacity > r->max_memory) {
+		free(data);
+		data = NULL;
+		capacity = 0;
+	}
+	d->data = data;
+	d->capacity = capacity;
+	return d;
+}
+
+static void expire_datagrams(libtrace_reassembler_t *r, uint64_t now) {
+	while (r->oldest && r->oldest->expires <= now) {
+		unlink_datagram(r, r->oldest);
+		r->stats.timeouts++;
+	}
+}
+
+/* Frees the oldest datagrams until another extra bytes can be allocated.
+ * Returns false if that isn't possible without evicting keep. */
+static bool make_room(libtrace_reassembler_t *r, size_t extra,
+		struct reasm_datagram *keep) {
+	while (r->stats.memory + extra > r->max_memory) {
+		if (r->oldest == NULL || r->oldest == keep)
+			return false;
+		unlink_datagram(r, r->oldest);
+		r->stats.evictions++;
+	}
+	return true;
+}
+
+static struct reasm_datagram *find_datagram(libtrace_reassembler_t *r,
+		libtrace_ip_t *ip, uint64_t now) {
+	uint32_t bucket = reasm_hash(ip->ip_src.s_addr, ip->ip_dst.s_addr,
+			ip->ip_id, ip->ip_p) & r->mask;
+	struct reasm_datagram *d;
+
+	for (d = r->table[bucket]; d; d = d->next) {
+		if (d->src == ip->ip_src.s_addr &&
+				d->dst == ip->ip_dst.s_addr &&
+				d->id == ip->ip_id && d->proto == ip->ip_p)
+			return d;
+	}
+
+	if (!make_room(r, sizeof(*d), NULL))
+		return NULL;
+	d = new_datagram(r);
+	if (!d)
+		return NULL;
+
+	d->src = ip->ip_src.s_addr;
+	d->dst = ip->ip_dst.s_addr;
+	d->id = ip->ip_id;
+	d->proto = ip->ip_p;
+	d->expires = now + r->timeout;
+
+	d->next = r->table[bucket];
+	r->table[bucket] = d;
+	d->older = r->newest;
+	if (r->newest)
+		r->newest->newer = d;
+	else
+		r->oldest = d;
+	r->newest = d;
+
+	r->stats.pending++;
+	r->stats.memory += sizeof(*d) + d->capacity;
+	return d;
+}
+
+/* Makes sure the payload buffer reaches at least end */
+static bool grow_datagram(libtrace_reassembler_t *r, struct reasm_datagram *d,
+		uint32_t end) {
+	uint32_t want = REASM_HEADROOM + end;
+	uint32_t capacity = d->capacity ? d->capacity : 2048;
+	uint8_t *data;
+
+	if (want <= d->capacity)
+		return true;
+	while (capacity < want)
+		capacity *= 2;
+	if (capacity > REASM_HEADROOM + REASM_MAX_PAYLOAD)
+		capacity = REASM_HEADROOM + REASM_MAX_PAYLOAD;
+
+	if (!make_room(r, capacity - d->capacity, d))
+		return false;
+	data = realloc(d->data, capacity);
+	if (!data)
+		return false;
+
+	r->stats.memory += capacity - d->capacity;
+	d->data = data;
+	d->capacity = capacity;
+	return true;
+}
+
+/* Records that the payload bytes [offset, end) have arrived, a 64 bit word
+ * of the bitmap at a time */
+static void mark_received(struct reasm_datagram *d, uint32_t offset,
+		uint32_t end) {
+	uint32_t block = offset / 8;
+	uint32_t last = (end + 7) / 8;
+
+	while (block < last) {
+		uint32_t bits = 64 - block % 64;
+		uint64_t mask;
+
+		if (bits > last - block)
+			bits = last - block;
+		mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) <<
+				(block % 64);
+		d->blocks += __builtin_popcountll(mask &
+				~d->received[block / 64]);
+		d->received[block / 64] |= mask;
+		block += bits;
+	}
+}
+
+/* Turns a complete datagram into r->result */
+static libtrace_packet_t *finish_datagram(libtrace_reassembler_t *r,
+		struct reasm_datagram *d, libtrace_packet_t *last) {
+	uint8_t *frame = d->data + REASM_HEADROOM - d->hdrlen;
+	libtrace_ip_t *ip = (libtrace_ip_t *)(d->data + REASM_HEADROOM -
+			d->iphlen);
+	libtrace_pcapfile_pkt_hdr_t *hdr;
+	uint64_t ts;
+
+	if (d->hdrlen + d->total > 65535) {
+		unlink_datagram(r, d);
+		r->stats.invalid++;
+		return NULL;
+	}
+
+	ip->ip_len = htons(d->iphlen + d->total);
+	ip->ip_off &= htons(IP_DF);
+	ip->ip_sum = 0;
+	ip->ip_sum = checksum_buffer(ip, d->iphlen);
+
+	trace_construct_packet(r->result, d->linktype, frame,
+			d->hdrlen + d->total);
+
+	/* Give the datagram the time that it was completed */
+	ts = trace_get_erf_timestamp(last);
+	hdr = (libtrace_pcapfile_pkt_hdr_t *)r->result->header;
+	hdr->ts_sec = (uint32_t)(ts >> 32);
+	hdr->ts_usec = (uint32_t)(((ts & 0xffffffffULL) * 1000000) >> 32);
+	r->result->order = last->order;
+
+	unlink_datagram(r, d);
+	r->stats.datagrams++;
+	return r->result;
+}
+
+DLLEXPORT libtrace_reassembler_t *trace_create_reassembler(size_t max_memory,
+		uint32_t timeout) {
+	libtrace_reassembler_t *r = calloc(1, sizeof(libtrace_reassembler_t));
+	uint32_t buckets = 64;
+
+	if (!r)
+		return NULL;
+
+	r->max_memory = max_memory ? max_memory : REASM_DEFAULT_MEMORY;
+	r->timeout = (uint64_t)(timeout ? timeout : REASM_DEFAULT_TIMEOUT) << 32;
+
+	/* Roughly one bucket for every datagram that could fit */
+	while (buckets < 65536 && buckets * 2048U < r->max_memory)
+		buckets *= 2;
+	r->mask = buckets - 1;
+	r->table = calloc(buckets, sizeof(struct reasm_datagram *));
+	r->result = trace_create_packet();
+	if (!r->table || !r->result) {
+		trace_destroy_reassembler(r);
+		return NULL;
+	}
+	return r;
+}
+
+DLLEXPORT libtrace_packet_t *trace_reassemble_packet(
+		libtrace_reassembler_t *r, libtrace_packet_t *packet) {
+	struct reasm_datagram *d;
+	libtrace_linktype_t linktype;
+	libtrace_ip_t *ip;
+	uint16_t ethertype, off;
+	uint32_t remaining, l2remaining, iphlen, plen, offset, end;
+	uint8_t *l2;
+	uint64_t now;
+
+	if (!r || !packet)
+		return packet;
+
+	ip = (libtrace_ip_t *)trace_get_layer3(packet, &ethertype, &remaining);
+	if (!ip || ethertype != TRACE_ETHERTYPE_IP ||
+			remaining < sizeof(libtrace_ip_t) || ip->ip_v != 4)
+		return packet;
+
+	off = ntohs(ip->ip_off);
+	if ((off & (IP_MF | IP_OFFMASK)) == 0)
+		return packet;
+
+	now = trace_get_erf_timestamp(packet);
+	expire_datagrams(r, now);
+
+	/* Anything that can't be reassembled is passed through untouched:
+	 * truncated fragments, fragments that aren't a multiple of 8 bytes
+	 * (except for the last) and datagrams that would be too large */
+	iphlen = ip->ip_hl * 4;
+	if (iphlen < sizeof(libtrace_ip_t) || ntohs(ip->ip_len) <= iphlen ||
+			remaining < ntohs(ip->ip_len)) {
+		r->stats.invalid++;
+		return packet;
+	}
+	plen = ntohs(ip->ip_len) - iphlen;
+	offset = (off & IP_OFFMASK) * 8;
+	end = offset + plen;
+	if (((off & IP_MF) && plen % 8 != 0) ||
+			end + iphlen > REASM_MAX_PAYLOAD) {
+		r->stats.invalid++;
+		return packet;
+	}
+
+	d = find_datagram(r, ip, now);
+	if (!d)
+		return NULL;
+	if (!grow_datagram(r, d, end)) {
+		/* This datagram alone doesn't fit in the memory limit */
+		unlink_datagram(r, d);
+		r->stats.evictions++;
+		return NULL;
+	}
+	r->stats.fragments++;
+
+	if (!(off & IP_MF)) {
+		/* The last fragment tells us how long the datagram is. If
+		 * fragments disagree about that, give up on it. */
+		if ((d->total && d->total != end) || d->maxend > end) {
+			unlink_datagram(r, d);
+			r->stats.invalid++;
+			return NULL;
+		}
+		d->total = end;
+	} else if (d->total && end > d->total) {
+		unlink_datagram(r, d);
+		r->stats.invalid++;
+		return NULL;
+	}
+	if (end > d->maxend)
+		d->maxend = end;
+
+	/* Later copies of the same bytes overwrite earlier ones */
+	memcpy(d->data + REASM_HEADROOM + offset, (uint8_t *)ip + iphlen, plen);
+	mark_received(d, offset, end);
+
+	if (offset == 0 && d->hdrlen == 0) {
+		/* Keep the link layer too, so the datagram can be decoded
+		 * like any other packet. If the link type can't be written
+		 * as a pcap packet, keep just the IP header. */
+		l2 = (uint8_t *)trace_get_layer2(packet, &linktype, &l2remaining);
+		if (!l2 || libtrace_to_pcap_dlt(linktype) == TRACE_DLT_ERROR ||
+				(uint8_t *)ip < l2) {
+			l2 = (uint8_t *)ip;
+			linktype = TRACE_TYPE_NONE;
+		}
+		if ((uint8_t *)ip - l2 + iphlen > REASM_HEADROOM) {
+			l2 = (uint8_t *)ip;
+			linktype = TRACE_TYPE_NONE;
+		}
+		d->hdrlen = (uint16_t)((uint8_t *)ip - l2 + iphlen);
+		d->iphlen = (uint8_t)iphlen;
+		d->linktype = linktype;
+		memcpy(d->data + REASM_HEADROOM - d->hdrlen, l2, d->hdrlen);
+	}
+
+	if (d->total && d->hdrlen && d->blocks == (d->total + 7) / 8)
+		return finish_datagram(r, d, packet);
+	return NULL;
+}
+
+DLLEXPORT void trace_get_reassembler_stats(libtrace_reassembler_t *r,
+		libtrace_reassembly_stats_t *stats) {
+	if (r && stats)
+		*stats = r->stats;
+}
+
+DLLEXPORT void trace_destroy_reassembler(libtrace_reassembler_t *r) {
+	if (!r)
+		return;
+	if (r->table) {
+		while (r->oldest)
+			unlink_datagram(r, r->oldest);
+		free(r->table);
+	}
+	while (r->spare) {
+		struct reasm_datagram *d = r->spare;
+		r->spare = d->next;
+		free(d->data);
+		free(d);
+	}
+	if (r->result)
+		trace_destroy_packet(r->result);
+	free(r);
+}
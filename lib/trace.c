@@ -95,7 +95,11 @@ volatile int libtrace_halt = 0;
 int libtrace_parallel = 0;
 
 static const libtrace_packet_cache_t clearcache = {
-        -1, -1, -1, -1, NULL, 0, 0, NULL, 0, 0, NULL, 0, 0};
+        .capture_length = -1,
+        .wire_length = -1,
+        .payload_length = -1,
+        .framing_length = -1,
+};
 
 /* strncpy is not assured to copy the final \0, so we
  * will use our own one that does
@@ -156,6 +160,7 @@ static void trace_init(void)
 		tzsplive_constructor();
                 rt_constructor();
                 ndag_constructor();
+                mem_constructor();
 #ifdef HAVE_WANDDER
                 etsilive_constructor();
 #endif
@@ -171,6 +176,9 @@ static void trace_init(void)
 #endif
 #ifdef HAVE_PFRING
 	pfring_constructor();	
+#endif
+#ifdef HAVE_SHM_FORMAT
+                shm_constructor();
 #endif
 	}
 }
@@ -325,8 +333,13 @@ DLLEXPORT libtrace_t *trace_create(const char *uri) {
 	libtrace->sequence_number = 0;
 	ZERO_USER_CONFIG(libtrace->config);
 	memset(&libtrace->combiner, 0, sizeof(libtrace->combiner));
+	libtrace->combiner_publish_bulk = NULL;
         libtrace->perpkt_cbs = NULL;
         libtrace->reporter_cbs = NULL;
+        libtrace->reporter_batch = NULL;
+        libtrace->reporter_batch_count = 0;
+        libtrace->pipeline_start_cycles = 0;
+        libtrace->pipeline_start_ns = 0;
 
 	if (_trace_set_configuration(libtrace, uri, &uri_portion) == 0) {
 		if (uri_portion == NULL) {
@@ -468,8 +481,13 @@ DLLEXPORT libtrace_t * trace_create_dead (const char *uri) {
 	libtrace->sequence_number = 0;
 	ZERO_USER_CONFIG(libtrace->config);
 	memset(&libtrace->combiner, 0, sizeof(libtrace->combiner));
+	libtrace->combiner_publish_bulk = NULL;
         libtrace->perpkt_cbs = NULL;
         libtrace->reporter_cbs = NULL;
+        libtrace->reporter_batch = NULL;
+        libtrace->reporter_batch_count = 0;
+        libtrace->pipeline_start_cycles = 0;
+        libtrace->pipeline_start_ns = 0;
 	for(tmp=formats_list;tmp;tmp=tmp->next) {
                 if (strlen(scan) == strlen(tmp->name) &&
                                 !strncasecmp(scan,
@@ -1119,7 +1137,15 @@ DLLEXPORT int trace_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet)
 			 * structure */
 			packet->trace = libtrace;
                         packet->which_trace_start = libtrace->startcount;
+#if ENABLE_DTRACE
+			DTRACE_PROBE1(libtrace, read_start,
+					libtrace->format->name);
+#endif
 			ret=libtrace->format->read_packet(libtrace,packet);
+#if ENABLE_DTRACE
+			DTRACE_PROBE2(libtrace, read_done,
+					libtrace->format->name, (int) ret);
+#endif
 			if (ret==(size_t)READ_MESSAGE) {
 				continue;
 			}
@@ -1609,6 +1635,32 @@ DLLEXPORT libtrace_eventobj_t trace_event(libtrace_t *trace,
 
 }
 
+#ifdef HAVE_BPF
+/* Creates an entry for a filter's program cache, taking ownership of the
+ * program. The program is JITed here so that entries never need to be
+ * changed once they are published. A NULL program makes an entry recording
+ * that the filter failed to compile for this DLT.
+ */
+static libtrace_filter_prog_t *trace_filter_new_prog(libtrace_dlt_t dlt,
+		struct bpf_program *program) {
+	libtrace_filter_prog_t *prog = (libtrace_filter_prog_t *)
+			calloc(1, sizeof(libtrace_filter_prog_t));
+
+	if (!prog)
+		return NULL;
+	prog->dlt = dlt;
+	if (program) {
+		prog->program = *program;
+		prog->valid = 1;
+		/* Programs that compile_program() can't handle are run with
+		 * bpf_filter() instead */
+		prog->jit = compile_program(program->bf_insns,
+				program->bf_len);
+	}
+	return prog;
+}
+#endif
+
 /** Setup a BPF filter based on pre-compiled byte-code.
  * @param bf_insns	A pointer to the start of the byte-code
  * @param bf_len	The number of BPF instructions
@@ -1625,6 +1677,8 @@ trace_create_filter_from_bytecode(void *bf_insns, unsigned int bf_len)
 #else
 	struct libtrace_filter_t *filter = (struct libtrace_filter_t *)
 		calloc(1, sizeof(struct libtrace_filter_t));
+	struct bpf_program program;
+
 	filter->filter.bf_insns = (struct bpf_insn *)
 		malloc(sizeof(struct bpf_insn) * bf_len);
 
@@ -1633,10 +1687,16 @@ trace_create_filter_from_bytecode(void *bf_insns, unsigned int bf_len)
 
 	filter->filter.bf_len = bf_len;
 	filter->filterstring = NULL;
-	filter->jitfilter = NULL;
 	/* "flag" indicates that the filter member is valid */
 	filter->flag = 1;
 
+	/* The same program is used whatever the DLT of the packet */
+	program.bf_len = bf_len;
+	program.bf_insns = (struct bpf_insn *)
+		malloc(sizeof(struct bpf_insn) * bf_len);
+	memcpy(program.bf_insns, bf_insns, bf_len * sizeof(struct bpf_insn));
+	filter->progs = trace_filter_new_prog(TRACE_DLT_ERROR, &program);
+
 	return filter;
 #endif
 }
@@ -1650,8 +1710,8 @@ DLLEXPORT libtrace_filter_t *trace_create_filter(const char *filterstring) {
 	libtrace_filter_t *filter = (libtrace_filter_t*)
 				calloc(1, sizeof(libtrace_filter_t));
 	filter->filterstring = strdup(filterstring);
-	filter->jitfilter = NULL;
 	filter->flag = 0;
+	filter->progs = NULL;
 	return filter;
 #else
 	fprintf(stderr,"This version of libtrace does not have bpf filter support\n");
@@ -1662,117 +1722,189 @@ DLLEXPORT libtrace_filter_t *trace_create_filter(const char *filterstring) {
 DLLEXPORT void trace_destroy_filter(libtrace_filter_t *filter)
 {
 #ifdef HAVE_BPF
+	libtrace_filter_prog_t *prog, *next;
+
 	free(filter->filterstring);
 	if (filter->flag)
 		pcap_freecode(&filter->filter);
-#ifdef HAVE_LLVM
-	if (filter->jitfilter)
-		destroy_program(filter->jitfilter);
-#endif
+	for (prog = filter->progs; prog; prog = next) {
+		next = prog->next;
+		if (prog->valid)
+			pcap_freecode(&prog->program);
+		if (prog->jit)
+			destroy_program(prog->jit);
+		free(prog);
+	}
 	free(filter);
 #else
 
 #endif
 }
 
-/* Compile a bpf filter, now we know the link type for the trace that we're
- * applying it to.
+#ifdef HAVE_BPF
+/* Finds the program for a filter that was compiled for the DLT of the
+ * packet's link type, compiling the filter if this is the first packet with
+ * that DLT. New programs are pushed onto the filter's cache with a CAS, so
+ * threads only ever wait for each other while libpcap compiles a filter.
  *
  * @internal
  *
- * @returns -1 on error, 0 on success
+ * @returns the program, or NULL if the filter cannot be applied to the
+ * packet
  */
-static int trace_bpf_compile(libtrace_filter_t *filter,
-		const libtrace_packet_t *packet,
-		void *linkptr,
-		libtrace_linktype_t linktype	) {
-#ifdef HAVE_BPF
-	/* It just so happens that the underlying libs used by pthread arn't
-	 * thread safe, namely lex/flex thingys, so single threaded compile
-	 * multi threaded running should be safe.
-	 */
+static libtrace_filter_prog_t *trace_filter_get_prog(
+		libtrace_filter_t *filter, const libtrace_packet_t *packet,
+		libtrace_linktype_t linktype) {
+	/* The parser in older versions of libpcap is not thread safe */
 	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	libtrace_filter_prog_t *head, *prog;
+	struct bpf_program program;
+	libtrace_dlt_t dlt;
+	pcap_t *pcap;
+	int err;
 
-	if (!packet) {
-		fprintf(stderr, "NULL packet passed into trace_bpf_compile()");
-		return TRACE_ERR_NULL_PACKET;
+	head = __atomic_load_n(&filter->progs, __ATOMIC_ACQUIRE);
+
+	/* Filters built from bytecode have already been compiled */
+	if (!filter->filterstring) {
+		if (!head)
+			trace_set_err(packet->trace, TRACE_ERR_BAD_FILTER,
+				"Bad filter passed into trace_apply_filter()");
+		return head;
 	}
 
-	if (!filter) {
-		trace_set_err(packet->trace,
-				TRACE_ERR_NULL_FILTER, "Filter is NULL trace_bpf_compile()");
-		return -1;
+	dlt = libtrace_to_pcap_dlt(linktype);
+	for (prog = head; prog; prog = prog->next) {
+		if (prog->dlt == dlt)
+			goto found;
 	}
 
-	/* If this isn't a real packet, then fail */
-	if (!linkptr) {
+	if (linktype==(libtrace_linktype_t)-1) {
 		trace_set_err(packet->trace,
-				TRACE_ERR_BAD_FILTER,"Packet has no payload");
-		return -1;
+				TRACE_ERR_BAD_FILTER,
+				"Packet has an unknown linktype");
+		return NULL;
+	}
+	if (dlt == TRACE_DLT_ERROR) {
+		trace_set_err(packet->trace,TRACE_ERR_BAD_FILTER,
+				"Unknown pcap equivalent linktype");
+		return NULL;
 	}
 
-	if (filter->filterstring && ! filter->flag) {
-		pcap_t *pcap = NULL;
-		if (linktype==(libtrace_linktype_t)-1) {
-			trace_set_err(packet->trace,
-					TRACE_ERR_BAD_FILTER,
-					"Packet has an unknown linktype");
-			return -1;
-		}
-		if (libtrace_to_pcap_dlt(linktype) == TRACE_DLT_ERROR) {
-			trace_set_err(packet->trace,TRACE_ERR_BAD_FILTER,
-					"Unknown pcap equivalent linktype");
-			return -1;
-		}
-		pthread_mutex_lock(&mutex);
-		/* Make sure not one bet us to this */
-		if (filter->flag) {
-			pthread_mutex_unlock(&mutex);
-			return 0;
-		}
-		pcap=(pcap_t *)pcap_open_dead(
-				(int)libtrace_to_pcap_dlt(linktype),
-				1500U);
-		/* build filter */
-		if (!pcap) {
-			trace_set_err(packet->trace, TRACE_ERR_BAD_FILTER,
-						"Unable to open pcap_t for compiling filters trace_bpf_compile()");
-			return -1;
-		}
-		if (pcap_compile( pcap, &filter->filter, filter->filterstring,
-					1, 0)) {
-			trace_set_err(packet->trace,TRACE_ERR_BAD_FILTER,
-					"Unable to compile the filter \"%s\": %s",
-					filter->filterstring,
-					pcap_geterr(pcap));
-			pcap_close(pcap);
-			pthread_mutex_unlock(&mutex);
-			return -1;
+	pcap=(pcap_t *)pcap_open_dead((int)dlt, 1500U);
+	if (!pcap) {
+		trace_set_err(packet->trace, TRACE_ERR_BAD_FILTER,
+				"Unable to open pcap_t for compiling filters trace_filter_get_prog()");
+		return NULL;
+	}
+	pthread_mutex_lock(&mutex);
+	err = pcap_compile(pcap, &program, filter->filterstring, 1, 0);
+	pthread_mutex_unlock(&mutex);
+	if (err) {
+		trace_set_err(packet->trace,TRACE_ERR_BAD_FILTER,
+				"Unable to compile the filter \"%s\": %s",
+				filter->filterstring,
+				pcap_geterr(pcap));
+	}
+	pcap_close(pcap);
+
+	/* Failures are cached too, so that we don't keep recompiling */
+	prog = trace_filter_new_prog(dlt, err ? NULL : &program);
+	if (!prog) {
+		if (!err)
+			pcap_freecode(&program);
+		trace_set_err(packet->trace, TRACE_ERR_OUT_OF_MEMORY,
+				"Unable to allocate memory for a compiled filter");
+		return NULL;
+	}
+
+	/* Another thread may have compiled the filter for this DLT at the
+	 * same time, in which case we use theirs instead */
+	prog->next = head;
+	while (!__atomic_compare_exchange_n(&filter->progs, &prog->next,
+			prog, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+		libtrace_filter_prog_t *p;
+
+		for (p = prog->next; p != head; p = p->next) {
+			if (p->dlt == dlt) {
+				if (prog->valid)
+					pcap_freecode(&prog->program);
+				if (prog->jit)
+					destroy_program(prog->jit);
+				free(prog);
+				prog = p;
+				goto found;
+			}
 		}
-		pcap_close(pcap);
-		filter->flag=1;
-		pthread_mutex_unlock(&mutex);
+		head = prog->next;
 	}
-	return 0;
-#else
-	trace_set_err(packet->trace,TRACE_ERR_OPTION_UNAVAIL,
-				"Feature unavailable");
-	return -1;
+	if (err)
+		return NULL;
+
+found:
+	if (!prog->valid) {
+		trace_set_err(packet->trace, TRACE_ERR_BAD_FILTER,
+				"Unable to compile the filter \"%s\"",
+				filter->filterstring);
+		return NULL;
+	}
+	return prog;
+}
 #endif
+
+#ifdef HAVE_BPF
+/* Finds the link layer header of a packet in a form that can be filtered by
+ * BPF. If the packet's link type has no pcap equivalent, the headers that
+ * demote_packet() would remove are skipped over in place.
+ *
+ * @returns 1 if the packet can be filtered, 0 if it has no payload to filter
+ * and -1 on error */
+static int trace_filter_find_link(const libtrace_packet_t *packet,
+		void **linkptr, uint32_t *clen, libtrace_linktype_t *linktype) {
+
+	*linkptr = trace_get_packet_buffer(packet, linktype, clen);
+
+	/* If we cannot get a suitable DLT for the packet, it may be because
+	 * the packet is encapsulated in a link type that does not correspond
+	 * to a DLT. Therefore, we should try skipping headers until we can
+	 * find a suitable link type. */
+	if (!demote_link_header(linkptr, linktype, clen)) {
+		trace_set_err(packet->trace, TRACE_ERR_NO_CONVERSION,
+				"pcap does not support this linktype so cannot apply BPF filters");
+		return -1;
+	}
+
+	if (!*linkptr)
+		return 0;
+	return 1;
 }
 
+/* Runs a filter against a link layer header found by
+ * trace_filter_find_link(), compiling the filter first if this is the first
+ * packet with this link type that it has been applied to */
+static int trace_filter_run(libtrace_filter_t *filter,
+		const libtrace_packet_t *packet, void *linkptr,
+		uint32_t clen, libtrace_linktype_t linktype) {
+	libtrace_filter_prog_t *prog;
+
+	prog = trace_filter_get_prog(filter, packet, linktype);
+	if (!prog)
+		return -1;
+
+	/* Now execute the filter */
+	if (prog->jit)
+		return bpf_jit_run(prog->jit, (unsigned char *)linkptr, clen);
+	return bpf_filter(prog->program.bf_insns,(u_char*)linkptr,(unsigned int)clen,(unsigned int)clen);
+}
+#endif
+
 DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
 			const libtrace_packet_t *packet) {
 #ifdef HAVE_BPF
 	void *linkptr = 0;
 	uint32_t clen = 0;
-	bool free_packet_needed = false;
 	int ret;
 	libtrace_linktype_t linktype;
-	libtrace_packet_t *packet_copy = (libtrace_packet_t*)packet;
-#ifdef HAVE_LLVM
-	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
 
 	if (!packet) {
 		fprintf(stderr, "NULL packet passed into trace_apply_filter()\n");
@@ -1792,95 +1924,151 @@ DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
 		|| linktype == TRACE_TYPE_PCAPNG_META)
 		return 1;
 
-	if (libtrace_to_pcap_dlt(linktype)==TRACE_DLT_ERROR) {
-
-		/* If we cannot get a suitable DLT for the packet, it may
-		 * be because the packet is encapsulated in a link type that
-		 * does not correspond to a DLT. Therefore, we should try
-		 * popping off headers until we either can find a suitable
-		 * link type or we can't do any more sensible decapsulation. */
-
-		/* Copy the packet, as we don't want to trash the one we
-		 * were passed in */
-		packet_copy=trace_copy_packet(packet);
-                if (packet_copy == NULL) {
-                        trace_set_err(packet->trace, TRACE_ERR_NO_CONVERSION,
-                                        "failed to demote packet within trace_apply_filter()");
-                        return -1;
-                }
-		free_packet_needed=true;
-
-		while (libtrace_to_pcap_dlt(linktype) == TRACE_DLT_ERROR) {
-			if (!demote_packet(packet_copy)) {
-				trace_set_err(packet->trace,
-						TRACE_ERR_NO_CONVERSION,
-						"pcap does not support this linktype so cannot apply BPF filters");
-				if (free_packet_needed) {
-					trace_destroy_packet(packet_copy);
-				}
-				return -1;
-			}
-			linktype = trace_get_link_type(packet_copy);
-		}
+#if ENABLE_DTRACE
+	DTRACE_PROBE1(libtrace, filter_start, filter);
+#endif
+	ret = trace_filter_find_link(packet, &linkptr, &clen, &linktype);
+	if (ret > 0)
+		ret = trace_filter_run(filter, packet, linkptr, clen,
+				linktype);
+#if ENABLE_DTRACE
+	DTRACE_PROBE2(libtrace, filter_done, filter, ret);
+#endif
+	return ret;
+#else
+	fprintf(stderr,"This version of libtrace does not have bpf filter support\n");
+	return 0;
+#endif
+}
 
-	}
+DLLEXPORT libtrace_filter_set_t *trace_create_filter_set(void) {
+#ifdef HAVE_BPF
+	return (libtrace_filter_set_t *)calloc(1,
+			sizeof(libtrace_filter_set_t));
+#else
+	fprintf(stderr,"This version of libtrace does not have bpf filter support\n");
+	return NULL;
+#endif
+}
 
-	linkptr = trace_get_packet_buffer(packet_copy,NULL,&clen);
-	if (!linkptr) {
-		if (free_packet_needed) {
-			trace_destroy_packet(packet_copy);
-		}
-		return 0;
-	}
+DLLEXPORT int trace_add_filter_to_set(libtrace_filter_set_t *set,
+		const char *filterstring) {
+#ifdef HAVE_BPF
+	libtrace_filter_t **filters;
+	int *same_as;
+	int i;
 
-	/* We need to compile the filter now, because before we didn't know
-	 * what the link type was
-	 */
-	// Note internal mutex locking used here
-	if (trace_bpf_compile(filter,packet_copy,linkptr,linktype)==-1) {
-		if (free_packet_needed) {
-			trace_destroy_packet(packet_copy);
-		}
+	if (!set || !filterstring)
 		return -1;
-	}
 
-	/* If we're jitting, we may need to JIT the BPF code now too */
-#if HAVE_LLVM
-	if (!filter->jitfilter) {
-		ASSERT_RET(pthread_mutex_lock(&mutex), == 0);
-		/* Again double check here like the bpf filter */
-		if(!filter->jitfilter)
-		/* Looking at compile_program source this appears to be thread safe 
-		 * however if this gets called twice we will leak this memory :(
-		 * as such lock here anyways */
-			filter->jitfilter = compile_program(filter->filter.bf_insns, filter->filter.bf_len);
-		ASSERT_RET(pthread_mutex_unlock(&mutex), == 0);
-	}
-#endif
+	filters = (libtrace_filter_t **)realloc(set->filters,
+			(set->count + 1) * sizeof(libtrace_filter_t *));
+	if (!filters)
+		return -1;
+	set->filters = filters;
+	same_as = (int *)realloc(set->same_as, (set->count + 1) * sizeof(int));
+	if (!same_as)
+		return -1;
+	set->same_as = same_as;
 
-	if (!filter->flag) {
-		trace_set_err(packet->trace, TRACE_ERR_BAD_FILTER,
-			"Bad filter passed into trace_apply_filter()");
+	set->filters[set->count] = trace_create_filter(filterstring);
+	if (!set->filters[set->count])
 		return -1;
+	set->same_as[set->count] = set->count;
+	for (i = 0; i < set->count; i++) {
+		if (set->same_as[i] == i &&
+				strcmp(set->filters[i]->filterstring,
+					filterstring) == 0) {
+			set->same_as[set->count] = i;
+			break;
+		}
 	}
-	/* Now execute the filter */
-#if HAVE_LLVM
-	ret=filter->jitfilter->bpf_run((unsigned char *)linkptr, clen);
+	return set->count++;
 #else
-	ret=bpf_filter(filter->filter.bf_insns,(u_char*)linkptr,(unsigned int)clen,(unsigned int)clen);
+	return -1;
 #endif
+}
+
+DLLEXPORT int trace_apply_filter_set(libtrace_filter_set_t *set,
+		const libtrace_packet_t *packet, uint64_t *matches) {
+#ifdef HAVE_BPF
+	void *linkptr = 0;
+	uint32_t clen = 0;
+	int i, ret, matched = 0, error = 0;
+	libtrace_linktype_t linktype;
+
+	if (!packet) {
+		fprintf(stderr, "NULL packet passed into trace_apply_filter_set()\n");
+		return TRACE_ERR_NULL_PACKET;
+	}
+	if (!set || !matches) {
+		trace_set_err(packet->trace, TRACE_ERR_NULL_FILTER,
+			"NULL filter set passed into trace_apply_filter_set()");
+		return -1;
+	}
 
-	/* If we copied the packet earlier, make sure that we free it */
-	if (free_packet_needed) {
-		trace_destroy_packet(packet_copy);
+	memset(matches, 0, TRACE_FILTER_SET_WORDS(set->count) *
+			sizeof(uint64_t));
+
+	/* Match all non-data packets, as trace_apply_filter() does */
+	linktype = trace_get_link_type(packet);
+
+	if (linktype == TRACE_TYPE_NONDATA || linktype == TRACE_TYPE_ERF_META
+		|| linktype == TRACE_TYPE_PCAPNG_META) {
+		for (i = 0; i < set->count; i++)
+			matches[i / 64] |= 1ULL << (i % 64);
+		return set->count;
 	}
-	return ret;
+
+	/* Find the link layer header once for every filter */
+	ret = trace_filter_find_link(packet, &linkptr, &clen, &linktype);
+	if (ret <= 0)
+		return ret;
+
+	for (i = 0; i < set->count; i++) {
+		int first = set->same_as[i];
+
+		if (first != i) {
+			/* Same filter as an earlier one */
+			if (TRACE_FILTER_SET_MATCHED(matches, first)) {
+				matches[i / 64] |= 1ULL << (i % 64);
+				matched ++;
+			}
+			continue;
+		}
+		ret = trace_filter_run(set->filters[i], packet, linkptr,
+				clen, linktype);
+		if (ret > 0) {
+			matches[i / 64] |= 1ULL << (i % 64);
+			matched ++;
+		} else if (ret < 0) {
+			/* The filter can't be applied to this packet, but it
+			 * may still work for other link types. The failure is
+			 * cached for this DLT, so it won't be recompiled */
+			error = 1;
+		}
+	}
+	return error ? -1 : matched;
 #else
 	fprintf(stderr,"This version of libtrace does not have bpf filter support\n");
 	return 0;
 #endif
 }
 
+DLLEXPORT void trace_destroy_filter_set(libtrace_filter_set_t *set) {
+#ifdef HAVE_BPF
+	int i;
+
+	if (!set)
+		return;
+	for (i = 0; i < set->count; i++)
+		trace_destroy_filter(set->filters[i]);
+	free(set->filters);
+	free(set->same_as);
+	free(set);
+#endif
+}
+
 /* Set the direction flag, if it has one
  * @param packet the packet opaque pointer
  * @param direction the new direction (0,1,2,3)
@@ -2548,6 +2736,20 @@ uint64_t trace_get_accepted_packets(libtrace_t *trace)
 	return ret ? ret : trace->accepted_packets;
 }
 
+/* The number of packets a perpkt thread has accepted beyond an even share */
+static uint64_t perpkt_imbalance(libtrace_t *trace, libtrace_thread_t *t) {
+	uint64_t total = 0;
+	uint64_t mine = t->accepted_packets * trace->perpkt_thread_count;
+	int i;
+
+	for (i = 0; i < trace->perpkt_thread_count; i++) {
+		total += trace->perpkt_threads[i].accepted_packets;
+	}
+	if (mine <= total)
+		return 0;
+	return (mine - total) / trace->perpkt_thread_count;
+}
+
 libtrace_stat_t *trace_get_statistics(libtrace_t *trace, libtrace_stat_t *stat)
 {
 	uint64_t ret = 0;
@@ -2602,6 +2804,24 @@ libtrace_stat_t *trace_get_statistics(libtrace_t *trace, libtrace_stat_t *stat)
 		stat->filtered += trace->perpkt_threads[i].filtered_packets;
 	}
 
+	if (trace->perpkt_thread_count > 1) {
+		stat->imbalance_valid = 1;
+		stat->imbalance = 0;
+		for (i = 0; i < trace->perpkt_thread_count; i++) {
+			stat->imbalance += perpkt_imbalance(trace,
+					&trace->perpkt_threads[i]);
+		}
+	}
+
+	if (trace_has_dedicated_hasher(trace)) {
+		stat->overflow_valid = 1;
+		stat->overflow = 0;
+		for (i = 0; i < trace->perpkt_thread_count; i++) {
+			stat->overflow +=
+				trace->perpkt_threads[i].overflow_packets;
+		}
+	}
+
 	if (trace->format->get_statistics) {
 		trace->format->get_statistics(trace, stat);
 	}
@@ -2634,6 +2854,14 @@ void trace_get_thread_statistics(libtrace_t *trace, libtrace_thread_t *t,
 	stat->accepted = t->accepted_packets;
 	stat->filtered_valid = 1;
 	stat->filtered = t->filtered_packets;
+	if (t->type == THREAD_PERPKT && trace->perpkt_thread_count > 1) {
+		stat->imbalance_valid = 1;
+		stat->imbalance = perpkt_imbalance(trace, t);
+	}
+	if (t->type == THREAD_PERPKT && trace_has_dedicated_hasher(trace)) {
+		stat->overflow_valid = 1;
+		stat->overflow = t->overflow_packets;
+	}
 	if (!trace_has_dedicated_hasher(trace) && trace->format->get_thread_statistics) {
 		trace->format->get_thread_statistics(trace, t, stat);
 	}
@@ -2720,7 +2948,10 @@ int trace_print_statistics(const libtrace_stat_t *s, FILE *f, const char *format
 
 inline void trace_clear_cache(libtrace_packet_t *packet) {
 
-        packet->cached = clearcache;
+        /* The tuple is only read when tuple_state says it is valid, so
+         * don't spend time copying over it for every packet */
+        memcpy(&packet->cached, &clearcache,
+                        offsetof(libtrace_packet_cache_t, tuple));
 }
 
 void trace_interrupt(void) {
@@ -82,6 +82,7 @@
 #include "format_helper.h"
 #include "rt_protocol.h"
 #include "hash_toeplitz.h"
+#include "hash_symmetric.h"
 
 #include <pthread.h>
 #include <signal.h>
@@ -159,6 +160,81 @@ static void print_memory_stats() {}
 
 static const libtrace_generic_t gen_zero = {0};
 
+/* A cheap timestamp for the pipeline statistics. On x86 this is the time
+ * stamp counter, which is converted to nanoseconds when the statistics are
+ * reported. Elsewhere this falls back to the monotonic clock. */
+static inline uint64_t pipeline_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static uint64_t pipeline_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Checks whether the current burst, packet or read should be timed for the
+ * pipeline statistics */
+static inline bool pipeline_sample(libtrace_t *trace,
+                                   struct pipeline_counters *pc) {
+	if (!trace->config.pipeline_stats)
+		return false;
+	if (pc->next_sample) {
+		pc->next_sample--;
+		return false;
+	}
+	pc->next_sample = PIPELINE_SAMPLE_INTERVAL - 1;
+	return true;
+}
+
+static inline void pipeline_record(struct pipeline_counters *pc,
+                                   enum libtrace_pipeline_stage stage,
+                                   uint64_t cycles) {
+	struct pipeline_stage_counters *sc = &pc->stages[stage];
+
+	sc->samples++;
+	sc->cycles += cycles;
+	if (cycles > sc->max_cycles)
+		sc->max_cycles = cycles;
+}
+
+/* Adds how full a ring buffer is to the occupancy histogram */
+static void pipeline_ring_occupancy(struct pipeline_counters *pc,
+                                    const libtrace_ringbuffer_t *rb) {
+	size_t capacity = rb->size - 1;
+	size_t used = libtrace_ringbuffer_count(rb);
+	size_t bucket;
+
+	if (used == 0)
+		bucket = 0;
+	else if (used >= capacity)
+		bucket = LIBTRACE_RING_OCCUPANCY_BUCKETS - 1;
+	else
+		bucket = 1 + (used - 1) * (LIBTRACE_RING_OCCUPANCY_BUCKETS - 2) /
+				(capacity - 1);
+	pc->ring_occupancy[bucket]++;
+}
+
+/* Passes any results the reporter thread has batched up to the result batch
+ * callback. This must be called by the reporter thread after every call
+ * into the combiner that might pass on results. */
+static void flush_reporter_batch(libtrace_t *trace) {
+        libtrace_thread_t *t = &trace->reporter_thread;
+
+        if (!trace->reporter_batch || trace->reporter_batch_count == 0)
+                return;
+        (*trace->reporter_cbs->message_result_batch)(trace, t,
+                        trace->global_blob, t->user_data,
+                        trace->reporter_batch, trace->reporter_batch_count);
+        trace->reporter_batch_count = 0;
+}
+
 /* This should optimise away the switch to nothing in the explict cases */
 inline void send_message(libtrace_t *trace, libtrace_thread_t *thread,
                 const enum libtrace_messages type,
@@ -221,6 +297,17 @@ inline void send_message(libtrace_t *trace, libtrace_thread_t *thread,
                                         thread->user_data, type, data, sender);
 		return;
 	case MESSAGE_RESULT:
+#if ENABLE_DTRACE
+                DTRACE_PROBE2(libtrace, result_deliver, data.res->key,
+                                data.res->type);
+#endif
+                if (cbs->message_result_batch && trace->reporter_batch) {
+                        trace->reporter_batch[trace->reporter_batch_count++] =
+                                        *data.res;
+                        if (trace->reporter_batch_count == REPORTER_BATCH_SIZE)
+                                flush_reporter_batch(trace);
+                        return;
+                }
                 if (cbs->message_result)
                         (*cbs->message_result)(trace, thread,
                                         trace->global_blob, thread->user_data,
@@ -381,11 +468,15 @@ static inline bool trace_supports_parallel(libtrace_t *trace)
 void libtrace_zero_thread(libtrace_thread_t * t) {
 	t->accepted_packets = 0;
 	t->filtered_packets = 0;
+	t->overflow_packets = 0;
 	t->recorded_first = false;
 	t->tracetime_offset_usec = 0;
+	t->next_tick = 0;
+	memset(&t->pipeline, 0, sizeof(t->pipeline));
 	t->user_data = 0;
 	t->format_data = 0;
 	libtrace_zero_ringbuffer(&t->rbuffer);
+	libtrace_zero_ringbuffer(&t->spill);
 	t->trace = NULL;
 	t->ret = NULL;
 	t->type = THREAD_EMPTY;
@@ -446,6 +537,12 @@ DLLEXPORT void libtrace_hold_packet(libtrace_packet_t *pkt) {
 	if (pkt->buf_control == TRACE_CTRL_PACKET)
 		return;
 
+	/* Buffers tracked by a bucket stay valid until the packet is
+	 * finalised, unless the format is running out of space for them */
+	if (pkt->srcbucket && pkt->internalid != 0 &&
+			!libtrace_bucket_low_space(pkt->srcbucket))
+		return;
+
     // Can the format module do this beter than copying the
     // entire packet?
     if (pkt->trace && pkt->trace->format->can_hold_packet)
@@ -481,6 +578,50 @@ static void trace_thread_pause(libtrace_t *trace, libtrace_thread_t *t) {
 	ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
 }
 
+/**
+ * Schedules the first interval tick for a processing thread that is about to
+ * start or resume reading packets. Ticks fall on multiples of the tick
+ * interval, so every thread agrees on their timestamps.
+ */
+static void start_tick_interval(libtrace_t *trace, libtrace_thread_t *t) {
+	uint64_t interval = trace->config.tick_interval * 1000;
+	struct timeval tv;
+	uint64_t next = 0;
+
+	if (interval) {
+		gettimeofday(&tv, NULL);
+		next = (tv_to_usec(&tv) / interval + 1) * interval;
+	}
+	__atomic_store_n(&t->next_tick, next, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sends a processing thread any interval ticks that have fallen due. This is
+ * called between bursts of packets, and when the keepalive thread wakes an
+ * idle thread.
+ */
+static void check_tick_interval(libtrace_t *trace, libtrace_thread_t *t) {
+	uint64_t interval = trace->config.tick_interval * 1000;
+	uint64_t next = t->next_tick;
+	libtrace_generic_t data;
+	struct timeval tv;
+	uint64_t now;
+
+	if (!next)
+		return;
+	gettimeofday(&tv, NULL);
+	now = tv_to_usec(&tv);
+	if (now < next)
+		return;
+	for (; next <= now; next += interval) {
+		/* The timestamp is passed on in the erf format */
+		data.uint64 = ((next / 1000000) << 32) +
+				(((next % 1000000) << 32) / 1000000);
+		send_message(trace, t, MESSAGE_TICK_INTERVAL, data, t);
+	}
+	__atomic_store_n(&t->next_tick, next, __ATOMIC_RELAXED);
+}
+
 /**
  * Sends a packet to the user, expects either a valid packet or a TICK packet.
  *
@@ -508,21 +649,18 @@ static inline int dispatch_packet(libtrace_t *trace,
         		t->accepted_packets++;
                 }
 
-		/* If packet is meta call the meta callback */
-		if (IS_LIBTRACE_META_PACKET((*packet))) {
-			/* Pass to meta callback if defined else pass to packet callback */
-			if (trace->perpkt_cbs->message_meta_packet) {
-				*packet = (*trace->perpkt_cbs->message_meta_packet)(trace, t,
-					trace->global_blob, t->user_data, *packet);
-			} else if (trace->perpkt_cbs->message_packet) {
-				*packet = (*trace->perpkt_cbs->message_packet)(trace, t,
-					trace->global_blob, t->user_data, *packet);
-			}
-		} else {
-			if (trace->perpkt_cbs->message_packet) {
-				*packet = (*trace->perpkt_cbs->message_packet)(trace, t,
-					trace->global_blob, t->user_data, *packet);
-			}
+		/* If packet is meta call the meta callback if defined, else
+		 * pass it to the packet callback */
+		if (IS_LIBTRACE_META_PACKET((*packet)) &&
+				trace->perpkt_cbs->message_meta_packet) {
+			*packet = (*trace->perpkt_cbs->message_meta_packet)(trace, t,
+				trace->global_blob, t->user_data, *packet);
+		} else if (trace->perpkt_cbs->message_packet_batch) {
+			(*trace->perpkt_cbs->message_packet_batch)(trace, t,
+				trace->global_blob, t->user_data, packet, 1);
+		} else if (trace->perpkt_cbs->message_packet) {
+			*packet = (*trace->perpkt_cbs->message_packet)(trace, t,
+				trace->global_blob, t->user_data, *packet);
 		}
 		trace_fin_packet(*packet);
 	} else {
@@ -537,6 +675,45 @@ static inline int dispatch_packet(libtrace_t *trace,
 	return 0;
 }
 
+/**
+ * Checks if a packet can be passed to the packet batch callback along with
+ * its neighbours. Ticks, and meta packets that have a callback of their own,
+ * are dispatched one at a time instead.
+ */
+static inline bool in_packet_batch(libtrace_t *trace,
+                                   libtrace_packet_t *packet) {
+	if (packet->error <= 0)
+		return false;
+	return !(IS_LIBTRACE_META_PACKET(packet) &&
+			trace->perpkt_cbs->message_meta_packet);
+}
+
+/**
+ * Sends a run of packets to the user's packet batch callback, every packet
+ * must have been accepted by in_packet_batch().
+ *
+ * @param trace The trace
+ * @param t The current thread
+ * @param packets [in,out] The packets, any packets the user keeps are set
+ *                to null upon return, the rest have been finished.
+ * @param count The number of packets
+ */
+static inline void dispatch_packet_batch(libtrace_t *trace,
+                                         libtrace_thread_t *t,
+                                         libtrace_packet_t *packets[],
+                                         int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!IS_LIBTRACE_META_PACKET(packets[i]))
+			t->accepted_packets++;
+	}
+	(*trace->perpkt_cbs->message_packet_batch)(trace, t,
+		trace->global_blob, t->user_data, packets, count);
+	for (i = 0; i < count; i++)
+		trace_fin_packet(packets[i]);
+}
+
 /**
  * Sends a batch of packets to the user, expects either a valid packet or a
  * TICK packet.
@@ -559,12 +736,34 @@ static inline int dispatch_packets(libtrace_t *trace,
                                   libtrace_packet_t *packets[],
                                   int nb_packets, int *empty, int *offset,
                                   bool tracetime) {
-	for (;*offset < nb_packets; ++*offset) {
-		int ret;
-		ret = dispatch_packet(trace, t, &packets[*offset], tracetime);
+	while (*offset < nb_packets) {
+		int ret = 0;
+		int count = 1;
+
+		/* Pass runs of ordinary packets to the batch callback in one
+		 * go, tracetime has to delay each packet on its own */
+		if (!tracetime && trace->perpkt_cbs->message_packet_batch &&
+				in_packet_batch(trace, packets[*offset])) {
+			while (*offset + count < nb_packets &&
+					in_packet_batch(trace,
+						packets[*offset + count]))
+				count++;
+			dispatch_packet_batch(trace, t, &packets[*offset],
+					count);
+		} else {
+			/* Start loading the next packet while the user is
+			 * busy with this one */
+			if (*offset + 1 < nb_packets &&
+					packets[*offset + 1]->error > 0)
+				__builtin_prefetch(packets[*offset + 1]->payload);
+			ret = dispatch_packet(trace, t, &packets[*offset],
+					tracetime);
+		}
 		if (ret == 0) {
 			/* Move full slots to front as we go */
-			if (packets[*offset]) {
+			for (; count > 0; count--, ++*offset) {
+				if (!packets[*offset])
+					continue;
 				if (*empty != *offset) {
 					packets[*empty] = packets[*offset];
 					packets[*offset] = NULL;
@@ -585,6 +784,26 @@ static inline int dispatch_packets(libtrace_t *trace,
 	return 0;
 }
 
+/* Reads the next packet the hasher has queued for a thread without blocking.
+ * The hasher only spills packets once the queue is full and keeps spilling
+ * until the spill buffer is empty again, so the queue always holds the
+ * older packets. Reading the spill buffer here rather than in the hasher
+ * means spilled packets don't wait for the hasher to read another packet. */
+static inline bool hasher_try_read(libtrace_t *libtrace, libtrace_thread_t *t,
+                                   libtrace_packet_t **packet) {
+	if (libtrace_ringbuffer_try_read(&t->rbuffer, (void **) packet))
+		return true;
+	return libtrace->config.hasher_overflow == HASHER_OVERFLOW_SPILL &&
+		libtrace_ringbuffer_try_read(&t->spill, (void **) packet);
+}
+
+static inline bool hasher_queue_empty(libtrace_t *libtrace,
+                                      libtrace_thread_t *t) {
+	return libtrace_ringbuffer_is_empty(&t->rbuffer) &&
+		(libtrace->config.hasher_overflow != HASHER_OVERFLOW_SPILL ||
+		 libtrace_ringbuffer_is_empty(&t->spill));
+}
+
 /**
  * Pauses a per packet thread, messages will not be processed when the thread
  * is paused.
@@ -603,6 +822,7 @@ static int trace_perpkt_thread_pause(libtrace_t *trace, libtrace_thread_t *t,
 	libtrace_packet_t * packet = NULL;
 
 	/* Let the user thread know we are going to pause */
+	__atomic_store_n(&t->next_tick, 0, __ATOMIC_RELAXED);
 	send_message(trace, t, MESSAGE_PAUSING, gen_zero, t);
 
 	/* Send through any remaining packets (or messages) without delay */
@@ -616,7 +836,7 @@ static int trace_perpkt_thread_pause(libtrace_t *trace, libtrace_thread_t *t,
 	/* If a hasher thread is running, empty input queues so we don't lose data */
 	if (trace_has_dedicated_hasher(trace)) {
 		// The hasher has stopped by this point, so the queue shouldn't be filling
-		while(!libtrace_ringbuffer_is_empty(&t->rbuffer) || t->format_data) {
+		while(!hasher_queue_empty(trace, t) || t->format_data) {
 			int ret = trace->pread(trace, t, &packet, 1);
 			if (ret == 1) {
 				if (packet->error > 0) {
@@ -634,7 +854,7 @@ static int trace_perpkt_thread_pause(libtrace_t *trace, libtrace_thread_t *t,
 				}
 				/* Verify no packets are remaining */
 				/* TODO refactor this sanity check out!! */
-				while (!libtrace_ringbuffer_is_empty(&t->rbuffer)) {
+				while (!hasher_queue_empty(trace, t)) {
 					ASSERT_RET(trace->pread(trace, t, &packet, 1), <= 0);
 					// No packets after this should have any data in them
 					if (packet->error > 0) {
@@ -653,6 +873,7 @@ static int trace_perpkt_thread_pause(libtrace_t *trace, libtrace_thread_t *t,
 	/* Now we do the actual pause, this returns when we resumed */
 	trace_thread_pause(trace, t);
 	send_message(trace, t, MESSAGE_RESUMING, gen_zero, t);
+	start_tick_interval(trace, t);
 	return 1;
 }
 
@@ -673,6 +894,9 @@ static void* perpkt_threads_entry(void *data) {
 	/* The offset to the first NULL packet upto offset */
 	int empty = 0;
         int j;
+	/* Set if this burst is being timed for the pipeline statistics */
+	bool sampled = false;
+	uint64_t start = 0, nested = 0;
 
 	/* Wait until trace_pstart has been completed */
 	ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
@@ -708,11 +932,16 @@ static void* perpkt_threads_entry(void *data) {
 	/* Let the per_packet function know we have started */
 	send_message(trace, t, MESSAGE_STARTING, gen_zero, t);
 	send_message(trace, t, MESSAGE_RESUMING, gen_zero, t);
+	start_tick_interval(trace, t);
 
 	for (;;) {
 
 		if (libtrace_message_queue_try_get(&t->messages, &message) != LIBTRACE_MQ_FAILED) {
 			int ret;
+#if ENABLE_DTRACE
+			DTRACE_PROBE2(libtrace, message_receive, t,
+					message.code);
+#endif
 			switch (message.code) {
 				case MESSAGE_DO_PAUSE: // This is internal
 					ret = trace_perpkt_thread_pause(trace, t,
@@ -729,6 +958,14 @@ static void* perpkt_threads_entry(void *data) {
 					continue;
 				case MESSAGE_DO_STOP: // This is internal
 					goto eof;
+				case MESSAGE_TICK_INTERVAL:
+					/* The keepalive thread is waking us
+					 * up to send any ticks that are due */
+					if (message.sender == &trace->keepalive_thread) {
+						check_tick_interval(trace, t);
+						continue;
+					}
+					break;
 			}
                         send_message(trace, t, message.code, message.data, 
                                         message.sender);
@@ -740,6 +977,7 @@ static void* perpkt_threads_entry(void *data) {
 
 		/* Do we need to read a new set of packets MOST LIKELY we do */
 		if (offset == nb_packets) {
+			check_tick_interval(trace, t);
 			/* Refill the packet buffer */
 			if (empty != nb_packets) {
 				// Refill the empty packets
@@ -748,6 +986,16 @@ static void* perpkt_threads_entry(void *data) {
 						      nb_packets - empty,
 						      nb_packets - empty);
 			}
+			sampled = pipeline_sample(trace, &t->pipeline);
+			if (sampled) {
+				if (trace_has_dedicated_hasher(trace))
+					pipeline_ring_occupancy(&t->pipeline,
+							&t->rbuffer);
+				t->pipeline.sampling = true;
+				nested = t->pipeline.stages[PIPELINE_STAGE_FILTER].cycles +
+					t->pipeline.wait_cycles;
+				start = pipeline_cycles();
+			}
 			if (!trace->pread) {
 				if (!packets[0]) {
 					fprintf(stderr, "Unable to read into NULL packet structure\n");
@@ -760,6 +1008,18 @@ static void* perpkt_threads_entry(void *data) {
 			} else {
 				nb_packets = trace->pread(trace, t, packets, trace->config.burst_size);
 			}
+			if (sampled && nb_packets > 0) {
+				/* Leave out the time spent filtering and
+				 * waiting for the hasher */
+				nested = t->pipeline.stages[PIPELINE_STAGE_FILTER].cycles +
+					t->pipeline.wait_cycles - nested;
+				pipeline_record(&t->pipeline, PIPELINE_STAGE_READ,
+						pipeline_cycles() - start - nested);
+			}
+			if (trace->config.pipeline_stats && nb_packets > 0) {
+				t->pipeline.bursts++;
+				t->pipeline.packets += nb_packets;
+			}
 			offset = 0;
 			empty = 0;
 		}
@@ -774,9 +1034,23 @@ static void* perpkt_threads_entry(void *data) {
         				store_first_packet(trace, packets[j], t);
                                 }
 			}
+			if (sampled) {
+				nested = t->pipeline.stages[PIPELINE_STAGE_COMBINER].cycles;
+				start = pipeline_cycles();
+			}
 			dispatch_packets(trace, t, packets, nb_packets, &empty,
 			                 &offset, trace->tracetime);
+			if (sampled) {
+				/* Leave out the time spent publishing results */
+				nested = t->pipeline.stages[PIPELINE_STAGE_COMBINER].cycles - nested;
+				pipeline_record(&t->pipeline, PIPELINE_STAGE_CALLBACK,
+						pipeline_cycles() - start - nested);
+				t->pipeline.sampling = false;
+				sampled = false;
+			}
 		} else {
+			t->pipeline.sampling = false;
+			sampled = false;
 			switch (nb_packets) {
 			case READ_EOF:
 				goto eof;
@@ -802,6 +1076,7 @@ eof:
 	/* ~~~~~~~~~~~~~~ Trace is finished do tear down ~~~~~~~~~~~~~~~~~~~~~ */
 
 	// Let the per_packet function know we have stopped
+	__atomic_store_n(&t->next_tick, 0, __ATOMIC_RELAXED);
 	send_message(trace, t, MESSAGE_PAUSING, gen_zero, t);
 	send_message(trace, t, MESSAGE_STOPPING, gen_zero, t);
 
@@ -831,6 +1106,79 @@ eof:
 	pthread_exit(NULL);
 }
 
+/* Called once the hasher has stopped reading, waits for a thread to read
+ * every packet left in its spill buffer so that they arrive before the end
+ * of the trace. If the thread finishes first its spilled packets are freed
+ * instead. */
+static void hasher_flush_spill(libtrace_t *trace, libtrace_thread_t *t) {
+	libtrace_packet_t *packet;
+
+	while (!libtrace_ringbuffer_is_empty(&t->spill)) {
+		if (t->state == THREAD_FINISHED) {
+			packet = libtrace_ringbuffer_read(&t->spill);
+			trace_free_packet(trace, packet);
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+/* Queues a packet for a processing thread, following the trace's overflow
+ * policy if the thread's queue is full. Ticks are never dropped, the hasher
+ * waits for room for them instead.
+ *
+ * Returns false if the packet was dropped, in which case it still belongs
+ * to the hasher. */
+static bool hasher_queue_packet(libtrace_t *trace, libtrace_thread_t *hasher,
+                                libtrace_thread_t *t,
+                                libtrace_packet_t *packet) {
+	libtrace_ringbuffer_t *rb = &t->rbuffer;
+	bool tick = packet->error == READ_TICK;
+	uint64_t start;
+
+	switch (trace->config.hasher_overflow) {
+	case HASHER_OVERFLOW_DROP:
+		if (libtrace_ringbuffer_try_write(rb, packet))
+			return true;
+		if (!tick)
+			goto overflow;
+		break;
+	case HASHER_OVERFLOW_SPILL:
+		/* The thread reads its spill buffer once its queue is empty.
+		 * Packets must reach it in order, so they only go straight to
+		 * the queue while nothing is spilled */
+		if (libtrace_ringbuffer_is_empty(&t->spill) &&
+				libtrace_ringbuffer_try_write(rb, packet))
+			return true;
+		if (libtrace_ringbuffer_try_write(&t->spill, packet))
+			return true;
+		if (!tick)
+			goto overflow;
+		while (!libtrace_ringbuffer_try_write(&t->spill, packet))
+			sched_yield();
+		return true;
+	default:
+		break;
+	}
+
+	if (trace->config.pipeline_stats && libtrace_ringbuffer_is_full(rb)) {
+		start = pipeline_cycles();
+		libtrace_ringbuffer_write(rb, packet);
+		pipeline_record(&hasher->pipeline, PIPELINE_STAGE_RING_WAIT,
+				pipeline_cycles() - start);
+	} else {
+		libtrace_ringbuffer_write(rb, packet);
+	}
+	return true;
+
+overflow:
+#if ENABLE_DTRACE
+	DTRACE_PROBE1(libtrace, hasher_overflow, t->perpkt_num);
+#endif
+	t->overflow_packets++;
+	return false;
+}
+
 /**
  * The start point for our single threaded hasher thread, this will read
  * and hash a packet from a data source and queue it against the correct
@@ -843,9 +1191,15 @@ static void* hasher_entry(void *data) {
 	libtrace_t *trace = (libtrace_t *)data;
 	libtrace_thread_t * t;
 	int i;
-	libtrace_packet_t * packet;
+	libtrace_packet_t *packets[trace->config.burst_size];
+	uint64_t hashes[trace->config.burst_size];
+	/* packets[0..nb_fresh) are ready to be read into */
+	size_t nb_fresh = 0;
+	size_t nb_packets, kept, j;
+	libtrace_packet_t * packet = NULL;
 	libtrace_message_t message = {0, {.uint64=0}, NULL};
-	int pkt_skipped = 0;
+	bool sampled;
+	uint64_t start = 0, read_end = 0;
 
 	if (!trace_has_dedicated_hasher(trace)) {
 		fprintf(stderr, "Trace does not have hasher associated with it in hasher_entry()\n");
@@ -866,19 +1220,30 @@ static void* hasher_entry(void *data) {
 	}
 	ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
 
-	/* Read all packets in then hash and queue against the correct thread */
+	/* Read a burst of packets, then hash and queue each against the
+	 * correct thread. The burst size is 1 for live formats, so packets
+	 * are never held back waiting for the rest of a burst. */
 	while (1) {
-		int thread;
-		if (!pkt_skipped)
-			libtrace_ocache_alloc(&trace->packet_freelist, (void **) &packet, 1, 1);
-		if (!packet) {
-			fprintf(stderr, "Hasher thread was unable to get a fresh packet from the "
-				"object cache\n");
-			pthread_exit(NULL);
+		/* Top up the burst, packets that weren't queued are reused */
+		if (nb_fresh < trace->config.burst_size) {
+			size_t need = trace->config.burst_size - nb_fresh;
+
+			if (libtrace_ocache_alloc(&trace->packet_freelist,
+					(void **) &packets[nb_fresh], need,
+					need) != need) {
+				fprintf(stderr, "Hasher thread was unable to get a fresh packet from the "
+					"object cache\n");
+				pthread_exit(NULL);
+			}
+			nb_fresh = trace->config.burst_size;
 		}
 
 		// Check for messages that we expect MESSAGE_DO_PAUSE, (internal messages only)
 		if (libtrace_message_queue_try_get(&t->messages, &message) != LIBTRACE_MQ_FAILED) {
+#if ENABLE_DTRACE
+			DTRACE_PROBE2(libtrace, message_receive, t,
+					message.code);
+#endif
 			switch(message.code) {
 				case MESSAGE_DO_PAUSE:
 					ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
@@ -899,52 +1264,117 @@ static void* hasher_entry(void *data) {
 						pthread_exit(NULL);
 					}
 					/* Mark the current packet as EOF */
+					packet = packets[--nb_fresh];
 					packet->error = 0;
 					goto hasher_eof;
 				default:
 					fprintf(stderr, "Hasher thread didn't expect message code=%d\n", message.code);
 			}
-			pkt_skipped = 1;
 			continue;
 		}
 
-		if ((packet->error = trace_read_packet(trace, packet)) <1) {
-			if (packet->error == READ_MESSAGE) {
-				pkt_skipped = 1;
-				continue;
-			} else {
-				break; /* We are EOF or error'd either way we stop  */
+		sampled = pipeline_sample(trace, &t->pipeline);
+		if (sampled)
+			start = pipeline_cycles();
+		for (nb_packets = 0; nb_packets < nb_fresh; nb_packets++) {
+			libtrace_packet_t *p = packets[nb_packets];
+
+			if ((p->error = trace_read_packet(trace, p)) < 1) {
+				if (p->error != READ_MESSAGE) {
+					/* We are EOF or error'd either way
+					 * we stop, once the burst is queued */
+					packet = p;
+					packets[nb_packets] = packets[--nb_fresh];
+				}
+				break;
+			}
+			/* Hold the packet to ensure it buffers do not
+			 * unexpectedly change. This can happen if format
+			 * module manages its own buffers that may be reused
+			 * before the packet is finised. */
+			libtrace_hold_packet(p);
+			if (sampled)
+				read_end = pipeline_cycles();
+			/* Don't hold up a pause waiting for the burst */
+			if (libtrace_message_queue_count(&t->messages) > 0) {
+				nb_packets++;
+				break;
 			}
 		}
-
-        /* Hold the packet to ensure it buffers do not unexpectedly change. This can happen
-		 * if format module manages its own buffers that may be reused before the packet is
-		 * finised.
-         */
-        libtrace_hold_packet(packet);
+		/* A read that found no packet is waiting, not reading */
+		if (sampled && nb_packets > 0) {
+			pipeline_record(&t->pipeline, PIPELINE_STAGE_HASHER_READ,
+					read_end - start);
+			start = pipeline_cycles();
+		}
 
 		/* We are guaranteed to have a hash function i.e. != NULL */
-		trace_packet_set_hash(packet, (*trace->hasher)(packet, trace->hasher_data));
-		thread = trace_packet_get_hash(packet) % trace->perpkt_thread_count;
-		/* Blocking write to the correct queue - I'm the only writer */
-		if (trace->perpkt_threads[thread].state != THREAD_FINISHED) {
-			uint64_t order = trace_packet_get_order(packet);
-			libtrace_ringbuffer_write(&trace->perpkt_threads[thread].rbuffer, packet);
-			if (trace->config.tick_count && order % trace->config.tick_count == 0) {
-				// Write ticks to everyone else
-				libtrace_packet_t * pkts[trace->perpkt_thread_count];
-				memset(pkts, 0, sizeof(void *) * trace->perpkt_thread_count);
-				libtrace_ocache_alloc(&trace->packet_freelist, (void **) pkts, trace->perpkt_thread_count, trace->perpkt_thread_count);
-				for (i = 0; i < trace->perpkt_thread_count; i++) {
-					pkts[i]->error = READ_TICK;
-					trace_packet_set_order(pkts[i], order);
-					libtrace_ringbuffer_write(&trace->perpkt_threads[i].rbuffer, pkts[i]);
+		if (trace->hasher == (fn_hasher) toeplitz_table_hash_packet ||
+				trace->hasher == (fn_hasher) toeplitz_table_hash_inner_packet) {
+			toeplitz_hash_packets(packets, nb_packets,
+					trace->hasher_data,
+					trace->hasher == (fn_hasher) toeplitz_table_hash_inner_packet,
+					hashes);
+		} else {
+			for (j = 0; j < nb_packets; j++)
+				hashes[j] = (*trace->hasher)(packets[j],
+						trace->hasher_data);
+		}
+		if (sampled && nb_packets > 0)
+			pipeline_record(&t->pipeline, PIPELINE_STAGE_HASHER,
+					pipeline_cycles() - start);
+
+		kept = 0;
+		for (j = 0; j < nb_packets; j++) {
+			int thread;
+			bool queued = false;
+			libtrace_packet_t *p = packets[j];
+
+			trace_packet_set_hash(p, hashes[j]);
+			thread = hashes[j] % trace->perpkt_thread_count;
+#if ENABLE_DTRACE
+			DTRACE_PROBE2(libtrace, hasher_dispatch, thread,
+					hashes[j]);
+#endif
+			/* Write to the correct queue - I'm the only writer */
+			if (trace->perpkt_threads[thread].state != THREAD_FINISHED) {
+				uint64_t order = trace_packet_get_order(p);
+
+				queued = hasher_queue_packet(trace, t,
+						&trace->perpkt_threads[thread], p);
+				if (trace->config.tick_count && order % trace->config.tick_count == 0) {
+					// Write ticks to everyone else
+					libtrace_packet_t * pkts[trace->perpkt_thread_count];
+					memset(pkts, 0, sizeof(void *) * trace->perpkt_thread_count);
+					libtrace_ocache_alloc(&trace->packet_freelist, (void **) pkts, trace->perpkt_thread_count, trace->perpkt_thread_count);
+					for (i = 0; i < trace->perpkt_thread_count; i++) {
+						pkts[i]->error = READ_TICK;
+						trace_packet_set_order(pkts[i], order);
+						hasher_queue_packet(trace, t,
+								&trace->perpkt_threads[i],
+								pkts[i]);
+					}
 				}
 			}
-			pkt_skipped = 0;
+			/* A dropped packet is reused for the next read */
+			if (!queued)
+				packets[kept++] = p;
 		}
+		/* Along with any that weren't read into */
+		for (j = nb_packets; j < nb_fresh; j++)
+			packets[kept++] = packets[j];
+		nb_fresh = kept;
+
+		if (packet)
+			break;
 	}
 hasher_eof:
+	libtrace_ocache_free(&trace->packet_freelist, (void **) packets,
+			nb_fresh, nb_fresh);
+	if (trace->config.hasher_overflow == HASHER_OVERFLOW_SPILL) {
+		for (i = 0; i < trace->perpkt_thread_count; i++)
+			hasher_flush_spill(trace, &trace->perpkt_threads[i]);
+	}
 	/* Broadcast our last failed read to all threads */
 	for (i = 0; i < trace->perpkt_thread_count; i++) {
 		libtrace_packet_t * bcast;
@@ -955,6 +1385,15 @@ hasher_eof:
 			bcast->error = packet->error;
 		}
 		ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
+		/* Wait for room without the lock, which a thread still
+		 * starting up needs. Unless packets are blocked for, the
+		 * hasher can reach the end before every thread has started */
+		while (trace->perpkt_threads[i].state != THREAD_FINISHED &&
+				libtrace_ringbuffer_is_full(&trace->perpkt_threads[i].rbuffer)) {
+			ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
+			sched_yield();
+			ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
+		}
 		if (trace->perpkt_threads[i].state != THREAD_FINISHED) {
 			libtrace_ringbuffer_write(&trace->perpkt_threads[i].rbuffer, bcast);
 		} else {
@@ -1043,17 +1482,22 @@ inline static int trace_pread_packet_hasher_thread(libtrace_t *libtrace,
                                                    libtrace_packet_t *packets[],
                                                    size_t nb_packets) {
 	size_t i;
+	uint64_t wait_start = 0;
 
         /* We store the last error message here */
         if (t->format_data) {
                 return ((libtrace_packet_t *)t->format_data)->error;
         }
 
+        /* Waiting for the hasher is left out of the read stage */
+        if (t->pipeline.sampling && hasher_queue_empty(libtrace, t))
+                wait_start = pipeline_cycles();
+
         /* libtrace_ringbuffer_read() blocks if a packet is not available
          * and this prevents the tick messages from being triggered. So check
          * for a available packet before continuing.
          */
-        while (libtrace_ringbuffer_is_empty(&t->rbuffer)) {
+        while (hasher_queue_empty(libtrace, t)) {
 
                 /* does libtrace have any messages in the queue */
                 if (libtrace_message_queue_count(&t->messages) > 0) {
@@ -1065,11 +1509,14 @@ inline static int trace_pread_packet_hasher_thread(libtrace_t *libtrace,
                  */
                 sched_yield();
         }
+	if (wait_start)
+		t->pipeline.wait_cycles += pipeline_cycles() - wait_start;
 
 	// Always grab at least one
 	if (packets[0]) // Recycle the old get the new
 		libtrace_ocache_free(&libtrace->packet_freelist, (void **) packets, 1, 1);
-	packets[0] = libtrace_ringbuffer_read(&t->rbuffer);
+	/* We are the only reader, so this can't fail */
+	hasher_try_read(libtrace, t, &packets[0]);
 
 	if (packets[0]->error <= 0 && packets[0]->error != READ_TICK) {
 		return packets[0]->error;
@@ -1078,13 +1525,13 @@ inline static int trace_pread_packet_hasher_thread(libtrace_t *libtrace,
 	for (i = 1; i < nb_packets; i++) {
 		if (packets[i]) // Recycle the old get the new
 			libtrace_ocache_free(&libtrace->packet_freelist, (void **) &packets[i], 1, 1);
-		if (!libtrace_ringbuffer_try_read(&t->rbuffer, (void **) &packets[i])) {
+		if (!hasher_try_read(libtrace, t, &packets[i])) {
 			packets[i] = NULL;
 			break;
 		}
 
 		/* We will return an error or EOF the next time around */
-		if (packets[i]->error <= 0 && packets[0]->error != READ_TICK) {
+		if (packets[i]->error <= 0 && packets[i]->error != READ_TICK) {
 			/* The message case will be checked automatically -
 			   However other cases like EOF and error will only be
 			   sent once*/
@@ -1218,6 +1665,8 @@ static void* reporter_entry(void *data) {
 	libtrace_message_t message = {0, {.uint64=0}, NULL};
 	libtrace_t *trace = (libtrace_t *)data;
 	libtrace_thread_t *t = &trace->reporter_thread;
+	bool sampled;
+	uint64_t start = 0;
 
 	/* Wait until all threads are started */
 	ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
@@ -1232,6 +1681,14 @@ static void* reporter_entry(void *data) {
 		trace->format->pregister_thread(trace, t, false);
 	}
 
+	if (trace->reporter_cbs->message_result_batch) {
+		trace->reporter_batch = malloc(REPORTER_BATCH_SIZE *
+				sizeof(libtrace_result_t));
+		trace->reporter_batch_count = 0;
+		if (!trace->reporter_batch)
+			fprintf(stderr, "Unable to allocate memory for the reporter result batch\n");
+	}
+
 	send_message(trace, t, MESSAGE_STARTING, (libtrace_generic_t){0}, t);
 	send_message(trace, t, MESSAGE_RESUMING, (libtrace_generic_t){0}, t);
 
@@ -1239,17 +1696,35 @@ static void* reporter_entry(void *data) {
 		if (trace->config.reporter_polling) {
 			if (libtrace_message_queue_try_get(&t->messages, &message) == LIBTRACE_MQ_FAILED)
 				message.code = MESSAGE_POST_REPORTER;
+#if ENABLE_DTRACE
+			else
+				DTRACE_PROBE2(libtrace, message_receive, t,
+						message.code);
+#endif
 		} else {
 			libtrace_message_queue_get(&t->messages, &message);
+#if ENABLE_DTRACE
+			DTRACE_PROBE2(libtrace, message_receive, t,
+					message.code);
+#endif
 		}
 		switch (message.code) {
 			// Check for results
 			case MESSAGE_POST_REPORTER:
+				sampled = pipeline_sample(trace, &t->pipeline);
+				if (sampled)
+					start = pipeline_cycles();
 				trace->combiner.read(trace, &trace->combiner);
+				flush_reporter_batch(trace);
+				if (sampled)
+					pipeline_record(&t->pipeline,
+							PIPELINE_STAGE_REPORTER,
+							pipeline_cycles() - start);
 				break;
 			case MESSAGE_DO_PAUSE:
 				if(trace->combiner.pause) {
 					trace->combiner.pause(trace, &trace->combiner);
+					flush_reporter_batch(trace);
 				}
 				send_message(trace, t, MESSAGE_PAUSING,
                                                 (libtrace_generic_t) {0}, t);
@@ -1265,6 +1740,9 @@ static void* reporter_entry(void *data) {
 
 	// Flush out whats left now all our threads have finished
 	trace->combiner.read_final(trace, &trace->combiner);
+	flush_reporter_batch(trace);
+	free(trace->reporter_batch);
+	trace->reporter_batch = NULL;
 
 	// GOODBYE
         send_message(trace, t, MESSAGE_PAUSING,(libtrace_generic_t) {0}, t);
@@ -1275,13 +1753,21 @@ static void* reporter_entry(void *data) {
 	pthread_exit(NULL);
 }
 
-/** Similar to delay_tracetime but send messages to all threads periodically */
+/**
+ * Wakes processing threads that have an interval tick due but are idle,
+ * e.g. blocked waiting for packets. Busy threads send themselves ticks
+ * between bursts, so this only checks each thread a quarter of an interval
+ * after every tick and leaves alone any thread that has already sent it.
+ */
 static void* keepalive_entry(void *data) {
-	struct timeval prev, next;
+	struct timeval next;
 	libtrace_message_t message = {0, {.uint64=0}, NULL};
 	libtrace_t *trace = (libtrace_t *)data;
-	uint64_t next_release;
+	uint64_t interval = trace->config.tick_interval * 1000;
+	uint64_t slack = interval / 4;
+	uint64_t next_release, now;
 	libtrace_thread_t *t = &trace->keepalive_thread;
+	int i;
 
 	/* Wait until all threads are started */
 	ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
@@ -1292,34 +1778,38 @@ static void* keepalive_entry(void *data) {
 	}
 	ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
 
-	gettimeofday(&prev, NULL);
         memset(&message, 0, sizeof(libtrace_message_t));
 	message.code = MESSAGE_TICK_INTERVAL;
+	message.sender = t;
 
 	while (trace->state != STATE_FINISHED) {
 		fd_set rfds;
-		next_release = tv_to_usec(&prev) + (trace->config.tick_interval * 1000);
 		gettimeofday(&next, NULL);
-		if (next_release > tv_to_usec(&next)) {
-			next = usec_to_tv(next_release - tv_to_usec(&next));
-			// Wait for timeout or a message
-			FD_ZERO(&rfds);
-			FD_SET(libtrace_message_queue_get_fd(&t->messages), &rfds);
-			if (select(libtrace_message_queue_get_fd(&t->messages)+1, &rfds, NULL, NULL, &next) == 1) {
-				libtrace_message_t msg;
-				libtrace_message_queue_get(&t->messages, &msg);
-				if (msg.code != MESSAGE_DO_STOP) {
-					fprintf(stderr, "Unexpected message code in keepalive_entry()\n");
-					pthread_exit(NULL);
-				}
-				goto done;
+		now = tv_to_usec(&next);
+		next_release = ((now - slack) / interval + 1) * interval + slack;
+		next = usec_to_tv(next_release - now);
+		// Wait for timeout or a message
+		FD_ZERO(&rfds);
+		FD_SET(libtrace_message_queue_get_fd(&t->messages), &rfds);
+		if (select(libtrace_message_queue_get_fd(&t->messages)+1, &rfds, NULL, NULL, &next) == 1) {
+			libtrace_message_t msg;
+			libtrace_message_queue_get(&t->messages, &msg);
+			if (msg.code != MESSAGE_DO_STOP) {
+				fprintf(stderr, "Unexpected message code in keepalive_entry()\n");
+				pthread_exit(NULL);
 			}
+			goto done;
 		}
-		prev = usec_to_tv(next_release);
-		if (trace->state == STATE_RUNNING) {
-			message.data.uint64 = ((((uint64_t)prev.tv_sec) << 32) +
-			                       (((uint64_t)prev.tv_usec << 32)/1000000));
-			trace_message_perpkts(trace, &message);
+		if (trace->state != STATE_RUNNING)
+			continue;
+		for (i = 0; i < trace->perpkt_thread_count; i++) {
+			libtrace_thread_t *perpkt = &trace->perpkt_threads[i];
+			uint64_t due = __atomic_load_n(&perpkt->next_tick,
+					__ATOMIC_RELAXED);
+
+			if (due && due <= next_release - slack &&
+					perpkt->state == THREAD_RUNNING)
+				trace_message_thread(trace, perpkt, &message);
 		}
 	}
 done:
@@ -1399,8 +1889,11 @@ static inline size_t filter_packets(libtrace_t *trace,
 	size_t i;
 
 	for (i = 0; i < nb_packets; ++i) {
-		// The filter needs the trace attached to receive the link type
-		packets[i]->trace = trace;
+		// The filter needs the trace attached to receive the link type,
+		// but keep any trace the format has already assigned (e.g. the
+		// dummy traces used by rt)
+		if (!packets[i]->trace)
+			packets[i]->trace = trace;
                 packets[i]->which_trace_start = trace->startcount;
 		if (trace_apply_filter(trace->filter, packets[i])) {
 			libtrace_packet_t *tmp;
@@ -1449,9 +1942,17 @@ static int trace_pread_packet_wrapper(libtrace_t *libtrace,
 	if (libtrace->format->pread_packets) {
 		int ret;
 		do {
+#if ENABLE_DTRACE
+			DTRACE_PROBE1(libtrace, read_start,
+					libtrace->format->name);
+#endif
 			ret=libtrace->format->pread_packets(libtrace, t,
 			                                    packets,
 			                                    nb_packets);
+#if ENABLE_DTRACE
+			DTRACE_PROBE2(libtrace, read_done,
+					libtrace->format->name, ret);
+#endif
 			/* Error, EOF or message? */
 			if (ret <= 0) {
 				return ret;
@@ -1459,8 +1960,16 @@ static int trace_pread_packet_wrapper(libtrace_t *libtrace,
 
 			if (libtrace->filter) {
 				int remaining;
+				uint64_t start = 0;
+
+				if (t->pipeline.sampling)
+					start = pipeline_cycles();
 				remaining = filter_packets(libtrace,
 				                           packets, ret);
+				if (t->pipeline.sampling)
+					pipeline_record(&t->pipeline,
+							PIPELINE_STAGE_FILTER,
+							pipeline_cycles() - start);
 				t->filtered_packets += ret - remaining;
 				ret = remaining;
 			}
@@ -1538,6 +2047,7 @@ static int trace_prestart(libtrace_t * libtrace, void *global_blob,
 	for (i = 0; i < libtrace->perpkt_thread_count; ++i) {
 		libtrace->perpkt_threads[i].accepted_packets = 0;
 		libtrace->perpkt_threads[i].filtered_packets = 0;
+		libtrace->perpkt_threads[i].overflow_packets = 0;
 	}
 	libtrace->accepted_packets = 0;
 	libtrace->filtered_packets = 0;
@@ -1605,9 +2115,17 @@ SIMPLE_FUNCTION static int get_nb_cores() {
 static void verify_configuration(libtrace_t *libtrace) {
 
         int i;
+	size_t queued_packets;
 
 	if (libtrace->config.hasher_queue_size <= 0)
 		libtrace->config.hasher_queue_size = 1000;
+	if (libtrace->config.hasher_spill_size <= 0)
+		libtrace->config.hasher_spill_size =
+		                4 * libtrace->config.hasher_queue_size;
+	queued_packets = libtrace->config.hasher_queue_size;
+	/* Spilled packets are held by the hasher rather than queued */
+	if (libtrace->config.hasher_overflow == HASHER_OVERFLOW_SPILL)
+		queued_packets += libtrace->config.hasher_spill_size;
 
 	if (libtrace->config.perpkt_threads <= 0) {
 		libtrace->perpkt_thread_count = get_nb_cores();
@@ -1625,15 +2143,36 @@ static void verify_configuration(libtrace_t *libtrace) {
 	if (libtrace->config.thread_cache_size <= 0)
 		libtrace->config.thread_cache_size = 64;
 	if (libtrace->config.cache_size <= 0)
-		libtrace->config.cache_size = (libtrace->config.hasher_queue_size + 1) * libtrace->perpkt_thread_count;
+		libtrace->config.cache_size = (queued_packets + 1) * libtrace->perpkt_thread_count;
 
 	if (libtrace->config.cache_size <
-		(libtrace->config.hasher_queue_size + 1) * libtrace->perpkt_thread_count)
+		(queued_packets + 1) * libtrace->perpkt_thread_count)
 		fprintf(stderr, "WARNING deadlocks may occur and extra memory allocating buffer sizes (packet_freelist_size) mismatched\n");
 
 	if (libtrace->combiner.initialise == NULL && libtrace->combiner.publish == NULL)
 		libtrace->combiner = combiner_unordered;
 
+	/* A hasher named in the configuration replaces the program's */
+	if (libtrace->config.hasher_configured)
+		trace_set_hasher(libtrace, libtrace->config.hasher_type, NULL,
+		                 NULL);
+
+	/* The hash fields may have been set after the hasher */
+	if (libtrace->hasher == (fn_hasher) symmetric_hash_packet &&
+	    libtrace->hasher_owner == HASH_OWNED_LIBTRACE) {
+		((symmetric_conf_t *) libtrace->hasher_data)->fields =
+		                libtrace->config.hasher_fields;
+	}
+	/* The Toeplitz hashers only differ in whether tunnels are removed */
+	if ((libtrace->hasher == (fn_hasher) toeplitz_table_hash_packet ||
+	     libtrace->hasher == (fn_hasher) toeplitz_table_hash_inner_packet) &&
+	    libtrace->hasher_owner == HASH_OWNED_LIBTRACE) {
+		if (libtrace->config.hasher_fields == HASHER_FIELDS_INNER)
+			libtrace->hasher = (fn_hasher) toeplitz_table_hash_inner_packet;
+		else
+			libtrace->hasher = (fn_hasher) toeplitz_table_hash_packet;
+	}
+
 	/* Figure out if we are using a dedicated hasher thread? */
 	if (libtrace->hasher && libtrace->perpkt_thread_count > 1) {
 		libtrace->hasher_thread.type = THREAD_HASHER;
@@ -1685,6 +2224,7 @@ static int trace_start_thread(libtrace_t *trace,
 	t->user_data = NULL;
 	t->type = type;
 	t->state = THREAD_RUNNING;
+	memset(&t->pipeline, 0, sizeof(t->pipeline));
 
 	if (!name) {
 		trace_set_err(trace, TRACE_ERR_THREAD, "NULL thread name in trace_start_thread()");
@@ -1722,6 +2262,10 @@ static int trace_start_thread(libtrace_t *trace,
 		                         trace->config.hasher_polling?
 		                                 LIBTRACE_RINGBUFFER_POLLING:
 		                                 LIBTRACE_RINGBUFFER_BLOCKING);
+		if (trace->config.hasher_overflow == HASHER_OVERFLOW_SPILL)
+			libtrace_ringbuffer_init(&t->spill,
+			                         trace->config.hasher_spill_size,
+			                         LIBTRACE_RINGBUFFER_POLLING);
 	}
 #if defined(HAVE_PTHREAD_SETNAME_NP) && defined(__linux__)
 	if(name)
@@ -1858,11 +2402,13 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
                 goto cleanup_none;
         }
 
-        if (per_packet_cbs->message_packet == NULL) {
+        if (per_packet_cbs->message_packet == NULL &&
+                        per_packet_cbs->message_packet_batch == NULL) {
                 trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "The per "
                                 "packet callbacks must include a handler "
                                 "for a packet. Please set this using "
-                                "trace_set_packet_cb().");
+                                "trace_set_packet_cb() or "
+                                "trace_set_packet_batch_cb().");
                 goto cleanup_none;
         }
 
@@ -1930,6 +2476,18 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
 	sigemptyset(&sig_block_all);
 	ASSERT_RET(pthread_sigmask(SIG_SETMASK, &sig_block_all, &sig_before), == 0);
 
+	/* Set up the combiner before any thread can publish to it */
+	if (reporter_cbs && libtrace->combiner.initialise) {
+		if (libtrace->combiner.initialise(libtrace,
+				&libtrace->combiner) != 0)
+			goto cleanup_started;
+	}
+
+	if (libtrace->config.pipeline_stats) {
+		libtrace->pipeline_start_cycles = pipeline_cycles();
+		libtrace->pipeline_start_ns = pipeline_ns();
+	}
+
 	/* If we need a hasher thread start it
 	 * Special Case: If single threaded we don't need a hasher
 	 */
@@ -1939,7 +2497,7 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
 		                   THREAD_HASHER, hasher_entry, -1,
 		                   "hasher-thread");
 		if (ret != 0)
-			goto cleanup_started;
+			goto cleanup_combiner;
 		libtrace->pread = trace_pread_packet_hasher_thread;
 	} else {
 		libtrace->hasher_thread.type = THREAD_EMPTY;
@@ -1965,8 +2523,6 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
 
 	/* Start the reporter thread */
 	if (reporter_cbs) {
-		if (libtrace->combiner.initialise)
-			libtrace->combiner.initialise(libtrace, &libtrace->combiner);
 		ret = trace_start_thread(libtrace, &libtrace->reporter_thread,
 		                   THREAD_REPORTER, reporter_entry, -1,
 		                   "reporter_thread");
@@ -2051,6 +2607,11 @@ cleanup_threads:
 		return -1;
 	}
 	libtrace->perpkt_thread_states[THREAD_FINISHED] = 0;
+cleanup_combiner:
+	/* No thread is using the combiner now, trace_destroy() won't free it
+	 * as the trace never left STATE_NEW */
+	if (reporter_cbs && libtrace->combiner.destroy)
+		libtrace->combiner.destroy(libtrace, &libtrace->combiner);
 cleanup_started:
 	if (libtrace->pread == trace_pread_packet_wrapper) {
 		if (libtrace->format->ppause_input)
@@ -2097,6 +2658,12 @@ DLLEXPORT int trace_set_packet_cb(libtrace_callback_set_t *cbset,
 	return 0;
 }
 
+DLLEXPORT int trace_set_packet_batch_cb(libtrace_callback_set_t *cbset,
+                fn_cb_packet_batch handler) {
+	cbset->message_packet_batch = handler;
+	return 0;
+}
+
 DLLEXPORT int trace_set_meta_packet_cb(libtrace_callback_set_t *cbset,
 		fn_cb_meta_packet handler) {
 	cbset->message_meta_packet = handler;
@@ -2127,6 +2694,12 @@ DLLEXPORT int trace_set_result_cb(libtrace_callback_set_t *cbset,
 	return 0;
 }
 
+DLLEXPORT int trace_set_result_batch_cb(libtrace_callback_set_t *cbset,
+                fn_cb_result_batch handler) {
+	cbset->message_result_batch = handler;
+	return 0;
+}
+
 DLLEXPORT int trace_set_user_message_cb(libtrace_callback_set_t *cbset,
                 fn_cb_usermessage handler) {
 	cbset->message_user = handler;
@@ -2232,6 +2805,7 @@ DLLEXPORT int trace_ppause(libtrace_t *libtrace)
 			fprintf(stderr, "Reporter thread is running, asking it to pause ...");
 		if (pthread_equal(pthread_self(), libtrace->reporter_thread.tid)) {
                         libtrace->combiner.pause(libtrace, &libtrace->combiner);
+                        flush_reporter_batch(libtrace);
                         thread_change_state(libtrace, &libtrace->reporter_thread, THREAD_PAUSED, true);
                 
                 } else {
@@ -2314,6 +2888,7 @@ DLLEXPORT int trace_pstop(libtrace_t *libtrace)
 
 DLLEXPORT int trace_set_hasher(libtrace_t *trace, enum hasher_types type, fn_hasher hasher, void *data) {
 	int ret = -1;
+	toeplitz_conf_t toeplitz;
 	if ((type == HASHER_CUSTOM && !hasher) || (type == HASHER_BALANCE && hasher)) {
 		return -1;
 	}
@@ -2330,6 +2905,10 @@ DLLEXPORT int trace_set_hasher(libtrace_t *trace, enum hasher_types type, fn_has
 		trace->hasher_data = data;
                 trace->hasher_owner = HASH_OWNED_EXTERNAL;
 	} else {
+                if (trace->hasher_owner == HASH_OWNED_LIBTRACE &&
+                                trace->hasher_data) {
+                        free(trace->hasher_data);
+                }
 		trace->hasher = NULL;
 		trace->hasher_data = NULL;
                 trace->hasher_owner = HASH_OWNED_LIBTRACE;
@@ -2357,15 +2936,23 @@ DLLEXPORT int trace_set_hasher(libtrace_t *trace, enum hasher_types type, fn_has
                                         err = trace_get_err(trace);
 					return 0;
 				case HASHER_BIDIRECTIONAL:
-					trace->hasher = (fn_hasher) toeplitz_hash_packet;
-					trace->hasher_data = calloc(1, sizeof(toeplitz_conf_t));
-					toeplitz_init_config(trace->hasher_data, 1);
+				case HASHER_UNIDIRECTIONAL:
+					toeplitz_init_config(&toeplitz,
+							type == HASHER_BIDIRECTIONAL);
+					trace->hasher_data = toeplitz_create_table(&toeplitz);
+					if (!trace->hasher_data) {
+						trace_set_err(trace, TRACE_ERR_OUT_OF_MEMORY,
+							"Unable to allocate memory for the hasher");
+						return -1;
+					}
+					trace->hasher = (fn_hasher) toeplitz_table_hash_packet;
                                         err = trace_get_err(trace);
 					return 0;
-				case HASHER_UNIDIRECTIONAL:
-					trace->hasher = (fn_hasher) toeplitz_hash_packet;
-					trace->hasher_data = calloc(1, sizeof(toeplitz_conf_t));
-					toeplitz_init_config(trace->hasher_data, 0);
+				case HASHER_SYMMETRIC:
+					trace->hasher = (fn_hasher) symmetric_hash_packet;
+					trace->hasher_data = calloc(1, sizeof(symmetric_conf_t));
+					symmetric_init_config(trace->hasher_data,
+							trace->config.hasher_fields);
                                         err = trace_get_err(trace);
 					return 0;
 			}
@@ -2427,6 +3014,11 @@ DLLEXPORT void trace_join(libtrace_t *libtrace) {
 				return;
 			}
 			libtrace_ringbuffer_destroy(&libtrace->perpkt_threads[i].rbuffer);
+			if (libtrace->config.hasher_overflow == HASHER_OVERFLOW_SPILL) {
+				while(libtrace_ringbuffer_try_read(&libtrace->perpkt_threads[i].spill, (void **) &packet))
+					trace_destroy_packet(packet);
+				libtrace_ringbuffer_destroy(&libtrace->perpkt_threads[i].spill);
+			}
 		}
 		// Cannot destroy vector yet, this happens with trace_destroy
 	}
@@ -2497,6 +3089,9 @@ DLLEXPORT int trace_message_thread(libtrace_t * libtrace, libtrace_thread_t *t,
 	if (!message->sender)
 		message->sender = get_thread_descriptor(libtrace);
 
+#if ENABLE_DTRACE
+	DTRACE_PROBE2(libtrace, message_send, t, message->code);
+#endif
 	ret = libtrace_message_queue_put(&t->messages, message);
 	return ret < 0 ? 0 : ret;
 }
@@ -2530,6 +3125,11 @@ DLLEXPORT int trace_message_perpkts(libtrace_t * libtrace, libtrace_message_t *
 	for (i = 0; i < libtrace->perpkt_thread_count; i++) {
 		if (libtrace->perpkt_threads[i].state == THREAD_RUNNING ||
 		    libtrace->perpkt_threads[i].state == THREAD_PAUSED) {
+#if ENABLE_DTRACE
+			DTRACE_PROBE2(libtrace, message_send,
+					&libtrace->perpkt_threads[i],
+					message->code);
+#endif
 			libtrace_message_queue_put(&libtrace->perpkt_threads[i].messages, message);
 		} else {
 			missed += 1;
@@ -2544,17 +3144,59 @@ DLLEXPORT int trace_message_perpkts(libtrace_t * libtrace, libtrace_message_t *
  */
 DLLEXPORT void trace_publish_result(libtrace_t *libtrace, libtrace_thread_t *t, uint64_t key, libtrace_generic_t value, int type) {
 	libtrace_result_t res;
+	uint64_t start = 0;
 	res.type = type;
 	res.key = key;
 	res.value = value;
+	res.flags = 0;
 	if (!libtrace->combiner.publish) {
 		fprintf(stderr, "Combiner has no publish method -- can not publish results!\n");
 		return;
 	}
+#if ENABLE_DTRACE
+	DTRACE_PROBE3(libtrace, result_publish, t->perpkt_num, key, type);
+#endif
+	if (t->pipeline.sampling)
+		start = pipeline_cycles();
 	libtrace->combiner.publish(libtrace, t->perpkt_num, &libtrace->combiner, &res);
+	if (t->pipeline.sampling)
+		pipeline_record(&t->pipeline, PIPELINE_STAGE_COMBINER,
+				pipeline_cycles() - start);
 	return;
 }
 
+DLLEXPORT void trace_publish_results(libtrace_t *libtrace, libtrace_thread_t *t,
+                libtrace_result_t *results, size_t count) {
+	uint64_t start = 0;
+	size_t i;
+
+	if (!libtrace->combiner.publish) {
+		fprintf(stderr, "Combiner has no publish method -- can not publish results!\n");
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		results[i].flags = 0;
+#if ENABLE_DTRACE
+		DTRACE_PROBE3(libtrace, result_publish, t->perpkt_num,
+				results[i].key, results[i].type);
+#endif
+	}
+	if (t->pipeline.sampling)
+		start = pipeline_cycles();
+	if (libtrace->combiner_publish_bulk) {
+		libtrace->combiner_publish_bulk(libtrace, t->perpkt_num,
+				&libtrace->combiner, results, count);
+	} else {
+		for (i = 0; i < count; i++) {
+			libtrace->combiner.publish(libtrace, t->perpkt_num,
+					&libtrace->combiner, &results[i]);
+		}
+	}
+	if (t->pipeline.sampling)
+		pipeline_record(&t->pipeline, PIPELINE_STAGE_COMBINER,
+				pipeline_cycles() - start);
+}
+
 DLLEXPORT void trace_set_combiner(libtrace_t *trace, const libtrace_combine_t *combiner, libtrace_generic_t config){
 	if (combiner) {
 		trace->combiner = *combiner;
@@ -2563,6 +3205,12 @@ DLLEXPORT void trace_set_combiner(libtrace_t *trace, const libtrace_combine_t *c
 		// No combiner, so don't try use it
 		memset(&trace->combiner, 0, sizeof(trace->combiner));
 	}
+	trace->combiner_publish_bulk = NULL;
+}
+
+DLLEXPORT void trace_set_combiner_publish_bulk(libtrace_t *trace,
+		fn_combiner_publish_bulk publish_bulk) {
+	trace->combiner_publish_bulk = publish_bulk;
 }
 
 DLLEXPORT uint64_t trace_packet_get_order(libtrace_packet_t * packet) {
@@ -2670,6 +3318,29 @@ DLLEXPORT int trace_set_hasher_polling(libtrace_t *trace, bool polling) {
 	return 0;
 }
 
+DLLEXPORT int trace_set_hasher_fields(libtrace_t *trace,
+                                      enum hasher_fields fields) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.hasher_fields = fields;
+	return 0;
+}
+
+DLLEXPORT int trace_set_hasher_overflow(libtrace_t *trace,
+                                        enum hasher_overflow overflow) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.hasher_overflow = overflow;
+	return 0;
+}
+
+DLLEXPORT int trace_set_hasher_spill_size(libtrace_t *trace, size_t size) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.hasher_spill_size = size;
+	return 0;
+}
+
 DLLEXPORT int trace_set_reporter_polling(libtrace_t *trace, bool polling) {
 	if (!trace_is_configurable(trace)) return -1;
 
@@ -2691,6 +3362,152 @@ DLLEXPORT int trace_set_debug_state(libtrace_t *trace, bool debug_state) {
 	return 0;
 }
 
+DLLEXPORT int trace_set_pipeline_stats(libtrace_t *trace, bool enabled) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.pipeline_stats = enabled;
+	return 0;
+}
+
+static void add_pipeline_counters(struct pipeline_counters *total,
+                                  const struct pipeline_counters *pc) {
+	int i;
+
+	total->bursts += pc->bursts;
+	total->packets += pc->packets;
+	for (i = 0; i < PIPELINE_STAGE_COUNT; i++) {
+		total->stages[i].samples += pc->stages[i].samples;
+		total->stages[i].cycles += pc->stages[i].cycles;
+		if (pc->stages[i].max_cycles > total->stages[i].max_cycles)
+			total->stages[i].max_cycles = pc->stages[i].max_cycles;
+	}
+	for (i = 0; i < LIBTRACE_RING_OCCUPANCY_BUCKETS; i++)
+		total->ring_occupancy[i] += pc->ring_occupancy[i];
+}
+
+DLLEXPORT int trace_get_pipeline_stats(libtrace_t *trace, libtrace_thread_t *t,
+                                       libtrace_pipeline_stats_t *stats) {
+	struct pipeline_counters total;
+	uint64_t cycles, ns;
+	double ns_per_cycle = 1.0;
+	int i;
+
+	if (!trace) {
+		fprintf(stderr, "NULL trace passed into trace_get_pipeline_stats()\n");
+		return TRACE_ERR_NULL_TRACE;
+	}
+	if (!stats) {
+		trace_set_err(trace, TRACE_ERR_NULL,
+			"NULL stats passed into trace_get_pipeline_stats()");
+		return -1;
+	}
+	if (!trace->config.pipeline_stats || !trace->perpkt_threads) {
+		trace_set_err(trace, TRACE_ERR_BAD_STATE,
+			"Pipeline statistics are only collected for a parallel "
+			"trace started with trace_set_pipeline_stats() enabled");
+		return -1;
+	}
+	if (t && t->trace != trace) {
+		trace_set_err(trace, TRACE_ERR_THREAD,
+			"The thread passed to trace_get_pipeline_stats() does "
+			"not belong to this trace");
+		return -1;
+	}
+
+	memset(&total, 0, sizeof(total));
+	memset(stats, 0, sizeof(libtrace_pipeline_stats_t));
+	if (t) {
+		add_pipeline_counters(&total, &t->pipeline);
+	} else {
+		for (i = 0; i < trace->perpkt_thread_count; i++)
+			add_pipeline_counters(&total,
+					&trace->perpkt_threads[i].pipeline);
+		if (trace->hasher_thread.type == THREAD_HASHER)
+			add_pipeline_counters(&total,
+					&trace->hasher_thread.pipeline);
+		if (trace->reporter_thread.type == THREAD_REPORTER)
+			add_pipeline_counters(&total,
+					&trace->reporter_thread.pipeline);
+		libtrace_ocache_get_stats(&trace->packet_freelist,
+				&stats->ocache_hits, &stats->ocache_misses);
+	}
+
+	/* Work out how long a cycle is from how far both clocks have moved
+	 * since the trace started */
+	cycles = pipeline_cycles() - trace->pipeline_start_cycles;
+	ns = pipeline_ns() - trace->pipeline_start_ns;
+	if (cycles)
+		ns_per_cycle = (double) ns / (double) cycles;
+
+	stats->elapsed_ns = ns;
+	stats->bursts = total.bursts;
+	stats->packets = total.packets;
+	for (i = 0; i < PIPELINE_STAGE_COUNT; i++) {
+		stats->stages[i].samples = total.stages[i].samples;
+		stats->stages[i].total_ns = total.stages[i].cycles * ns_per_cycle;
+		stats->stages[i].max_ns = total.stages[i].max_cycles * ns_per_cycle;
+	}
+	memcpy(stats->ring_occupancy, total.ring_occupancy,
+			sizeof(stats->ring_occupancy));
+	return 0;
+}
+
+DLLEXPORT int trace_print_pipeline_stats(const libtrace_pipeline_stats_t *stats,
+                                         FILE *f) {
+	static const char *names[PIPELINE_STAGE_COUNT] = {
+		"read", "filter", "hasher", "hasher read", "ring wait",
+		"callback", "combiner", "reporter"
+	};
+	uint64_t lookups = stats->ocache_hits + stats->ocache_misses;
+	uint64_t samples = 0;
+	int i;
+
+	if (fprintf(f, "%-12s\t%12s\t%12s\t%12s\n", "stage", "samples",
+				"mean us", "max us") < 0)
+		return -1;
+	for (i = 0; i < PIPELINE_STAGE_COUNT; i++) {
+		const libtrace_stage_stats_t *st = &stats->stages[i];
+
+		if (st->samples == 0)
+			continue;
+		if (fprintf(f, "%-12s\t%12" PRIu64 "\t%12.3f\t%12.3f\n",
+					names[i], st->samples,
+					st->total_ns / 1000.0 / st->samples,
+					st->max_ns / 1000.0) < 0)
+			return -1;
+	}
+	if (stats->elapsed_ns && fprintf(f, "%-12s\t%12" PRIu64
+				"\t%12.0f packets/s\n", "packets",
+				stats->packets, stats->packets * 1e9 /
+				stats->elapsed_ns) < 0)
+		return -1;
+	if (stats->bursts && fprintf(f, "%-12s\t%12" PRIu64
+				"\t%12.1f packets/burst\n", "bursts",
+				stats->bursts,
+				(double) stats->packets / stats->bursts) < 0)
+		return -1;
+
+	for (i = 0; i < LIBTRACE_RING_OCCUPANCY_BUCKETS; i++)
+		samples += stats->ring_occupancy[i];
+	if (samples) {
+		if (fprintf(f, "ring occupancy\t empty") < 0)
+			return -1;
+		for (i = 0; i < LIBTRACE_RING_OCCUPANCY_BUCKETS; i++) {
+			if (fprintf(f, " %.0f%%", stats->ring_occupancy[i] *
+						100.0 / samples) < 0)
+				return -1;
+		}
+		if (fprintf(f, " full\n") < 0)
+			return -1;
+	}
+	if (lookups && fprintf(f, "packet cache\t%12" PRIu64 " hits\t%12"
+				PRIu64 " misses\t%.2f%% miss\n",
+				stats->ocache_hits, stats->ocache_misses,
+				stats->ocache_misses * 100.0 / lookups) < 0)
+		return -1;
+	return 0;
+}
+
 static bool config_bool_parse(char *value) {
 	if (strcmp(value, "true") == 0)
 		return true;
@@ -2729,6 +3546,53 @@ static int config_coremap_parse(const char *value, struct user_configuration *uc
 	return 0;
 }
 
+static int config_hasher_parse(const char *value, struct user_configuration *uc) {
+	if (strcmp(value, "balance") == 0)
+		uc->hasher_type = HASHER_BALANCE;
+	else if (strcmp(value, "bidirectional") == 0)
+		uc->hasher_type = HASHER_BIDIRECTIONAL;
+	else if (strcmp(value, "unidirectional") == 0)
+		uc->hasher_type = HASHER_UNIDIRECTIONAL;
+	else if (strcmp(value, "symmetric") == 0)
+		uc->hasher_type = HASHER_SYMMETRIC;
+	else {
+		fprintf(stderr, "Unknown hasher %s\n", value);
+		return -1;
+	}
+	uc->hasher_configured = true;
+	return 0;
+}
+
+static int config_hasher_fields_parse(const char *value, struct user_configuration *uc) {
+	if (strcmp(value, "5tuple") == 0)
+		uc->hasher_fields = HASHER_FIELDS_5TUPLE;
+	else if (strcmp(value, "ip") == 0)
+		uc->hasher_fields = HASHER_FIELDS_IP;
+	else if (strcmp(value, "vlan") == 0)
+		uc->hasher_fields = HASHER_FIELDS_VLAN;
+	else if (strcmp(value, "inner") == 0)
+		uc->hasher_fields = HASHER_FIELDS_INNER;
+	else {
+		fprintf(stderr, "Unknown hasher fields %s\n", value);
+		return -1;
+	}
+	return 0;
+}
+
+static int config_hasher_overflow_parse(const char *value, struct user_configuration *uc) {
+	if (strcmp(value, "block") == 0)
+		uc->hasher_overflow = HASHER_OVERFLOW_BLOCK;
+	else if (strcmp(value, "drop") == 0)
+		uc->hasher_overflow = HASHER_OVERFLOW_DROP;
+	else if (strcmp(value, "spill") == 0)
+		uc->hasher_overflow = HASHER_OVERFLOW_SPILL;
+	else {
+		fprintf(stderr, "Unknown hasher overflow policy %s\n", value);
+		return -1;
+	}
+	return 0;
+}
+
 DLLEXPORT int trace_set_coremap(libtrace_t *trace, const char *value) {
 	if (!trace_is_configurable(trace)) return -1;
 	return config_coremap_parse(value, &trace->config);
@@ -2775,6 +3639,17 @@ static int config_string(struct user_configuration *uc, char *key, char *value)
 	} else if (strcmp(key, "hasher_polling") == 0
 	           || strcmp(key, "hp") == 0) {
 		uc->hasher_polling = config_bool_parse(value);
+	} else if (strcmp(key, "hasher") == 0) {
+		return config_hasher_parse(value, uc);
+	} else if (strcmp(key, "hasher_fields") == 0
+	           || strcmp(key, "hf") == 0) {
+		return config_hasher_fields_parse(value, uc);
+	} else if (strcmp(key, "hasher_overflow") == 0
+	           || strcmp(key, "ho") == 0) {
+		return config_hasher_overflow_parse(value, uc);
+	} else if (strcmp(key, "hasher_spill_size") == 0
+	           || strcmp(key, "hss") == 0) {
+		uc->hasher_spill_size = strtoll(value, NULL, 10);
 	} else if (strcmp(key, "reporter_polling") == 0
 	           || strcmp(key, "rp") == 0) {
 		uc->reporter_polling = config_bool_parse(value);
@@ -2784,6 +3659,9 @@ static int config_string(struct user_configuration *uc, char *key, char *value)
 	} else if (strcmp(key, "debug_state") == 0
 	           || strcmp(key, "ds") == 0) {
 		uc->debug_state = config_bool_parse(value);
+	} else if (strcmp(key, "pipeline_stats") == 0
+	           || strcmp(key, "ps") == 0) {
+		uc->pipeline_stats = config_bool_parse(value);
 	} else if (strcmp(key, "coremap") == 0) {
 		return config_coremap_parse(value, uc);
 	} else {
@@ -18,6 +18,7 @@ BuildRequires: numactl-devel
 BuildRequires: ncurses-devel
 BuildRequires: openssl-devel
 BuildRequires: libyaml-devel
+BuildRequires: systemtap-sdt-devel
 BuildRequires: libwandder1-devel
 BuildRequires: libwandio1-devel
 BuildRequires: dpdk-wand-devel
@@ -18,6 +18,7 @@ BuildRequires: numactl-devel
 BuildRequires: ncurses-devel
 BuildRequires: openssl-devel
 BuildRequires: libyaml-devel
+BuildRequires: systemtap-sdt-devel
 BuildRequires: libwandder2-devel
 BuildRequires: libwandio1-devel
 BuildRequires: dpdk-devel
@@ -113,6 +114,7 @@ find $RPM_BUILD_ROOT -name '*.la' -exec rm -f {} ';'
 %files tools
 %{_bindir}/*
 %{_mandir}/man1/*
+%{_datadir}/libtrace/probes/*
 
 %files -n libpacketdump4
 %{_libdir}/libpacketdump/*.so
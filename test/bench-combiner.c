@@ -0,0 +1,218 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Measures how quickly the combiners can pass results to the reporter when
+ * every packet produces a result, across 1 to 64 perpkt threads. The trace
+ * is replayed from memory so that reading packets costs as little as
+ * possible. The ordered combiner is also checked to deliver results in
+ * packet order.
+ *
+ * Each combiner is run twice, once publishing every result on its own and
+ * once publishing them in batches with trace_publish_results() to a result
+ * batch callback.
+ *
+ * Usage: bench-combiner [uri]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include "libtrace_parallel.h"
+
+#define DEFAULT_URI "mem:loops=20000:erf:traces/100_packets.erf"
+#define BATCH 32
+
+struct batch {
+	libtrace_result_t results[BATCH];
+	size_t count;
+};
+
+struct reporter_state {
+	uint64_t results;
+	uint64_t last_key;
+	int out_of_order;
+	int ordered;
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls UNUSED,
+		libtrace_packet_t *packet) {
+	libtrace_generic_t value;
+
+	value.uint64 = trace_get_wire_length(packet);
+	trace_publish_result(trace, t, trace_packet_get_order(packet), value,
+			RESULT_USER);
+	return packet;
+}
+
+static void *start_batch(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+		void *global UNUSED) {
+	return calloc(1, sizeof(struct batch));
+}
+
+static libtrace_packet_t *per_packet_batch(libtrace_t *trace,
+		libtrace_thread_t *t, void *global UNUSED, void *tls,
+		libtrace_packet_t *packet) {
+	struct batch *batch = tls;
+	libtrace_result_t *res = &batch->results[batch->count++];
+
+	res->key = trace_packet_get_order(packet);
+	res->value.uint64 = trace_get_wire_length(packet);
+	res->type = RESULT_USER;
+	if (batch->count == BATCH) {
+		trace_publish_results(trace, t, batch->results, batch->count);
+		batch->count = 0;
+	}
+	return packet;
+}
+
+static void stop_batch(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls) {
+	struct batch *batch = tls;
+
+	trace_publish_results(trace, t, batch->results, batch->count);
+	free(batch);
+}
+
+static void count_result(struct reporter_state *state,
+		libtrace_result_t *result) {
+	if (result->type != RESULT_USER)
+		return;
+	if (state->ordered && state->results && result->key <= state->last_key)
+		state->out_of_order++;
+	state->last_key = result->key;
+	state->results++;
+}
+
+static void per_result(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global,
+		void *tls UNUSED, libtrace_result_t *result) {
+	count_result(global, result);
+}
+
+static void per_result_batch(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global,
+		void *tls UNUSED, libtrace_result_t *results, size_t count) {
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		count_result(global, &results[i]);
+}
+
+static int run(const char *uri, const libtrace_combine_t *combiner,
+		int ordered, int batched, int threads) {
+	struct reporter_state state;
+	libtrace_callback_set_t *pktcbs, *rescbs;
+	libtrace_t *trace;
+	double start, elapsed;
+
+	memset(&state, 0, sizeof(state));
+	state.ordered = ordered;
+
+	trace = trace_create(uri);
+	if (trace_is_err(trace)) {
+		trace_perror(trace, "%s", uri);
+		trace_destroy(trace);
+		return 1;
+	}
+	pktcbs = trace_create_callback_set();
+	rescbs = trace_create_callback_set();
+	if (batched) {
+		trace_set_starting_cb(pktcbs, start_batch);
+		trace_set_packet_cb(pktcbs, per_packet_batch);
+		trace_set_stopping_cb(pktcbs, stop_batch);
+		trace_set_result_batch_cb(rescbs, per_result_batch);
+	} else {
+		trace_set_packet_cb(pktcbs, per_packet);
+		trace_set_result_cb(rescbs, per_result);
+	}
+
+	trace_set_perpkt_threads(trace, threads);
+	trace_set_combiner(trace, combiner, (libtrace_generic_t){0});
+
+	start = now();
+	if (trace_pstart(trace, &state, pktcbs, rescbs) == -1) {
+		trace_perror(trace, "Failed to start trace");
+		return 1;
+	}
+	trace_join(trace);
+	elapsed = now() - start;
+
+	if (trace_is_err(trace)) {
+		trace_perror(trace, "%s", uri);
+		return 1;
+	}
+	printf("%8d %12" PRIu64 " %10.1f %12.0f", threads, state.results,
+			elapsed / 1e6, state.results / (elapsed / 1e9));
+	if (ordered)
+		printf(" %s", state.out_of_order ? "OUT OF ORDER" : "in order");
+	printf("\n");
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(rescbs);
+	return state.out_of_order != 0;
+}
+
+static int run_all(const char *uri, const char *name,
+		const libtrace_combine_t *combiner, int ordered) {
+	int batched, threads, err = 0;
+
+	for (batched = 0; batched <= 1; batched++) {
+		printf("%s combiner, %s\n", name, batched ?
+				"in batches" : "one result at a time");
+		printf("%8s %12s %10s %12s\n", "threads", "results", "ms",
+				"results/s");
+		for (threads = 1; threads <= 64; threads *= 2)
+			err |= run(uri, combiner, ordered, batched, threads);
+		printf("\n");
+	}
+	return err;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = DEFAULT_URI;
+	int err = 0;
+
+	if (argc > 1)
+		uri = argv[1];
+
+	err |= run_all(uri, "ordered", &combiner_ordered, 1);
+	err |= run_all(uri, "unordered", &combiner_unordered, 0);
+	return err;
+}
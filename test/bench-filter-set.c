@@ -0,0 +1,167 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Measures the cost of applying a group of filters to every packet, both
+ * one filter at a time with trace_apply_filter() and all at once with a
+ * filter set. The default trace is ERF; legacyatm:traces/legacyatm.gz can be
+ * used to time packets that have to be demoted before they can be filtered.
+ *
+ * Usage: bench-filter-set [uri [passes]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include "libtrace.h"
+
+#define MAX_PACKETS 100000
+
+static const char *expressions[] = {
+	"tcp",
+	"udp",
+	"tcp port 80",
+	"host 192.168.1.1",
+	"udp and (port 53 or port 123)",
+	"ip and not net 10.0.0.0/8",
+	"tcp[tcpflags] & tcp-syn != 0",
+	"icmp",
+	"portrange 1000-2000",
+	"tcp",
+	"ip6 or (ip and len > 1000)",
+	"port 80",
+};
+
+#define FILTER_COUNT (sizeof(expressions) / sizeof(expressions[0]))
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "erf:traces/100_packets.erf";
+	libtrace_packet_t *packets[MAX_PACKETS];
+	libtrace_packet_t *packet;
+	libtrace_filter_t *filters[FILTER_COUNT];
+	libtrace_filter_set_t *set;
+	uint64_t matches[TRACE_FILTER_SET_WORDS(FILTER_COUNT)];
+	uint64_t single = 0, combined = 0;
+	double start, each, all;
+	libtrace_t *trace;
+	int passes = 10000;
+	int count = 0;
+	int i, j;
+	size_t f;
+
+	if (argc > 1)
+		uri = argv[1];
+	if (argc > 2)
+		passes = atoi(argv[2]);
+
+	/* Load the packets into memory so that we are only timing the
+	 * filters themselves */
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	packet = trace_create_packet();
+	while (count < MAX_PACKETS && trace_read_packet(trace, packet) > 0) {
+		if (trace_get_wire_length(packet) == 0)
+			continue;
+		packets[count++] = trace_copy_packet(packet);
+	}
+	iferr(trace);
+	trace_destroy_packet(packet);
+
+	if (count == 0) {
+		printf("No packets read from %s\n", uri);
+		return 1;
+	}
+
+	set = trace_create_filter_set();
+	for (f = 0; f < FILTER_COUNT; f++) {
+		filters[f] = trace_create_filter(expressions[f]);
+		trace_add_filter_to_set(set, expressions[f]);
+		/* Compile and JIT the filters outside of the timed loops */
+		trace_apply_filter(filters[f], packets[0]);
+	}
+	trace_apply_filter_set(set, packets[0], matches);
+
+	start = now();
+	for (i = 0; i < passes; i++) {
+		for (j = 0; j < count; j++) {
+			for (f = 0; f < FILTER_COUNT; f++) {
+				if (trace_apply_filter(filters[f],
+						packets[j]) > 0)
+					single ++;
+			}
+		}
+	}
+	each = now() - start;
+
+	start = now();
+	for (i = 0; i < passes; i++) {
+		for (j = 0; j < count; j++) {
+			int ret = trace_apply_filter_set(set, packets[j],
+					matches);
+			if (ret > 0)
+				combined += ret;
+		}
+	}
+	all = now() - start;
+
+	printf("%d packets from %s, %d filters, %d passes\n", count, uri,
+			(int)FILTER_COUNT, passes);
+	printf("%-24s %10s %10s\n", "", "ns/packet", "matches");
+	printf("%-24s %8.1fns %10" PRIu64 "\n", "trace_apply_filter",
+			each / ((double)passes * count), single / passes);
+	printf("%-24s %8.1fns %10" PRIu64 "%s\n", "trace_apply_filter_set",
+			all / ((double)passes * count), combined / passes,
+			single == combined ? "" : " MISMATCH");
+
+	for (f = 0; f < FILTER_COUNT; f++)
+		trace_destroy_filter(filters[f]);
+	trace_destroy_filter_set(set);
+	for (j = 0; j < count; j++)
+		trace_destroy_packet(packets[j]);
+	trace_destroy(trace);
+	return single == combined ? 0 : 1;
+}
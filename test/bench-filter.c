@@ -0,0 +1,172 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Compares the cost of trace_apply_filter() against running the same
+ * program through libpcap's bpf_filter() interpreter, for a set of typical
+ * tcpdump expressions. Only Ethernet packets are used.
+ *
+ * Usage: bench-filter [uri [passes]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pcap.h>
+#include "libtrace.h"
+
+#define MAX_PACKETS 100000
+
+static const char *expressions[] = {
+	"tcp",
+	"tcp port 80",
+	"host 192.168.1.1",
+	"udp and (port 53 or port 123)",
+	"ip and not net 10.0.0.0/8",
+	"tcp[tcpflags] & tcp-syn != 0",
+	"icmp or arp",
+	"portrange 1000-2000",
+	"ip6 or (ip and len > 1000)",
+	NULL
+};
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "pcapfile:traces/100_packets.pcap";
+	libtrace_packet_t *packets[MAX_PACKETS];
+	libtrace_packet_t *packet;
+	libtrace_linktype_t linktype = TRACE_TYPE_UNKNOWN;
+	libtrace_t *trace;
+	int passes = 10000;
+	int count = 0;
+	int error = 0;
+	int i, j, e;
+
+	if (argc > 1)
+		uri = argv[1];
+	if (argc > 2)
+		passes = atoi(argv[2]);
+
+	/* Load the packets into memory so that we are only timing the
+	 * filters themselves */
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	packet = trace_create_packet();
+	while (count < MAX_PACKETS && trace_read_packet(trace, packet) > 0) {
+		if (trace_get_packet_buffer(packet, &linktype, NULL) == NULL ||
+				linktype != TRACE_TYPE_ETH)
+			continue;
+		packets[count++] = trace_copy_packet(packet);
+	}
+	iferr(trace);
+	trace_destroy_packet(packet);
+
+	if (count == 0) {
+		printf("No Ethernet packets read from %s\n", uri);
+		return 1;
+	}
+
+	printf("%d packets from %s, %d passes\n", count, uri, passes);
+	printf("%-32s %10s %10s %8s\n", "expression", "bpf_filter",
+			"libtrace", "matches");
+
+	for (e = 0; expressions[e]; e++) {
+		struct bpf_program prog;
+		libtrace_filter_t *filter;
+		pcap_t *pcap;
+		uint64_t imatch = 0, jmatch = 0;
+		double start, interp, jit;
+
+		pcap = pcap_open_dead(DLT_EN10MB, 65535);
+		if (pcap_compile(pcap, &prog, expressions[e], 1, 0) != 0) {
+			printf("%-32s %s\n", expressions[e], pcap_geterr(pcap));
+			pcap_close(pcap);
+			continue;
+		}
+		filter = trace_create_filter(expressions[e]);
+
+		/* Compile and JIT the filter outside of the timed loop */
+		trace_apply_filter(filter, packets[0]);
+
+		start = now();
+		for (i = 0; i < passes; i++) {
+			for (j = 0; j < count; j++) {
+				uint32_t rem;
+				void *link = trace_get_packet_buffer(
+						packets[j], NULL, &rem);
+				if (bpf_filter(prog.bf_insns, link, rem, rem))
+					imatch ++;
+			}
+		}
+		interp = now() - start;
+
+		start = now();
+		for (i = 0; i < passes; i++) {
+			for (j = 0; j < count; j++) {
+				if (trace_apply_filter(filter, packets[j]) > 0)
+					jmatch ++;
+			}
+		}
+		jit = now() - start;
+
+		printf("%-32s %8.1fns %8.1fns %8" PRIu64 "%s\n", expressions[e],
+				interp / ((double)passes * count),
+				jit / ((double)passes * count),
+				jmatch / passes,
+				imatch == jmatch ? "" : " MISMATCH");
+		if (imatch != jmatch)
+			error = 1;
+
+		trace_destroy_filter(filter);
+		pcap_freecode(&prog);
+		pcap_close(pcap);
+	}
+
+	for (j = 0; j < count; j++)
+		trace_destroy_packet(packets[j]);
+	trace_destroy(trace);
+	return error;
+}
@@ -0,0 +1,186 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Measures IP fragment reassembly under heavy fragmentation. Every
+ * datagram is split into fragments, and the fragments of many datagrams
+ * are shuffled together so that lots of datagrams are in progress at once.
+ *
+ * Usage: bench-reassembly [passes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "libtrace.h"
+
+#define MAX_FRAGMENTS 65536
+
+struct shape {
+	const char *name;
+	/* UDP payload bytes in each datagram */
+	size_t payload;
+	/* Payload bytes in each fragment, a multiple of 8 */
+	size_t fragsize;
+	/* How many datagrams have fragments in flight at once */
+	int concurrent;
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Builds one fragment of a UDP datagram inside an Ethernet frame */
+static libtrace_packet_t *build_fragment(uint32_t src, uint16_t id,
+		size_t total, size_t offset, size_t len) {
+	uint8_t buf[14 + 20 + 65536];
+	libtrace_ether_t *eth = (libtrace_ether_t *)buf;
+	libtrace_ip_t *ip = (libtrace_ip_t *)(buf + sizeof(*eth));
+	libtrace_packet_t *packet = trace_create_packet();
+	uint8_t *payload = (uint8_t *)(ip + 1);
+
+	memset(buf, 0, sizeof(*eth) + sizeof(*ip));
+	eth->ether_type = htons(TRACE_ETHERTYPE_IP);
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(sizeof(*ip) + len);
+	ip->ip_id = htons(id);
+	ip->ip_off = htons((offset + len < total ? 0x2000 : 0) | (offset / 8));
+	ip->ip_ttl = 64;
+	ip->ip_p = TRACE_IPPROTO_UDP;
+	ip->ip_src.s_addr = htonl(src);
+	ip->ip_dst.s_addr = htonl(0xc0a80001);
+	memset(payload, (int)offset, len);
+	if (offset == 0) {
+		libtrace_udp_t *udp = (libtrace_udp_t *)payload;
+		udp->source = htons(1024 + id);
+		udp->dest = htons(53);
+		udp->len = htons(total);
+		udp->check = 0;
+	}
+
+	trace_construct_packet(packet, TRACE_TYPE_ETH, buf,
+			sizeof(*eth) + sizeof(*ip) + len);
+	return packet;
+}
+
+/* Builds the fragments for a shape. Datagrams are started in batches of
+ * shape->concurrent, and the fragments within each batch are shuffled. */
+static int build_shape(const struct shape *shape, libtrace_packet_t **frags) {
+	size_t total = shape->payload + sizeof(libtrace_udp_t);
+	int per = (int)((total + shape->fragsize - 1) / shape->fragsize);
+	int datagrams = MAX_FRAGMENTS / per;
+	unsigned int seed = 1;
+	int count = 0;
+	int d, f, i;
+
+	datagrams -= datagrams % shape->concurrent;
+	for (d = 0; d < datagrams; d += shape->concurrent) {
+		int first = count;
+
+		for (i = 0; i < shape->concurrent; i++) {
+			for (f = 0; f < per; f++) {
+				size_t offset = f * shape->fragsize;
+				size_t len = total - offset;
+				if (len > shape->fragsize)
+					len = shape->fragsize;
+				frags[count++] = build_fragment(
+						0x0a000000 + d + i,
+						(uint16_t)(d + i), total,
+						offset, len);
+			}
+		}
+		for (i = count - 1; i > first; i--) {
+			int j = first + rand_r(&seed) % (i - first + 1);
+			libtrace_packet_t *tmp = frags[i];
+			frags[i] = frags[j];
+			frags[j] = tmp;
+		}
+	}
+	return count;
+}
+
+int main(int argc, char *argv[]) {
+	static const struct shape shapes[] = {
+		{"8KB, 1480B fragments", 8192, 1480, 1},
+		{"8KB, 1480B fragments", 8192, 1480, 64},
+		{"8KB, 1480B fragments", 8192, 1480, 1024},
+		{"64KB, 1480B fragments", 65000, 1480, 64},
+		{"1400B, 64B fragments", 1400, 64, 64},
+		{"1400B, 8B fragments", 1400, 8, 16},
+	};
+	static libtrace_packet_t *frags[MAX_FRAGMENTS];
+	libtrace_reassembly_stats_t stats;
+	libtrace_reassembler_t *r;
+	int passes = 20;
+	int error = 0;
+	size_t s;
+	int count, i, p;
+
+	if (argc > 1)
+		passes = atoi(argv[1]);
+	if (passes < 1)
+		passes = 1;
+
+	printf("%-24s %10s %10s %12s %12s\n", "datagram", "in flight",
+			"fragments", "ns/fragment", "ns/datagram");
+	for (s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+		double start, elapsed;
+
+		count = build_shape(&shapes[s], frags);
+		r = trace_create_reassembler(64 * 1024 * 1024, 0);
+
+		start = now();
+		for (p = 0; p < passes; p++) {
+			for (i = 0; i < count; i++)
+				trace_reassemble_packet(r, frags[i]);
+		}
+		elapsed = now() - start;
+
+		trace_get_reassembler_stats(r, &stats);
+		printf("%-24s %10d %10d %12.1f %12.1f%s\n", shapes[s].name,
+				shapes[s].concurrent, count,
+				elapsed / ((double)passes * count),
+				elapsed / (double)stats.datagrams,
+				stats.pending || stats.evictions ||
+				stats.invalid ? " INCOMPLETE" : "");
+		if (stats.pending || stats.evictions || stats.invalid)
+			error = 1;
+
+		trace_destroy_reassembler(r);
+		for (i = 0; i < count; i++)
+			trace_destroy_packet(frags[i]);
+	}
+
+	return error;
+}
@@ -0,0 +1,205 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Checks that the table driven Toeplitz hash gives the same results as
+ * hashing one bit at a time, and measures how much faster it is. The
+ * per-packet and batch packet hashers are then timed against a trace.
+ *
+ * Usage: bench-toeplitz [uri [passes]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include "libtrace.h"
+#include "hash_toeplitz.h"
+
+#define MAX_PACKETS 100000
+#define INPUTS 4096
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Compares the two implementations over random input of the same lengths
+ * and offsets that toeplitz_hash_packet() uses */
+static int bench_inputs(const toeplitz_conf_t *conf,
+		const toeplitz_table_t *tt, int passes) {
+	static uint8_t inputs[INPUTS][36];
+	static const size_t shapes[][2] = {
+		{0, 8}, {8, 4}, {0, 12}, {0, 32}, {32, 4}, {0, 36}
+	};
+	unsigned int seed = 1;
+	volatile uint32_t sink = 0;
+	double start, bitwise, table;
+	size_t s;
+	int i, p;
+
+	for (i = 0; i < INPUTS; i++) {
+		for (s = 0; s < sizeof(inputs[i]); s++)
+			inputs[i][s] = (uint8_t) rand_r(&seed);
+	}
+
+	for (s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+		size_t off = shapes[s][0], n = shapes[s][1];
+
+		for (i = 0; i < INPUTS; i++) {
+			if (toeplitz_hash(conf, inputs[i], off, n, i) !=
+					toeplitz_table_hash(tt, inputs[i], off, n, i)) {
+				printf("MISMATCH hashing %zu bytes at offset %zu\n",
+						n, off);
+				return 1;
+			}
+		}
+	}
+
+	printf("%-24s %10s %10s\n", "input", "bitwise", "table");
+	for (s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+		size_t off = shapes[s][0], n = shapes[s][1];
+
+		if (off != 0)
+			continue;
+		start = now();
+		for (p = 0; p < passes / 10; p++) {
+			for (i = 0; i < INPUTS; i++)
+				sink ^= toeplitz_hash(conf, inputs[i], 0, n, 0);
+		}
+		bitwise = now() - start;
+
+		start = now();
+		for (p = 0; p < passes / 10; p++) {
+			for (i = 0; i < INPUTS; i++)
+				sink ^= toeplitz_table_hash(tt, inputs[i], 0, n, 0);
+		}
+		table = now() - start;
+
+		printf("%2zu bytes %15s %8.1fns %8.1fns\n", n, "",
+				bitwise / ((double)(passes / 10) * INPUTS),
+				table / ((double)(passes / 10) * INPUTS));
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "pcapfile:traces/100_packets.pcap";
+	static libtrace_packet_t *packets[MAX_PACKETS];
+	static uint64_t bitwise[MAX_PACKETS], single[MAX_PACKETS];
+	static uint64_t batch[MAX_PACKETS];
+	libtrace_packet_t *packet;
+	toeplitz_conf_t *conf;
+	toeplitz_table_t *tt;
+	libtrace_t *trace;
+	double start, slow, each, all;
+	int passes = 1000;
+	int count = 0;
+	int error = 0;
+	int i, j;
+
+	if (argc > 1)
+		uri = argv[1];
+	if (argc > 2)
+		passes = atoi(argv[2]);
+	if (passes < 10)
+		passes = 10;
+
+	conf = calloc(1, sizeof(toeplitz_conf_t));
+	toeplitz_init_config(conf, 0);
+	tt = toeplitz_create_table(conf);
+
+	if (bench_inputs(conf, tt, passes))
+		return 1;
+
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	packet = trace_create_packet();
+	while (count < MAX_PACKETS && trace_read_packet(trace, packet) > 0)
+		packets[count++] = trace_copy_packet(packet);
+	iferr(trace);
+	trace_destroy_packet(packet);
+
+	if (count == 0) {
+		printf("No packets read from %s\n", uri);
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < passes / 10; i++) {
+		for (j = 0; j < count; j++)
+			bitwise[j] = toeplitz_hash_packet(packets[j], conf);
+	}
+	slow = now() - start;
+
+	start = now();
+	for (i = 0; i < passes; i++) {
+		for (j = 0; j < count; j++)
+			single[j] = toeplitz_table_hash_packet(packets[j], tt);
+	}
+	each = now() - start;
+
+	start = now();
+	for (i = 0; i < passes; i++)
+		toeplitz_hash_packets(packets, count, tt, false, batch);
+	all = now() - start;
+
+	for (j = 0; j < count; j++) {
+		if (bitwise[j] != single[j] || single[j] != batch[j])
+			error = 1;
+	}
+
+	printf("\n%d packets from %s, %d passes\n", count, uri, passes);
+	printf("%-26s %8.1fns\n", "toeplitz_hash_packet",
+			slow / ((double)(passes / 10) * count));
+	printf("%-26s %8.1fns\n", "toeplitz_table_hash_packet",
+			each / ((double)passes * count));
+	printf("%-26s %8.1fns%s\n", "toeplitz_hash_packets",
+			all / ((double)passes * count),
+			error ? " MISMATCH" : "");
+
+	for (j = 0; j < count; j++)
+		trace_destroy_packet(packets[j]);
+	trace_destroy(trace);
+	toeplitz_destroy_table(tt);
+	free(conf);
+	return error;
+}
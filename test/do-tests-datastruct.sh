@@ -21,6 +21,8 @@ echo Testing deque
 do_test ./test-datastruct-deque
 echo Testing ringbuffer
 do_test ./test-datastruct-ringbuffer
+echo Testing spsc queue
+do_test ./test-datastruct-spscqueue
 echo
 echo "Tests passed: $OK"
 echo "Tests failed: $FAIL"
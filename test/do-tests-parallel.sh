@@ -50,6 +50,9 @@ do_test ./test-format-parallel rawerf
 echo \* Read pcapng
 do_test ./test-format-parallel pcapng
 
+echo \* Read mem
+do_test ./test-format-parallel mem:pcapfile:traces/100_packets.pcap
+
 echo \* Read testing hasher function
 do_test ./test-format-parallel-hasher erf
 
@@ -65,6 +68,30 @@ do_test ./test-format-parallel-stressthreads erf
 echo \* Read testing reporter thread
 do_test ./test-format-parallel-reporter erf
 
+echo \* Testing sorted combiner
+do_test ./test-combiner-sorted
+
+echo \* Testing reducing combiner
+do_test ./test-combiner-reducing
+
+echo \* Testing windowed combiner
+do_test ./test-combiner-windowed
+
+echo \* Testing batched result publishing
+do_test ./test-publish-results
+
+echo \* Testing packet batch callback
+do_test ./test-packet-batch
+
+echo \* Testing interval ticks
+do_test ./test-tick-interval
+
+echo \* Testing pipeline statistics
+do_test ./test-pipeline-stats
+
+echo \* Testing hasher overflow policies
+do_test ./test-hasher-overflow
+
 echo \* Testing Trace-Time Playback
 do_test ./test-tracetime-parallel
 
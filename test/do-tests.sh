@@ -76,6 +76,12 @@ do_test ./test-decode pcapng
 echo \* Testing pcap-bpf
 do_test ./test-pcap-bpf
 
+echo \* Testing filter sets
+do_test ./test-filter-set
+
+echo \* Testing symmetric hasher
+do_test ./test-hasher-symmetric
+
 echo \* Testing payload length
 do_test ./test-plen
 
@@ -110,6 +116,15 @@ do_test ./test-fragment
 echo \* Testing event framework
 do_test ./test-event
 
+echo \* Testing shared memory fan-out
+do_test ./test-shm
+
+echo \* Testing shared memory with several consumers
+do_test ./test-shm-parallel
+
+echo \* Testing in-memory replay
+do_test ./test-mem
+
 echo \* Testing time conversions
 echo \* ERF
 do_test ./test-time erf
@@ -342,6 +357,15 @@ do_test ./test-layer2-headers
 echo " * Layer2 Headers QinQ"
 do_test ./test-qinq
 
+echo " * Flow tuple"
+do_test ./test-flow-tuple
+
+echo " * Checksums"
+do_test ./test-checksum
+
+echo " * IP reassembly"
+do_test ./test-reassembly
+
 echo " * Test structures"
 do_test ./test-structures
 
@@ -0,0 +1,242 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+
+static uint32_t seed = 1;
+
+static uint8_t next_byte(void) {
+	seed = seed * 1103515245 + 12345;
+	return (uint8_t)(seed >> 16);
+}
+
+static uint32_t next_addr(void) {
+	return ((uint32_t)next_byte() << 24) | ((uint32_t)next_byte() << 16) |
+		((uint32_t)next_byte() << 8) | next_byte();
+}
+
+/* The obvious, word at a time, sum of a buffer in network byte order */
+static uint32_t ref_sum(const uint8_t *buf, size_t len) {
+	uint32_t sum = 0;
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (buf[i] << 8) | buf[i + 1];
+	if (len & 1)
+		sum += buf[len - 1] << 8;
+	return sum;
+}
+
+static uint16_t ref_finish(uint32_t sum) {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+/* Sums the pseudo header and transport segment of a frame built by
+ * build_frame(), without folding or inverting the result */
+static uint32_t ref_transport_sum(const uint8_t *buf, size_t len) {
+	const libtrace_ip_t *ip = (const libtrace_ip_t *)
+		(buf + sizeof(libtrace_ether_t));
+	const uint8_t *l4 = (const uint8_t *)ip + sizeof(libtrace_ip_t);
+	size_t l4len = buf + len - l4;
+
+	return ref_sum((const uint8_t *)&ip->ip_src, 8) + ip->ip_p + l4len +
+		ref_sum(l4, l4len);
+}
+
+/* Builds an Ethernet/IPv4 frame carrying a TCP or UDP segment with a random
+ * payload of plen bytes. All checksums are left as zero. */
+static size_t build_frame(uint8_t *buf, uint8_t proto, size_t plen) {
+	libtrace_ether_t *eth = (libtrace_ether_t *)buf;
+	libtrace_ip_t *ip = (libtrace_ip_t *)(buf + sizeof(libtrace_ether_t));
+	uint8_t *l4 = (uint8_t *)ip + sizeof(libtrace_ip_t);
+	size_t l4len;
+	size_t i;
+
+	memset(buf, 0, sizeof(libtrace_ether_t) + sizeof(libtrace_ip_t) +
+			sizeof(libtrace_tcp_t));
+	eth->ether_type = htons(TRACE_ETHERTYPE_IP);
+
+	if (proto == TRACE_IPPROTO_TCP) {
+		libtrace_tcp_t *tcp = (libtrace_tcp_t *)l4;
+		tcp->source = htons(next_byte() + 1024);
+		tcp->dest = htons(80);
+		tcp->seq = htonl(next_addr());
+		tcp->doff = 5;
+		tcp->window = htons(next_byte() << 8);
+		l4len = sizeof(libtrace_tcp_t) + plen;
+	} else {
+		libtrace_udp_t *udp = (libtrace_udp_t *)l4;
+		udp->source = htons(next_byte() + 1024);
+		udp->dest = htons(53);
+		l4len = sizeof(libtrace_udp_t) + plen;
+		udp->len = htons(l4len);
+	}
+
+	for (i = l4len - plen; i < l4len; i++)
+		l4[i] = next_byte();
+
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(sizeof(libtrace_ip_t) + l4len);
+	ip->ip_id = htons(next_byte());
+	ip->ip_ttl = 64;
+	ip->ip_p = proto;
+	ip->ip_src.s_addr = htonl(next_addr());
+	ip->ip_dst.s_addr = htonl(next_addr());
+
+	return sizeof(libtrace_ether_t) + sizeof(libtrace_ip_t) + l4len;
+}
+
+static int check(int ok, const char *what, uint8_t proto, size_t plen) {
+	if (!ok)
+		printf("failure: %s (protocol %u, %zu payload bytes)\n", what,
+				proto, plen);
+	return !ok;
+}
+
+/* Checks the full calculations against the reference implementation, then
+ * changes the addresses and checks that adjusting the checksums gives the
+ * same answer as calculating them again */
+static int test_frame(libtrace_packet_t *packet, uint8_t proto, size_t plen) {
+	uint8_t buf[256];
+	size_t len = build_frame(buf, proto, plen);
+	libtrace_ip_t *ip;
+	uint16_t *ipsum, *l4sum;
+	uint16_t csum, l3csum, l4csum;
+	uint32_t oldaddrs[2], newaddrs[2];
+	libtrace_linktype_t linktype;
+	uint32_t remaining;
+	int error = 0;
+
+	trace_construct_packet(packet, TRACE_TYPE_ETH, buf, len);
+
+	ipsum = trace_checksum_layer3(packet, &l3csum);
+	l4sum = trace_checksum_transport(packet, &l4csum);
+	if (ipsum == NULL || l4sum == NULL)
+		return check(0, "no checksum found", proto, plen);
+
+	ip = trace_get_ip(packet);
+	error |= check(l3csum == ref_finish(ref_sum((uint8_t *)ip,
+			sizeof(libtrace_ip_t))), "layer 3 checksum", proto, plen);
+	csum = ref_finish(ref_transport_sum(trace_get_layer2(packet, &linktype,
+			&remaining), len));
+	if (proto == TRACE_IPPROTO_UDP && csum == 0)
+		csum = 0xffff;
+	error |= check(l4csum == csum, "transport checksum", proto, plen);
+
+	/* Write the checksums in, then swap the addresses for new ones */
+	*ipsum = htons(l3csum);
+	*l4sum = htons(l4csum);
+
+	memcpy(oldaddrs, &ip->ip_src, sizeof(oldaddrs));
+	newaddrs[0] = htonl(next_addr());
+	newaddrs[1] = oldaddrs[1];
+	if (plen & 1)
+		newaddrs[1] = htonl(next_addr());
+	memcpy(&ip->ip_src, newaddrs, sizeof(newaddrs));
+
+	*ipsum = trace_checksum_adjust(*ipsum, oldaddrs, newaddrs,
+			sizeof(oldaddrs));
+	*l4sum = trace_checksum_adjust(*l4sum, oldaddrs, newaddrs,
+			sizeof(oldaddrs));
+	if (proto == TRACE_IPPROTO_UDP && *l4sum == 0)
+		*l4sum = 0xffff;
+
+	trace_checksum_layer3(packet, &l3csum);
+	trace_checksum_transport(packet, &l4csum);
+	error |= check(ntohs(*ipsum) == l3csum, "adjusted layer 3 checksum",
+			proto, plen);
+	error |= check(ntohs(*l4sum) == l4csum, "adjusted transport checksum",
+			proto, plen);
+
+	return error;
+}
+
+/* A UDP checksum that works out to be zero has to be sent as all ones */
+static int test_udp_zero(libtrace_packet_t *packet) {
+	uint8_t buf[256];
+	size_t len = build_frame(buf, TRACE_IPPROTO_UDP, 16);
+	uint8_t *last = buf + len - 2;
+	uint32_t sum;
+	uint16_t csum;
+
+	/* Choose the last payload word so that everything sums to 0xffff */
+	last[0] = last[1] = 0;
+	sum = ref_transport_sum(buf, len);
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	last[0] = (uint8_t)((0xffff - sum) >> 8);
+	last[1] = (uint8_t)(0xffff - sum);
+
+	trace_construct_packet(packet, TRACE_TYPE_ETH, buf, len);
+	if (trace_checksum_transport(packet, &csum) == NULL)
+		return check(0, "no checksum found", TRACE_IPPROTO_UDP, 16);
+	return check(csum == 0xffff, "zero UDP checksum", TRACE_IPPROTO_UDP,
+			16);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+	libtrace_packet_t *packet = trace_create_packet();
+	const uint8_t l4[2] = {TRACE_IPPROTO_TCP, TRACE_IPPROTO_UDP};
+	uint16_t csum, old, new;
+	int error = 0;
+	size_t plen;
+	int i;
+
+	/* Cover every combination of trailing bytes the checksum code can
+	 * be left with, for both transports */
+	for (i = 0; i < 2; i++) {
+		for (plen = 0; plen < 80; plen++)
+			error |= test_frame(packet, l4[i], plen);
+	}
+
+	error |= test_udp_zero(packet);
+
+	/* The worked example from RFC 1624 section 4 */
+	csum = htons(0xdd2f);
+	old = htons(0x5555);
+	new = htons(0x3285);
+	error |= check(trace_checksum_adjust(csum, &old, &new, 2) ==
+			htons(0x0000), "RFC 1624 example", 0, 0);
+
+	trace_destroy_packet(packet);
+
+	if (error)
+		return 1;
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Checks that the reducing combiner passes on a single merged result for
+ * each key once every thread has published it, and that keys only some
+ * threads published are passed on in key order when the trace finishes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+
+#define THREADS 4
+#define PACKETS 5000
+#define KEYS 10
+
+struct report {
+	int results;
+	int partial;
+	int errors;
+	uint64_t last_partial;
+};
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED) {
+	return calloc(1, sizeof(uint64_t));
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED, void *tls,
+		libtrace_packet_t *packet) {
+	(*(uint64_t *) tls)++;
+	return packet;
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls) {
+	uint64_t key;
+	libtrace_generic_t value;
+
+	/* Every thread publishes keys 1 to KEYS, each key is worth its
+	 * number of packets times the key */
+	for (key = 1; key <= KEYS; key++) {
+		value.uint64 = *(uint64_t *) tls * key;
+		trace_publish_result(trace, t, key, value, RESULT_USER);
+	}
+	/* Only the first thread publishes these */
+	if (trace_get_perpkt_thread_id(t) == 0) {
+		for (key = 1000 + KEYS; key > 1000; key--) {
+			value.uint64 = key;
+			trace_publish_result(trace, t, key, value, RESULT_USER);
+		}
+	}
+	free(tls);
+}
+
+static void merge_sum(libtrace_result_t *merged, libtrace_result_t *res,
+		void *data) {
+	assert(merged->key == res->key);
+	merged->value.uint64 += res->value.uint64;
+	(*(int *) data)++;
+}
+
+static void report_cb(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global,
+		void *tls UNUSED, libtrace_result_t *result) {
+	struct report *report = global;
+
+	assert(result->type == RESULT_USER);
+	if (result->key > 1000) {
+		if (result->value.uint64 != result->key ||
+				result->key <= report->last_partial)
+			report->errors++;
+		report->last_partial = result->key;
+		report->partial++;
+		return;
+	}
+	if (result->value.uint64 != PACKETS * result->key)
+		report->errors++;
+	report->results++;
+}
+
+int main() {
+	const char *uri = "mem:loops=50:erf:traces/100_packets.erf";
+	libtrace_callback_set_t *processing, *reporter;
+	libtrace_reducer_config_t config;
+	struct report report;
+	libtrace_t *trace;
+	int merges = 0;
+
+	memset(&report, 0, sizeof(report));
+	config.merge = merge_sum;
+	config.data = &merges;
+
+	/* A merge function is required */
+	trace = trace_create(uri);
+	iferr(trace, uri);
+	processing = trace_create_callback_set();
+	reporter = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_packet_cb(processing, per_packet);
+	trace_set_stopping_cb(processing, stop_processing);
+	trace_set_result_cb(reporter, report_cb);
+	trace_set_perpkt_threads(trace, THREADS);
+	trace_set_combiner(trace, &combiner_reducing, (libtrace_generic_t){0});
+	assert(trace_pstart(trace, &report, processing, reporter) == -1);
+	trace_destroy(trace);
+
+	trace = trace_create(uri);
+	iferr(trace, uri);
+	trace_set_perpkt_threads(trace, THREADS);
+	trace_set_combiner(trace, &combiner_reducing,
+			(libtrace_generic_t){.ptr = &config});
+
+	trace_pstart(trace, &report, processing, reporter);
+	iferr(trace, uri);
+	trace_join(trace);
+	iferr(trace, uri);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+
+	if (report.results != KEYS || report.partial != KEYS ||
+			merges != KEYS * (THREADS - 1) || report.errors) {
+		printf("got %d merged and %d partial results from %d merges, "
+				"%d wrong\n", report.results, report.partial,
+				merges, report.errors);
+		return 1;
+	}
+	printf("success\n");
+	return 0;
+}
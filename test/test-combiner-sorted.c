@@ -0,0 +1,137 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Checks that the sorted combiner delivers every result in key order, both
+ * when everything is held in memory and when a small memory budget forces
+ * results to be spilled to disk. Each thread publishes its results in the
+ * reverse of key order, so every run has to be sorted.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+
+#define LOOPS 50
+#define PACKETS (100 * LOOPS)
+
+struct report {
+	uint64_t last;
+	int results;
+	int out_of_order;
+};
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls UNUSED,
+		libtrace_packet_t *packet) {
+	libtrace_generic_t value;
+
+	value.uint64 = trace_packet_get_order(packet);
+	trace_publish_result(trace, t, UINT64_MAX - value.uint64, value,
+			RESULT_USER);
+	return packet;
+}
+
+static void report_cb(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global,
+		void *tls UNUSED, libtrace_result_t *result) {
+	struct report *report = global;
+
+	assert(result->type == RESULT_USER);
+	assert(result->key == UINT64_MAX - result->value.uint64);
+	if (report->results && result->key <= report->last)
+		report->out_of_order++;
+	report->last = result->key;
+	report->results++;
+}
+
+static int run(uint64_t budget) {
+	const char *uri = "mem:loops=50:erf:traces/100_packets.erf";
+	libtrace_callback_set_t *processing, *reporter;
+	struct report report;
+	libtrace_t *trace;
+
+	memset(&report, 0, sizeof(report));
+
+	trace = trace_create(uri);
+	iferr(trace, uri);
+
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+	reporter = trace_create_callback_set();
+	trace_set_result_cb(reporter, report_cb);
+
+	trace_set_perpkt_threads(trace, 4);
+	trace_set_combiner(trace, &combiner_sorted,
+			(libtrace_generic_t){.uint64 = budget});
+
+	trace_pstart(trace, &report, processing, reporter);
+	iferr(trace, uri);
+	trace_join(trace);
+	iferr(trace, uri);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+
+	if (report.results != PACKETS || report.out_of_order) {
+		printf("budget %" PRIu64 ": got %d of %d results, %d out of order\n",
+				budget, report.results, PACKETS,
+				report.out_of_order);
+		return 1;
+	}
+	return 0;
+}
+
+int main() {
+	int err = 0;
+
+	/* Everything in memory */
+	err |= run(0);
+	/* About 20 results per thread before spilling */
+	err |= run(80 * sizeof(libtrace_result_t));
+	/* Spill every result */
+	err |= run(1);
+
+	if (err == 0)
+		printf("success\n");
+	return err;
+}
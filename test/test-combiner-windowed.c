@@ -0,0 +1,169 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Checks that the windowed combiner passes results on in event time order,
+ * with each window followed by a tick. A second run makes one thread slow
+ * and sets a lateness bound, so results from that thread can be late, and
+ * checks that those are flagged as late and nothing else is out of order.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "libtrace_parallel.h"
+
+#define PACKETS (100 * 50)
+/* 10ms in ERF time */
+#define WINDOW (((uint64_t) 1 << 32) / 100)
+
+struct report {
+	uint64_t last_ts;
+	uint64_t last_tick;
+	int results;
+	int late;
+	int ticks;
+	int errors;
+	int slow;
+};
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global, void *tls UNUSED, libtrace_packet_t *packet) {
+	struct report *report = global;
+	libtrace_generic_t value;
+
+	if (report->slow && trace_get_perpkt_thread_id(t) == 0)
+		usleep(500);
+
+	value.uint64 = trace_packet_get_order(packet);
+	trace_publish_result(trace, t, trace_get_erf_timestamp(packet), value,
+			RESULT_USER);
+	return packet;
+}
+
+static void report_cb(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global,
+		void *tls UNUSED, libtrace_result_t *result) {
+	struct report *report = global;
+
+	if (result->type == RESULT_TICK_INTERVAL) {
+		/* Ticks mark the end of a window and always move forward */
+		if (result->key <= report->last_tick ||
+				result->key % WINDOW != 0 ||
+				result->key < report->last_ts)
+			report->errors++;
+		report->last_tick = result->key;
+		report->ticks++;
+		return;
+	}
+
+	assert(result->type == RESULT_USER);
+	report->results++;
+	if (result->flags & RESULT_FLAG_LATE) {
+		/* Late results belong to a window that has been passed on */
+		if (result->key >= report->last_tick)
+			report->errors++;
+		report->late++;
+		return;
+	}
+	if (result->key < report->last_ts || result->key < report->last_tick)
+		report->errors++;
+	report->last_ts = result->key;
+}
+
+static int run(uint64_t lateness, int slow) {
+	const char *uri = "mem:loops=50:erf:traces/100_packets.erf";
+	libtrace_callback_set_t *processing, *reporter;
+	libtrace_window_config_t config;
+	struct report report;
+	libtrace_t *trace;
+
+	memset(&report, 0, sizeof(report));
+	report.slow = slow;
+	config.window = WINDOW;
+	config.lateness = lateness;
+
+	trace = trace_create(uri);
+	iferr(trace, uri);
+
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+	reporter = trace_create_callback_set();
+	trace_set_result_cb(reporter, report_cb);
+
+	trace_set_perpkt_threads(trace, 4);
+	trace_set_reporter_thold(trace, 1);
+	trace_set_combiner(trace, &combiner_windowed,
+			(libtrace_generic_t){.ptr = &config});
+
+	trace_pstart(trace, &report, processing, reporter);
+	iferr(trace, uri);
+	trace_join(trace);
+	iferr(trace, uri);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+
+	if (report.results != PACKETS || report.errors ||
+			(lateness == 0 && report.late) || (slow && report.ticks == 0)) {
+		printf("lateness %" PRIu64 ": got %d of %d results, %d late, "
+				"%d ticks, %d wrong\n", lateness,
+				report.results, PACKETS, report.late,
+				report.ticks, report.errors);
+		return 1;
+	}
+	return 0;
+}
+
+int main() {
+	int err = 0;
+
+	/* Every window waits for all of the threads */
+	err |= run(0, 0);
+	err |= run(0, 1);
+	/* Don't wait more than a window for the slow thread */
+	err |= run(WINDOW, 1);
+
+	if (err == 0)
+		printf("success\n");
+	return err;
+}
@@ -0,0 +1,94 @@
+#include "data-struct/spsc_queue.h"
+#include <pthread.h>
+#include <assert.h>
+
+#define TEST_SIZE 1000000
+
+static void * producer(void * a) {
+	libtrace_spsc_queue_t * queue = (libtrace_spsc_queue_t *) a;
+	int i;
+	for (i = 0; i < TEST_SIZE; i++)
+		libtrace_spsc_queue_push(queue, &i);
+	return 0;
+}
+
+static void * consumer(void * a) {
+	libtrace_spsc_queue_t * queue = (libtrace_spsc_queue_t *) a;
+	int i, value;
+	for (i = 0; i < TEST_SIZE; i++) {
+		while (libtrace_spsc_queue_pop_front(queue, &value) == 0);
+		assert(value == i);
+	}
+	return 0;
+}
+
+static int sum = 0;
+
+static void add_to_sum(void *data) {
+	sum += *(int *) data;
+}
+
+/**
+ * Tests the single producer single consumer queue, first this establishes
+ * that single threaded operations work correctly across several segments,
+ * then does a basic consumer producer thread-safety test.
+ */
+int main() {
+	int i, value, *peeked;
+	int count = LIBTRACE_SPSC_SEGMENT_SIZE * 3 + 7;
+	pthread_t t[2];
+	libtrace_spsc_queue_t queue;
+
+	assert(libtrace_spsc_queue_init(&queue, sizeof(int)) == 0);
+	assert(libtrace_spsc_queue_get_size(&queue) == 0);
+	assert(libtrace_spsc_queue_peek_front(&queue) == NULL);
+
+	for (i = 0; i < count; i++)
+		assert(libtrace_spsc_queue_push(&queue, &i) == 0);
+	assert(libtrace_spsc_queue_get_size(&queue) == (size_t) count);
+
+	libtrace_spsc_queue_apply_function(&queue, add_to_sum);
+	assert(sum == count * (count - 1) / 2);
+
+	/* Now verify and remove */
+	for (i = 0; i < count; i++) {
+		peeked = libtrace_spsc_queue_peek_front(&queue);
+		assert(peeked && *peeked == i);
+		value = -1;
+		assert(libtrace_spsc_queue_pop_front(&queue, &value));
+		assert(value == i);
+	}
+	// It's empty make sure nothing works
+	value = -1;
+	assert(libtrace_spsc_queue_peek_front(&queue) == NULL);
+	assert(!libtrace_spsc_queue_pop_front(&queue, &value));
+	assert(value == -1);
+	assert(libtrace_spsc_queue_get_size(&queue) == 0);
+
+	// A bulk push part way into a segment that spills over several more
+	{
+		int bulk[LIBTRACE_SPSC_SEGMENT_SIZE * 2 + 5];
+		int n = sizeof(bulk) / sizeof(bulk[0]);
+
+		for (i = 0; i < n; i++)
+			bulk[i] = i;
+		assert(libtrace_spsc_queue_push_bulk(&queue, bulk, n) == 0);
+		assert(libtrace_spsc_queue_get_size(&queue) == (size_t) n);
+		for (i = 0; i < n; i++) {
+			assert(libtrace_spsc_queue_pop_front(&queue, &value));
+			assert(value == i);
+		}
+		assert(libtrace_spsc_queue_get_size(&queue) == 0);
+	}
+
+	// Test thread safety
+	pthread_create(&t[0], NULL, &producer, (void *) &queue);
+	pthread_create(&t[1], NULL, &consumer, (void *) &queue);
+
+	pthread_join(t[0], NULL);
+	pthread_join(t[1], NULL);
+	assert(libtrace_spsc_queue_get_size(&queue) == 0);
+
+	libtrace_spsc_queue_destroy(&queue);
+	return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "libtrace.h"
+
+#define FILTER_COUNT 5
+
+static const char *exprs[FILTER_COUNT] = {
+	"port 80",
+	"tcp",
+	"port 80",	/* duplicate of the first filter */
+	"udp",
+	"not ip",
+};
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+/* Applies a filter that is shared between traces with different link types
+ * and checks that it agrees with a filter that has only seen this trace */
+static int test_shared_filter(libtrace_filter_t *shared, const char *uri) {
+	libtrace_filter_t *fresh = trace_create_filter("tcp");
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_t *trace = trace_create(uri);
+	int count = 0;
+
+	iferr(trace);
+	if (trace_start(trace)==-1) {
+		iferr(trace);
+	}
+	while (trace_read_packet(trace, packet) > 0) {
+		int expected = trace_apply_filter(fresh, packet);
+
+		if (trace_apply_filter(shared, packet) != expected) {
+			iferr(trace);
+			printf("failure: shared filter disagrees on %s\n", uri);
+			return 1;
+		}
+		count += expected > 0;
+	}
+	iferr(trace);
+	if (count == 0) {
+		printf("failure: no tcp packets found in %s\n", uri);
+		return 1;
+	}
+
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	trace_destroy_filter(fresh);
+	return 0;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+        char *uri = "pcap:traces/100_packets.pcap";
+	libtrace_t *trace;
+	libtrace_packet_t *packet;
+	libtrace_filter_t *filters[FILTER_COUNT];
+	libtrace_filter_set_t *set = trace_create_filter_set();
+	uint64_t matches[TRACE_FILTER_SET_WORDS(FILTER_COUNT)];
+	int counts[FILTER_COUNT] = {0};
+	int psize;
+	int i;
+
+	assert(set);
+	for (i = 0; i < FILTER_COUNT; i++) {
+		filters[i] = trace_create_filter(exprs[i]);
+		if (trace_add_filter_to_set(set, exprs[i]) != i) {
+			printf("failure: filter %d was given the wrong index\n", i);
+			return 1;
+		}
+	}
+
+	trace = trace_create(uri);
+	iferr(trace);
+
+	if (trace_start(trace)==-1) {
+		iferr(trace);
+	}
+
+	packet=trace_create_packet();
+	while ((psize = trace_read_packet(trace, packet)) > 0) {
+		int expected = 0;
+		int matched = trace_apply_filter_set(set, packet, matches);
+
+		if (matched < 0) {
+			iferr(trace);
+			printf("failure: trace_apply_filter_set failed\n");
+			return 1;
+		}
+
+		/* Every filter in the set must agree with the same filter
+		 * applied on its own */
+		for (i = 0; i < FILTER_COUNT; i++) {
+			int single = trace_apply_filter(filters[i], packet) > 0;
+
+			if (single != !!TRACE_FILTER_SET_MATCHED(matches, i)) {
+				printf("failure: filter \"%s\" disagrees with the filter set\n",
+						exprs[i]);
+				return 1;
+			}
+			expected += single;
+			counts[i] += single;
+		}
+		if (matched != expected) {
+			printf("failure: %d filters matched but %d were reported\n",
+					expected, matched);
+			return 1;
+		}
+	}
+	if (psize < 0)
+		iferr(trace);
+
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	for (i = 0; i < FILTER_COUNT; i++)
+		trace_destroy_filter(filters[i]);
+	trace_destroy_filter_set(set);
+
+	if (counts[0] != 54 || counts[2] != 54) {
+		printf("failure: 54 packets expected on port 80, %d seen\n",
+				counts[0]);
+		return 1;
+	}
+
+	/* A filter is compiled for each link type it is applied to */
+	filters[0] = trace_create_filter("tcp");
+	if (test_shared_filter(filters[0], "pcap:traces/100_packets.pcap") ||
+			test_shared_filter(filters[0],
+				"pcapfile:traces/sll.pcap.gz") ||
+			test_shared_filter(filters[0],
+				"pcap:traces/100_packets.pcap"))
+		return 1;
+	trace_destroy_filter(filters[0]);
+	printf("success: filter set matched the individual filters\n");
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static libtrace_t *open_trace(const char *uri) {
+	libtrace_t *trace = trace_create(uri);
+
+	iferr(trace);
+	if (trace_start(trace) == -1)
+		iferr(trace);
+	return trace;
+}
+
+/* Checks the tuple of one packet against the individual accessors run on
+ * a second copy of the same packet */
+static int check_tuple(libtrace_packet_t *packet, libtrace_packet_t *ref,
+		int count) {
+	const libtrace_flow_tuple_t *tuple = trace_get_flow_tuple(packet);
+	libtrace_linktype_t linktype;
+	uint16_t ethertype;
+	uint32_t remaining;
+	uint8_t proto, more;
+	char *l2, *l3, *l4;
+	void *ptr;
+	int error = 0;
+
+	l2 = trace_get_layer2(ref, &linktype, &remaining);
+	if (!tuple) {
+		if (l2) {
+			printf("fail: packet %d has no tuple\n", count);
+			return 1;
+		}
+		return 0;
+	}
+
+	l3 = trace_get_layer3(ref, &ethertype, &remaining);
+	if (!l3 != !(tuple->flags & LIBTRACE_TUPLE_L3) || (l3 &&
+			(tuple->l3_offset != l3 - l2 ||
+			tuple->ethertype != ethertype))) {
+		printf("fail: packet %d layer 3 differs\n", count);
+		error = 1;
+	}
+	if (l3 && ethertype == TRACE_ETHERTYPE_IP) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+		if (tuple->ip_version != 4 ||
+				tuple->src_ip.ip4.s_addr != ip->ip_src.s_addr ||
+				tuple->dst_ip.ip4.s_addr != ip->ip_dst.s_addr) {
+			printf("fail: packet %d IPv4 addresses differ\n",
+					count);
+			error = 1;
+		}
+	}
+	if (l3 && ethertype == TRACE_ETHERTYPE_IPV6) {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+		if (tuple->ip_version != 6 ||
+				memcmp(&tuple->src_ip.ip6, &ip6->ip_src, 16) ||
+				memcmp(&tuple->dst_ip.ip6, &ip6->ip_dst, 16)) {
+			printf("fail: packet %d IPv6 addresses differ\n",
+					count);
+			error = 1;
+		}
+	}
+
+	l4 = trace_get_transport(ref, &proto, &remaining);
+	if (!l4 != !(tuple->flags & LIBTRACE_TUPLE_L4) || (l4 &&
+			(tuple->l4_offset != l4 - l2 ||
+			tuple->proto != proto))) {
+		printf("fail: packet %d transport differs\n", count);
+		error = 1;
+	}
+	if (tuple->src_port != trace_get_source_port(ref) ||
+			tuple->dst_port != trace_get_destination_port(ref)) {
+		printf("fail: packet %d ports differ\n", count);
+		error = 1;
+	}
+	if (tuple->frag_offset != trace_get_fragment_offset(ref, &more) ||
+			!(tuple->flags & LIBTRACE_TUPLE_MORE_FRAGMENTS) != !more) {
+		printf("fail: packet %d fragment offset differs\n", count);
+		error = 1;
+	}
+
+	/* The outermost label functions only look through untagged
+	 * Ethernet, so just compare the first label seen */
+	if (tuple->vlan_count && trace_get_outermost_vlan(ref,
+			(uint8_t **)&ptr, &remaining) != tuple->vlans[0]) {
+		printf("fail: packet %d VLAN differs\n", count);
+		error = 1;
+	}
+	if (tuple->mpls_count && !tuple->vlan_count &&
+			trace_get_outermost_mpls(ref, (uint8_t **)&ptr,
+			&remaining) != tuple->mpls[0]) {
+		printf("fail: packet %d MPLS label differs\n", count);
+		error = 1;
+	}
+
+	/* Later calls are served from the cache */
+	if (trace_get_flow_tuple(packet) != tuple ||
+			trace_get_source_port(packet) != tuple->src_port) {
+		printf("fail: packet %d tuple is not cached\n", count);
+		error = 1;
+	}
+	return error;
+}
+
+static int test_trace(const char *uri) {
+	libtrace_t *trace = open_trace(uri);
+	libtrace_t *reftrace = open_trace(uri);
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_packet_t *ref = trace_create_packet();
+	int count = 0;
+	int error = 0;
+
+	while (trace_read_packet(trace, packet) > 0) {
+		if (trace_read_packet(reftrace, ref) <= 0) {
+			printf("fail: traces differ in length\n");
+			error = 1;
+			break;
+		}
+		error |= check_tuple(packet, ref, count);
+		count++;
+	}
+	iferr(trace);
+
+	if (count == 0) {
+		printf("fail: no packets read\n");
+		error = 1;
+	}
+	if (error)
+		printf("fail: %s\n", uri);
+	trace_destroy_packet(packet);
+	trace_destroy_packet(ref);
+	trace_destroy(trace);
+	trace_destroy(reftrace);
+	return error;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+	static const char *uris[] = {
+		"pcapfile:traces/100_packets.pcap",
+		"pcapfile:traces/sll.pcap.gz",
+		"pcapfile:traces/vlan.pcap",
+		"pcapfile:traces/qinq.pcap",
+		"pcapfile:traces/mpls.pcap",
+		"pcapfile:traces/10_mpls_ip.pcap",
+		"erf:traces/fragtest.erf.gz",
+	};
+	size_t i;
+	int error = 0;
+
+	for (i = 0; i < sizeof(uris) / sizeof(uris[0]); i++)
+		error |= test_trace(uris[i]);
+
+	if (!error)
+		printf("success: flow tuples match the header accessors\n");
+	return error;
+}
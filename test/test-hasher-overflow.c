@@ -0,0 +1,226 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+/* Checks that the hasher follows its overflow policy when a processing
+ * thread cannot keep up: blocking and spilling deliver every packet in
+ * order, while dropping counts each packet that was not delivered. Ticks
+ * must reach every thread whatever the policy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libtrace_parallel.h"
+
+#define THREADS 2
+#define PACKETS 5000
+#define TICK_COUNT 100
+
+struct counts {
+	pthread_mutex_t lock;
+	uint64_t packets;
+	uint64_t accepted;
+	uint64_t overflow;
+	uint64_t ticks;
+	int out_of_order;
+};
+
+struct thread_counts {
+	uint64_t packets;
+	uint64_t ticks;
+	uint64_t last_order;
+	int out_of_order;
+};
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+/* Send everything to the first thread so its queue fills up */
+static uint64_t first_thread(const libtrace_packet_t *packet UNUSED,
+		void *data UNUSED) {
+	return 0;
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED) {
+	return calloc(1, sizeof(struct thread_counts));
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED,
+		void *tls, libtrace_packet_t *packet) {
+	struct thread_counts *counts = tls;
+	uint64_t order = trace_packet_get_order(packet);
+
+	if (counts->packets && order <= counts->last_order)
+		counts->out_of_order++;
+	counts->last_order = order;
+	counts->packets++;
+
+	/* Stall long enough for the hasher to fill the queue */
+	if (counts->packets == 1)
+		usleep(20000);
+	return packet;
+}
+
+static void per_tick(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+		void *global UNUSED, void *tls, uint64_t order UNUSED) {
+	struct thread_counts *counts = tls;
+
+	counts->ticks++;
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+		void *global, void *tls) {
+	struct counts *counts = global;
+	struct thread_counts *mine = tls;
+	libtrace_stat_t *stats = trace_create_statistics();
+
+	trace_get_thread_statistics(trace, t, stats);
+	pthread_mutex_lock(&counts->lock);
+	counts->packets += mine->packets;
+	counts->ticks += mine->ticks;
+	counts->out_of_order += mine->out_of_order;
+	if (stats->accepted_valid)
+		counts->accepted += stats->accepted;
+	if (stats->overflow_valid)
+		counts->overflow += stats->overflow;
+	pthread_mutex_unlock(&counts->lock);
+	free(stats);
+	free(mine);
+}
+
+static int run_trace(libtrace_callback_set_t *processing,
+		enum hasher_overflow overflow, const char *name) {
+	const char *uri = "mem:loops=50:erf:traces/100_packets.erf";
+	struct counts counts;
+	libtrace_stat_t *stats;
+	libtrace_t *trace;
+	int errors = 0;
+
+	memset(&counts, 0, sizeof(counts));
+	pthread_mutex_init(&counts.lock, NULL);
+
+	trace = trace_create(uri);
+	iferr(trace, uri);
+	trace_set_perpkt_threads(trace, THREADS);
+	trace_set_hasher(trace, HASHER_CUSTOM, first_thread, NULL);
+	trace_set_hasher_queue_size(trace, 16);
+	trace_set_hasher_overflow(trace, overflow);
+	/* Leave room for the ticks as well */
+	trace_set_hasher_spill_size(trace, PACKETS * 2);
+	trace_set_tick_count(trace, TICK_COUNT);
+	trace_pstart(trace, &counts, processing, NULL);
+	iferr(trace, uri);
+	trace_join(trace);
+	iferr(trace, uri);
+
+	stats = trace_get_statistics(trace, NULL);
+	if (!stats->overflow_valid || stats->overflow != counts.overflow) {
+		printf("%s: trace counted %" PRIu64 " overflowed packets, "
+				"threads counted %" PRIu64 "\n", name,
+				stats->overflow, counts.overflow);
+		errors++;
+	}
+	if (counts.accepted != counts.packets) {
+		printf("%s: accepted %" PRIu64 " packets but processed %"
+				PRIu64 "\n", name, counts.accepted,
+				counts.packets);
+		errors++;
+	}
+	if (counts.out_of_order) {
+		printf("%s: %d packets arrived out of order\n", name,
+				counts.out_of_order);
+		errors++;
+	}
+
+	if (counts.ticks != THREADS * (PACKETS / TICK_COUNT)) {
+		printf("%s: %" PRIu64 " ticks arrived, expected %d\n", name,
+				counts.ticks, THREADS * (PACKETS / TICK_COUNT));
+		errors++;
+	}
+
+	if (overflow == HASHER_OVERFLOW_DROP) {
+		if (counts.overflow == 0) {
+			printf("%s: no packets were dropped\n", name);
+			errors++;
+		}
+		if (counts.packets + counts.overflow != PACKETS) {
+			printf("%s: processed %" PRIu64 " and dropped %" PRIu64
+					" packets, expected %d in total\n",
+					name, counts.packets, counts.overflow,
+					PACKETS);
+			errors++;
+		}
+	} else {
+		if (counts.overflow != 0 || counts.packets != PACKETS) {
+			printf("%s: processed %" PRIu64 " and dropped %" PRIu64
+					" packets, expected %d and none\n",
+					name, counts.packets, counts.overflow,
+					PACKETS);
+			errors++;
+		}
+	}
+
+	trace_destroy(trace);
+	pthread_mutex_destroy(&counts.lock);
+	return errors;
+}
+
+int main() {
+	libtrace_callback_set_t *processing;
+	int errors = 0;
+
+	processing = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_packet_cb(processing, per_packet);
+	trace_set_tick_count_cb(processing, per_tick);
+	trace_set_stopping_cb(processing, stop_processing);
+
+	errors += run_trace(processing, HASHER_OVERFLOW_BLOCK, "block");
+	errors += run_trace(processing, HASHER_OVERFLOW_DROP, "drop");
+	errors += run_trace(processing, HASHER_OVERFLOW_SPILL, "spill");
+
+	trace_destroy_callback_set(processing);
+
+	if (errors)
+		return 1;
+	printf("success\n");
+	return 0;
+}
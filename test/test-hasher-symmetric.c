@@ -0,0 +1,363 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+#include "hash_symmetric.h"
+#include "hash_toeplitz.h"
+
+/* Builds an IPv4/TCP packet */
+static size_t build_ip_tcp(uint8_t *buf, uint32_t src, uint32_t dst,
+		uint16_t sport, uint16_t dport) {
+	libtrace_ip_t *ip = (libtrace_ip_t *)buf;
+	libtrace_tcp_t *tcp = (libtrace_tcp_t *)(buf + sizeof(libtrace_ip_t));
+
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(sizeof(libtrace_ip_t) + sizeof(libtrace_tcp_t));
+	ip->ip_ttl = 64;
+	ip->ip_p = TRACE_IPPROTO_TCP;
+	ip->ip_src.s_addr = htonl(src);
+	ip->ip_dst.s_addr = htonl(dst);
+
+	tcp->source = htons(sport);
+	tcp->dest = htons(dport);
+	tcp->doff = 5;
+	return sizeof(libtrace_ip_t) + sizeof(libtrace_tcp_t);
+}
+
+/* Builds an Ethernet/IPv4/TCP frame, with a VLAN tag if vlan is not 0 */
+static size_t build_frame(uint8_t *buf, uint16_t vlan, uint32_t src,
+		uint32_t dst, uint16_t sport, uint16_t dport) {
+	libtrace_ether_t *eth = (libtrace_ether_t *)buf;
+	size_t len = sizeof(libtrace_ether_t);
+
+	memset(buf, 0, 128);
+	if (vlan) {
+		libtrace_8021q_t *tag = (libtrace_8021q_t *)(buf + len);
+		eth->ether_type = htons(TRACE_ETHERTYPE_8021Q);
+		tag->tci = htons(vlan);
+		tag->vlan_ether_type = htons(TRACE_ETHERTYPE_IP);
+		len += sizeof(libtrace_8021q_t);
+	} else {
+		eth->ether_type = htons(TRACE_ETHERTYPE_IP);
+	}
+
+	return len + build_ip_tcp(buf + len, src, dst, sport, dport);
+}
+
+enum tunnel { TUNNEL_VXLAN, TUNNEL_GTPU, TUNNEL_GTPU_EXT, TUNNEL_GRE_MPLS };
+
+/* Builds an Ethernet/IPv4 frame with a tunnel from outer to outer + 1,
+ * carrying an IPv4/TCP packet */
+static size_t build_tunnel(uint8_t *buf, enum tunnel tunnel, uint32_t outer,
+		uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport) {
+	libtrace_ether_t *eth = (libtrace_ether_t *)buf;
+	libtrace_ip_t *ip = (libtrace_ip_t *)(buf + sizeof(libtrace_ether_t));
+	libtrace_udp_t *udp;
+	uint8_t *p = buf + sizeof(libtrace_ether_t) + sizeof(libtrace_ip_t);
+	size_t len;
+
+	memset(buf, 0, 256);
+	eth->ether_type = htons(TRACE_ETHERTYPE_IP);
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_ttl = 64;
+	ip->ip_p = TRACE_IPPROTO_UDP;
+	ip->ip_src.s_addr = htonl(outer);
+	ip->ip_dst.s_addr = htonl(outer + 1);
+
+	udp = (libtrace_udp_t *)p;
+	p += sizeof(libtrace_udp_t);
+
+	switch (tunnel) {
+		case TUNNEL_VXLAN:
+			udp->dest = htons(4789);
+			p[0] = 0x08;
+			p += sizeof(libtrace_vxlan_t);
+			((libtrace_ether_t *)p)->ether_type =
+					htons(TRACE_ETHERTYPE_IP);
+			p += sizeof(libtrace_ether_t);
+			break;
+		case TUNNEL_GTPU:
+			udp->dest = htons(2152);
+			p[0] = 0x30;
+			p[1] = 0xff;
+			p += 8;
+			break;
+		case TUNNEL_GTPU_EXT:
+			/* A sequence number and a PDU session container */
+			udp->dest = htons(2152);
+			p[0] = 0x36;
+			p[1] = 0xff;
+			p[11] = 0x85;
+			p[12] = 1;
+			p += 16;
+			break;
+		case TUNNEL_GRE_MPLS:
+			ip->ip_p = TRACE_IPPROTO_GRE;
+			p = (uint8_t *)udp;
+			((libtrace_gre_t *)p)->ethertype =
+					htons(TRACE_ETHERTYPE_MPLS);
+			p += 4;
+			/* Bottom of stack */
+			p[2] = 0x01;
+			p[3] = 64;
+			p += 4;
+			break;
+	}
+
+	p += build_ip_tcp(p, src, dst, sport, dport);
+	len = p - buf;
+	ip->ip_len = htons(len - sizeof(libtrace_ether_t));
+	if (ip->ip_p == TRACE_IPPROTO_UDP) {
+		udp->source = htons(50000);
+		udp->len = htons(len - ((uint8_t *)udp - buf));
+	}
+	return len;
+}
+
+static uint64_t hash_buffer(const symmetric_conf_t *conf, uint8_t *buf,
+		size_t len) {
+	libtrace_packet_t *packet = trace_create_packet();
+	uint64_t hash;
+
+	trace_construct_packet(packet, TRACE_TYPE_ETH, buf, len);
+	hash = symmetric_hash_packet(packet, conf);
+	trace_destroy_packet(packet);
+	return hash;
+}
+
+static uint64_t hash_frame(const symmetric_conf_t *conf, uint16_t vlan,
+		uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport) {
+	uint8_t buf[128];
+	size_t len = build_frame(buf, vlan, src, dst, sport, dport);
+
+	return hash_buffer(conf, buf, len);
+}
+
+static uint64_t hash_tunnel(const symmetric_conf_t *conf, enum tunnel tunnel,
+		uint32_t outer, uint32_t src, uint32_t dst, uint16_t sport,
+		uint16_t dport) {
+	uint8_t buf[256];
+	size_t len = build_tunnel(buf, tunnel, outer, src, dst, sport, dport);
+
+	return hash_buffer(conf, buf, len);
+}
+
+static uint64_t toeplitz_tunnel(const toeplitz_table_t *conf,
+		enum tunnel tunnel, uint32_t outer, uint32_t src, uint32_t dst,
+		uint16_t sport, uint16_t dport) {
+	libtrace_packet_t *packet = trace_create_packet();
+	uint8_t buf[256];
+	size_t len = build_tunnel(buf, tunnel, outer, src, dst, sport, dport);
+	uint64_t hash;
+
+	trace_construct_packet(packet, TRACE_TYPE_ETH, buf, len);
+	hash = toeplitz_table_hash_inner_packet(packet, conf);
+	trace_destroy_packet(packet);
+	return hash;
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED,
+		void *tls UNUSED, libtrace_packet_t *packet) {
+	return packet;
+}
+
+static int check(int ok, const char *what) {
+	if (!ok)
+		printf("failure: %s\n", what);
+	return !ok;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+	symmetric_conf_t *conf = calloc(1, sizeof(symmetric_conf_t));
+	symmetric_conf_t *soft = calloc(1, sizeof(symmetric_conf_t));
+	const uint32_t a = 0x0a000001, b = 0xc0a80102;
+	uint8_t data[1000];
+	libtrace_t *trace;
+	int error = 0;
+	size_t i;
+
+	/* The CRC32C check value, in both implementations */
+	symmetric_init_config(conf, HASHER_FIELDS_5TUPLE);
+	memcpy(soft, conf, sizeof(symmetric_conf_t));
+	soft->hw_crc = 0;
+	error |= check((symmetric_crc32c(conf, (const uint8_t *)"123456789", 9,
+			0xffffffff) ^ 0xffffffff) == 0xe3069283,
+			"CRC32C of \"123456789\"");
+	error |= check((symmetric_crc32c(soft, (const uint8_t *)"123456789", 9,
+			0xffffffff) ^ 0xffffffff) == 0xe3069283,
+			"software CRC32C of \"123456789\"");
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (uint8_t)(i * 7 + 3);
+	for (i = 0; i < sizeof(data); i += 37) {
+		error |= check(symmetric_crc32c(conf, data, i, i) ==
+				symmetric_crc32c(soft, data, i, i),
+				"hardware and software CRC32C differ");
+	}
+
+	/* 5-tuple: both directions match, other flows don't */
+	error |= check(hash_frame(conf, 0, a, b, 1234, 80) ==
+			hash_frame(conf, 0, b, a, 80, 1234),
+			"5-tuple hash is not symmetric");
+	error |= check(hash_frame(conf, 0, a, b, 1234, 80) !=
+			hash_frame(conf, 0, a, b, 1235, 80),
+			"5-tuple hash ignores ports");
+	error |= check(hash_frame(conf, 0, a, a, 1234, 80) ==
+			hash_frame(conf, 0, a, a, 80, 1234),
+			"5-tuple hash is not symmetric for equal addresses");
+	error |= check(hash_frame(conf, 10, a, b, 1234, 80) ==
+			hash_frame(conf, 20, a, b, 1234, 80),
+			"5-tuple hash depends on the VLAN");
+
+	/* Only the first fragment has ports, so fragments are hashed on
+	 * their addresses to keep a datagram together */
+	{
+		uint8_t buf[128];
+		size_t len = build_frame(buf, 0, a, b, 1234, 80);
+		libtrace_ip_t *ip = (libtrace_ip_t *)(buf +
+				sizeof(libtrace_ether_t));
+		uint64_t first;
+
+		ip->ip_off = htons(0x2000);
+		first = hash_buffer(conf, buf, len);
+		ip->ip_off = htons(185);
+		error |= check(first == hash_buffer(conf, buf, len),
+				"fragments of a datagram hash differently");
+	}
+
+	/* IP only: ports are ignored */
+	conf->fields = HASHER_FIELDS_IP;
+	error |= check(hash_frame(conf, 0, a, b, 1234, 80) ==
+			hash_frame(conf, 0, b, a, 4321, 443),
+			"IP hash depends on ports");
+
+	/* VLAN aware: the VLAN ID matters, and is still symmetric */
+	conf->fields = HASHER_FIELDS_VLAN;
+	error |= check(hash_frame(conf, 10, a, b, 1234, 80) !=
+			hash_frame(conf, 20, a, b, 1234, 80),
+			"VLAN hash ignores the VLAN");
+	error |= check(hash_frame(conf, 10, a, b, 1234, 80) ==
+			hash_frame(conf, 10, b, a, 80, 1234),
+			"VLAN hash is not symmetric");
+
+	/* Inner: tunnelled packets hash the same as the packet they carry,
+	 * whatever the tunnel endpoints */
+	conf->fields = HASHER_FIELDS_INNER;
+	{
+		static const enum tunnel tunnels[] = { TUNNEL_VXLAN,
+			TUNNEL_GTPU, TUNNEL_GTPU_EXT, TUNNEL_GRE_MPLS };
+		uint64_t plain = hash_frame(conf, 0, a, b, 1234, 80);
+
+		for (i = 0; i < sizeof(tunnels) / sizeof(tunnels[0]); i++) {
+			error |= check(hash_tunnel(conf, tunnels[i], 0x01010101,
+					a, b, 1234, 80) == plain,
+					"inner hash differs from the plain "
+					"packet");
+			error |= check(hash_tunnel(conf, tunnels[i], 0x02020202,
+					b, a, 80, 1234) == plain,
+					"inner hash depends on the tunnel");
+			error |= check(hash_tunnel(conf, tunnels[i], 0x01010101,
+					a, b, 1235, 80) != plain,
+					"inner hash ignores the inner ports");
+		}
+	}
+
+	/* The Toeplitz hashers can look inside tunnels too */
+	{
+		toeplitz_conf_t toeplitz;
+		toeplitz_table_t *tc;
+		uint64_t inner;
+
+		toeplitz_init_config(&toeplitz, 1);
+		tc = toeplitz_create_table(&toeplitz);
+		inner = toeplitz_tunnel(tc, TUNNEL_VXLAN, 0x01010101, a, b,
+				1234, 80);
+		error |= check(toeplitz_tunnel(tc, TUNNEL_GTPU, 0x02020202, b,
+				a, 80, 1234) == inner,
+				"inner Toeplitz hash depends on the tunnel");
+		error |= check(toeplitz_tunnel(tc, TUNNEL_VXLAN, 0x01010101, a,
+				b, 1235, 80) != inner,
+				"inner Toeplitz hash ignores the inner ports");
+		toeplitz_destroy_table(tc);
+	}
+
+	conf->fields = HASHER_FIELDS_5TUPLE;
+	error |= check(hash_tunnel(conf, TUNNEL_VXLAN, 0x01010101, a, b, 1234,
+			80) == hash_tunnel(conf, TUNNEL_VXLAN, 0x01010101, b,
+			a, 4321, 443), "5-tuple hash looks inside tunnels");
+
+	/* The hasher can be chosen through the configuration string */
+	trace = trace_create("pcapfile:traces/100_packets.pcap");
+	error |= check(trace_set_configuration(trace,
+			"hasher=symmetric,hasher_fields=vlan") == 0,
+			"configuring the symmetric hasher");
+	error |= check(trace_set_hasher_fields(trace, HASHER_FIELDS_IP) == 0,
+			"setting the hasher fields");
+	error |= check(trace_set_hasher(trace, HASHER_SYMMETRIC, NULL,
+			NULL) == 0, "setting the symmetric hasher");
+	trace_destroy(trace);
+
+	/* Spread a VXLAN trace over two threads and check the imbalance is
+	 * reported */
+	trace = trace_create("pcapfile:traces/vxlan.pcap");
+	error |= check(trace_set_configuration(trace,
+			"hasher=symmetric,hasher_fields=inner,perpkt_threads=2")
+			== 0, "configuring the inner hasher");
+	{
+		libtrace_callback_set_t *pktcbs = trace_create_callback_set();
+		libtrace_stat_t *stats;
+
+		trace_set_packet_cb(pktcbs, per_packet);
+		error |= check(trace_pstart(trace, NULL, pktcbs, NULL) == 0,
+				"starting the VXLAN trace");
+		trace_join(trace);
+		stats = trace_get_statistics(trace, NULL);
+		error |= check(stats && stats->imbalance_valid &&
+				stats->accepted_valid &&
+				stats->imbalance <= stats->accepted,
+				"imbalance is not reported");
+		trace_destroy_callback_set(pktcbs);
+	}
+	trace_destroy(trace);
+
+	free(conf);
+	free(soft);
+	if (!error)
+		printf("success: symmetric hasher\n");
+	return error;
+}
@@ -0,0 +1,84 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libtrace.h"
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+	char *uri = "mem:loops=3:pcapfile:traces/100_packets.pcap";
+	libtrace_t *trace;
+	libtrace_packet_t *packet;
+	uint64_t lastorder = 0;
+	double lastts = 0;
+	int error = 0;
+	int count = 0;
+
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	packet = trace_create_packet();
+	while (trace_read_packet(trace, packet) > 0) {
+		if (packet->order <= lastorder) {
+			printf("failure: packet %d is out of order\n", count);
+			error = 1;
+		}
+		if (trace_get_seconds(packet) < lastts) {
+			printf("failure: packet %d went back in time\n", count);
+			error = 1;
+		}
+		lastorder = packet->order;
+		lastts = trace_get_seconds(packet);
+		count ++;
+	}
+	iferr(trace);
+
+	if (count != 300) {
+		printf("failure: 300 packets expected, %d seen\n", count);
+		error = 1;
+	}
+	if (error == 0)
+		printf("success: 300 packets read\n");
+
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	return error;
+}
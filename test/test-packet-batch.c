@@ -0,0 +1,167 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Checks that the packet batch callback sees every packet exactly once, in
+ * order within each thread, and that packets it keeps are not reused until
+ * they are freed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "libtrace_parallel.h"
+
+#define THREADS 4
+#define PACKETS 5000
+#define KEEP 10
+
+struct count {
+	uint64_t packets;
+	uint64_t batches;
+	uint64_t last;
+	int errors;
+	int nkept;
+	libtrace_packet_t *kept[KEEP];
+	uint64_t kept_order[KEEP];
+};
+
+struct total {
+	pthread_mutex_t lock;
+	uint64_t packets;
+	uint64_t batches;
+	int errors;
+};
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED) {
+	return calloc(1, sizeof(struct count));
+}
+
+/* Checks the packets we kept have not been overwritten, then frees them */
+static void release_kept(libtrace_t *trace, struct count *count) {
+	int i;
+
+	for (i = 0; i < count->nkept; i++) {
+		if (trace_packet_get_order(count->kept[i]) !=
+				count->kept_order[i])
+			count->errors++;
+		trace_free_packet(trace, count->kept[i]);
+	}
+	count->nkept = 0;
+}
+
+static void per_batch(libtrace_t *trace, libtrace_thread_t *t UNUSED,
+		void *global UNUSED, void *tls, libtrace_packet_t **packets,
+		size_t n) {
+	struct count *count = tls;
+	size_t i;
+
+	assert(n > 0);
+	count->batches++;
+	for (i = 0; i < n; i++) {
+		uint64_t order = trace_packet_get_order(packets[i]);
+
+		if (count->packets && order <= count->last)
+			count->errors++;
+		count->last = order;
+		count->packets++;
+		/* Hold on to some packets until a later batch */
+		if (count->packets % 7 == 0) {
+			if (count->nkept == KEEP)
+				release_kept(trace, count);
+			count->kept_order[count->nkept] = order;
+			count->kept[count->nkept++] = packets[i];
+			packets[i] = NULL;
+		}
+	}
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t UNUSED,
+		void *global, void *tls) {
+	struct total *total = global;
+	struct count *count = tls;
+
+	release_kept(trace, count);
+	pthread_mutex_lock(&total->lock);
+	total->packets += count->packets;
+	total->batches += count->batches;
+	total->errors += count->errors;
+	pthread_mutex_unlock(&total->lock);
+	free(count);
+}
+
+int main() {
+	const char *uri = "mem:loops=50:erf:traces/100_packets.erf";
+	libtrace_callback_set_t *processing;
+	struct total total;
+	libtrace_t *trace;
+
+	memset(&total, 0, sizeof(total));
+	pthread_mutex_init(&total.lock, NULL);
+
+	processing = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_packet_batch_cb(processing, per_batch);
+	trace_set_stopping_cb(processing, stop_processing);
+
+	trace = trace_create(uri);
+	iferr(trace, uri);
+	trace_set_perpkt_threads(trace, THREADS);
+	trace_pstart(trace, &total, processing, NULL);
+	iferr(trace, uri);
+	trace_join(trace);
+	iferr(trace, uri);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+
+	/* Packets should be passed on in bursts rather than one at a time */
+	if (total.packets != PACKETS || total.errors ||
+			total.batches * 2 > total.packets) {
+		printf("got %" PRIu64 " packets in %" PRIu64 " batches, "
+				"%d wrong\n", total.packets, total.batches,
+				total.errors);
+		return 1;
+	}
+	printf("success\n");
+	return 0;
+}
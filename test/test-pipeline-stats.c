@@ -0,0 +1,169 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Checks that the pipeline statistics count every packet read by the
+ * processing threads, time each stage of the pipeline and are only
+ * available when they were asked for.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+
+#define THREADS 4
+#define PACKETS 5000
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+/* Remember each processing thread so its statistics can be asked for */
+static void *start_processing(libtrace_t *trace UNUSED, libtrace_thread_t *t,
+		void *global) {
+	libtrace_thread_t **threads = global;
+
+	threads[trace_get_perpkt_thread_id(t)] = t;
+	return NULL;
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED,
+		void *tls UNUSED, libtrace_packet_t *packet) {
+	return packet;
+}
+
+static libtrace_t *run_trace(libtrace_callback_set_t *processing,
+		libtrace_thread_t **threads, bool stats) {
+	const char *uri = "mem:loops=50:erf:traces/100_packets.erf";
+	libtrace_t *trace;
+
+	trace = trace_create(uri);
+	iferr(trace, uri);
+	trace_set_perpkt_threads(trace, THREADS);
+	trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+	trace_set_pipeline_stats(trace, stats);
+	trace_pstart(trace, threads, processing, NULL);
+	iferr(trace, uri);
+	trace_join(trace);
+	iferr(trace, uri);
+	return trace;
+}
+
+int main() {
+	libtrace_callback_set_t *processing;
+	libtrace_pipeline_stats_t stats, thread_stats;
+	libtrace_thread_t *threads[THREADS];
+	libtrace_t *trace;
+	uint64_t occupancy = 0, packets = 0;
+	int i, errors = 0;
+
+	processing = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_packet_cb(processing, per_packet);
+
+	/* Statistics have to be turned on before the trace starts */
+	trace = run_trace(processing, threads, false);
+	if (trace_get_pipeline_stats(trace, NULL, &stats) != -1) {
+		printf("got pipeline statistics without enabling them\n");
+		errors++;
+	}
+	trace_get_err(trace);
+	trace_destroy(trace);
+
+	trace = run_trace(processing, threads, true);
+	if (trace_get_pipeline_stats(trace, NULL, &stats) != 0) {
+		trace_perror(trace, "trace_get_pipeline_stats");
+		return 1;
+	}
+	trace_print_pipeline_stats(&stats, stdout);
+
+	/* The end of trace marker may be read as part of a burst */
+	if (stats.packets < PACKETS || stats.packets > PACKETS + THREADS) {
+		printf("counted %" PRIu64 " packets\n", stats.packets);
+		errors++;
+	}
+	if (stats.bursts == 0 || stats.bursts > stats.packets) {
+		printf("counted %" PRIu64 " bursts\n", stats.bursts);
+		errors++;
+	}
+	if (!stats.stages[PIPELINE_STAGE_READ].samples ||
+			!stats.stages[PIPELINE_STAGE_HASHER].samples ||
+			!stats.stages[PIPELINE_STAGE_HASHER_READ].samples ||
+			!stats.stages[PIPELINE_STAGE_CALLBACK].samples) {
+		printf("a stage of the pipeline was never timed\n");
+		errors++;
+	}
+	for (i = 0; i < PIPELINE_STAGE_COUNT; i++) {
+		if (stats.stages[i].max_ns > stats.stages[i].total_ns) {
+			printf("stage %d took longer once than in total\n", i);
+			errors++;
+		}
+	}
+	for (i = 0; i < LIBTRACE_RING_OCCUPANCY_BUCKETS; i++)
+		occupancy += stats.ring_occupancy[i];
+	if (occupancy == 0) {
+		printf("ring occupancy was never sampled\n");
+		errors++;
+	}
+	if (stats.ocache_hits + stats.ocache_misses == 0) {
+		printf("packet cache was never used\n");
+		errors++;
+	}
+
+	/* The per thread statistics should add up to the totals */
+	for (i = 0; i < THREADS; i++) {
+		if (trace_get_pipeline_stats(trace, threads[i], &thread_stats) != 0) {
+			trace_perror(trace, "trace_get_pipeline_stats");
+			return 1;
+		}
+		packets += thread_stats.packets;
+	}
+	if (packets != stats.packets) {
+		printf("threads counted %" PRIu64 " packets, expected %"
+				PRIu64 "\n", packets, stats.packets);
+		errors++;
+	}
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+
+	if (errors)
+		return 1;
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Checks that results published with trace_publish_results() reach a result
+ * batch callback in the same order they would have one at a time, for the
+ * ordered, unordered and sorted combiners.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libtrace_parallel.h"
+
+#define THREADS 4
+#define PACKETS 5000
+#define BATCH 16
+
+struct batch {
+	int count;
+	libtrace_result_t results[BATCH];
+};
+
+struct report {
+	int results;
+	int batches;
+	int errors;
+	uint64_t last;
+};
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED) {
+	return calloc(1, sizeof(struct batch));
+}
+
+static void publish_batch(libtrace_t *trace, libtrace_thread_t *t,
+		struct batch *batch) {
+	if (batch->count) {
+		trace_publish_results(trace, t, batch->results, batch->count);
+		batch->count = 0;
+	}
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace,
+		libtrace_thread_t *t, void *global UNUSED, void *tls,
+		libtrace_packet_t *packet) {
+	struct batch *batch = tls;
+	libtrace_result_t *res = &batch->results[batch->count++];
+
+	res->key = trace_packet_get_order(packet);
+	res->value.uint64 = res->key;
+	res->type = RESULT_USER;
+	if (batch->count == BATCH)
+		publish_batch(trace, t, batch);
+	return packet;
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls) {
+	publish_batch(trace, t, tls);
+	free(tls);
+}
+
+static void report_batch(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global,
+		void *tls UNUSED, libtrace_result_t *results, size_t count) {
+	struct report *report = global;
+	size_t i;
+
+	assert(count > 0);
+	report->batches++;
+	for (i = 0; i < count; i++) {
+		if (results[i].type != RESULT_USER ||
+				results[i].value.uint64 != results[i].key ||
+				results[i].flags != 0)
+			report->errors++;
+		else if (report->results && results[i].key <= report->last)
+			report->errors++;
+		report->last = results[i].key;
+		report->results++;
+	}
+}
+
+static void report_unordered(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global,
+		void *tls UNUSED, libtrace_result_t *results, size_t count) {
+	struct report *report = global;
+	size_t i;
+
+	report->batches++;
+	for (i = 0; i < count; i++) {
+		if (results[i].value.uint64 != results[i].key)
+			report->errors++;
+		report->results++;
+	}
+}
+
+static int run(const char *name, const libtrace_combine_t *combiner,
+		fn_cb_result_batch handler) {
+	const char *uri = "mem:loops=50:erf:traces/100_packets.erf";
+	libtrace_callback_set_t *processing, *reporter;
+	struct report report;
+	libtrace_t *trace;
+
+	memset(&report, 0, sizeof(report));
+	processing = trace_create_callback_set();
+	reporter = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_packet_cb(processing, per_packet);
+	trace_set_stopping_cb(processing, stop_processing);
+	trace_set_result_batch_cb(reporter, handler);
+
+	trace = trace_create(uri);
+	iferr(trace, uri);
+	trace_set_perpkt_threads(trace, THREADS);
+	trace_set_combiner(trace, combiner, (libtrace_generic_t){0});
+	trace_pstart(trace, &report, processing, reporter);
+	iferr(trace, uri);
+	trace_join(trace);
+	iferr(trace, uri);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+
+	if (report.results != PACKETS || report.errors ||
+			report.batches > report.results) {
+		printf("%s: got %d results in %d batches, %d wrong\n", name,
+				report.results, report.batches, report.errors);
+		return 1;
+	}
+	return 0;
+}
+
+int main() {
+	int failed = 0;
+
+	failed |= run("ordered", &combiner_ordered, report_batch);
+	failed |= run("sorted", &combiner_sorted, report_batch);
+	failed |= run("unordered", &combiner_unordered, report_unordered);
+	if (failed)
+		return 1;
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+
+#define PAYLOAD 3000
+#define FRAGSIZE 400
+#define NFRAGS ((PAYLOAD + 8 + FRAGSIZE - 1) / FRAGSIZE)
+
+/* The UDP datagram that gets fragmented, header included */
+static uint8_t datagram[8 + PAYLOAD];
+
+static void build_datagram(void) {
+	libtrace_udp_t *udp = (libtrace_udp_t *)datagram;
+	int i;
+
+	for (i = 0; i < PAYLOAD; i++)
+		datagram[8 + i] = (uint8_t)(i * 7 + 3);
+	udp->source = htons(5353);
+	udp->dest = htons(53);
+	udp->len = htons(sizeof(datagram));
+	udp->check = 0;
+}
+
+/* Sets the timestamp of a constructed (PCAP) packet */
+static void set_time(libtrace_packet_t *packet, uint32_t sec) {
+	uint32_t *hdr = (uint32_t *)packet->header;
+
+	hdr[0] = sec;
+	hdr[1] = 0;
+}
+
+/* Builds fragment n of the datagram with the given IP ID, inside an
+ * Ethernet frame with a VLAN tag */
+static void build_fragment(libtrace_packet_t *packet, int n, uint16_t id,
+		uint32_t sec) {
+	uint8_t buf[128 + FRAGSIZE];
+	libtrace_ether_t *eth = (libtrace_ether_t *)buf;
+	libtrace_8021q_t *vlan = (libtrace_8021q_t *)(eth + 1);
+	libtrace_ip_t *ip = (libtrace_ip_t *)(vlan + 1);
+	size_t offset = n * FRAGSIZE;
+	size_t len = sizeof(datagram) - offset;
+	int more = 0;
+
+	if (len > FRAGSIZE) {
+		len = FRAGSIZE;
+		more = 1;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	eth->ether_type = htons(TRACE_ETHERTYPE_8021Q);
+	vlan->tci = htons(100);
+	vlan->vlan_ether_type = htons(TRACE_ETHERTYPE_IP);
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(sizeof(libtrace_ip_t) + len);
+	ip->ip_id = htons(id);
+	ip->ip_off = htons((more ? 0x2000 : 0) | (offset / 8));
+	ip->ip_ttl = 64;
+	ip->ip_p = TRACE_IPPROTO_UDP;
+	ip->ip_src.s_addr = htonl(0x0a000001);
+	ip->ip_dst.s_addr = htonl(0x0a000002);
+	memcpy(ip + 1, datagram + offset, len);
+
+	trace_construct_packet(packet, TRACE_TYPE_ETH, buf,
+			(uint8_t *)(ip + 1) + len - buf);
+	set_time(packet, sec);
+}
+
+static int check(int ok, const char *what) {
+	if (!ok)
+		printf("failure: %s\n", what);
+	return !ok;
+}
+
+/* Checks that a reassembled packet holds the original datagram */
+static int check_datagram(libtrace_packet_t *result) {
+	libtrace_ip_t *ip;
+	libtrace_udp_t *udp;
+	uint32_t remaining;
+	uint16_t csum, *field;
+	uint8_t proto;
+	int error = 0;
+
+	if (check(result != NULL, "datagram was not reassembled"))
+		return 1;
+
+	ip = trace_get_ip(result);
+	if (check(ip != NULL, "no IP header in the reassembled packet"))
+		return 1;
+	error |= check(ntohs(ip->ip_len) == sizeof(libtrace_ip_t) +
+			sizeof(datagram), "IP length");
+	error |= check(ip->ip_off == 0, "fragment fields were not cleared");
+	field = trace_checksum_layer3(result, &csum);
+	error |= check(field && ntohs(*field) == csum, "IP checksum");
+
+	udp = (libtrace_udp_t *)trace_get_transport(result, &proto, &remaining);
+	error |= check(udp && proto == TRACE_IPPROTO_UDP &&
+			remaining == sizeof(datagram), "UDP header");
+	if (udp)
+		error |= check(memcmp(udp, datagram, sizeof(datagram)) == 0,
+				"payload");
+	error |= check(trace_get_source_port(result) == 5353, "source port");
+	error |= check(trace_get_capture_length(result) ==
+			sizeof(libtrace_ether_t) + sizeof(libtrace_8021q_t) +
+			sizeof(libtrace_ip_t) + sizeof(datagram), "capture length");
+	return error;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+	static const int order[NFRAGS] = {3, 0, 7, 5, 1, 2, 6, 4};
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_packet_t *result = NULL;
+	libtrace_reassembler_t *r;
+	libtrace_reassembly_stats_t stats;
+	uint8_t plain[64];
+	int error = 0;
+	int i;
+
+	build_datagram();
+
+	/* Out of order, with one fragment repeated */
+	r = trace_create_reassembler(0, 0);
+	for (i = 0; i < NFRAGS; i++) {
+		build_fragment(packet, order[i], 1, 100);
+		result = trace_reassemble_packet(r, packet);
+		if (i == 3) {
+			build_fragment(packet, order[i], 1, 100);
+			error |= check(trace_reassemble_packet(r, packet) ==
+					NULL, "duplicate fragment");
+		}
+		if (i < NFRAGS - 1)
+			error |= check(result == NULL, "incomplete datagram");
+	}
+	error |= check_datagram(result);
+	error |= check(trace_get_seconds(result) == 100, "timestamp");
+
+	/* Packets that aren't fragments come straight back */
+	memset(plain, 0, sizeof(plain));
+	((libtrace_ether_t *)plain)->ether_type = htons(TRACE_ETHERTYPE_IP);
+	((libtrace_ip_t *)(plain + 14))->ip_v = 4;
+	((libtrace_ip_t *)(plain + 14))->ip_hl = 5;
+	((libtrace_ip_t *)(plain + 14))->ip_len = htons(sizeof(plain) - 14);
+	trace_construct_packet(packet, TRACE_TYPE_ETH, plain, sizeof(plain));
+	error |= check(trace_reassemble_packet(r, packet) == packet,
+			"unfragmented packet");
+
+	trace_get_reassembler_stats(r, &stats);
+	error |= check(stats.fragments == NFRAGS + 1 && stats.datagrams == 1 &&
+			stats.pending == 0 && stats.memory == 0, "counters");
+
+	/* A datagram that doesn't complete in time is thrown away */
+	build_fragment(packet, 0, 2, 200);
+	trace_reassemble_packet(r, packet);
+	build_fragment(packet, 1, 3, 231);
+	trace_reassemble_packet(r, packet);
+	trace_get_reassembler_stats(r, &stats);
+	error |= check(stats.timeouts == 1 && stats.pending == 1, "timeout");
+	trace_destroy_reassembler(r);
+
+	/* Datagrams are evicted, oldest first, to stay within the memory
+	 * limit, and the newest datagram can still complete */
+	r = trace_create_reassembler(32 * 1024, 0);
+	for (i = 0; i < 100; i++) {
+		build_fragment(packet, 0, 1000 + i, 300);
+		trace_reassemble_packet(r, packet);
+	}
+	trace_get_reassembler_stats(r, &stats);
+	error |= check(stats.evictions > 0 && stats.memory <= 32 * 1024,
+			"memory limit");
+	for (i = 1; i < NFRAGS; i++) {
+		build_fragment(packet, i, 1099, 300);
+		result = trace_reassemble_packet(r, packet);
+	}
+	error |= check_datagram(result);
+	trace_destroy_reassembler(r);
+
+	trace_destroy_packet(packet);
+
+	if (error)
+		return 1;
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,332 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+/* Checks the shared memory ring with more than one reader: a consumer in
+ * another process and a consumer read by several threads must each see
+ * every packet. When the ring overflows, every packet a consumer misses must
+ * be counted as a drop, whether it was skipped forward by the producer or
+ * held on to the space so that the producer could not write.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libtrace_parallel.h"
+
+#define THREADS 4
+#define SOURCE "mem:loops=%d:pcapfile:traces/100_packets.pcap"
+
+struct counts {
+	pthread_mutex_t lock;
+	uint64_t packets;
+	int out_of_order;
+};
+
+struct thread_counts {
+	uint64_t packets;
+	uint64_t last_order;
+	int out_of_order;
+};
+
+void iferr(libtrace_t *trace, const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+void iferrout(libtrace_out_t *trace, const char *msg)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+/* Writes loops copies of the test trace, returning the number written */
+static int write_packets(libtrace_out_t *shmout, int loops, int *attempted) {
+	char uri[128];
+	libtrace_t *src;
+	libtrace_packet_t *packet;
+	int written = 0;
+
+	snprintf(uri, sizeof(uri), SOURCE, loops);
+	src = trace_create(uri);
+	iferr(src, uri);
+	trace_start(src);
+	iferr(src, uri);
+
+	packet = trace_create_packet();
+	*attempted = 0;
+	while (trace_read_packet(src, packet) > 0) {
+		(*attempted)++;
+		if (trace_write_packet(shmout, packet) > 0)
+			written++;
+		iferrout(shmout, "writing");
+	}
+	iferr(src, uri);
+	trace_destroy_packet(packet);
+	trace_destroy(src);
+	return written;
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED) {
+	return calloc(1, sizeof(struct thread_counts));
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED,
+		void *tls, libtrace_packet_t *packet) {
+	struct thread_counts *counts = tls;
+	uint64_t order = trace_packet_get_order(packet);
+
+	/* Each thread claims its own batches in turn, so the packets
+	 * reaching one thread are still in order */
+	if (counts->packets && order <= counts->last_order)
+		counts->out_of_order++;
+	counts->last_order = order;
+	counts->packets++;
+	return packet;
+}
+
+static void stop_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global, void *tls) {
+	struct counts *counts = global;
+	struct thread_counts *mine = tls;
+
+	pthread_mutex_lock(&counts->lock);
+	counts->packets += mine->packets;
+	counts->out_of_order += mine->out_of_order;
+	pthread_mutex_unlock(&counts->lock);
+	free(mine);
+}
+
+/* Reads the ring from a separate process, exiting with a non-zero status if
+ * any packets went missing. ready is written to once attached. */
+static int read_child(int ready, int expected) {
+	libtrace_t *shmin;
+	libtrace_packet_t *packet;
+	int count = 0;
+
+	shmin = trace_create("shm:libtrace-test-par");
+	iferr(shmin, "child");
+	trace_start(shmin);
+	iferr(shmin, "child");
+	if (write(ready, "", 1) != 1)
+		return 1;
+	close(ready);
+
+	packet = trace_create_packet();
+	while (trace_read_packet(shmin, packet) > 0)
+		count++;
+	iferr(shmin, "child");
+	trace_destroy_packet(packet);
+	trace_destroy(shmin);
+
+	if (count != expected)
+		printf("failure: child process read %d packets, expected %d\n",
+				count, expected);
+	return count != expected;
+}
+
+static int test_consumers(void) {
+	libtrace_out_t *shmout;
+	libtrace_t *shmin;
+	libtrace_callback_set_t *processing;
+	libtrace_stat_t *stats;
+	struct counts counts;
+	int pipefd[2];
+	int attempted, written, status;
+	int error = 0;
+	pid_t child;
+	char c;
+
+	/* Large enough that nobody falls behind */
+	shmout = trace_create_output("shm:libtrace-test-par:16");
+	iferrout(shmout, "shm output");
+	trace_start_output(shmout);
+	iferrout(shmout, "shm output");
+
+	/* Fork before any threads are started */
+	if (pipe(pipefd) < 0) {
+		perror("pipe");
+		return 1;
+	}
+	child = fork();
+	if (child < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (child == 0) {
+		close(pipefd[0]);
+		_exit(read_child(pipefd[1], 5000));
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &c, 1) != 1) {
+		printf("failure: child process did not attach\n");
+		return 1;
+	}
+	close(pipefd[0]);
+
+	memset(&counts, 0, sizeof(counts));
+	pthread_mutex_init(&counts.lock, NULL);
+	processing = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_packet_cb(processing, per_packet);
+	trace_set_stopping_cb(processing, stop_processing);
+
+	shmin = trace_create("shm:libtrace-test-par");
+	iferr(shmin, "shm input");
+	trace_set_perpkt_threads(shmin, THREADS);
+	trace_pstart(shmin, &counts, processing, NULL);
+	iferr(shmin, "shm input");
+
+	written = write_packets(shmout, 50, &attempted);
+	/* Destroying the producer tells consumers there is nothing more */
+	trace_destroy_output(shmout);
+
+	trace_join(shmin);
+	iferr(shmin, "shm input");
+
+	if (written != 5000) {
+		printf("failure: 5000 packets expected to be written, %d were\n",
+				written);
+		error = 1;
+	}
+	if (counts.packets != 5000) {
+		printf("failure: %d threads read %" PRIu64 " packets, expected "
+				"5000\n", THREADS, counts.packets);
+		error = 1;
+	}
+	if (counts.out_of_order) {
+		printf("failure: %d packets reached a thread out of order\n",
+				counts.out_of_order);
+		error = 1;
+	}
+	stats = trace_get_statistics(shmin, NULL);
+	if (stats->dropped_valid && stats->dropped != 0) {
+		printf("failure: %" PRIu64 " packets dropped\n", stats->dropped);
+		error = 1;
+	}
+
+	if (waitpid(child, &status, 0) != child || !WIFEXITED(status) ||
+			WEXITSTATUS(status) != 0) {
+		printf("failure: child process consumer failed\n");
+		error = 1;
+	}
+
+	trace_destroy(shmin);
+	trace_destroy_callback_set(processing);
+	return error;
+}
+
+/* Overfills the smallest ring with a consumer attached. If hold is set the
+ * consumer keeps a packet from the ring while the producer writes, so the
+ * space can't be reused and the producer must drop packets. Otherwise the
+ * consumer is skipped forward past the packets it missed. */
+static int test_full(const char *name, int hold) {
+	char uri[128];
+	libtrace_out_t *shmout;
+	libtrace_t *shmin;
+	libtrace_packet_t *packet;
+	libtrace_stat_t *stats;
+	int attempted, written, more;
+	int count = 0;
+	int error = 0;
+
+	snprintf(uri, sizeof(uri), "shm:%s:1", name);
+	shmout = trace_create_output(uri);
+	iferrout(shmout, uri);
+	trace_start_output(shmout);
+	iferrout(shmout, uri);
+
+	snprintf(uri, sizeof(uri), "shm:%s", name);
+	shmin = trace_create(uri);
+	iferr(shmin, uri);
+	trace_start(shmin);
+	iferr(shmin, uri);
+
+	packet = trace_create_packet();
+	written = write_packets(shmout, 1, &attempted);
+	if (hold && trace_read_packet(shmin, packet) > 0)
+		count++;
+	/* 200 loops of the trace is about twice the size of the ring */
+	written += write_packets(shmout, 200, &more);
+	attempted += more;
+	if (hold && written == attempted) {
+		printf("failure: %s: no writes failed while the ring was "
+				"held\n", name);
+		error = 1;
+	}
+	if (!hold && written != attempted) {
+		printf("failure: %s: %d of %d writes failed\n", name,
+				attempted - written, attempted);
+		error = 1;
+	}
+	/* Destroying the producer tells consumers there is nothing more */
+	trace_destroy_output(shmout);
+
+	while (trace_read_packet(shmin, packet) > 0)
+		count++;
+	iferr(shmin, uri);
+
+	stats = trace_get_statistics(shmin, NULL);
+	if (!stats->dropped_valid || stats->dropped == 0) {
+		printf("failure: %s: no drops were counted\n", name);
+		error = 1;
+	} else if (count + stats->dropped != (uint64_t)attempted) {
+		printf("failure: %s: read %d packets and dropped %" PRIu64
+				", expected %d in total\n", name, count,
+				stats->dropped, attempted);
+		error = 1;
+	}
+
+	trace_destroy_packet(packet);
+	trace_destroy(shmin);
+	return error;
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+	int error = 0;
+
+	error |= test_consumers();
+	error |= test_full("libtrace-test-skip", 0);
+	error |= test_full("libtrace-test-hold", 1);
+
+	if (error == 0)
+		printf("success: shared memory consumers\n");
+	return error;
+}
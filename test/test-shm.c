@@ -0,0 +1,126 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include "libtrace.h"
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+void iferrout(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+	libtrace_t *src, *shmin;
+	libtrace_out_t *shmout;
+	libtrace_packet_t *packet;
+	libtrace_stat_t *stat;
+	uint64_t lastorder = 0;
+	int error = 0;
+	int count = 0;
+	int written = 0;
+	int ret;
+
+	/* The producer has to exist before anyone can attach */
+	shmout = trace_create_output("shm:libtrace-test:1");
+	iferrout(shmout);
+	trace_start_output(shmout);
+	iferrout(shmout);
+
+	shmin = trace_create("shm:libtrace-test");
+	iferr(shmin);
+	trace_start(shmin);
+	iferr(shmin);
+
+	src = trace_create("pcapfile:traces/100_packets.pcap");
+	iferr(src);
+	trace_start(src);
+	iferr(src);
+
+	packet = trace_create_packet();
+	while (trace_read_packet(src, packet) > 0) {
+		if (trace_write_packet(shmout, packet) > 0)
+			written ++;
+		iferrout(shmout);
+	}
+	iferr(src);
+	trace_destroy(src);
+
+	/* Destroying the producer tells consumers there is nothing more */
+	trace_destroy_output(shmout);
+
+	while ((ret = trace_read_packet(shmin, packet)) > 0) {
+		if (packet->order <= lastorder) {
+			printf("failure: packets out of order\n");
+			error = 1;
+		}
+		lastorder = packet->order;
+		count ++;
+	}
+	iferr(shmin);
+
+	if (written != 100) {
+		printf("failure: 100 packets expected to be written, %d were\n",
+				written);
+		error = 1;
+	}
+	if (count != 100) {
+		printf("failure: 100 packets expected, %d seen\n", count);
+		error = 1;
+	}
+
+	stat = trace_get_statistics(shmin, NULL);
+	if (stat->dropped_valid && stat->dropped != 0) {
+		printf("failure: %" PRIu64 " packets dropped\n", stat->dropped);
+		error = 1;
+	}
+
+	if (error == 0)
+		printf("success: 100 packets read\n");
+
+	trace_destroy_packet(packet);
+	trace_destroy(shmin);
+	return error;
+}
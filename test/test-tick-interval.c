@@ -0,0 +1,168 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+/* Checks that interval ticks reach processing threads both while they are
+ * busy reading packets and while they are idle waiting for the next packet
+ * in trace time, and that every tick falls on a multiple of the interval.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "libtrace_parallel.h"
+
+#define THREADS 4
+#define INTERVAL 10
+
+struct ticks {
+	uint64_t ticks;
+	uint64_t last;
+	int errors;
+};
+
+struct total {
+	pthread_mutex_t lock;
+	uint64_t min_ticks;
+	uint64_t max_ticks;
+	int errors;
+};
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED) {
+	return calloc(1, sizeof(struct ticks));
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED,
+		void *tls UNUSED, libtrace_packet_t *packet) {
+	return packet;
+}
+
+static void per_tick(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+		void *global UNUSED, void *tls, uint64_t tick) {
+	struct ticks *ticks = tls;
+	/* Convert from the erf format, rounding to the nearest usec */
+	uint64_t usec = (tick >> 32) * 1000000 +
+			(((tick & 0xffffffff) * 1000000 + (1ull << 31)) >> 32);
+
+	if (usec % (INTERVAL * 1000) != 0)
+		ticks->errors++;
+	if (ticks->ticks && usec != ticks->last + INTERVAL * 1000)
+		ticks->errors++;
+	ticks->last = usec;
+	ticks->ticks++;
+}
+
+static void stop_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global, void *tls) {
+	struct total *total = global;
+	struct ticks *ticks = tls;
+
+	pthread_mutex_lock(&total->lock);
+	if (ticks->ticks < total->min_ticks)
+		total->min_ticks = ticks->ticks;
+	if (ticks->ticks > total->max_ticks)
+		total->max_ticks = ticks->ticks;
+	total->errors += ticks->errors;
+	pthread_mutex_unlock(&total->lock);
+	free(ticks);
+}
+
+static int run(const char *uri, bool tracetime) {
+	libtrace_callback_set_t *processing;
+	struct timeval start, end;
+	struct total total;
+	libtrace_t *trace;
+	uint64_t expected;
+
+	memset(&total, 0, sizeof(total));
+	total.min_ticks = UINT64_MAX;
+	pthread_mutex_init(&total.lock, NULL);
+
+	processing = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_packet_cb(processing, per_packet);
+	trace_set_tick_interval_cb(processing, per_tick);
+	trace_set_stopping_cb(processing, stop_processing);
+
+	trace = trace_create(uri);
+	iferr(trace, uri);
+	trace_set_perpkt_threads(trace, THREADS);
+	trace_set_tick_interval(trace, INTERVAL);
+	trace_set_tracetime(trace, tracetime);
+	gettimeofday(&start, NULL);
+	trace_pstart(trace, &total, processing, NULL);
+	iferr(trace, uri);
+	trace_join(trace);
+	iferr(trace, uri);
+	gettimeofday(&end, NULL);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+
+	/* Allow for the threads starting and stopping at different times */
+	expected = ((end.tv_sec - start.tv_sec) * 1000 +
+			(end.tv_usec - start.tv_usec) / 1000) / INTERVAL;
+	if (total.errors || total.max_ticks > expected + 1 ||
+			total.min_ticks + 3 < expected) {
+		printf("%s: expected %" PRIu64 " ticks, got %" PRIu64
+				" to %" PRIu64 ", %d wrong\n", uri, expected,
+				total.min_ticks, total.max_ticks,
+				total.errors);
+		return 1;
+	}
+	return 0;
+}
+
+int main() {
+	int failed = 0;
+
+	/* Idle between packets */
+	failed |= run("mem:loops=10:erf:traces/100_packets.erf", true);
+	/* Busy */
+	failed |= run("mem:loops=100000:erf:traces/100_packets.erf", false);
+	if (failed)
+		return 1;
+	printf("success\n");
+	return 0;
+}
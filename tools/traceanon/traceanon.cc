@@ -79,16 +79,6 @@ static void usage(char *argv0)
 	exit(1);
 }
 
-/* Incrementally update a checksum */
-static void update_in_cksum(uint16_t *csum, uint16_t old, uint16_t newval)
-{
-	uint32_t sum = (~htons(*csum) & 0xFFFF)
-		     + (~htons(old) & 0xFFFF)
-		     + htons(newval);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	*csum = htons(~(sum + (sum >> 16)));
-}
-
 void add_port_to_server(traceanon_radius_server_t *server, uint16_t port ){
 	traceanon_port_list_t *currPort;
 	currPort = (traceanon_port_list_t*) malloc(sizeof(traceanon_port_list_t));
@@ -97,11 +87,59 @@ void add_port_to_server(traceanon_radius_server_t *server, uint16_t port ){
 	server->port = currPort;
 }
 
-UNUSED static void update_in_cksum32(uint16_t *csum, uint32_t old,
-                uint32_t newval)
-{
-	update_in_cksum(csum,(uint16_t)(old>>16),(uint16_t)(newval>>16));
-	update_in_cksum(csum,(uint16_t)(old&0xFFFF),(uint16_t)(newval&0xFFFF));
+/* Adjusts a checksum (if there is one) for a field that has changed.
+ * Checksums inside quoted packets needn't be aligned, hence the memcpys. */
+static inline void update_cksum(void *csum, const void *oldval,
+                const void *newval, uint16_t len) {
+        uint16_t sum;
+
+        if (csum == NULL)
+                return;
+        memcpy(&sum, csum, sizeof(sum));
+        sum = trace_checksum_adjust(sum, oldval, newval, len);
+        memcpy(csum, &sum, sizeof(sum));
+}
+
+/* Updates the TCP or UDP checksum at the start of an IP payload to cover
+ * the new addresses in the pseudo header. Returns a pointer to the
+ * checksum field, or NULL if it is not present in the captured bytes.
+ */
+static void *update_transport_cksum(uint8_t proto, void *transport,
+                uint32_t remaining, const void *oldaddrs,
+                const void *newaddrs, uint16_t len) {
+
+        if (transport == NULL)
+                return NULL;
+
+        if (proto == TRACE_IPPROTO_TCP && remaining >= sizeof(libtrace_tcp_t)) {
+                libtrace_tcp_t *tcp = (libtrace_tcp_t *)transport;
+                void *csum = (char *)tcp + offsetof(libtrace_tcp_t, check);
+                update_cksum(csum, oldaddrs, newaddrs, len);
+                return csum;
+        }
+
+        if (proto == TRACE_IPPROTO_UDP && remaining >= sizeof(libtrace_udp_t)) {
+                libtrace_udp_t *udp = (libtrace_udp_t *)transport;
+                /* Zero means the sender didn't calculate a checksum */
+                if (udp->check == 0)
+                        return NULL;
+                void *csum = (char *)udp + offsetof(libtrace_udp_t, check);
+                update_cksum(csum, oldaddrs, newaddrs, len);
+                if (udp->check == 0)
+                        udp->check = 0xffff;
+                return csum;
+        }
+
+        if (proto == TRACE_IPPROTO_ICMPV6 &&
+                        remaining >= sizeof(libtrace_icmp6_t)) {
+                libtrace_icmp6_t *icmp6 = (libtrace_icmp6_t *)transport;
+                void *csum = (char *)icmp6 +
+                                offsetof(libtrace_icmp6_t, checksum);
+                update_cksum(csum, oldaddrs, newaddrs, len);
+                return csum;
+        }
+
+        return NULL;
 }
 
 /* Ok this is remarkably complicated
@@ -113,22 +151,57 @@ UNUSED static void update_in_cksum32(uint16_t *csum, uint32_t old,
  * error!  So anonymise that too, but remember that it's travelling in
  * the opposite direction so we need to encrypt the destination and
  * source instead of the source and destination!
+ *
+ * Everything we change inside a quoted packet is also covered by the
+ * checksum of the ICMP message quoting it, which is passed in as outer.
+ *
+ * The checksums are updated rather than recalculated, so this works on
+ * truncated packets too. An updated checksum is the same as one
+ * calculated from scratch over the new addresses, so it doesn't give
+ * anything away about the original ones.
  */
 static void encrypt_ips(traceanon_opts_t *opts, Anonymiser *anon,
-                struct libtrace_ip *ip) {
-	libtrace_icmp_t *icmp=trace_get_icmp_from_ip(ip,NULL);
+                struct libtrace_ip *ip, uint32_t remaining, void *outer) {
+        struct in_addr oldaddrs[2], newaddrs[2];
+        uint16_t oldsum, oldl4sum = 0;
+        void *l4sum = NULL;
+        uint8_t proto = 0;
+        void *transport;
+
+        if (remaining < sizeof(libtrace_ip_t))
+                return;
+
+        oldaddrs[0] = newaddrs[0] = ip->ip_src;
+        oldaddrs[1] = newaddrs[1] = ip->ip_dst;
 
 	if (opts->enc_source_opt) {
-		uint32_t new_ip=htonl(anon->anonIPv4(ntohl(ip->ip_src.s_addr)));
-		ip->ip_src.s_addr = new_ip;
+		newaddrs[0].s_addr = htonl(anon->anonIPv4(ntohl(ip->ip_src.s_addr)));
+		ip->ip_src = newaddrs[0];
 	}
 
 	if (opts->enc_dest_opt) {
-		uint32_t new_ip=htonl(anon->anonIPv4(ntohl(ip->ip_dst.s_addr)));
-		ip->ip_dst.s_addr = new_ip;
+		newaddrs[1].s_addr = htonl(anon->anonIPv4(ntohl(ip->ip_dst.s_addr)));
+		ip->ip_dst = newaddrs[1];
 	}
 
-	if (icmp) {
+        /* The source and destination addresses are next to each other, so
+         * they can be treated as a single 8 byte field */
+        oldsum = ip->ip_sum;
+        update_cksum((char *)ip + offsetof(libtrace_ip_t, ip_sum),
+                        oldaddrs, newaddrs, sizeof(oldaddrs));
+        update_cksum(outer, oldaddrs, newaddrs, sizeof(oldaddrs));
+        update_cksum(outer, &oldsum, &ip->ip_sum, sizeof(oldsum));
+
+        transport = trace_get_payload_from_ip(ip, &proto, &remaining);
+        if (transport == NULL)
+                return;
+
+	if (proto == TRACE_IPPROTO_ICMP && remaining >= sizeof(libtrace_icmp_t)) {
+                libtrace_icmp_t *icmp = (libtrace_icmp_t *)transport;
+
+                l4sum = (char *)icmp + offsetof(libtrace_icmp_t, checksum);
+                oldl4sum = icmp->checksum;
+
 		/* These are error codes that return the IP packet
 		 * internally 
 		 */
@@ -139,27 +212,50 @@ static void encrypt_ips(traceanon_opts_t *opts, Anonymiser *anon,
 			char *ptr = (char *)icmp;
 			encrypt_ips(opts, anon,
 				(struct libtrace_ip*)(ptr+
-					sizeof(struct libtrace_icmp)));
+					sizeof(struct libtrace_icmp)),
+                                remaining - sizeof(struct libtrace_icmp),
+                                l4sum);
 		}
+	} else {
+                if (proto == TRACE_IPPROTO_TCP &&
+                                remaining >= sizeof(libtrace_tcp_t))
+                        oldl4sum = ((libtrace_tcp_t *)transport)->check;
+                else if (proto == TRACE_IPPROTO_UDP &&
+                                remaining >= sizeof(libtrace_udp_t))
+                        oldl4sum = ((libtrace_udp_t *)transport)->check;
+                l4sum = update_transport_cksum(proto, transport, remaining,
+                                oldaddrs, newaddrs, sizeof(oldaddrs));
+        }
 
-		if (opts->enc_source_opt || opts->enc_dest_opt)
-			icmp->checksum = 0;
-	}
+        /* Quoted packets are often cut short, so only account for the
+         * transport checksum if it was actually there to be changed */
+        if (l4sum)
+                update_cksum(outer, &oldl4sum, l4sum, sizeof(oldl4sum));
 }
 
 static void encrypt_ipv6(traceanon_opts_t *opts, Anonymiser *anon,
-                libtrace_ip6_t *ip6) {
+                libtrace_ip6_t *ip6, uint32_t remaining) {
 
         uint8_t previp[16];
+        uint8_t proto = 0;
+        void *transport;
+
+        /* Find the transport header before we start changing things, the
+         * new addresses have to be folded into its checksum as well */
+        transport = trace_get_payload_from_ip6(ip6, &proto, &remaining);
 
 	if (opts->enc_source_opt) {
                 memcpy(previp, &(ip6->ip_src.s6_addr), 16);
 		anon->anonIPv6(previp, (uint8_t *)&(ip6->ip_src.s6_addr));
+                update_transport_cksum(proto, transport, remaining, previp,
+                                &(ip6->ip_src.s6_addr), 16);
 	}
 
 	if (opts->enc_dest_opt) {
                 memcpy(previp, &(ip6->ip_dst.s6_addr), 16);
 		anon->anonIPv6(previp, (uint8_t *)&(ip6->ip_dst.s6_addr));
+                update_transport_cksum(proto, transport, remaining, previp,
+                                &(ip6->ip_dst.s6_addr), 16);
 	}
 
 }
@@ -290,14 +386,14 @@ int radius_ip_match(traceanon_opts_t *opts,
 }
 
 //checks if packet src/dest is filtered for RADIUS and anonymised/encrypted as needed
-static void check_radius(libtrace_udp_t *udp, struct libtrace_ip *ipptr,
+static int check_radius(libtrace_udp_t *udp, struct libtrace_ip *ipptr,
                 libtrace_packet_t *packet, Anonymiser *anon,
                 traceanon_opts_t *opts) {
 
 	uint16_t testPort = 0;
 
         if (udp == NULL) {
-                return;
+                return 0;
         }
 
         /* Failure to byteswap port numbers here is intentional. Instead,
@@ -307,14 +403,15 @@ static void check_radius(libtrace_udp_t *udp, struct libtrace_ip *ipptr,
         if(ipptr->ip_src.s_addr == opts->radius_server.ipaddr.s_addr){
                 testPort = udp->source;
                 if (radius_ip_match(opts, packet, anon, testPort))
-                        return;
+                        return 1;
         }
 
         if(ipptr->ip_dst.s_addr == opts->radius_server.ipaddr.s_addr){
                 testPort = udp->dest;
                 if (radius_ip_match(opts, packet, anon, testPort))
-                        return;
+                        return 1;
         }
+        return 0;
 }
 
 static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
@@ -323,8 +420,10 @@ static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
 	struct libtrace_ip *ipptr;
         libtrace_ip6_t *ip6;
 	libtrace_udp_t *udp = NULL;
-	libtrace_tcp_t *tcp = NULL;
-        libtrace_icmp6_t *icmp6 = NULL;
+        void *l3;
+        uint16_t ethertype;
+        uint32_t remaining;
+        int radius_changed = 0;
         Anonymiser *anon = (Anonymiser *)tls;
         libtrace_generic_t result;
         traceanon_opts_t *opts = (traceanon_opts_t *)global;
@@ -336,36 +435,30 @@ static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
         ip6 = trace_get_ip6(packet);
         udp = trace_get_udp(packet);
 
-	if (opts->enc_radius_packet){
-		check_radius(udp, ipptr, packet, anon, opts);
+	if (opts->enc_radius_packet && ipptr){
+		radius_changed = check_radius(udp, ipptr, packet, anon, opts);
 	}
 
-        if (ipptr && (opts->enc_source_opt || opts->enc_dest_opt)) {
-                encrypt_ips(opts, anon, ipptr);
-                ipptr->ip_sum = 0;
-        } else if (ip6 && (opts->enc_source_opt || opts->enc_dest_opt)) {
-                encrypt_ipv6(opts, anon, ip6);
-        }
-
-
-        /* Replace checksums so that IP encryption cannot be
-         * reversed -- TODO allow checksums to be updated and remain valid
-         * for the new addresses */
-
-        /* XXX replace with nice use of trace_get_transport() */
-
-        if (udp && (opts->enc_source_opt || opts->enc_dest_opt)) {
-                udp->check = 0;
-        }
-
-        tcp = trace_get_tcp(packet);
-        if (tcp && (opts->enc_source_opt || opts->enc_dest_opt)) {
-                tcp->check = 0;
+        if (opts->enc_source_opt || opts->enc_dest_opt) {
+                l3 = trace_get_layer3(packet, &ethertype, &remaining);
+                if (ipptr && l3 == ipptr) {
+                        encrypt_ips(opts, anon, ipptr, remaining, NULL);
+                } else if (ip6 && l3 == ip6) {
+                        encrypt_ipv6(opts, anon, ip6, remaining);
+                }
         }
 
-        icmp6 = trace_get_icmp6(packet);
-        if (icmp6 && (opts->enc_source_opt || opts->enc_dest_opt)) {
-                icmp6->checksum = 0;
+        /* The RADIUS payload has changed underneath the UDP checksum, so
+         * that one has to be calculated again from scratch. If we can't
+         * (e.g. the packet was truncated), drop the checksum instead. */
+        if (radius_changed && udp->check != 0) {
+                uint16_t csum;
+                uint16_t *csum_ptr = trace_checksum_transport(packet, &csum);
+
+                if (csum_ptr)
+                        *csum_ptr = htons(csum);
+                else
+                        udp->check = 0;
         }
 
         /* TODO: Encrypt IP's in ARP packets */
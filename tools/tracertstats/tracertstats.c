@@ -68,14 +68,21 @@ int filter_count=0;
 int burstsize=10;
 bool realtime=0;
 uint8_t report_drops = 0;
+/* Print where the time went in each stage of the parallel pipeline */
+uint8_t pipeline_stats = 0;
 
 struct filter_t {
 	char *expr;
-	struct libtrace_filter_t *filter;
 	uint64_t count;
 	uint64_t bytes;
 } *filters = NULL;
 
+/* Every filter is applied at once, the index of each filter in the set is
+ * the same as its index in filters */
+libtrace_filter_set_t *filter_set = NULL;
+/* Set once a filter has failed to apply to a packet */
+int filter_failed = 0;
+
 uint64_t packet_count=UINT64_MAX;
 uint32_t packet_interval=UINT32_MAX;
 pthread_mutex_t ts_lock;
@@ -270,18 +277,25 @@ static libtrace_packet_t *cb_packet(libtrace_t *trace, libtrace_thread_t *t,
                 /* Don't count ERF provenance and similar packets */
                 return packet;
         }
-        for(i=0;i<filter_count;++i) {
-                int filter_ret;
-                if (filters[i].filter == NULL)
-                        continue;
-                filter_ret = trace_apply_filter(filters[i].filter, packet);
-                if (filter_ret > 0) {
-                        td->results->filters[i].count++;
-                        td->results->filters[i].bytes+=wlen;
-                } else if (filter_ret < 0) {
-                        trace_perror(trace, "trace_apply_filter");
-                        fprintf(stderr, "Removing filter from filterlist\n");
-                        filters[i].filter = NULL;
+        if (filter_count > 0) {
+                uint64_t matches[TRACE_FILTER_SET_WORDS(filter_count)];
+
+                if (trace_apply_filter_set(filter_set, packet, matches) < 0) {
+                        /* A filter that can't be applied to this link type
+                         * just doesn't match, only report it once. This is
+                         * a race, but at worst it is reported twice */
+                        if (!filter_failed) {
+                                filter_failed = 1;
+                                trace_perror(trace, "trace_apply_filter_set");
+                        } else {
+                                trace_get_err(trace);
+                        }
+                }
+                for(i=0;i<filter_count;++i) {
+                        if (TRACE_FILTER_SET_MATCHED(matches, i)) {
+                                td->results->filters[i].count++;
+                                td->results->filters[i].bytes+=wlen;
+                        }
                 }
         }
 
@@ -341,6 +355,8 @@ static void run_trace(char *uri)
 	trace_set_combiner(trace, &combiner_ordered, (libtrace_generic_t){0});
         trace_set_perpkt_threads(trace, threadcount);
 	trace_set_burst_size(trace, burstsize);
+	if (pipeline_stats)
+		trace_set_pipeline_stats(trace, true);
 
 	if (trace_get_information(trace)->live) {
                 trace_set_tick_interval(trace, (int) (packet_interval * 1000));
@@ -379,6 +395,12 @@ static void run_trace(char *uri)
                 stats = trace_get_statistics(trace, stats);
         }
 	report_results((glob_last_ts >> 32), totalcount, totalbytes, stats);
+	if (pipeline_stats) {
+		libtrace_pipeline_stats_t pstats;
+
+		if (trace_get_pipeline_stats(trace, NULL, &pstats) == 0)
+			trace_print_pipeline_stats(&pstats, stderr);
+	}
 	if (trace_is_err(trace))
 		trace_perror(trace,"%s",uri);
 
@@ -410,6 +432,8 @@ static void usage(char *argv0)
         "-d --report-drops      Include statistics about number of packets dropped or\n"
         "                       lost by the capture process\n"
         "-r --realtime          Process trace files in realtime\n"
+        "-S --stats             Print how long each stage of the parallel\n"
+        "                       pipeline took to stderr\n"
 	"-h --help	Print this usage statement\n"
 	,argv0);
 }
@@ -434,10 +458,11 @@ int main(int argc, char *argv[]) {
 			{ "nobuffer",	        0, 0, 'N' },
 			{ "report-drops",	0, 0, 'd' },
                         { "realtime",           0, 0, 'r' },
+                        { "stats",              0, 0, 'S' },
 			{ NULL, 		0, 0, 0   },
 		};
 
-		int c=getopt_long(argc, argv, "c:f:i:o:t:dhmNr",
+		int c=getopt_long(argc, argv, "c:f:i:o:t:dhmNrS",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -451,10 +476,16 @@ int main(int argc, char *argv[]) {
 				burstsize = 1;
 				break;
 			case 'f': 
+				if (!filter_set)
+					filter_set = trace_create_filter_set();
+				if (trace_add_filter_to_set(filter_set, optarg) < 0) {
+					fprintf(stderr, "Unable to create filter %s\n",
+							optarg);
+					return 1;
+				}
 				++filter_count;
 				filters=realloc(filters,filter_count*sizeof(struct filter_t));
 				filters[filter_count-1].expr=strdup(optarg);
-				filters[filter_count-1].filter=trace_create_filter(optarg);
 				filters[filter_count-1].count=0;
 				filters[filter_count-1].bytes=0;
 				break;
@@ -487,6 +518,9 @@ int main(int argc, char *argv[]) {
                         case 'r':
                                 realtime = 1;
                                 break;
+                        case 'S':
+                                pipeline_stats = 1;
+                                break;
 			case 'h':
 				  usage(argv[0]);
 				  return 1;
@@ -539,6 +573,8 @@ int main(int argc, char *argv[]) {
 		output_destroy(output);
 	}
 
+	if (filter_set)
+		trace_destroy_filter_set(filter_set);
 
 	return 0;
 }
@@ -63,11 +63,16 @@ static void cleanup_signal(int signal UNUSED)
 
 struct filter_t {
 	char *expr;
-	struct libtrace_filter_t *filter;
 } *filters = NULL;
 
 int filter_count=0;
 
+/* Every filter is applied at once, the index of each filter in the set is
+ * the same as its index in filters */
+libtrace_filter_set_t *filter_set = NULL;
+/* Set once a filter has failed to apply to a packet */
+int filter_failed = 0;
+
 
 typedef struct statistics {
 	uint64_t count;
@@ -77,6 +82,26 @@ typedef struct statistics {
 volatile uint64_t totcount = 0;
 volatile uint64_t totbytes = 0;
 
+/* Print where the time went in each stage of the parallel pipeline */
+int pipeline_stats = 0;
+
+
+/* Adds one thread's counters into another's, so that the reporter only sees
+ * a single result with the totals */
+static void merge_counters(libtrace_result_t *merged, libtrace_result_t *res,
+		void *data UNUSED) {
+	statistics_t *total = merged->value.ptr;
+	statistics_t *counters = res->value.ptr;
+	int i;
+
+	for (i = 0; i < filter_count + 1; i++) {
+		total[i].count += counters[i].count;
+		total[i].bytes += counters[i].bytes;
+	}
+	free(counters);
+}
+
+static libtrace_reducer_config_t reducer = { merge_counters, NULL };
 
 static void fn_result(libtrace_t *trace UNUSED,
                 libtrace_thread_t *sender UNUSED,
@@ -131,6 +156,12 @@ static void fn_print_results(libtrace_t *trace,
         if (stats->errors_valid)
                 fprintf(stderr,"%30s:\t%12" PRIu64 "\n",
                                 "Erred packets", stats->errors);
+        if (stats->imbalance_valid)
+                fprintf(stderr,"%30s:\t%12" PRIu64 "\n",
+                                "Imbalanced packets", stats->imbalance);
+        if (stats->overflow_valid)
+                fprintf(stderr,"%30s:\t%12" PRIu64 "\n",
+                                "Overflowed packets", stats->overflow);
         printf("%30s:\t%12"PRIu64"\t%12" PRIu64 "\n","Total",counters[0].count,counters[0].bytes);
         totcount+=counters[0].count;
         totbytes+=counters[0].bytes;
@@ -169,18 +200,25 @@ static libtrace_packet_t* fn_packet(libtrace_t *trace,
                 /* Don't count ERF provenance etc. */
                 return pkt;
         }
-	for(i=0;i<filter_count;++i) {
-		if (filters[i].filter == NULL)
-			continue;
-		if(trace_apply_filter(filters[i].filter,pkt) > 0) {
-			results[i+1].count++;
-			results[i+1].bytes+=wlen;
+	if (filter_count > 0) {
+		uint64_t matches[TRACE_FILTER_SET_WORDS(filter_count)];
+
+		if (trace_apply_filter_set(filter_set, pkt, matches) < 0) {
+			/* A filter that can't be applied to this link type
+			 * just doesn't match, only report it once. This is a
+			 * race, but at worst it is reported twice */
+			if (!filter_failed) {
+				filter_failed = 1;
+				trace_perror(trace, "trace_apply_filter_set");
+			} else {
+				trace_get_err(trace);
+			}
 		}
-		if (trace_is_err(trace)) {
-			trace_perror(trace, "trace_apply_filter");
-			fprintf(stderr, "Removing filter from filterlist\n");
-			/* This is a race, but will be atomic */
-			filters[i].filter = NULL;
+		for(i=0;i<filter_count;++i) {
+			if (TRACE_FILTER_SET_MATCHED(matches, i)) {
+				results[i+1].count++;
+				results[i+1].bytes+=wlen;
+			}
 		}
 	}
 	results[0].count++;
@@ -214,6 +252,10 @@ static void run_trace(char *uri, int threadcount)
 
         if (threadcount != 0)
                 trace_set_perpkt_threads(inptrace, threadcount);
+        if (pipeline_stats)
+                trace_set_pipeline_stats(inptrace, true);
+        trace_set_combiner(inptrace, &combiner_reducing,
+                        (libtrace_generic_t){.ptr = &reducer});
 
 	/* Start the trace as a parallel trace */
 	if (trace_pstart(inptrace, NULL, pktcbs, rescbs)==-1) {
@@ -224,6 +266,13 @@ static void run_trace(char *uri, int threadcount)
 	/* Wait for all threads to stop */
 	trace_join(inptrace);
 
+	if (pipeline_stats) {
+		libtrace_pipeline_stats_t stats;
+
+		if (trace_get_pipeline_stats(inptrace, NULL, &stats) == 0)
+			trace_print_pipeline_stats(&stats, stderr);
+	}
+
 	if (trace_is_err(inptrace))
 		trace_perror(inptrace,"%s",uri);
 
@@ -234,7 +283,7 @@ static void run_trace(char *uri, int threadcount)
 
 static void usage(char *argv0)
 {
-	fprintf(stderr,"Usage: %s [-h|--help] [--threads|-t threads] [--filter|-f bpf ]... libtraceuri...\n",argv0);
+	fprintf(stderr,"Usage: %s [-h|--help] [--threads|-t threads] [--filter|-f bpf ]... [--stats|-S] libtraceuri...\n",argv0);
 }
 
 int main(int argc, char *argv[]) {
@@ -249,10 +298,11 @@ int main(int argc, char *argv[]) {
 			{ "filter",	   1, 0, 'f' },
 			{ "help", 0, 0, 'h' },
 			{ "threads",		1, 0, 't' },
+			{ "stats",		0, 0, 'S' },
 			{ NULL, 	   0, 0, 0   },
 		};
 
-		int c=getopt_long(argc, argv, "f:ht:",
+		int c=getopt_long(argc, argv, "f:ht:S",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -260,10 +310,16 @@ int main(int argc, char *argv[]) {
 
 		switch (c) {
 			case 'f':
+				if (!filter_set)
+					filter_set = trace_create_filter_set();
+				if (trace_add_filter_to_set(filter_set, optarg) < 0) {
+					fprintf(stderr, "Unable to create filter %s\n",
+							optarg);
+					return 1;
+				}
 				++filter_count;
 				filters=realloc(filters,filter_count*sizeof(struct filter_t));
 				filters[filter_count-1].expr=strdup(optarg);
-				filters[filter_count-1].filter=trace_create_filter(optarg);
 				break;
 			case 'h':
 			        usage(argv[0]);
@@ -273,6 +329,9 @@ int main(int argc, char *argv[]) {
                                 if (threadcount <= 0)
                                         threadcount = 1;
                                 break;
+                        case 'S':
+                                pipeline_stats = 1;
+                                break;
                         default:
 				fprintf(stderr,"Unknown option: %c\n",c);
 				usage(argv[0]);
@@ -294,6 +353,8 @@ int main(int argc, char *argv[]) {
 		printf("Grand total:\n");
 		printf("%30s:\t%12"PRIu64"\t%12" PRIu64 "\n","Total",totcount,totbytes);
 	}
-	
+
+	if (filter_set)
+		trace_destroy_filter_set(filter_set);
 	return 0;
 }